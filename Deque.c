@@ -0,0 +1,85 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "Deque.h"
+#include "err.h"
+
+// Memory orderings follow "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+struct Deque {
+    _Alignas(64) atomic_llong top;
+    _Alignas(64) atomic_llong bottom;
+    size_t mask;
+    _Atomic(void*)* buffer;
+};
+
+Deque* deque_new(size_t capacity)
+{
+    Deque* deque = malloc(sizeof(Deque));
+    if (!deque) { bad_malloc(); }
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    deque->buffer = malloc(size * sizeof(*deque->buffer));
+    if (!deque->buffer) { bad_malloc(); }
+    deque->mask = size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return deque;
+}
+
+void deque_free(Deque* deque)
+{
+    free(deque->buffer);
+    free(deque);
+}
+
+bool deque_push(Deque* deque, void* value)
+{
+    long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if ((size_t)(b - t) > deque->mask)
+        return false; // Full.
+    atomic_store_explicit(&deque->buffer[b & deque->mask], value, memory_order_relaxed);
+    // A release store rather than a release fence: the same ordering, and
+    // ThreadSanitizer (which ignores fences) sees the item handed to thieves.
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+void* deque_pop(Deque* deque)
+{
+    long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) { // Empty.
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void* value = atomic_load_explicit(&deque->buffer[b & deque->mask], memory_order_relaxed);
+    if (t == b) {
+        // Last element - race against thieves.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            value = NULL;
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return value;
+}
+
+void* deque_steal(Deque* deque)
+{
+    long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    void* value = atomic_load_explicit(&deque->buffer[t & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return value;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// A fixed-capacity work-stealing deque (Chase-Lev).
+// Only the owner thread may call `deque_push` and `deque_pop`, which work
+// on the bottom end; any thread may call `deque_steal`, which takes
+// elements from the top end. Elements are non-null pointers.
+typedef struct Deque Deque;
+
+// Create a new, empty deque. `capacity` is rounded up to a power of two.
+Deque* deque_new(size_t capacity);
+
+// Free the deque. Elements still inside are not freed.
+void deque_free(Deque* deque);
+
+// Push `value` at the bottom and return true,
+// or do nothing and return false if the deque is full. Owner only.
+bool deque_push(Deque* deque, void* value);
+
+// Pop the most recently pushed element, or return NULL if empty. Owner only.
+void* deque_pop(Deque* deque);
+
+// Take the oldest element, or return NULL if the deque is empty
+// or another thread won the race for it.
+void* deque_steal(Deque* deque);
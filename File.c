@@ -0,0 +1,201 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "File.h"
+#include "err.h"
+
+// Smallest allocation for a partially filled chunk.
+#define MIN_CHUNK_CAPACITY 64
+
+struct Chunk {
+    atomic_size_t refcount;
+    size_t len; // Number of bytes of data actually stored.
+    size_t capacity;
+    char data[];
+};
+
+struct File {
+    Chunk** chunks; // Chunk i covers bytes [i * CHUNK_SIZE, (i + 1) * CHUNK_SIZE). NULL is a hole.
+    size_t n_chunks;
+    size_t chunks_capacity;
+    size_t size;
+};
+
+// Shared source of zeros for holes and for the unstored tails of chunks.
+// Its reference count is never touched.
+static const char zeros[CHUNK_SIZE];
+
+void chunk_acquire(Chunk* chunk)
+{
+    if (chunk)
+        atomic_fetch_add_explicit(&chunk->refcount, 1, memory_order_relaxed);
+}
+
+void chunk_release(Chunk* chunk)
+{
+    if (chunk && atomic_fetch_sub_explicit(&chunk->refcount, 1, memory_order_acq_rel) == 1)
+        free(chunk);
+}
+
+static Chunk* chunk_new(size_t capacity)
+{
+    Chunk* chunk = malloc(sizeof(Chunk) + capacity);
+    if (!chunk) { bad_malloc(); }
+    atomic_init(&chunk->refcount, 1);
+    chunk->len = 0;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+// Capacity for a chunk which has to hold at least `len` bytes. Grows
+// geometrically so that appending in small pieces stays linear.
+static size_t chunk_capacity_for(size_t len, size_t old_capacity)
+{
+    size_t capacity = old_capacity > MIN_CHUNK_CAPACITY ? old_capacity : MIN_CHUNK_CAPACITY;
+    while (capacity < len)
+        capacity *= 2;
+    return capacity < CHUNK_SIZE ? capacity : CHUNK_SIZE;
+}
+
+File* file_new()
+{
+    File* file = malloc(sizeof(File));
+    if (!file) { bad_malloc(); }
+    memset(file, 0, sizeof(File));
+    return file;
+}
+
+void file_free(File* file)
+{
+    for (size_t i = 0; i < file->n_chunks; ++i)
+        chunk_release(file->chunks[i]);
+    free(file->chunks);
+    free(file);
+}
+
+size_t file_size(File* file)
+{
+    return file->size;
+}
+
+static void reserve_chunks(File* file, size_t n_chunks)
+{
+    if (n_chunks <= file->n_chunks)
+        return;
+    if (n_chunks > file->chunks_capacity) {
+        size_t capacity = file->chunks_capacity ? file->chunks_capacity : 1;
+        while (capacity < n_chunks)
+            capacity *= 2;
+        Chunk** chunks = realloc(file->chunks, capacity * sizeof(Chunk*));
+        if (!chunks) { bad_malloc(); }
+        file->chunks = chunks;
+        file->chunks_capacity = capacity;
+    }
+    memset(file->chunks + file->n_chunks, 0, (n_chunks - file->n_chunks) * sizeof(Chunk*));
+    file->n_chunks = n_chunks;
+}
+
+File* file_clone(File* file)
+{
+    File* clone = file_new();
+    reserve_chunks(clone, file->n_chunks);
+    for (size_t i = 0; i < file->n_chunks; ++i) {
+        chunk_acquire(file->chunks[i]);
+        clone->chunks[i] = file->chunks[i];
+    }
+    clone->size = file->size;
+    return clone;
+}
+
+// Write `buf` to bytes [lo, hi) of the i-th chunk.
+static void chunk_write(File* file, size_t i, size_t lo, size_t hi, const char* buf)
+{
+    Chunk* old = file->chunks[i];
+    size_t old_len = old ? old->len : 0;
+    size_t new_len = hi > old_len ? hi : old_len;
+
+    Chunk* chunk;
+    if (old && atomic_load_explicit(&old->refcount, memory_order_acquire) == 1) {
+        // Nobody else can see this chunk, so it is safe to modify it in place.
+        chunk = old;
+        if (chunk->capacity < new_len) {
+            size_t capacity = chunk_capacity_for(new_len, chunk->capacity);
+            chunk = realloc(chunk, sizeof(Chunk) + capacity);
+            if (!chunk) { bad_malloc(); }
+            chunk->capacity = capacity;
+        }
+    } else {
+        // The chunk is shared with readers - copy everything we don't overwrite.
+        chunk = chunk_new(lo == 0 && hi == CHUNK_SIZE ? CHUNK_SIZE : chunk_capacity_for(new_len, 0));
+        if (old) {
+            memcpy(chunk->data, old->data, lo < old_len ? lo : old_len);
+            if (hi < old_len)
+                memcpy(chunk->data + hi, old->data + hi, old_len - hi);
+            chunk_release(old);
+        }
+    }
+    if (lo > old_len)
+        memset(chunk->data + old_len, 0, lo - old_len);
+    memcpy(chunk->data + lo, buf, hi - lo);
+    chunk->len = new_len;
+    file->chunks[i] = chunk;
+}
+
+void file_write(File* file, size_t offset, const char* buf, size_t len)
+{
+    if (!len)
+        return;
+    size_t end = offset + len;
+    if (end < offset) { fatal("File offset overflow"); }
+    reserve_chunks(file, (end + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+    for (size_t i = offset / CHUNK_SIZE; i * CHUNK_SIZE < end; ++i) {
+        size_t chunk_start = i * CHUNK_SIZE;
+        size_t lo = offset > chunk_start ? offset - chunk_start : 0;
+        size_t hi = end - chunk_start < CHUNK_SIZE ? end - chunk_start : CHUNK_SIZE;
+        chunk_write(file, i, lo, hi, buf + (chunk_start + lo - offset));
+    }
+
+    if (end > file->size)
+        file->size = end;
+}
+
+size_t file_read_max_refs(size_t len)
+{
+    // Each chunk touched yields at most a data piece and a zero piece.
+    return 2 * (len / CHUNK_SIZE + 2);
+}
+
+size_t file_read(File* file, size_t offset, size_t len, ChunkRef* refs, size_t* read_len)
+{
+    *read_len = 0;
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+    size_t end = offset + len;
+
+    size_t n_refs = 0;
+    for (size_t pos = offset; pos < end;) {
+        size_t i = pos / CHUNK_SIZE;
+        size_t in_chunk = pos - i * CHUNK_SIZE;
+        size_t chunk_end = end - i * CHUNK_SIZE < CHUNK_SIZE ? end - i * CHUNK_SIZE : CHUNK_SIZE;
+        Chunk* chunk = file->chunks[i];
+        size_t stored = chunk ? chunk->len : 0;
+        if (stored > chunk_end)
+            stored = chunk_end;
+
+        if (in_chunk < stored) {
+            chunk_acquire(chunk);
+            refs[n_refs++] = (ChunkRef) { chunk->data + in_chunk, stored - in_chunk, chunk };
+            in_chunk = stored;
+        }
+        if (in_chunk < chunk_end)
+            refs[n_refs++] = (ChunkRef) { zeros + in_chunk, chunk_end - in_chunk, NULL };
+        pos = i * CHUNK_SIZE + chunk_end;
+    }
+
+    *read_len = len;
+    return n_refs;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// Contents of a regular file, stored as an array of fixed-size chunks.
+// Chunks are reference counted and immutable once shared: a writer modifies
+// a chunk in place only while the file holds the sole reference to it,
+// otherwise it copies the chunk first (copy-on-write).
+// A File is not synchronized - the caller must hold the owning node's lock
+// (shared for file_read, exclusive for file_write).
+typedef struct File File;
+
+typedef struct Chunk Chunk;
+
+// Size of a full chunk. Every chunk except the last one covers exactly
+// CHUNK_SIZE bytes of the file (missing bytes are read as zeros).
+#define CHUNK_SIZE ((size_t)1 << 20)
+
+// A reference to a contiguous, immutable piece of file contents.
+// `data` stays valid until the reference is released with `chunk_release`,
+// even if the file is overwritten, moved or removed in the meantime.
+typedef struct ChunkRef {
+    const char* data;
+    size_t len;
+    Chunk* chunk;
+} ChunkRef;
+
+// Take an additional reference to `chunk`.
+void chunk_acquire(Chunk* chunk);
+
+// Drop a reference to `chunk`, freeing it if it was the last one.
+void chunk_release(Chunk* chunk);
+
+// Create a new, empty file.
+File* file_new();
+
+// Free the file and drop its references to the chunks. Chunks still
+// referenced by readers are freed when their last reference is released.
+void file_free(File* file);
+
+// Create a file with the same contents. The copy shares all chunks with
+// `file` (copy-on-write), so this costs one pointer per chunk, not a copy of the data.
+File* file_clone(File* file);
+
+// Return the size of the file in bytes.
+size_t file_size(File* file);
+
+// Write `len` bytes from `buf` at `offset`, extending the file if needed.
+// A gap between the previous end of file and `offset` reads as zeros.
+void file_write(File* file, size_t offset, const char* buf, size_t len);
+
+// Return the maximal number of references `file_read` may produce
+// for a read of `len` bytes.
+size_t file_read_max_refs(size_t len);
+
+// Fill `refs` with references covering up to `len` bytes starting at `offset`
+// (reads are truncated at the end of file). Each reference is acquired and
+// must be released by the caller. `refs` must have room for
+// `file_read_max_refs(len)` elements.
+// Returns the number of references stored; `*read_len` is set to the total
+// number of bytes they cover.
+size_t file_read(File* file, size_t offset, size_t len, ChunkRef* refs, size_t* read_len);
@@ -1,53 +1,80 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "HashMap.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Initial number of hash buckets; the table doubles whenever it holds
+// more entries than buckets, so chains stay O(1) long on average.
+#define MIN_BUCKETS 8
 
 typedef struct Pair Pair;
 
 struct Pair {
     char* key;
     void* value;
+    uint64_t hash; // Full hash of key, to skip most strcmp calls and rehash cheaply.
     Pair* next; // Next item in a single-linked list.
 };
 
 struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
+    Pair** buckets; // Linked lists of key-value pairs, allocated on first insert.
+    size_t n_buckets; // Zero or a power of two.
     size_t size; // total number of entries in map.
+    uint64_t seed;
+    bool borrowed; // Keys are not copied nor freed.
 };
 
-static unsigned int get_hash(const char* key);
-
 HashMap* hmap_new()
+{
+    return hmap_new_seeded(0);
+}
+
+HashMap* hmap_new_seeded(uint64_t seed)
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
     memset(map, 0, sizeof(HashMap));
+    map->seed = seed;
+    return map;
+}
+
+HashMap* hmap_new_borrowed(uint64_t seed)
+{
+    HashMap* map = hmap_new_seeded(seed);
+    if (map)
+        map->borrowed = true;
     return map;
 }
 
 void hmap_free(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
+    for (size_t h = 0; h < map->n_buckets; ++h) {
         for (Pair* p = map->buckets[h]; p;) {
             Pair* q = p;
             p = p->next;
-            free(q->key);
+            if (!map->borrowed)
+                free(q->key);
             free(q);
         }
     }
+    free(map->buckets);
     free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+uint64_t hmap_seed(HashMap* map)
+{
+    return map->seed;
+}
+
+static Pair* hmap_find(HashMap* map, uint64_t hash, const char* key)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
+    if (!map->n_buckets)
+        return NULL;
+    for (Pair* p = map->buckets[hash & (map->n_buckets - 1)]; p; p = p->next) {
+        if (p->hash == hash && (p->key == key || strcmp(key, p->key) == 0))
             return p;
     }
     return NULL;
@@ -55,40 +82,107 @@ static Pair* hmap_find(HashMap* map, int h, const char* key)
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    return hmap_get_hashed(map, key, hmap_hash(map->seed, key, strlen(key)));
+}
+
+void* hmap_get_hashed(HashMap* map, const char* key, uint64_t hash)
+{
+    Pair* p = hmap_find(map, hash, key);
     if (p)
         return p->value;
     else
         return NULL;
 }
 
+void* hmap_get_identical(HashMap* map, const char* key, uint64_t hash)
+{
+    if (!map->n_buckets)
+        return NULL;
+    for (Pair* p = map->buckets[hash & (map->n_buckets - 1)]; p; p = p->next) {
+        if (p->key == key)
+            return p->value;
+    }
+    return NULL;
+}
+
+const char* hmap_find_key(HashMap* map, const char* key)
+{
+    Pair* p = hmap_find(map, hmap_hash(map->seed, key, strlen(key)), key);
+    return p ? p->key : NULL;
+}
+
+// Rehash into `n_buckets` buckets (a power of two).
+static void hmap_resize(HashMap* map, size_t n_buckets)
+{
+    Pair** buckets = calloc(n_buckets, sizeof(Pair*));
+    if (!buckets)
+        return; // Keep the old table - longer chains, but still correct.
+    for (size_t h = 0; h < map->n_buckets; ++h) {
+        for (Pair* p = map->buckets[h]; p;) {
+            Pair* next = p->next;
+            Pair** bucket = &buckets[p->hash & (n_buckets - 1)];
+            p->next = *bucket;
+            *bucket = p;
+            p = next;
+        }
+    }
+    free(map->buckets);
+    map->buckets = buckets;
+    map->n_buckets = n_buckets;
+}
+
+// Double the number of buckets (or allocate the initial ones).
+static void hmap_grow(HashMap* map)
+{
+    hmap_resize(map, map->n_buckets ? 2 * map->n_buckets : MIN_BUCKETS);
+}
+
+void hmap_reserve(HashMap* map, size_t n)
+{
+    size_t n_buckets = map->n_buckets ? map->n_buckets : MIN_BUCKETS;
+    while (n_buckets <= n)
+        n_buckets *= 2;
+    if (n_buckets != map->n_buckets)
+        hmap_resize(map, n_buckets);
+}
+
 bool hmap_insert(HashMap* map, const char* key, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    uint64_t hash = hmap_hash(map->seed, key, strlen(key));
+    Pair* p = hmap_find(map, hash, key);
     if (p)
         return false; // Already exists.
+    if (map->size >= map->n_buckets)
+        hmap_grow(map);
+    if (!map->n_buckets)
+        return false;
     Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    if (!new_p)
+        return false;
+    new_p->key = map->borrowed ? (char*)key : strdup(key);
     new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
+    new_p->hash = hash;
+    Pair** bucket = &map->buckets[hash & (map->n_buckets - 1)];
+    new_p->next = *bucket;
+    *bucket = new_p;
     map->size++;
     return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
+    if (!map->n_buckets)
+        return false;
+    uint64_t hash = hmap_hash(map->seed, key, strlen(key));
+    Pair** pp = &(map->buckets[hash & (map->n_buckets - 1)]);
     while (*pp) {
         Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
+        if (p->hash == hash && strcmp(key, p->key) == 0) {
             *pp = p->next;
-            free(p->key);
+            if (!map->borrowed)
+                free(p->key);
             free(p);
             map->size--;
             return true;
@@ -105,14 +199,14 @@ size_t hmap_size(HashMap* map)
 
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    HashMapIterator it = { 0, map->n_buckets ? map->buckets[0] : NULL };
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
     Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
+    while (!p && it->bucket + 1 < (long)map->n_buckets) {
         p = map->buckets[++it->bucket];
     }
     if (!p)
@@ -123,12 +217,55 @@ bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value
     return true;
 }
 
-static unsigned int get_hash(const char* key)
+// The hash follows the structure of wyhash (Wang Yi): the input is consumed
+// 8 or 16 bytes at a time and mixed with 64x64->128-bit multiplications,
+// folded to 64 bits. Without knowing the seed, an attacker cannot choose names
+// that collide, which keeps chains short even for adversarial directories.
+static const uint64_t P0 = 0xa0761d6478bd642full;
+static const uint64_t P1 = 0xe7037ed1a0b428dbull;
+static const uint64_t P2 = 0x8ebc6af09c88c6e3ull;
+static const uint64_t P3 = 0x589965cc75374cc3ull;
+
+static inline uint64_t mum(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read64(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hmap_hash(uint64_t seed, const char* key, size_t len)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
+    const char* p = key;
+    size_t n = len;
+    uint64_t h = seed ^ P0;
+    uint64_t a = 0, b = 0;
+    while (n > 16) {
+        h = mum(read64(p) ^ P1, read64(p + 8) ^ h);
+        p += 16;
+        n -= 16;
+    }
+    if (n > 8) {
+        a = read64(p);
+        b = read64(p + n - 8);
+    } else if (n >= 4) {
+        a = read32(p);
+        b = read32(p + n - 4);
+    } else if (n > 0) {
+        a = ((uint64_t)(unsigned char)p[0] << 16) | ((uint64_t)(unsigned char)p[n >> 1] << 8)
+            | (unsigned char)p[n - 1];
     }
-    return hash % N_BUCKETS;
+    return mum(P1 ^ len, mum(a ^ P2, b ^ h ^ P3));
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // A structure representing a mapping from keys to values.
@@ -7,9 +8,25 @@
 // Values are non-null pointers (void*, which you can cast to any other pointer type).
 typedef struct HashMap HashMap;
 
-// Create a new, empty map.
+// Create a new, empty map (with hash seed 0).
 HashMap* hmap_new();
 
+// Create a new, empty map hashing keys with the given seed.
+// Maps sharing a seed agree on `hmap_hash`, so a key can be hashed once
+// and looked up in all of them with `hmap_get_hashed`.
+HashMap* hmap_new_seeded(uint64_t seed);
+
+// Create a new, empty map which stores the inserted key pointers themselves
+// instead of copies, e.g. for interned names (see Intern.h). The caller must
+// keep each key alive while it is in the map, and free it afterwards.
+HashMap* hmap_new_borrowed(uint64_t seed);
+
+// Return the seed the map was created with.
+uint64_t hmap_seed(HashMap* map);
+
+// Hash `len` bytes of `key` with `seed`.
+uint64_t hmap_hash(uint64_t seed, const char* key, size_t len);
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
@@ -17,6 +34,16 @@ void hmap_free(HashMap* map);
 // Get the value stored under `key`, or NULL if not present.
 void* hmap_get(HashMap* map, const char* key);
 
+// Same as `hmap_get`, for `hash` equal to hmap_hash(hmap_seed(map), key, strlen(key)).
+void* hmap_get_hashed(HashMap* map, const char* key, uint64_t hash);
+
+// Same as `hmap_get_hashed`, but compares keys by pointer only: `key` must be
+// the very pointer inserted (useful with interned keys, see `hmap_new_borrowed`).
+void* hmap_get_identical(HashMap* map, const char* key, uint64_t hash);
+
+// Return the key stored in the map that is equal to `key`, or NULL if not present.
+const char* hmap_find_key(HashMap* map, const char* key);
+
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
@@ -30,6 +57,9 @@ bool hmap_remove(HashMap* map, const char* key);
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Make room for `n` elements in total, so that inserting them won't rehash.
+void hmap_reserve(HashMap* map, size_t n);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
@@ -52,6 +82,6 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-    int bucket;
+    long bucket;
     void* pair;
 };
@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include "HashMap.h"
+#include "Intern.h"
+#include "err.h"
+
+// The table is split into shards by hash, each with its own lock and
+// its own chained hash table, so that threads interning different names
+// rarely contend. Taking and dropping additional references is lock-free;
+// a reference count reaches or leaves zero only under the shard lock.
+#define N_SHARDS 64
+#define MIN_BUCKETS 16
+
+typedef struct Entry Entry;
+
+struct Entry {
+    atomic_size_t refcount;
+    uint64_t hash;
+    Entry* next;
+    size_t len;
+    char name[];
+};
+
+typedef struct Shard {
+    pthread_mutex_t lock;
+    Entry** buckets;
+    size_t n_buckets; // Zero or a power of two.
+    size_t size;
+} Shard;
+
+static Shard shards[N_SHARDS];
+static uint64_t seed;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t n_names;
+static atomic_size_t n_references;
+static atomic_size_t n_bytes;
+static atomic_size_t n_referenced_bytes; // What a private copy per reference would take.
+
+// Memory taken by an allocation of `size` bytes, for a typical malloc
+// (8-byte header, 16-byte granularity, 32-byte minimum).
+static size_t allocated_size(size_t size)
+{
+    size = (size + 8 + 15) & ~(size_t)15;
+    return size < 32 ? 32 : size;
+}
+
+static void init(void)
+{
+    for (int i = 0; i < N_SHARDS; ++i)
+        ensure(!pthread_mutex_init(&shards[i].lock, NULL));
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        seed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec;
+    }
+}
+
+static Entry* entry_of(const char* interned)
+{
+    return (Entry*)(interned - offsetof(Entry, name));
+}
+
+static Shard* shard_of(uint64_t hash)
+{
+    // The low bits select the bucket, so select the shard with the high ones.
+    return &shards[hash >> 58];
+}
+
+static Entry* shard_find(Shard* shard, const char* name, size_t len, uint64_t hash)
+{
+    if (!shard->n_buckets)
+        return NULL;
+    for (Entry* e = shard->buckets[hash & (shard->n_buckets - 1)]; e; e = e->next) {
+        if (e->hash == hash && e->len == len && !memcmp(e->name, name, len))
+            return e;
+    }
+    return NULL;
+}
+
+static void shard_grow(Shard* shard)
+{
+    size_t n_buckets = shard->n_buckets ? 2 * shard->n_buckets : MIN_BUCKETS;
+    Entry** buckets = calloc(n_buckets, sizeof(Entry*));
+    if (!buckets) { bad_malloc(); }
+    for (size_t h = 0; h < shard->n_buckets; ++h) {
+        for (Entry* e = shard->buckets[h]; e;) {
+            Entry* next = e->next;
+            Entry** bucket = &buckets[e->hash & (n_buckets - 1)];
+            e->next = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->n_buckets = n_buckets;
+}
+
+static void count_reference(Entry* entry, long delta)
+{
+    atomic_fetch_add_explicit(&n_references, (size_t)delta, memory_order_relaxed);
+    atomic_fetch_add_explicit(&n_referenced_bytes, (size_t)(delta * (long)allocated_size(entry->len + 1)),
+        memory_order_relaxed);
+}
+
+// Look `name` up and take a reference to it, creating it if `create` is set.
+static const char* intern(const char* name, bool create)
+{
+    pthread_once(&init_once, init);
+    size_t len = strlen(name);
+    uint64_t hash = hmap_hash(seed, name, len);
+    Shard* shard = shard_of(hash);
+
+    ensure(!pthread_mutex_lock(&shard->lock));
+    Entry* entry = shard_find(shard, name, len, hash);
+    if (entry) {
+        atomic_fetch_add_explicit(&entry->refcount, 1, memory_order_relaxed);
+    } else if (create) {
+        entry = malloc(sizeof(Entry) + len + 1);
+        if (!entry) { bad_malloc(); }
+        atomic_init(&entry->refcount, 1);
+        entry->hash = hash;
+        entry->len = len;
+        memcpy(entry->name, name, len + 1);
+        if (shard->size >= shard->n_buckets)
+            shard_grow(shard);
+        Entry** bucket = &shard->buckets[hash & (shard->n_buckets - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        shard->size++;
+        atomic_fetch_add_explicit(&n_names, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&n_bytes, allocated_size(sizeof(Entry) + len + 1), memory_order_relaxed);
+    }
+    ensure(!pthread_mutex_unlock(&shard->lock));
+
+    if (!entry)
+        return NULL;
+    count_reference(entry, 1);
+    return entry->name;
+}
+
+const char* intern_acquire(const char* name)
+{
+    return intern(name, true);
+}
+
+const char* intern_find(const char* name)
+{
+    return intern(name, false);
+}
+
+void intern_ref(const char* interned)
+{
+    Entry* entry = entry_of(interned);
+    atomic_fetch_add_explicit(&entry->refcount, 1, memory_order_relaxed);
+    count_reference(entry, 1);
+}
+
+void intern_release(const char* interned)
+{
+    Entry* entry = entry_of(interned);
+    count_reference(entry, -1);
+
+    // Fast path: we are not the last holder.
+    size_t refcount = atomic_load_explicit(&entry->refcount, memory_order_relaxed);
+    while (refcount > 1) {
+        if (atomic_compare_exchange_weak_explicit(&entry->refcount, &refcount, refcount - 1,
+                memory_order_release, memory_order_relaxed))
+            return;
+    }
+
+    // We may be the last holder - drop the reference under the shard lock,
+    // so that nobody finds the entry between reaching zero and unlinking.
+    Shard* shard = shard_of(entry->hash);
+    ensure(!pthread_mutex_lock(&shard->lock));
+    if (atomic_fetch_sub_explicit(&entry->refcount, 1, memory_order_acq_rel) == 1) {
+        Entry** pp = &shard->buckets[entry->hash & (shard->n_buckets - 1)];
+        while (*pp != entry)
+            pp = &(*pp)->next;
+        *pp = entry->next;
+        shard->size--;
+        atomic_fetch_sub_explicit(&n_names, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&n_bytes, allocated_size(sizeof(Entry) + entry->len + 1), memory_order_relaxed);
+        free(entry);
+    }
+    ensure(!pthread_mutex_unlock(&shard->lock));
+}
+
+void intern_stats(InternStats* stats)
+{
+    stats->names = atomic_load_explicit(&n_names, memory_order_relaxed);
+    stats->references = atomic_load_explicit(&n_references, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&n_bytes, memory_order_relaxed);
+    size_t referenced = atomic_load_explicit(&n_referenced_bytes, memory_order_relaxed);
+    stats->bytes_saved = referenced > stats->bytes ? referenced - stats->bytes : 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+
+// A global, thread-safe table of interned names.
+// Each distinct name is stored once and shared by all its holders; the copy
+// is reference counted and freed when the last holder releases it.
+// Interned names can be compared by pointer: two interned names are equal
+// iff they are the same pointer (while both are held).
+
+// Return the interned copy of `name`, creating it if needed, and take
+// a reference to it.
+const char* intern_acquire(const char* name);
+
+// Return the interned copy of `name` with a new reference to it, or NULL
+// (without creating it) if `name` is not currently interned.
+const char* intern_find(const char* name);
+
+// Take an additional reference to an interned name held by the caller.
+void intern_ref(const char* interned);
+
+// Drop a reference to an interned name, freeing it if it was the last one.
+void intern_release(const char* interned);
+
+typedef struct InternStats {
+    size_t names; // Distinct names currently interned.
+    size_t references; // References held to them.
+    size_t bytes; // Memory used by the interned names.
+    size_t bytes_saved; // Memory private copies for every reference would take, minus `bytes`.
+} InternStats;
+
+// Fill `stats` with a snapshot of the table's counters.
+void intern_stats(InternStats* stats);
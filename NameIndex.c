@@ -0,0 +1,571 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Intern.h"
+#include "NameIndex.h"
+#include "err.h"
+
+typedef struct Stripe {
+    _Alignas(64) pthread_mutex_t lock; // One cache line per stripe.
+    NameIndex* index;
+} Stripe;
+
+// The elements of a frozen index: `keys` sorted, `values[i]` under `keys[i]`,
+// both arrays and the names in one allocation.
+typedef struct Frozen {
+    size_t n;
+    const char** keys;
+    void** values;
+} Frozen;
+
+struct NameIndex {
+    NameIndexKind kind;
+    uint64_t seed;
+    union {
+        HashMap* hmap;
+        Trie* trie;
+    };
+    // Non-null for striped indexes, which then keep no elements themselves.
+    Stripe* stripes;
+    // Non-null for frozen indexes, which keep all elements there.
+    Frozen* frozen;
+    atomic_size_t size; // Kept apart from the containers, so that it can be read without locks.
+};
+
+// Hash kinds pick the stripe by the high bits of the hash (hash maps use
+// the low ones), tries by the first letter, to keep iteration sorted.
+static size_t stripe_of(NameIndex* index, const char* key, uint64_t hash)
+{
+    if (index->kind == NAME_INDEX_TRIE)
+        return (size_t)(key[0] - 'a') * NAME_INDEX_STRIPES / 26;
+    return hash >> (64 - 4);
+}
+
+_Static_assert(NAME_INDEX_STRIPES == 16, "stripe_of takes 4 bits of the hash");
+
+static NameIndex* stripe_for_hashed(NameIndex* index, const char* key, uint64_t hash)
+{
+    return index->stripes[stripe_of(index, key, hash)].index;
+}
+
+static NameIndex* stripe_for(NameIndex* index, const char* key)
+{
+    uint64_t hash = index->kind == NAME_INDEX_TRIE ? 0 : hmap_hash(index->seed, key, strlen(key));
+    return stripe_for_hashed(index, key, hash);
+}
+
+NameIndex* index_new(NameIndexKind kind, uint64_t seed)
+{
+    NameIndex* index = malloc(sizeof(NameIndex));
+    if (!index) { bad_malloc(); }
+    index->kind = kind;
+    index->seed = seed;
+    index->stripes = NULL;
+    index->frozen = NULL;
+    atomic_init(&index->size, 0);
+    switch (kind) {
+    case NAME_INDEX_HASH:
+        if (!(index->hmap = hmap_new_seeded(seed))) { bad_malloc(); }
+        break;
+    case NAME_INDEX_INTERNED:
+        if (!(index->hmap = hmap_new_borrowed(seed))) { bad_malloc(); }
+        break;
+    case NAME_INDEX_TRIE:
+        index->trie = trie_new();
+        break;
+    }
+    return index;
+}
+
+void index_free(NameIndex* index)
+{
+    const char* key;
+    void* value;
+    if (index->frozen) {
+        free(index->frozen);
+        free(index);
+        return;
+    }
+    if (index->stripes) {
+        for (int i = 0; i < NAME_INDEX_STRIPES; ++i) {
+            index_free(index->stripes[i].index);
+            ensure(!pthread_mutex_destroy(&index->stripes[i].lock));
+        }
+        free(index->stripes);
+        free(index);
+        return;
+    }
+    switch (index->kind) {
+    case NAME_INDEX_INTERNED:
+        for (HashMapIterator it = hmap_iterator(index->hmap); hmap_next(index->hmap, &it, &key, &value);)
+            intern_release(key);
+        // fall through
+    case NAME_INDEX_HASH:
+        hmap_free(index->hmap);
+        break;
+    case NAME_INDEX_TRIE:
+        trie_free(index->trie);
+        break;
+    }
+    free(index);
+}
+
+NameIndexKind index_kind(NameIndex* index)
+{
+    return index->kind;
+}
+
+uint64_t index_seed(NameIndex* index)
+{
+    return index->seed;
+}
+
+// Position of the first key of a frozen index not less than `key`.
+static size_t frozen_lower_bound(const Frozen* frozen, const char* key)
+{
+    size_t low = 0, high = frozen->n;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(frozen->keys[middle], key) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static void* frozen_get(const Frozen* frozen, const char* key)
+{
+    size_t i = frozen_lower_bound(frozen, key);
+    return i < frozen->n && !strcmp(frozen->keys[i], key) ? frozen->values[i] : NULL;
+}
+
+void* index_get(NameIndex* index, const char* key)
+{
+    if (index->frozen)
+        return frozen_get(index->frozen, key);
+    if (index->stripes)
+        return index_get(stripe_for(index, key), key);
+    switch (index->kind) {
+    case NAME_INDEX_HASH:
+    case NAME_INDEX_INTERNED:
+        return hmap_get(index->hmap, key);
+    case NAME_INDEX_TRIE:
+        return trie_get(index->trie, key);
+    }
+    return NULL;
+}
+
+void* index_get_hashed(NameIndex* index, const char* key, uint64_t hash)
+{
+    if (index->frozen)
+        return frozen_get(index->frozen, key);
+    if (index->stripes)
+        return index_get_hashed(stripe_for_hashed(index, key, hash), key, hash);
+    if (index->kind != NAME_INDEX_TRIE)
+        return hmap_get_hashed(index->hmap, key, hash);
+    return index_get(index, key);
+}
+
+void* index_get_interned(NameIndex* index, const char* key, const char* interned, uint64_t hash)
+{
+    if (index->frozen)
+        return frozen_get(index->frozen, key);
+    if (index->stripes)
+        return index_get_interned(stripe_for_hashed(index, key, hash), key, interned, hash);
+    if (index->kind != NAME_INDEX_INTERNED)
+        return index_get_hashed(index, key, hash);
+    // A name which is not interned is not in any interned index.
+    return interned ? hmap_get_identical(index->hmap, interned, hash) : NULL;
+}
+
+static bool insert_element(NameIndex* index, const char* key, void* value)
+{
+    const char* interned;
+    if (index->frozen)
+        return false;
+    if (index->stripes)
+        return index_insert(stripe_for(index, key), key, value);
+    switch (index->kind) {
+    case NAME_INDEX_HASH:
+        return hmap_insert(index->hmap, key, value);
+    case NAME_INDEX_INTERNED:
+        if (!value || hmap_get(index->hmap, key))
+            return false;
+        interned = intern_acquire(key);
+        if (!hmap_insert(index->hmap, interned, value)) { bad_malloc(); }
+        return true;
+    case NAME_INDEX_TRIE:
+        return trie_insert(index->trie, key, value);
+    }
+    return false;
+}
+
+bool index_insert(NameIndex* index, const char* key, void* value)
+{
+    if (!insert_element(index, key, value))
+        return false;
+    atomic_fetch_add_explicit(&index->size, 1, memory_order_relaxed);
+    return true;
+}
+
+static bool remove_element(NameIndex* index, const char* key)
+{
+    const char* interned;
+    if (index->frozen)
+        return false;
+    if (index->stripes)
+        return index_remove(stripe_for(index, key), key);
+    switch (index->kind) {
+    case NAME_INDEX_HASH:
+        return hmap_remove(index->hmap, key);
+    case NAME_INDEX_INTERNED:
+        if (!(interned = hmap_find_key(index->hmap, key)))
+            return false;
+        hmap_remove(index->hmap, interned);
+        intern_release(interned);
+        return true;
+    case NAME_INDEX_TRIE:
+        return trie_remove(index->trie, key);
+    }
+    return false;
+}
+
+bool index_remove(NameIndex* index, const char* key)
+{
+    if (!remove_element(index, key))
+        return false;
+    atomic_fetch_sub_explicit(&index->size, 1, memory_order_relaxed);
+    return true;
+}
+
+size_t index_size(NameIndex* index)
+{
+    return atomic_load_explicit(&index->size, memory_order_relaxed);
+}
+
+void index_reserve(NameIndex* index, size_t n)
+{
+    if (index->frozen)
+        return;
+    if (index->stripes) {
+        // Keys spread evenly over the stripes, give each some slack.
+        size_t per_stripe = n / NAME_INDEX_STRIPES + n / (4 * NAME_INDEX_STRIPES);
+        for (int i = 0; i < NAME_INDEX_STRIPES; ++i)
+            index_reserve(index->stripes[i].index, per_stripe);
+        return;
+    }
+    switch (index->kind) {
+    case NAME_INDEX_HASH:
+    case NAME_INDEX_INTERNED:
+        hmap_reserve(index->hmap, n);
+        break;
+    case NAME_INDEX_TRIE:
+        break; // Tries allocate per key anyway.
+    }
+}
+
+NameIndexIterator index_iterator(NameIndex* index)
+{
+    return index_prefix_iterator(index, "");
+}
+
+static void iterator_start(NameIndexIterator* it, NameIndex* index)
+{
+    if (it->locking) {
+        ensure(!pthread_mutex_lock(&it->index->stripes[it->stripe].lock));
+        it->locked = true;
+    }
+    it->current = index;
+    if (index->frozen) {
+        it->position = frozen_lower_bound(index->frozen, it->prefix);
+        return;
+    }
+    switch (index->kind) {
+    case NAME_INDEX_HASH:
+    case NAME_INDEX_INTERNED:
+        it->hash = hmap_iterator(index->hmap);
+        break;
+    case NAME_INDEX_TRIE:
+        it->trie = trie_prefix_iterator(index->trie, it->prefix);
+        break;
+    }
+}
+
+NameIndexIterator index_prefix_iterator(NameIndex* index, const char* prefix)
+{
+    NameIndexIterator it;
+    it.index = index;
+    it.prefix = prefix;
+    it.prefix_len = strlen(prefix);
+    it.stripe = it.last_stripe = 0;
+    it.locking = it.locked = false;
+    it.position = 0;
+    if (!index->stripes) {
+        iterator_start(&it, index);
+    } else {
+        // A trie prefix lies in a single stripe.
+        if (index->kind == NAME_INDEX_TRIE && *prefix)
+            it.stripe = it.last_stripe = stripe_of(index, prefix, 0);
+        else
+            it.last_stripe = NAME_INDEX_STRIPES - 1;
+        iterator_start(&it, index->stripes[it.stripe].index);
+    }
+    return it;
+}
+
+static bool iterator_next(NameIndexIterator* it, const char** key, void** value)
+{
+    Frozen* frozen = it->current->frozen;
+    if (frozen) {
+        // Keys with the prefix are next to each other.
+        if (it->position == frozen->n || strncmp(frozen->keys[it->position], it->prefix, it->prefix_len))
+            return false;
+        *key = frozen->keys[it->position];
+        *value = frozen->values[it->position++];
+        return true;
+    }
+    switch (it->current->kind) {
+    case NAME_INDEX_HASH:
+    case NAME_INDEX_INTERNED:
+        while (hmap_next(it->current->hmap, &it->hash, key, value)) {
+            if (!strncmp(*key, it->prefix, it->prefix_len))
+                return true;
+        }
+        return false;
+    case NAME_INDEX_TRIE:
+        return trie_next(&it->trie, key, value);
+    }
+    return false;
+}
+
+bool index_next(NameIndexIterator* it, const char** key, void** value)
+{
+    while (!iterator_next(it, key, value)) {
+        index_iterator_end(it);
+        if (it->stripe == it->last_stripe)
+            return false;
+        it->stripe++;
+        iterator_start(it, it->index->stripes[it->stripe].index);
+    }
+    return true;
+}
+
+NameIndexIterator index_locking_iterator(NameIndex* index)
+{
+    if (!index->stripes)
+        return index_iterator(index);
+    NameIndexIterator it;
+    it.index = index;
+    it.prefix = "";
+    it.prefix_len = 0;
+    it.stripe = 0;
+    it.last_stripe = NAME_INDEX_STRIPES - 1;
+    it.position = 0;
+    it.locking = true;
+    it.locked = false;
+    iterator_start(&it, index->stripes[0].index);
+    return it;
+}
+
+void index_iterator_end(NameIndexIterator* it)
+{
+    if (it->locked) {
+        ensure(!pthread_mutex_unlock(&it->index->stripes[it->stripe].lock));
+        it->locked = false;
+    }
+}
+
+static int compare_string_pointers(const void* p1, const void* p2)
+{
+    const char* const* s1 = p1;
+    const char* const* s2 = p2;
+    return strcmp(*s1, *s2);
+}
+
+// Join `n` keys with commas into a newly allocated string.
+static char* join_keys(const char** keys, size_t n)
+{
+    size_t result_size = 1;
+    for (size_t i = 0; i < n; ++i)
+        result_size += strlen(keys[i]) + 1;
+    char* result = malloc(result_size);
+    if (!result) { bad_malloc(); }
+    char* position = result;
+    for (size_t i = 0; i < n; ++i) {
+        if (i)
+            *position++ = ',';
+        size_t len = strlen(keys[i]);
+        memcpy(position, keys[i], len);
+        position += len;
+    }
+    *position = '\0';
+    return result;
+}
+
+char* index_contents_string(NameIndex* index, const char* prefix)
+{
+    const char* key;
+    void* value;
+    NameIndexIterator it = index_prefix_iterator(index, prefix);
+
+    if (index->kind != NAME_INDEX_TRIE && !index->frozen) {
+        // Keys of a HashMap stay valid as long as the map, so collect and sort them.
+        const char** keys = malloc((index_size(index) + 1) * sizeof(char*));
+        if (!keys) { bad_malloc(); }
+        size_t n = 0;
+        while (index_next(&it, &key, &value))
+            keys[n++] = key;
+        qsort(keys, n, sizeof(char*), compare_string_pointers);
+        char* result = join_keys(keys, n);
+        free(keys);
+        return result;
+    }
+
+    // Sorted kinds: append keys as they come.
+    size_t capacity = 64;
+    size_t len = 0;
+    char* result = malloc(capacity);
+    if (!result) { bad_malloc(); }
+    while (index_next(&it, &key, &value)) {
+        size_t key_len = strlen(key);
+        while (len + key_len + 2 > capacity) {
+            capacity *= 2;
+            if (!(result = realloc(result, capacity))) { bad_malloc(); }
+        }
+        if (len)
+            result[len++] = ',';
+        memcpy(result + len, key, key_len);
+        len += key_len;
+    }
+    result[len] = '\0';
+    return result;
+}
+
+void index_make_striped(NameIndex* index)
+{
+    if (index->stripes || index->frozen)
+        return;
+    Stripe* stripes = aligned_alloc(_Alignof(Stripe), NAME_INDEX_STRIPES * sizeof(Stripe));
+    if (!stripes) { bad_malloc(); }
+    for (int i = 0; i < NAME_INDEX_STRIPES; ++i) {
+        ensure(!pthread_mutex_init(&stripes[i].lock, NULL));
+        stripes[i].index = index_new(index->kind, index->seed);
+    }
+
+    // Move the elements. Interned keys are handed over with their references.
+    const char* key;
+    void* value;
+    size_t size = index_size(index);
+    NameIndexIterator it = index_iterator(index);
+    index->stripes = stripes;
+    while (iterator_next(&it, &key, &value)) {
+        NameIndex* stripe = stripe_for(index, key);
+        if (index->kind == NAME_INDEX_INTERNED) {
+            if (!hmap_insert(stripe->hmap, key, value)) { fatal("Duplicate key"); }
+            atomic_fetch_add_explicit(&stripe->size, 1, memory_order_relaxed);
+        } else {
+            if (!index_insert(stripe, key, value)) { fatal("Duplicate key"); }
+        }
+    }
+    atomic_store_explicit(&index->size, size, memory_order_relaxed);
+    switch (index->kind) {
+    case NAME_INDEX_HASH:
+    case NAME_INDEX_INTERNED:
+        hmap_free(index->hmap);
+        index->hmap = NULL;
+        break;
+    case NAME_INDEX_TRIE:
+        trie_free(index->trie);
+        index->trie = NULL;
+        break;
+    }
+}
+
+void index_freeze(NameIndex* index)
+{
+    if (index->frozen)
+        return;
+    size_t n = index_size(index);
+    const char* key;
+    void* value;
+    size_t names_size = 0;
+    NameIndexIterator it = index_iterator(index);
+    while (index_next(&it, &key, &value))
+        names_size += strlen(key) + 1;
+
+    Frozen* frozen = malloc(sizeof(Frozen) + n * (sizeof(char*) + sizeof(void*)) + names_size);
+    // Tries build keys in a reused buffer, so copy each name as it is visited.
+    struct Element {
+        const char* key; // First, so that compare_string_pointers sorts by it.
+        void* value;
+    }* elements = malloc((n + 1) * sizeof(struct Element));
+    if (!frozen || !elements) { bad_malloc(); }
+    frozen->n = n;
+    frozen->keys = (const char**)(frozen + 1);
+    frozen->values = (void**)(frozen->keys + n);
+    char* names = (char*)(frozen->values + n);
+    it = index_iterator(index);
+    for (size_t i = 0; i < n; ++i) {
+        ensure(index_next(&it, &key, &value));
+        size_t len = strlen(key) + 1;
+        memcpy(names, key, len);
+        elements[i] = (struct Element) { names, value };
+        names += len;
+    }
+    qsort(elements, n, sizeof(struct Element), compare_string_pointers);
+    for (size_t i = 0; i < n; ++i) {
+        frozen->keys[i] = elements[i].key;
+        frozen->values[i] = elements[i].value;
+    }
+    free(elements);
+
+    // Free the old container (and release interned names) through a copy of the index.
+    NameIndex* old = malloc(sizeof(NameIndex));
+    if (!old) { bad_malloc(); }
+    memcpy(old, index, sizeof(NameIndex));
+    index_free(old);
+    index->stripes = NULL;
+    index->hmap = NULL;
+    index->frozen = frozen;
+}
+
+bool index_frozen(NameIndex* index)
+{
+    return index->frozen != NULL;
+}
+
+bool index_striped(NameIndex* index)
+{
+    return index->stripes != NULL;
+}
+
+void index_lock_key(NameIndex* index, const char* key, uint64_t hash)
+{
+    if (index->stripes)
+        ensure(!pthread_mutex_lock(&index->stripes[stripe_of(index, key, hash)].lock));
+}
+
+void index_unlock_key(NameIndex* index, const char* key, uint64_t hash)
+{
+    if (index->stripes)
+        ensure(!pthread_mutex_unlock(&index->stripes[stripe_of(index, key, hash)].lock));
+}
+
+void index_lock_all(NameIndex* index)
+{
+    if (!index->stripes)
+        return;
+    for (int i = 0; i < NAME_INDEX_STRIPES; ++i)
+        ensure(!pthread_mutex_lock(&index->stripes[i].lock));
+}
+
+void index_unlock_all(NameIndex* index)
+{
+    if (!index->stripes)
+        return;
+    for (int i = NAME_INDEX_STRIPES; i-- > 0;)
+        ensure(!pthread_mutex_unlock(&index->stripes[i].lock));
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HashMap.h"
+#include "Trie.h"
+
+// An index of the children of a directory: a mapping from names to values,
+// backed by one of several data structures chosen at creation.
+// Keys are valid folder names (see `is_folder_name_valid`), all distinct.
+// Values are non-null pointers.
+typedef struct NameIndex NameIndex;
+
+typedef enum NameIndexKind {
+    // Seeded hash map: O(1) lookups, unordered iteration.
+    NAME_INDEX_HASH,
+    // Compressed radix tree: lookups in O(name length), sorted iteration,
+    // cheap prefix enumeration, shared prefixes stored once.
+    NAME_INDEX_TRIE,
+    // Seeded hash map whose keys are interned in the global name table
+    // (see Intern.h): every distinct name is stored once for all directories.
+    NAME_INDEX_INTERNED,
+} NameIndexKind;
+
+// Create a new, empty index. `seed` is the hash seed (ignored by kinds
+// which don't hash).
+NameIndex* index_new(NameIndexKind kind, uint64_t seed);
+
+// Free the index, but not the values.
+void index_free(NameIndex* index);
+
+NameIndexKind index_kind(NameIndex* index);
+
+// Return the seed the index was created with.
+uint64_t index_seed(NameIndex* index);
+
+// Get the value stored under `key`, or NULL if not present.
+void* index_get(NameIndex* index, const char* key);
+
+// Same as `index_get`, for `hash` equal to hmap_hash(index_seed(index), key, strlen(key)).
+void* index_get_hashed(NameIndex* index, const char* key, uint64_t hash);
+
+// Same as `index_get_hashed`, for `interned` equal to the result of
+// intern_find(key) (possibly NULL), held by the caller. Interned indexes
+// then compare names by pointer, others ignore `interned`.
+void* index_get_interned(NameIndex* index, const char* key, const char* interned, uint64_t hash);
+
+// Insert a `value` under `key` and return true,
+// or do nothing and return false if `key` already exists.
+bool index_insert(NameIndex* index, const char* key, void* value);
+
+// Remove the value under `key` and return true (the value is not free'd),
+// or do nothing and return false if `key` was not present.
+bool index_remove(NameIndex* index, const char* key);
+
+// Return the number of elements in the index. Unlike the other functions, it may
+// be called concurrently with modifications, and then returns a recent value.
+size_t index_size(NameIndex* index);
+
+// Make room for `n` elements in total (without concurrent access), so that
+// inserting them won't rehash. Does nothing for tries and frozen indexes.
+void index_reserve(NameIndex* index, size_t n);
+
+typedef struct NameIndexIterator NameIndexIterator;
+
+// Return an iterator over all elements (in no particular order).
+NameIndexIterator index_iterator(NameIndex* index);
+
+// Return an iterator over the elements whose keys start with `prefix`
+// (in no particular order). Tries visit only the matching subtree and frozen
+// indexes only the matching range, other kinds filter a full scan. Striped tries are split by the first
+// letter, so they still iterate in sorted order.
+NameIndexIterator index_prefix_iterator(NameIndex* index, const char* prefix);
+
+// Set `*key` and `*value` to the current element and advance the iterator.
+// If there are no more elements, leaves `*key` and `*value` unchanged and
+// returns false.
+// `*key` is only valid until the next call.
+// The index cannot be modified while it is being iterated.
+bool index_next(NameIndexIterator* it, const char** key, void** value);
+
+// Striped indexes. A striped index is split by key into NAME_INDEX_STRIPES
+// sub-indexes ("stripes"), each with its own mutex, so that threads working
+// on different keys don't contend. The index itself doesn't take the locks:
+// `index_get`, `index_insert` and `index_remove` on a striped index may run
+// concurrently if each caller holds the stripe of its key (`index_lock_key`).
+// Other functions (and the above without a stripe lock) need either all
+// stripes (`index_lock_all`) or no concurrent access at all.
+// For unstriped indexes the locking functions do nothing.
+#define NAME_INDEX_STRIPES 16
+
+// Convert the index to a striped one (without concurrent access).
+// Indexes stay striped until freed.
+void index_make_striped(NameIndex* index);
+
+bool index_striped(NameIndex* index);
+
+// Lock or unlock the stripe of `key`. `hash` is as in `index_get_hashed`
+// (ignored by kinds which don't hash).
+void index_lock_key(NameIndex* index, const char* key, uint64_t hash);
+void index_unlock_key(NameIndex* index, const char* key, uint64_t hash);
+
+// Lock or unlock all stripes, in a fixed order.
+void index_lock_all(NameIndex* index);
+void index_unlock_all(NameIndex* index);
+
+// Like `index_iterator`, but holds the lock of the stripe being iterated
+// (and no other), so it may run concurrently with `index_lock_key` holders.
+// Finish it with `index_iterator_end`, also after `index_next` returned false.
+NameIndexIterator index_locking_iterator(NameIndex* index);
+void index_iterator_end(NameIndexIterator* it);
+
+// Frozen indexes. Freezing moves the elements into one sorted array, with
+// the names stored right after it, and drops the original container (and
+// stripes). Lookups are binary searches over that block, iteration and
+// `index_contents_string` go in sorted order without sorting, and interned
+// names are released. A frozen index can't be modified: `index_insert` and
+// `index_remove` return false and `index_make_striped` does nothing.
+
+// Freeze the index (without concurrent access).
+void index_freeze(NameIndex* index);
+
+bool index_frozen(NameIndex* index);
+
+// Return a string containing all keys starting with `prefix`, sorted,
+// comma-separated, without a trailing comma (like `make_map_contents_string`).
+// Tries produce it in order, without sorting.
+// The caller should free the result.
+char* index_contents_string(NameIndex* index, const char* prefix);
+
+struct NameIndexIterator {
+    NameIndex* index;
+    NameIndex* current; // The stripe being iterated, or `index`.
+    size_t stripe, last_stripe;
+    bool locking, locked; // See `index_locking_iterator`.
+    const char* prefix;
+    size_t prefix_len;
+    size_t position; // Next element of a frozen index.
+    HashMapIterator hash;
+    TrieIterator trie;
+};
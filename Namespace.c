@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Namespace.h"
+#include "HashMap.h"
+#include "err.h"
+#include "path_utils.h"
+
+/*
+Tablica montowan to mapa: sciezka punktu montowania -> drzewo, plus maska
+glebokosci, na ktorych sa punkty montowania. Rozwiazanie sciezki sprawdza
+w mapie tylko jej prefiksy o takich glebokosciach (zwykle jeden albo dwa),
+a wygrywa najdluzszy. Operacje trzymaja rwlock tablicy w trybie czytelnika
+przez caly czas dzialania, wiec ns_mount i ns_umount (pisarze) czekaja na
+operacje w toku, a po ns_umount drzewo nie jest juz uzywane.
+*/
+
+typedef struct Mount {
+  Tree *tree;
+  size_t depth;
+} Mount;
+
+struct Namespace {
+  Tree *root;
+  HashMap *mounts;
+  uint64_t depth_mask; // bit min(d, 63) ustawiony, jesli jest punkt montowania na glebokosci d
+  pthread_rwlock_t lock;
+};
+
+static uint64_t depth_bit(size_t depth) {
+  return (uint64_t)1 << (depth < 63 ? depth : 63);
+}
+
+Namespace *ns_new(Tree *root) {
+  Namespace *ns = (Namespace *)malloc(sizeof(Namespace));
+  if (!ns) { bad_malloc(); }
+  ns->root = root;
+  if (!(ns->mounts = hmap_new())) { bad_malloc(); }
+  ns->depth_mask = 0;
+  if (pthread_rwlock_init(&ns->lock, NULL)) { syserr("pthread_rwlock_init"); }
+  return ns;
+}
+
+void ns_free(Namespace *ns) {
+  const char *key;
+  void *value;
+  HashMapIterator it = hmap_iterator(ns->mounts);
+  while (hmap_next(ns->mounts, &it, &key, &value)) { free(value); }
+  hmap_free(ns->mounts);
+  ensure(!pthread_rwlock_destroy(&ns->lock));
+  free(ns);
+}
+
+// zwraca drzewo, do ktorego nalezy path, i ustawia *subpath na sciezke w nim
+// (sufiks path); wymaga tablicy zablokowanej
+static Tree *resolve(Namespace *ns, const char *path, const char **subpath) {
+  Tree *tree = ns->root;
+  *subpath = path;
+  if (!ns->depth_mask) { return tree; }
+
+  char prefix[MAX_PATH_LENGTH + 1];
+  size_t depth = 0;
+  for (const char *c = path + 1; *c; ++c) {
+    if (*c != '/') { continue; }
+    depth++;
+    if (!(ns->depth_mask & depth_bit(depth))) { continue; }
+    size_t len = c - path + 1;
+    memcpy(prefix, path, len);
+    prefix[len] = '\0';
+    Mount *mount = (Mount *)hmap_get(ns->mounts, prefix);
+    if (mount) {
+      tree = mount->tree;
+      *subpath = c;
+    }
+  }
+  return tree;
+}
+
+static void read_lock(Namespace *ns) {
+  ensure(!pthread_rwlock_rdlock(&ns->lock));
+}
+
+static void unlock(Namespace *ns) {
+  ensure(!pthread_rwlock_unlock(&ns->lock));
+}
+
+// czy pod path (nie liczac samego path) jest jakis punkt montowania
+static bool has_mounts_below(Namespace *ns, const char *path) {
+  size_t len = strlen(path);
+  const char *key;
+  void *value;
+  HashMapIterator it = hmap_iterator(ns->mounts);
+  while (hmap_next(ns->mounts, &it, &key, &value)) {
+    if (strlen(key) > len && !strncmp(key, path, len)) { return true; }
+  }
+  return false;
+}
+
+int ns_mount(Namespace *ns, const char *path, Tree *tree) {
+  if (!is_path_valid(path) || !strcmp(path, "/") || !tree) { return EINVAL; }
+
+  int result = 0;
+  ensure(!pthread_rwlock_wrlock(&ns->lock));
+  if (hmap_get(ns->mounts, path)) { result = EBUSY; goto exit; }
+
+  const char *subpath;
+  Tree *parent = resolve(ns, path, &subpath);
+  TreeStat stat;
+  if ((result = tree_stat(parent, subpath, &stat))) { goto exit; }
+  char *list = tree_list(parent, subpath);
+  if (!list) { result = ENOTDIR; goto exit; }
+  free(list);
+
+  Mount *mount = (Mount *)malloc(sizeof(Mount));
+  if (!mount) { bad_malloc(); }
+  mount->tree = tree;
+  mount->depth = 0;
+  for (const char *c = path + 1; *c; ++c) {
+    if (*c == '/') { mount->depth++; }
+  }
+  if (!hmap_insert(ns->mounts, path, mount)) { bad_malloc(); }
+  ns->depth_mask |= depth_bit(mount->depth);
+
+exit:
+  unlock(ns);
+  return result;
+}
+
+int ns_umount(Namespace *ns, const char *path) {
+  if (!is_path_valid(path)) { return EINVAL; }
+
+  int result = 0;
+  ensure(!pthread_rwlock_wrlock(&ns->lock));
+  Mount *mount = (Mount *)hmap_get(ns->mounts, path);
+  if (!mount) { result = EINVAL; goto exit; }
+  if (has_mounts_below(ns, path)) { result = EBUSY; goto exit; }
+
+  ensure(hmap_remove(ns->mounts, path));
+  free(mount);
+  // maske liczymy od nowa - punktow montowania jest niewiele
+  ns->depth_mask = 0;
+  const char *key;
+  void *value;
+  HashMapIterator it = hmap_iterator(ns->mounts);
+  while (hmap_next(ns->mounts, &it, &key, &value)) { ns->depth_mask |= depth_bit(((Mount *)value)->depth); }
+
+exit:
+  unlock(ns);
+  return result;
+}
+
+char *ns_list(Namespace *ns, const char *path) {
+  if (!is_path_valid(path)) { return NULL; }
+  read_lock(ns);
+  const char *subpath;
+  Tree *tree = resolve(ns, path, &subpath);
+  char *result = tree_list(tree, subpath);
+  unlock(ns);
+  return result;
+}
+
+int ns_create(Namespace *ns, const char *path) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  read_lock(ns);
+  const char *subpath;
+  Tree *tree = resolve(ns, path, &subpath);
+  int result = tree_create(tree, subpath);
+  unlock(ns);
+  return result;
+}
+
+int ns_remove(Namespace *ns, const char *path) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  read_lock(ns);
+  const char *subpath;
+  Tree *tree = resolve(ns, path, &subpath);
+  // korzen zamontowanego drzewa to punkt montowania - tree_remove zwroci EBUSY
+  int result = tree_remove(tree, subpath);
+  unlock(ns);
+  return result;
+}
+
+int ns_move(Namespace *ns, const char *source, const char *target) {
+  if (!source || !is_path_valid(source)) { return EINVAL; }
+  if (!target || !is_path_valid(target)) { return EINVAL; }
+
+  int result;
+  read_lock(ns);
+  const char *source_subpath, *target_subpath;
+  Tree *source_tree = resolve(ns, source, &source_subpath);
+  Tree *target_tree = resolve(ns, target, &target_subpath);
+  if (!strcmp(source_subpath, "/") || has_mounts_below(ns, source)) {
+    result = EBUSY;
+  } else if (source_tree != target_tree) {
+    result = EXDEV;
+  } else {
+    result = tree_move(source_tree, source_subpath, target_subpath);
+  }
+  unlock(ns);
+  return result;
+}
+
+int ns_stat(Namespace *ns, const char *path, TreeStat *stat) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  read_lock(ns);
+  const char *subpath;
+  Tree *tree = resolve(ns, path, &subpath);
+  int result = tree_stat(tree, subpath, stat);
+  unlock(ns);
+  return result;
+}
+
+int ns_write(Namespace *ns, const char *path, size_t offset, const char *buf, size_t len) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  read_lock(ns);
+  const char *subpath;
+  Tree *tree = resolve(ns, path, &subpath);
+  int result = tree_write(tree, subpath, offset, buf, len);
+  unlock(ns);
+  return result;
+}
+
+int ns_read(Namespace *ns, const char *path, size_t offset, size_t len, TreeReadResult *result) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  read_lock(ns);
+  const char *subpath;
+  Tree *tree = resolve(ns, path, &subpath);
+  int err = tree_read(tree, subpath, offset, len, result);
+  unlock(ns);
+  return err;
+}
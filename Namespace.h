@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "Tree.h"
+
+// Przestrzeń nazw złożona z niezależnych drzew: drzewo główne obsługuje "/",
+// a pozostałe są zamontowane pod ścieżkami folderów (także w innych zamontowanych
+// drzewach). Operacja trafia do drzewa o najdłuższym pasującym punkcie montowania
+// i działa na nim z jego własną hierarchią locków, więc tree_move w jednym drzewie
+// nie blokuje operacji w innych. Drzewa nie należą do przestrzeni nazw - wywołujący
+// zwalnia je sam, po ns_umount albo ns_free.
+typedef struct Namespace Namespace;
+
+// Tworzy przestrzeń nazw z drzewem root pod "/".
+Namespace* ns_new(Tree* root);
+
+// Zwalnia przestrzeń nazw (bez drzew). Żadna operacja nie może być w toku.
+void ns_free(Namespace* ns);
+
+// Montuje tree pod path, które musi być istniejącym folderem w przestrzeni nazw.
+// Zwraca 0, EINVAL (zła ścieżka albo "/"), ENOENT, ENOTDIR albo EBUSY (path jest już punktem montowania).
+// Czeka na zakończenie operacji w toku.
+int ns_mount(Namespace* ns, const char* path, Tree* tree);
+
+// Odmontowuje drzewo spod path. Zwraca 0, EINVAL (path nie jest punktem montowania)
+// albo EBUSY (pod path są zamontowane inne drzewa). Czeka na zakończenie operacji w toku,
+// więc po powrocie drzewo można zwolnić.
+int ns_umount(Namespace* ns, const char* path);
+
+// Odpowiedniki operacji z Tree.h, wykonywane w drzewie, do którego należy ścieżka.
+// Punktu montowania nie można usunąć ani przenieść (EBUSY); nie można też przenieść
+// folderu, pod którym jest punkt montowania (EBUSY). ns_move między różnymi drzewami
+// zwraca EXDEV.
+char* ns_list(Namespace* ns, const char* path);
+int ns_create(Namespace* ns, const char* path);
+int ns_remove(Namespace* ns, const char* path);
+int ns_move(Namespace* ns, const char* source, const char* target);
+int ns_stat(Namespace* ns, const char* path, TreeStat* stat);
+int ns_write(Namespace* ns, const char* path, size_t offset, const char* buf, size_t len);
+int ns_read(Namespace* ns, const char* path, size_t offset, size_t len, TreeReadResult* result);
@@ -0,0 +1,97 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Ring.h"
+#include "err.h"
+
+// Each cell carries a sequence number: cell i is free for the producer of
+// position p when seq == p, and holds the element of position p when
+// seq == p + 1. The consumer releases it for position p + capacity.
+typedef struct Cell {
+    atomic_size_t seq;
+    char data[];
+} Cell;
+
+struct Ring {
+    _Alignas(64) atomic_size_t head; // Next position to pop.
+    _Alignas(64) atomic_size_t tail; // Next position to push.
+    _Alignas(64) size_t mask;
+    size_t elem_size;
+    size_t cell_size;
+    char* cells;
+};
+
+static Cell* get_cell(Ring* ring, size_t position)
+{
+    return (Cell*)(ring->cells + (position & ring->mask) * ring->cell_size);
+}
+
+Ring* ring_new(size_t capacity, size_t elem_size)
+{
+    Ring* ring = malloc(sizeof(Ring));
+    if (!ring) { bad_malloc(); }
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    ring->mask = size - 1;
+    ring->elem_size = elem_size;
+    // Keep cells aligned for atomic_size_t and for the elements.
+    ring->cell_size = (sizeof(Cell) + elem_size + _Alignof(max_align_t) - 1) / _Alignof(max_align_t) * _Alignof(max_align_t);
+    ring->cells = malloc(size * ring->cell_size);
+    if (!ring->cells) { bad_malloc(); }
+    for (size_t i = 0; i < size; ++i)
+        atomic_init(&get_cell(ring, i)->seq, i);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+void ring_free(Ring* ring)
+{
+    free(ring->cells);
+    free(ring);
+}
+
+bool ring_push(Ring* ring, const void* elem)
+{
+    size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        Cell* cell = get_cell(ring, position);
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)position;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                memcpy(cell->data, elem, ring->elem_size);
+                atomic_store_explicit(&cell->seq, position + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // Full: the cell still holds an element from the previous lap.
+        } else {
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+bool ring_pop(Ring* ring, void* elem)
+{
+    size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        Cell* cell = get_cell(ring, position);
+        intptr_t diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(position + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                memcpy(elem, cell->data, ring->elem_size);
+                atomic_store_explicit(&cell->seq, position + ring->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // Empty.
+        } else {
+            position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
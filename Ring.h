@@ -0,0 +1,23 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// A bounded, lock-free multi-producer multi-consumer FIFO queue of
+// fixed-size elements (Vyukov's array-based queue). Elements are copied in
+// and out of the ring.
+typedef struct Ring Ring;
+
+// Create a new, empty ring for elements of `elem_size` bytes.
+// `capacity` is rounded up to a power of two.
+Ring* ring_new(size_t capacity, size_t elem_size);
+
+// Free the ring. Must not be called concurrently with any other operation.
+void ring_free(Ring* ring);
+
+// Copy `elem` into the ring and return true,
+// or do nothing and return false if the ring is full.
+bool ring_push(Ring* ring, const void* elem);
+
+// Copy the oldest element into `elem`, remove it and return true,
+// or leave `elem` unchanged and return false if the ring is empty.
+bool ring_pop(Ring* ring, void* elem);
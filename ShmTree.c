@@ -0,0 +1,539 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ShmTree.h"
+#include "HashMap.h"
+#include "Tree.h" // EINVMV
+#include "err.h"
+#include "path_utils.h"
+#include "rwlock.h"
+
+/*
+Uklad segmentu: na poczatku naglowek, dalej bloki przydzielane przez alokator
+z klasami rozmiarow (potegi dwojki od MIN_BLOCK, kazda z lista wolnych blokow),
+chroniony mutexem wspolnym dla procesow. Wskazniki w segmencie to przesuniecia
+od jego poczatku (0 to NULL, bo tam jest naglowek). Dzieci folderu trzymamy
+w tablicy kubelkow z listami przez pole next dziecka, a nazwe - w samym dziecku.
+Synchronizacja jest taka jak w Tree.c: locki czytelnika na przodkach, lock
+pisarza na ojcu zmienianego wierzcholka, a dla przeniesienia na LCA ojcow.
+Mutexy sa "robust": proces, ktory padnie w srodku krotkiej sekcji krytycznej,
+nie blokuje innych, ale rwlock trzymany przez martwy proces zostaje wziety.
+*/
+
+#define SHM_TREE_MAGIC 0x3130454552544853ull // "SHTREE01"
+#define MIN_BLOCK ((size_t)64)
+#define N_CLASSES 40
+#define MIN_BUCKETS 4
+// jak dlugo otwierajacy czeka, az tworzacy zainicjalizuje segment
+#define OPEN_TIMEOUT_MS 5000
+
+typedef uint64_t shm_off_t;
+
+typedef struct ShmNode {
+  rwlock_t lock;
+  shm_off_t parent;
+  shm_off_t next; // nastepne dziecko ojca w tym samym kubelku
+  uint64_t hash;
+  shm_off_t buckets; // tablica n_buckets przesuniec dzieci; 0, dopoki nie ma dzieci
+  size_t n_buckets;
+  size_t n_children;
+  char name[];
+} ShmNode;
+
+typedef struct ShmHeader {
+  atomic_uint_fast64_t magic; // ustawiane na koncu inicjalizacji
+  size_t size;
+  uint64_t seed;
+  shm_off_t root;
+  pthread_mutex_t alloc_lock;
+  size_t brk; // poczatek nigdy nieprzydzielonej czesci
+  shm_off_t free_lists[N_CLASSES];
+} ShmHeader;
+
+struct ShmTree {
+  char *base;
+  ShmHeader *header;
+  size_t size;
+  int fd;
+};
+
+static void *at(ShmTree *tree, shm_off_t offset) {
+  return offset ? tree->base + offset : NULL;
+}
+
+static shm_off_t offset_of(ShmTree *tree, const void *ptr) {
+  return ptr ? (shm_off_t)((const char *)ptr - tree->base) : 0;
+}
+
+static void alloc_lock(ShmHeader *header) {
+  int err = pthread_mutex_lock(&header->alloc_lock);
+  if (err == EOWNERDEAD) { err = pthread_mutex_consistent(&header->alloc_lock); }
+  ensure(!err);
+}
+
+static size_t size_class(size_t size) {
+  size_t class = 0;
+  while (class < N_CLASSES && MIN_BLOCK << class < size) { class++; }
+  return class;
+}
+
+// zwraca 0, jesli w segmencie nie ma miejsca
+static shm_off_t shm_alloc(ShmTree *tree, size_t size) {
+  size_t class = size_class(size);
+  if (class == N_CLASSES) { return 0; }
+  ShmHeader *header = tree->header;
+  alloc_lock(header);
+  shm_off_t offset = header->free_lists[class];
+  if (offset) {
+    header->free_lists[class] = *(shm_off_t *)at(tree, offset);
+  } else if (header->brk + (MIN_BLOCK << class) <= header->size) {
+    offset = header->brk;
+    header->brk += MIN_BLOCK << class;
+  }
+  ensure(!pthread_mutex_unlock(&header->alloc_lock));
+  return offset;
+}
+
+static void shm_dealloc(ShmTree *tree, shm_off_t offset, size_t size) {
+  size_t class = size_class(size);
+  ShmHeader *header = tree->header;
+  alloc_lock(header);
+  *(shm_off_t *)at(tree, offset) = header->free_lists[class];
+  header->free_lists[class] = offset;
+  ensure(!pthread_mutex_unlock(&header->alloc_lock));
+}
+
+static ShmNode *node_new(ShmTree *tree, const char *name, uint64_t hash) {
+  size_t len = strlen(name);
+  ShmNode *node = (ShmNode *)at(tree, shm_alloc(tree, sizeof(ShmNode) + len + 1));
+  if (!node) { return NULL; }
+  rwlock_init(&node->lock, true);
+  node->parent = node->next = node->buckets = 0;
+  node->hash = hash;
+  node->n_buckets = node->n_children = 0;
+  memcpy(node->name, name, len + 1);
+  return node;
+}
+
+static void node_free(ShmTree *tree, ShmNode *node) {
+  rwlock_fini(&node->lock);
+  if (node->buckets) { shm_dealloc(tree, node->buckets, node->n_buckets * sizeof(shm_off_t)); }
+  shm_dealloc(tree, offset_of(tree, node), sizeof(ShmNode) + strlen(node->name) + 1);
+}
+
+static ShmNode *get_child(ShmTree *tree, ShmNode *node, const char *name, uint64_t hash) {
+  if (!node->n_children) { return NULL; }
+  shm_off_t *buckets = (shm_off_t *)at(tree, node->buckets);
+  for (ShmNode *child = (ShmNode *)at(tree, buckets[hash % node->n_buckets]); child;
+       child = (ShmNode *)at(tree, child->next)) {
+    if (child->hash == hash && !strcmp(child->name, name)) { return child; }
+  }
+  return NULL;
+}
+
+// dopina child do node (child nie moze tam byc); zwraca false, jesli zabraklo miejsca na kubelki
+static bool insert_child(ShmTree *tree, ShmNode *node, ShmNode *child) {
+  if (node->n_children >= node->n_buckets) {
+    size_t n_buckets = node->n_buckets ? 2 * node->n_buckets : MIN_BUCKETS;
+    shm_off_t *buckets = (shm_off_t *)at(tree, shm_alloc(tree, n_buckets * sizeof(shm_off_t)));
+    if (buckets) {
+      memset(buckets, 0, n_buckets * sizeof(shm_off_t));
+      shm_off_t *old = (shm_off_t *)at(tree, node->buckets);
+      for (size_t i = 0; i < node->n_buckets; ++i) {
+        for (ShmNode *moved = (ShmNode *)at(tree, old[i]), *next; moved; moved = next) {
+          next = (ShmNode *)at(tree, moved->next);
+          moved->next = buckets[moved->hash % n_buckets];
+          buckets[moved->hash % n_buckets] = offset_of(tree, moved);
+        }
+      }
+      if (old) { shm_dealloc(tree, node->buckets, node->n_buckets * sizeof(shm_off_t)); }
+      node->buckets = offset_of(tree, buckets);
+      node->n_buckets = n_buckets;
+    } else if (!node->n_buckets) {
+      return false;
+    }
+    // bez miejsca na wieksza tablice zostajemy przy dluzszych listach
+  }
+  shm_off_t *buckets = (shm_off_t *)at(tree, node->buckets);
+  child->next = buckets[child->hash % node->n_buckets];
+  buckets[child->hash % node->n_buckets] = offset_of(tree, child);
+  child->parent = offset_of(tree, node);
+  node->n_children++;
+  return true;
+}
+
+static void remove_child(ShmTree *tree, ShmNode *node, ShmNode *child) {
+  shm_off_t *it = &((shm_off_t *)at(tree, node->buckets))[child->hash % node->n_buckets];
+  while (*it != offset_of(tree, child)) { it = &((ShmNode *)at(tree, *it))->next; }
+  *it = child->next;
+  node->n_children--;
+}
+
+// sciezka rozbita na komponenty z hashami, jak ParsedPath w Tree.c
+typedef struct ShmPath {
+  size_t n;
+  char names[MAX_PATH_LENGTH + 1];
+  const char *components[MAX_PATH_LENGTH / 2];
+  uint64_t hashes[MAX_PATH_LENGTH / 2];
+} ShmPath;
+
+// path musi byc poprawna (is_path_valid)
+static void parse_path(ShmTree *tree, const char *path, ShmPath *parsed) {
+  strcpy(parsed->names, path + 1);
+  parsed->n = 0;
+  for (char *name = parsed->names; *name;) {
+    char *end = strchr(name, '/');
+    *end = '\0';
+    parsed->components[parsed->n] = name;
+    parsed->hashes[parsed->n] = hmap_hash(tree->header->seed, name, end - name);
+    parsed->n++;
+    name = end + 1;
+  }
+}
+
+// locki wziete przez lock_path
+typedef struct ShmLocks {
+  ShmNode *last;
+  size_t n;
+} ShmLocks;
+
+// schodzi od korzenia po komponentach [0, to) path, biorac locki czytelnika na
+// mijanych folderach, ale nie na znalezionym wierzcholku (ten blokuje wolajacy)
+static ShmNode *lock_path(ShmTree *tree, const ShmPath *path, size_t to, ShmLocks *locks) {
+  ShmNode *node = (ShmNode *)at(tree, tree->header->root);
+  locks->n = 0;
+  for (size_t i = 0; i < to && node; ++i) {
+    rwlock_rdlock(&node->lock);
+    locks->last = node;
+    locks->n++;
+    node = get_child(tree, node, path->components[i], path->hashes[i]);
+  }
+  return node;
+}
+
+// oddaje locki od najglebszego, idac po przesunieciach parent
+static void unlock_path(ShmTree *tree, ShmLocks *locks) {
+  ShmNode *node = locks->last;
+  for (size_t i = 0; i < locks->n; ++i) {
+    ShmNode *parent = (ShmNode *)at(tree, node->parent);
+    rwlock_rdunlock(&node->lock);
+    node = parent;
+  }
+}
+
+// zwraca true, jesli str zaczyna sie od prefix i jest dluzszy
+static bool has_strict_prefix(const char *str, const char *prefix) {
+  size_t len = strlen(prefix);
+  return strlen(str) > len && !strncmp(str, prefix, len);
+}
+
+static uint64_t random_seed() {
+  uint64_t seed;
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ (uint64_t)getpid();
+  }
+  return seed;
+}
+
+// tworzacy segment przygotowuje naglowek i korzen; magic ustawia na koncu
+static void init_segment(ShmTree *tree) {
+  ShmHeader *header = tree->header;
+  header->size = tree->size;
+  header->seed = random_seed();
+  pthread_mutexattr_t attr;
+  ensure(!pthread_mutexattr_init(&attr));
+  ensure(!pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED));
+  ensure(!pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST));
+  ensure(!pthread_mutex_init(&header->alloc_lock, &attr));
+  ensure(!pthread_mutexattr_destroy(&attr));
+  header->brk = (sizeof(ShmHeader) + MIN_BLOCK - 1) / MIN_BLOCK * MIN_BLOCK;
+  memset(header->free_lists, 0, sizeof(header->free_lists));
+  ShmNode *root = node_new(tree, "", 0);
+  if (!root) { fatal("Shared tree segment too small"); }
+  header->root = offset_of(tree, root);
+  atomic_store_explicit(&header->magic, SHM_TREE_MAGIC, memory_order_release);
+}
+
+static void sleep_ms(long ms) {
+  struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+ShmTree *shm_tree_open(const char *name, size_t size) {
+  bool created = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if (fd < 0) { return NULL; }
+
+  if (created) {
+    if (size < sizeof(ShmHeader) + 4 * MIN_BLOCK) { size = sizeof(ShmHeader) + 4 * MIN_BLOCK; }
+    if (ftruncate(fd, size)) {
+      int err = errno;
+      shm_unlink(name);
+      close(fd);
+      errno = err;
+      return NULL;
+    }
+  } else {
+    // tworzacy mogl jeszcze nie ustawic rozmiaru
+    struct stat st;
+    int waited = 0;
+    while (!fstat(fd, &st) && st.st_size == 0 && waited++ < OPEN_TIMEOUT_MS) { sleep_ms(1); }
+    if (st.st_size == 0) {
+      close(fd);
+      errno = ETIMEDOUT;
+      return NULL;
+    }
+    size = st.st_size;
+  }
+
+  char *base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  ShmTree *tree = (ShmTree *)malloc(sizeof(ShmTree));
+  if (!tree) { bad_malloc(); }
+  tree->base = base;
+  tree->header = (ShmHeader *)base;
+  tree->size = size;
+  tree->fd = fd;
+
+  if (created) {
+    init_segment(tree);
+  } else {
+    int waited = 0;
+    while (atomic_load_explicit(&tree->header->magic, memory_order_acquire) != SHM_TREE_MAGIC) {
+      if (waited++ == OPEN_TIMEOUT_MS) {
+        shm_tree_close(tree);
+        errno = ETIMEDOUT;
+        return NULL;
+      }
+      sleep_ms(1);
+    }
+  }
+  return tree;
+}
+
+void shm_tree_close(ShmTree *tree) {
+  ensure(!munmap(tree->base, tree->size));
+  close(tree->fd);
+  free(tree);
+}
+
+int shm_tree_unlink(const char *name) {
+  return shm_unlink(name) ? errno : 0;
+}
+
+size_t shm_tree_free_space(ShmTree *tree) {
+  alloc_lock(tree->header);
+  size_t result = tree->header->size - tree->header->brk;
+  ensure(!pthread_mutex_unlock(&tree->header->alloc_lock));
+  return result;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+char *shm_tree_list(ShmTree *tree, const char *path) {
+  if (!is_path_valid(path)) { return NULL; }
+
+  ShmPath parsed;
+  ShmLocks locks;
+  parse_path(tree, path, &parsed);
+  ShmNode *node = lock_path(tree, &parsed, parsed.n, &locks);
+  char *result = NULL;
+  if (node) {
+    rwlock_rdlock(&node->lock);
+    const char **names = (const char **)malloc((node->n_children + 1) * sizeof(char *));
+    if (!names) { bad_malloc(); }
+    size_t n = 0, len = 0;
+    shm_off_t *buckets = (shm_off_t *)at(tree, node->buckets);
+    for (size_t i = 0; i < node->n_buckets; ++i) {
+      for (ShmNode *child = (ShmNode *)at(tree, buckets[i]); child; child = (ShmNode *)at(tree, child->next)) {
+        names[n++] = child->name;
+        len += strlen(child->name) + 1;
+      }
+    }
+    qsort(names, n, sizeof(char *), compare_names);
+    if (!(result = (char *)malloc(len + 1))) { bad_malloc(); }
+    char *end = result;
+    for (size_t i = 0; i < n; ++i) {
+      if (i) { *end++ = ','; }
+      end = stpcpy(end, names[i]);
+    }
+    *end = '\0';
+    free(names);
+    rwlock_rdunlock(&node->lock);
+  }
+  unlock_path(tree, &locks);
+  return result;
+}
+
+int shm_tree_create(ShmTree *tree, const char *path) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  if (!strcmp(path, "/")) { return EEXIST; }
+
+  int result = 0;
+  ShmPath parsed;
+  ShmLocks locks;
+  parse_path(tree, path, &parsed);
+  size_t depth = parsed.n - 1;
+  ShmNode *parent = lock_path(tree, &parsed, depth, &locks);
+  if (!parent) { result = ENOENT; goto exit; }
+
+  rwlock_wrlock(&parent->lock);
+  if (get_child(tree, parent, parsed.components[depth], parsed.hashes[depth])) {
+    result = EEXIST;
+  } else {
+    ShmNode *node = node_new(tree, parsed.components[depth], parsed.hashes[depth]);
+    if (!node) {
+      result = ENOSPC;
+    } else if (!insert_child(tree, parent, node)) {
+      node_free(tree, node);
+      result = ENOSPC;
+    }
+  }
+  rwlock_wrunlock(&parent->lock);
+
+exit:
+  unlock_path(tree, &locks);
+  return result;
+}
+
+int shm_tree_remove(ShmTree *tree, const char *path) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  if (!strcmp(path, "/")) { return EBUSY; }
+
+  int result = 0;
+  ShmPath parsed;
+  ShmLocks locks;
+  parse_path(tree, path, &parsed);
+  size_t depth = parsed.n - 1;
+  ShmNode *parent = lock_path(tree, &parsed, depth, &locks);
+  if (!parent) { result = ENOENT; goto exit; }
+
+  rwlock_wrlock(&parent->lock);
+  ShmNode *node = get_child(tree, parent, parsed.components[depth], parsed.hashes[depth]);
+  if (!node) {
+    result = ENOENT;
+  } else if (node->n_children) {
+    result = ENOTEMPTY;
+  } else {
+    remove_child(tree, parent, node);
+    node_free(tree, node);
+  }
+  rwlock_wrunlock(&parent->lock);
+
+exit:
+  unlock_path(tree, &locks);
+  return result;
+}
+
+// schodzi bez lockow po komponentach [from, to) path; wolajacy ma wylacznosc na node
+static ShmNode *walk_path(ShmTree *tree, ShmNode *node, const ShmPath *path, size_t from, size_t to) {
+  for (size_t i = from; i < to && node; ++i) {
+    node = get_child(tree, node, path->components[i], path->hashes[i]);
+  }
+  return node;
+}
+
+int shm_tree_move(ShmTree *tree, const char *source, const char *target) {
+  if (!source || !is_path_valid(source)) { return EINVAL; }
+  if (!target || !is_path_valid(target)) { return EINVAL; }
+  if (!strcmp(source, "/")) { return EBUSY; }
+  if (!strcmp(target, "/")) { return EEXIST; }
+  if (has_strict_prefix(target, source)) { return EINVMV; }
+
+  ShmPath *paths = (ShmPath *)malloc(2 * sizeof(ShmPath));
+  if (!paths) { bad_malloc(); }
+  ShmPath *source_path = &paths[0], *target_path = &paths[1];
+  parse_path(tree, source, source_path);
+  parse_path(tree, target, target_path);
+  size_t source_depth = source_path->n - 1;
+  size_t target_depth = target_path->n - 1;
+
+  int result = 0;
+  ShmLocks locks;
+  if (has_strict_prefix(source, target)) {
+    ShmNode *node = lock_path(tree, source_path, source_path->n, &locks);
+    result = node ? EEXIST : ENOENT;
+    goto exit;
+  }
+
+  // LCA ojcow lezy na koncu najdluzszego wspolnego prefiksu ich sciezek
+  size_t lca_depth = 0;
+  while (lca_depth < source_depth && lca_depth < target_depth &&
+         !strcmp(source_path->components[lca_depth], target_path->components[lca_depth])) {
+    lca_depth++;
+  }
+  ShmNode *lca = lock_path(tree, source_path, lca_depth, &locks);
+  if (!lca) { result = ENOENT; goto exit; }
+
+  rwlock_wrlock(&lca->lock);
+  ShmNode *source_parent = walk_path(tree, lca, source_path, lca_depth, source_depth);
+  ShmNode *target_parent = walk_path(tree, lca, target_path, lca_depth, target_depth);
+  ShmNode *node = source_parent ? get_child(tree, source_parent, source_path->components[source_depth],
+                                            source_path->hashes[source_depth]) : NULL;
+  if (!source_parent || !target_parent || !node) {
+    result = ENOENT;
+  } else if (get_child(tree, target_parent, target_path->components[target_depth],
+                       target_path->hashes[target_depth])) {
+    result = EEXIST;
+  } else {
+    // nazwa jest w wierzcholku, wiec przy zmianie nazwy potrzebny jest nowy
+    const char *name = target_path->components[target_depth];
+    ShmNode *moved = node;
+    if (strcmp(node->name, name)) {
+      moved = node_new(tree, name, target_path->hashes[target_depth]);
+      if (!moved) { result = ENOSPC; goto exit2; }
+    }
+    remove_child(tree, source_parent, node);
+    if (!insert_child(tree, target_parent, moved)) {
+      ensure(insert_child(tree, source_parent, node));
+      if (moved != node) { node_free(tree, moved); }
+      result = ENOSPC;
+      goto exit2;
+    }
+    if (moved != node) {
+      // przenosimy dzieci razem z tablica kubelkow
+      moved->buckets = node->buckets;
+      moved->n_buckets = node->n_buckets;
+      moved->n_children = node->n_children;
+      shm_off_t *buckets = (shm_off_t *)at(tree, moved->buckets);
+      for (size_t i = 0; i < moved->n_buckets; ++i) {
+        for (ShmNode *child = (ShmNode *)at(tree, buckets[i]); child; child = (ShmNode *)at(tree, child->next)) {
+          child->parent = offset_of(tree, moved);
+        }
+      }
+      node->buckets = 0;
+      node_free(tree, node);
+    }
+  }
+
+exit2:
+  rwlock_wrunlock(&lca->lock);
+exit:
+  unlock_path(tree, &locks);
+  free(paths);
+  return result;
+}
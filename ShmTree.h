@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+
+// Drzewo folderów w nazwanym segmencie pamięci współdzielonej (shm_open + mmap),
+// z którego może korzystać naraz wiele procesów. Wierzchołki, tablice dzieci i nazwy
+// leżą w segmencie i wskazują na siebie przez przesunięcia względem jego początku,
+// więc każdy proces może go zmapować pod innym adresem; rwlocki wierzchołków
+// i alokatora działają między procesami. Operacje i ich wyniki są takie jak w Tree.h;
+// dodatkowo create i move zwracają ENOSPC, gdy w segmencie zabraknie miejsca.
+typedef struct ShmTree ShmTree;
+
+// Otwiera drzewo w segmencie name (np. "/tree"), a jeśli segment nie istnieje - tworzy go
+// o rozmiarze size bajtów, z pustym folderem "/". Zwraca NULL (z errno), jeśli się nie uda.
+ShmTree* shm_tree_open(const char* name, size_t size);
+
+// Odmapowuje drzewo w tym procesie; segment i drzewo zostają dla innych procesów.
+void shm_tree_close(ShmTree* tree);
+
+// Usuwa nazwę segmentu (jak shm_unlink); procesy, które go mają otwartego, działają dalej.
+int shm_tree_unlink(const char* name);
+
+char* shm_tree_list(ShmTree* tree, const char* path);
+int shm_tree_create(ShmTree* tree, const char* path);
+int shm_tree_remove(ShmTree* tree, const char* path);
+int shm_tree_move(ShmTree* tree, const char* source, const char* target);
+
+// Zwraca liczbę bajtów segmentu, które nie zostały jeszcze nigdy przydzielone.
+size_t shm_tree_free_space(ShmTree* tree);
@@ -1,42 +1,655 @@
 #include <errno.h>
+#include <fcntl.h> // open
 #include <stdlib.h>
 #include <stddef.h> // NULL
 #include <string.h> // strlen
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h> // sysconf
 
 #include "Tree.h"
+#include "Deque.h"
+#include "File.h"
 #include "HashMap.h"
+#include "Intern.h"
+#include "Ring.h"
+#include "TreeTrace.h"
+#include "NameIndex.h"
 #include "err.h"
 #include "path_utils.h"
 #include "rwlock.h"
 
+typedef struct TreeLog TreeLog;
+typedef struct Trace Trace;
+
+// wierzcholek jest albo folderem (children != NULL), albo plikiem (file != NULL)
+// descendants i height (wysokosc poddrzewa, 0 dla liscia) sa aktualizowane
+// atomowo przy kazdej zmianie struktury, wiec mozna je czytac bez locka
 struct Tree {
-  HashMap *hmap;
+  NameIndex *children;
+  File *file;
   rwlock_t *rwlock;
+  Tree *parent;
+  atomic_size_t descendants;
+  atomic_size_t height;
+  TreeWatch *watches; // obserwatorzy tego folderu
+  atomic_size_t n_watches; // tylko w korzeniu: liczba aktywnych obserwacji w drzewie
+  atomic_bool striped; // indeks dzieci ma pasy; raz ustawione zostaje
+  atomic_size_t pins; // ile watkow trzyma wskaznik na wierzcholek bez locka (patrz get_child_pinned)
+  atomic_size_t handles; // ile otwartych uchwytow (TreeDir) wskazuje na folder
+  atomic_bool frozen; // wierzcholek jest w zamrozonym poddrzewie (tree_freeze); raz ustawione zostaje
+  _Atomic(TreeLog *) log; // tylko w korzeniu: strumienie zmian (tree_log_open) albo NULL
+  _Atomic(Trace *) trace; // tylko w korzeniu: slad wywolan (tree_trace_start) albo NULL
 };
 
+static Tree *node_new(NameIndex *children, File *file) {
+  Tree *node = (Tree *)malloc(sizeof(Tree));
+  if (!node) { bad_malloc(); }
+  if (!(node->rwlock = rwlock_new())) { syserr("Unable to create lock"); }
+  node->children = children;
+  node->file = file;
+  node->parent = NULL;
+  atomic_init(&node->descendants, 0);
+  atomic_init(&node->height, 0);
+  node->watches = NULL;
+  atomic_init(&node->n_watches, 0);
+  atomic_init(&node->striped, false);
+  atomic_init(&node->pins, 0);
+  atomic_init(&node->handles, 0);
+  atomic_init(&node->frozen, false);
+  atomic_init(&node->log, NULL);
+  atomic_init(&node->trace, NULL);
+  return node;
+}
+
+// wszystkie foldery drzewa dziela rodzaj indeksu dzieci i seed funkcji
+// hashujacej, wylosowany w tree_new, wiec hash nazwy policzony raz pasuje do
+// kazdej mapy w drzewie
+static Tree *dir_node_new(NameIndexKind kind, uint64_t seed) {
+  return node_new(index_new(kind, seed), NULL);
+}
+
+// nowy folder w tym samym drzewie co parent
+static Tree *child_dir_new(Tree *parent) {
+  return dir_node_new(index_kind(parent->children), index_seed(parent->children));
+}
+
+static uint64_t random_seed() {
+  uint64_t seed;
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ (uint64_t)(uintptr_t)&seed;
+  }
+  return seed;
+}
+
 Tree* tree_new() {
-  Tree *tree = (Tree *)malloc(sizeof(Tree));
-  if (!tree) { bad_malloc(); }
-  if (!(tree->rwlock = rwlock_new())) { syserr("Unable to create lock"); }
-  if (!(tree->hmap = hmap_new())) { bad_malloc(); }
-  return tree;
+  return tree_new_with_index(NAME_INDEX_HASH);
+}
+
+Tree* tree_new_with_index(NameIndexKind kind) {
+  return dir_node_new(kind, random_seed());
+}
+
+static Tree *file_node_new() {
+  return node_new(NULL, file_new());
+}
+
+// zwraca dziecko o danej nazwie; plik nie ma dzieci
+static Tree *get_child(Tree *node, const char *name) {
+  if (!node->children) { return NULL; }
+  return (Tree *)index_get(node->children, name);
+}
+
+// sciezka rozbita na komponenty; hash kazdego komponentu liczymy raz, przy
+// parsowaniu, i uzywamy przy kazdym index_get w czasie blokowania i odblokowywania
+typedef struct ParsedPath {
+  size_t n;
+  char names[MAX_PATH_LENGTH + 1]; // komponenty zakonczone '\0'
+  const char *components[MAX_PATH_LENGTH / 2];
+  uint64_t hashes[MAX_PATH_LENGTH / 2];
+  // co trzyma ostatnie przejscie w trybie LOCK (patrz unlock_subfolder)
+  Tree *found;
+  Tree *last_locked;
+  size_t n_locked;
+  bool pinned;
+} ParsedPath;
+
+// path musi byc poprawna (is_path_valid)
+static void parse_path(Tree *tree, const char *path, ParsedPath *parsed) {
+  uint64_t seed = index_seed(tree->children);
+  bool hashed = index_kind(tree->children) != NAME_INDEX_TRIE; // trie nie uzywa hashy
+  strcpy(parsed->names, path + 1);
+  parsed->n = 0;
+  for (char *name = parsed->names; *name;) {
+    char *end = strchr(name, '/');
+    *end = '\0';
+    parsed->components[parsed->n] = name;
+    parsed->hashes[parsed->n] = hashed ? hmap_hash(seed, name, end - name) : 0;
+    parsed->n++;
+    name = end + 1;
+  }
+}
+
+static Tree *get_child_parsed(Tree *node, const ParsedPath *path, size_t i) {
+  if (!node->children) { return NULL; }
+  return (Tree *)index_get_hashed(node->children, path->components[i], path->hashes[i]);
+}
+
+/*
+Agregaty poddrzewa: zmiana struktury pod wierzcholkiem node poprawia liczniki
+na sciezce od node do korzenia, po wskaznikach parent. Ta sciezka jest stala,
+bo operacja trzyma read-locki na wszystkich przodkach, a przodka nie da sie
+w tym czasie odlaczyc: zwykle zmiany zbioru dzieci wymagaja locka pisarza na
+ojcu, a w folderze z pasami (create_until, remove_striped) wystarcza lock
+czytelnika i mutex pasa, ale usuwane dziecko musi byc wolne (trywrlock).
+Zbiory dzieci przodkow nie sa wiec stale - w folderach z pasami wiele
+operacji naraz dodaje i usuwa dzieci i poprawia te same liczniki. Liczby
+potomkow poprawiamy atomowym dodawaniem. Wysokosci rosna przez atomowe
+maksimum; gdy maleja, wysokosc przodka liczymy od nowa z jego dzieci (CAS,
+bo rownolegle ktos moze ja podnosic) i idziemy w gore tylko dopoki sie
+zmienia. Dziecko, ktore urosnie miedzy policzeniem a CAS, moze nie podniesc
+ojca, bo widzi jeszcze stara wysokosc - lower_height sprawdza wiec wynik
+po CAS jeszcze raz (bariery w raise_height i lower_height).
+*/
+
+// dodaje delta do liczby potomkow wierzcholkow od node w gore, do stop (bez niego)
+static void add_descendants(Tree *node, Tree *stop, long delta) {
+  for (; node != stop; node = node->parent) {
+    atomic_fetch_add_explicit(&node->descendants, (size_t)delta, memory_order_relaxed);
+  }
+}
+
+static size_t get_height(Tree *node) {
+  return atomic_load_explicit(&node->height, memory_order_relaxed);
+}
+
+// node ma dziecko o wysokosci child_height
+static void raise_height(Tree *node, size_t child_height) {
+  for (; node; node = node->parent) {
+    // para z bariera w lower_height: albo zobaczymy obnizona wysokosc node,
+    // albo lower_height zobaczy wyzsze dziecko
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t height = get_height(node);
+    do {
+      if (height > child_height) { return; }
+    } while (!atomic_compare_exchange_weak_explicit(&node->height, &height, child_height + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    child_height++;
+  }
+}
+
+// wysokosc folderu policzona z dzieci, ale nie wieksza niz limit: konczymy, gdy
+// ktores dziecko ja osiaga, wiec w duzym folderze zwykle wystarcza pierwsze.
+// Przodkow trzymamy tylko w trybie czytelnika, wiec folderowi z pasami moga
+// w tym czasie przybywac dzieci - iterujemy z lockiem biezacego pasa.
+static size_t children_height(Tree *node, size_t limit) {
+  size_t result = 0;
+  const char *key;
+  void *value;
+  NameIndexIterator it = index_locking_iterator(node->children);
+  while (result < limit && index_next(&it, &key, &value)) {
+    size_t height = get_height((Tree *)value) + 1;
+    if (height > result) { result = height; }
+  }
+  index_iterator_end(&it);
+  return result;
+}
+
+// node stracil dziecko - jego wysokosc mogla zmalec
+static void lower_height(Tree *node) {
+  for (; node; node = node->parent) {
+    size_t height = get_height(node);
+    size_t new_height;
+    do {
+      new_height = children_height(node, height);
+      if (new_height >= height) { return; }
+    } while (!atomic_compare_exchange_weak_explicit(&node->height, &height, new_height,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    // dziecko moglo urosnac po policzeniu new_height, a jego raise_height
+    // zobaczyc jeszcze stara wysokosc i skonczyc - wtedy po CAS wysokosc
+    // bylaby za mala na zawsze, wiec liczymy ja jeszcze raz, ze wszystkich dzieci
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t child_height = children_height(node, SIZE_MAX);
+    if (child_height > new_height) { raise_height(node, child_height - 1); }
+  }
+}
+
+// wolane po wstawieniu node do parent->children, pod lockiem pisarza na parent
+static void attach_node(Tree *parent, Tree *node) {
+  node->parent = parent;
+  add_descendants(parent, NULL, atomic_load_explicit(&node->descendants, memory_order_relaxed) + 1);
+  raise_height(parent, get_height(node));
+}
+
+// wolane po usunieciu node z parent->children, pod lockiem pisarza na parent
+static void detach_node(Tree *parent, Tree *node) {
+  add_descendants(parent, NULL, -(long)atomic_load_explicit(&node->descendants, memory_order_relaxed) - 1);
+  lower_height(parent);
+}
+
+/*
+Obserwacja folderow: kazdy folder ma liste obserwatorow, a korzen licznik
+aktywnych obserwacji w calym drzewie. Mutacja w drzewie bez obserwatorow placi
+tylko za odczyt tego licznika. W przeciwnym razie, po wykonaniu zmiany, a przed
+oddaniem lockow, przechodzi od ojca zmienionego wierzcholka do korzenia
+i wrzuca zdarzenie do kolejek obserwatorow ojca i rekurencyjnych obserwatorow
+przodkow. Listy sa stale, bo dopisanie obserwatora wymaga locka pisarza na
+folderze, a mutacja trzyma locki na calej sciezce (lub lock pisarza na LCA).
+Kolejka obserwatora to ograniczony ring bez lockow; gdy jest pelna, zdarzenie
+przepada i ustawiamy flage przepelnienia. tree_unwatch nie bierze lockow -
+tylko konczy obserwacje, a obserwatora usuwa z listy folderu ten, kto ma
+na folderze wylacznosc (albo zwolnienie folderu). Pamiec zwalnia ostatni
+z dwoch wlascicieli (uzytkownik i lista folderu).
+*/
+
+struct TreeWatch {
+  Tree *tree; // korzen drzewa
+  bool recursive;
+  atomic_bool active;
+  atomic_bool overflowed;
+  atomic_int refcount;
+  Ring *events;
+  TreeWatch *next;
+};
+
+// laczy pary zdarzen TREE_EVENT_MOVED_FROM i TREE_EVENT_MOVED_TO
+static atomic_uint_fast64_t next_cookie;
+
+static bool is_watched(Tree *tree) {
+  return atomic_load_explicit(&tree->n_watches, memory_order_relaxed);
+}
+
+static void watch_release(TreeWatch *watch) {
+  if (atomic_fetch_sub_explicit(&watch->refcount, 1, memory_order_acq_rel) > 1) { return; }
+  TreeEvent event;
+  while (ring_pop(watch->events, &event)) { free(event.path); }
+  ring_free(watch->events);
+  free(watch);
+}
+
+// konczy obserwacje; licznik w korzeniu zmniejsza tylko pierwsze wywolanie
+static void watch_deactivate(TreeWatch *watch) {
+  if (atomic_exchange(&watch->active, false)) {
+    atomic_fetch_sub_explicit(&watch->tree->n_watches, 1, memory_order_relaxed);
+  }
+}
+
+static void watch_post(TreeWatch *watch, TreeEventType type, const char *path, uint64_t cookie) {
+  TreeEvent event = { type, strdup(path), cookie };
+  if (!event.path) { bad_malloc(); }
+  if (!ring_push(watch->events, &event)) {
+    free(event.path);
+    atomic_store_explicit(&watch->overflowed, true, memory_order_release);
+  }
+}
+
+// zdarzenie dotyczace dziecka path folderu parent; wolajacy ma wylacznosc na parent
+// (lock pisarza na nim albo na jego przodku) i read-locki na pozostalych przodkach
+static void notify(Tree *tree, Tree *parent, TreeEventType type, const char *path, uint64_t cookie) {
+  if (!is_watched(tree)) { return; }
+  for (TreeWatch **it = &parent->watches; *it;) {
+    TreeWatch *watch = *it;
+    if (!atomic_load(&watch->active)) {
+      *it = watch->next;
+      watch_release(watch);
+      continue;
+    }
+    watch_post(watch, type, path, cookie);
+    it = &watch->next;
+  }
+  for (Tree *node = parent->parent; node; node = node->parent) {
+    for (TreeWatch *watch = node->watches; watch; watch = watch->next) {
+      if (watch->recursive && atomic_load(&watch->active)) { watch_post(watch, type, path, cookie); }
+    }
+  }
+}
+
+// folder node znika: jego obserwatorzy dostaja (jesli path != NULL) ostatnie
+// zdarzenie o usunieciu samego folderu i zostaja odlaczeni
+static void detach_watches(Tree *node, const char *path) {
+  while (node->watches) {
+    TreeWatch *watch = node->watches;
+    node->watches = watch->next;
+    if (path && atomic_load(&watch->active)) { watch_post(watch, TREE_EVENT_REMOVED, path, 0); }
+    watch_deactivate(watch);
+    watch_release(watch);
+  }
+}
+
+bool tree_watch_next(TreeWatch *watch, TreeEvent *event) {
+  if (ring_pop(watch->events, event)) { return true; }
+  if (atomic_exchange_explicit(&watch->overflowed, false, memory_order_acquire)) {
+    *event = (TreeEvent){ TREE_EVENT_OVERFLOW, NULL, 0 };
+    return true;
+  }
+  return false;
+}
+
+void tree_unwatch(TreeWatch *watch) {
+  watch_deactivate(watch);
+  watch_release(watch);
+}
+
+/*
+Strumienie zmian: korzen drzewa, w ktorym ktos otworzyl strumien, ma TreeLog
+z lista strumieni. Mutacja drzewa bez otwartych strumieni placi tylko za odczyt
+licznika. W przeciwnym razie, po wykonaniu zmiany, a przed oddaniem lockow,
+pod mutexem logu nadaje rekordowi kolejny numer i dopisuje go do kolejek
+wszystkich strumieni. Mutacje, ktore nie wykluczaja sie lockami drzewa, zmieniaja
+rozlaczne poddrzewa, wiec ich kolejnosc w logu nie ma znaczenia, a pozostale
+trafiaja do niego w kolejnosci wykonania. Rekord jest jeden dla wszystkich
+strumieni; zwalnia go ostatni z odbiorcow. Kolejki rosna bez limitu, zeby
+mutacja trzymajaca locki nigdy nie czekala na odbiorce.
+*/
+
+typedef struct LogEntry {
+  atomic_int refcount;
+  TreeLogRecord record;
+  char data[]; // napisy i dane zapisu z rekordu
+} LogEntry;
+
+struct TreeLogStream {
+  TreeLog *log;
+  TreeLogStream *next;
+  pthread_cond_t ready;
+  // kolejka: entries[start..end)
+  LogEntry **entries;
+  size_t start;
+  size_t end;
+  size_t capacity;
+};
+
+struct TreeLog {
+  pthread_mutex_t lock;
+  atomic_uint_fast64_t seq; // numer ostatniego rekordu
+  atomic_size_t n_streams;
+  TreeLogStream *streams;
+};
+
+// log drzewa, jesli jest otwarty jakis strumien; wolajacy trzyma lock na korzeniu
+static TreeLog *active_log(Tree *tree) {
+  TreeLog *log = atomic_load_explicit(&tree->log, memory_order_acquire);
+  return log && atomic_load_explicit(&log->n_streams, memory_order_relaxed) ? log : NULL;
+}
+
+static bool is_logged(Tree *tree) {
+  return active_log(tree) != NULL;
+}
+
+static void stream_push(TreeLogStream *stream, LogEntry *entry) {
+  if (stream->end == stream->capacity) {
+    if (stream->start) {
+      memmove(stream->entries, stream->entries + stream->start, (stream->end - stream->start) * sizeof(LogEntry *));
+      stream->end -= stream->start;
+      stream->start = 0;
+    }
+    if (stream->end == stream->capacity) {
+      stream->capacity = stream->capacity ? 2 * stream->capacity : 64;
+      stream->entries = (LogEntry **)realloc(stream->entries, stream->capacity * sizeof(LogEntry *));
+      if (!stream->entries) { bad_malloc(); }
+    }
+  }
+  stream->entries[stream->end++] = entry;
+  if (stream->end - stream->start == 1) { pthread_cond_signal(&stream->ready); }
+}
+
+static void entry_release(LogEntry *entry) {
+  if (atomic_fetch_sub_explicit(&entry->refcount, 1, memory_order_acq_rel) == 1) { free(entry); }
+}
+
+// rekord zmiany change z kopiami jej napisow i danych
+static LogEntry *log_entry_new(const TreeLogRecord *change) {
+  size_t path_size = strlen(change->path) + 1;
+  size_t target_size = change->target ? strlen(change->target) + 1 : 0;
+  LogEntry *entry = (LogEntry *)malloc(sizeof(LogEntry) + path_size + target_size + change->len);
+  if (!entry) { bad_malloc(); }
+  entry->record = *change;
+  char *data = entry->data;
+  memcpy(data, change->path, path_size);
+  entry->record.path = data;
+  data += path_size;
+  if (target_size) {
+    memcpy(data, change->target, target_size);
+    entry->record.target = data;
+    data += target_size;
+  }
+  if (change->len) { memcpy(data, change->data, change->len); }
+  entry->record.data = data;
+  return entry;
+}
+
+// nadaje rekordom kolejne numery i dopisuje je do strumieni, bez przeplotu z innymi.
+// Wolajacy trzyma locki, pod ktorymi wykonal zmiany.
+static void log_append(TreeLog *log, LogEntry **entries, size_t n) {
+  pthread_mutex_lock(&log->lock);
+  int n_streams = 0;
+  for (TreeLogStream *stream = log->streams; stream; stream = stream->next) { n_streams++; }
+  uint64_t seq = atomic_load_explicit(&log->seq, memory_order_relaxed);
+  for (size_t i = 0; i < n; ++i) {
+    entries[i]->record.seq = ++seq;
+    clock_gettime(CLOCK_MONOTONIC, &entries[i]->record.time);
+    atomic_init(&entries[i]->refcount, n_streams);
+    for (TreeLogStream *stream = log->streams; stream; stream = stream->next) { stream_push(stream, entries[i]); }
+  }
+  atomic_store_explicit(&log->seq, seq, memory_order_release);
+  pthread_mutex_unlock(&log->lock);
+  // ostatni strumien zamknieto po sprawdzeniu active_log
+  if (!n_streams) {
+    for (size_t i = 0; i < n; ++i) { free(entries[i]); }
+  }
+}
+
+static void log_change(Tree *tree, const TreeLogRecord *change) {
+  TreeLog *log = active_log(tree);
+  if (!log) { return; }
+  LogEntry *entry = log_entry_new(change);
+  log_append(log, &entry, 1);
+}
+
+static void log_op(Tree *tree, TreeLogOpType type, const char *path, const char *target) {
+  TreeLogRecord change = { 0 };
+  change.type = type;
+  change.path = path;
+  change.target = target;
+  log_change(tree, &change);
+}
+
+static void log_write(Tree *tree, const char *path, size_t offset, const char *buf, size_t len) {
+  TreeLogRecord change = { 0 };
+  change.type = TREE_LOG_WRITE;
+  change.path = path;
+  change.data = buf;
+  change.offset = offset;
+  change.len = len;
+  log_change(tree, &change);
+}
+
+size_t tree_log_read(TreeLogStream *stream, const TreeLogRecord **records, size_t max,
+                     const struct timespec *deadline) {
+  TreeLog *log = stream->log;
+  pthread_mutex_lock(&log->lock);
+  while (stream->start == stream->end && max) {
+    int err = deadline ? pthread_cond_timedwait(&stream->ready, &log->lock, deadline)
+                       : pthread_cond_wait(&stream->ready, &log->lock);
+    if (err == ETIMEDOUT) { break; }
+  }
+  size_t n = 0;
+  while (n < max && stream->start < stream->end) { records[n++] = &stream->entries[stream->start++]->record; }
+  if (stream->start == stream->end) { stream->start = stream->end = 0; }
+  pthread_mutex_unlock(&log->lock);
+  return n;
+}
+
+void tree_log_release(const TreeLogRecord **records, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    entry_release((LogEntry *)((char *)records[i] - offsetof(LogEntry, record)));
+  }
+}
+
+void tree_log_close(TreeLogStream *stream) {
+  TreeLog *log = stream->log;
+  pthread_mutex_lock(&log->lock);
+  TreeLogStream **it = &log->streams;
+  while (*it != stream) { it = &(*it)->next; }
+  *it = stream->next;
+  atomic_fetch_sub_explicit(&log->n_streams, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&log->lock);
+
+  for (size_t i = stream->start; i < stream->end; ++i) { entry_release(stream->entries[i]); }
+  ensure(!pthread_cond_destroy(&stream->ready));
+  free(stream->entries);
+  free(stream);
+}
+
+uint64_t tree_log_seq(Tree *tree) {
+  TreeLog *log = atomic_load_explicit(&tree->log, memory_order_acquire);
+  return log ? atomic_load_explicit(&log->seq, memory_order_acquire) : 0;
+}
+
+static void log_free(Tree *tree) {
+  TreeLog *log = atomic_load_explicit(&tree->log, memory_order_relaxed);
+  if (!log) { return; }
+  ensure(!pthread_mutex_destroy(&log->lock));
+  free(log);
+}
+
+/*
+Slad wywolan (tree_trace_start). Watek dopisuje wpis do jednego z TRACE_STRIPES
+buforow, wybranego wg numeru watku, pod jego mutexem; pelny bufor trafia do
+pliku jednym write pod file_lock. Watek pisze zawsze do tego samego bufora,
+wiec jego wpisy zostaja w kolejnosci wywolan. Struktura sladu zyje do
+tree_free, a koniec sladu zamyka plik pod mutexami wszystkich buforow, wiec
+wywolanie konczace sie po tree_trace_stop tylko nie dopisuje swojego wpisu.
+*/
+
+#define TRACE_STRIPES 16
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+typedef struct TraceStripe {
+  _Alignas(64) pthread_mutex_t lock; // osobna linia cache na bufor
+  char *data;
+  size_t len;
+} TraceStripe;
+
+struct Trace {
+  atomic_bool active;
+  int fd; // -1 poza sladem; zmieniany pod mutexami wszystkich buforow
+  uint64_t start; // poczatek sladu na zegarze CLOCK_MONOTONIC, w ns; jak fd
+  pthread_mutex_t file_lock;
+  int error; // pierwszy blad zapisu, pod file_lock
+  TraceStripe stripes[TRACE_STRIPES];
+};
+
+static atomic_uint next_trace_thread;
+static _Thread_local uint32_t trace_thread;
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// wolajacy trzyma mutex bufora
+static void trace_flush(Trace *trace, TraceStripe *stripe) {
+  pthread_mutex_lock(&trace->file_lock);
+  for (size_t done = 0; done < stripe->len && !trace->error;) {
+    ssize_t n = write(trace->fd, stripe->data + done, stripe->len - done);
+    if (n > 0) {
+      done += n;
+    } else if (!n || errno != EINTR) {
+      trace->error = n ? errno : EIO;
+    }
+  }
+  pthread_mutex_unlock(&trace->file_lock);
+  stripe->len = 0;
+}
+
+// dopisuje wpis wywolania z chwili start (wpis poczatkowy - bez czasu) z n_extra
+// polami dodatkowymi i sciezkami; pomija wywolania sprzed biezacego sladu
+static void trace_append(Trace *trace, TreeTraceEntry *entry, uint64_t start, const uint64_t *extra, size_t n_extra,
+                         const char *path, const char *target) {
+  if (!trace_thread) { trace_thread = atomic_fetch_add_explicit(&next_trace_thread, 1, memory_order_relaxed) + 1; }
+  entry->thread = trace_thread;
+  // dluzsze sciezki i tak sa niepoprawne
+  entry->path_len = path ? strnlen(path, MAX_PATH_LENGTH + 1) : 0;
+  entry->target_len = target ? strnlen(target, MAX_PATH_LENGTH + 1) : 0;
+  size_t size = sizeof(*entry) + n_extra * sizeof(uint64_t) + entry->path_len + entry->target_len;
+
+  TraceStripe *stripe = &trace->stripes[trace_thread % TRACE_STRIPES];
+  pthread_mutex_lock(&stripe->lock);
+  if (trace->fd >= 0 && (entry->flags & TREE_TRACE_SETUP || start >= trace->start)) {
+    if (!(entry->flags & TREE_TRACE_SETUP)) { entry->time = start - trace->start; }
+    if (stripe->len + size > TRACE_BUFFER_SIZE) { trace_flush(trace, stripe); }
+    char *end = stripe->data + stripe->len;
+    memcpy(end, entry, sizeof(*entry));
+    end += sizeof(*entry);
+    if (n_extra) { memcpy(end, extra, n_extra * sizeof(uint64_t)); }
+    end += n_extra * sizeof(uint64_t);
+    if (path) { memcpy(end, path, entry->path_len); }
+    if (target) { memcpy(end + entry->path_len, target, entry->target_len); }
+    stripe->len += size;
+  }
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+// konczy slad: dopisuje bufory i zamyka plik; zwraca pierwszy blad zapisu
+static int trace_close(Trace *trace) {
+  atomic_store_explicit(&trace->active, false, memory_order_relaxed);
+  for (int i = 0; i < TRACE_STRIPES; ++i) { pthread_mutex_lock(&trace->stripes[i].lock); }
+  int result = 0;
+  if (trace->fd >= 0) {
+    for (int i = 0; i < TRACE_STRIPES; ++i) { trace_flush(trace, &trace->stripes[i]); }
+    result = trace->error;
+    if (close(trace->fd) && !result) { result = errno; }
+    trace->fd = -1;
+  }
+  for (int i = TRACE_STRIPES; i-- > 0;) { pthread_mutex_unlock(&trace->stripes[i].lock); }
+  return result;
+}
+
+static void trace_free(Tree *tree) {
+  Trace *trace = atomic_load_explicit(&tree->trace, memory_order_relaxed);
+  if (!trace) { return; }
+  trace_close(trace);
+  for (int i = 0; i < TRACE_STRIPES; ++i) {
+    ensure(!pthread_mutex_destroy(&trace->stripes[i].lock));
+    free(trace->stripes[i].data);
+  }
+  ensure(!pthread_mutex_destroy(&trace->file_lock));
+  free(trace);
 }
 
+
 // Można zakładać, że operacja tree_free zostanie wykonana na danym drzewie dokładnie raz, po zakończeniu wszystkich innych operacji.
 // wiec nie musimy blokowac wierzcholkow, caller musi poczekac az sie skoncza
 void tree_free(Tree* tree) {
+  if (tree->file) {
+    file_free(tree->file);
+    rwlock_destroy(tree->rwlock);
+    free(tree);
+    return;
+  }
+
+  detach_watches(tree, NULL);
+  log_free(tree);
+  trace_free(tree);
   const char *key;
   void *value;
-  HashMapIterator it = hmap_iterator(tree->hmap);
-  while (hmap_next(tree->hmap, &it, &key, &value)) {
+  NameIndexIterator it = index_iterator(tree->children);
+  while (index_next(&it, &key, &value)) {
     Tree *child = (Tree *)value;
     tree_free(child);
   }
 
   rwlock_destroy(tree->rwlock);
-  hmap_free(tree->hmap);
+  index_free(tree->children);
   free(tree);
   return;
 }
@@ -57,7 +670,7 @@ Tree *path_rdunlock(Tree *tree, const char *path) {
   const char *subpath = path;
   if ((subpath = split_path(subpath, component))) {
     assert(subtree);
-    subtree = (Tree *)hmap_get(subtree->hmap, component);
+    subtree = get_child(subtree, component);
     result = path_rdunlock(subtree, subpath);
     rwlock_rdunlock(tree->rwlock);
     if (!subtree) { return NULL; }
@@ -79,7 +692,7 @@ Tree *get_subfolder(Tree *tree, const char *path, TraverseMode mode) {
   while ((subpath = split_path(subpath, component))) {
     if (mode == LOCK) { rwlock_rdlock(subtree->rwlock); }
 
-    subtree = (Tree *)hmap_get(subtree->hmap, component);
+    subtree = get_child(subtree, component);
 
     if (!subtree) { return NULL; }
   }
@@ -87,167 +700,2643 @@ Tree *get_subfolder(Tree *tree, const char *path, TraverseMode mode) {
   return subtree;
 }
 
-char* tree_list(Tree* tree, const char *path) {
-  if (!is_path_valid(path)) { return NULL; }
+/*
+Wersje _timed i _try: kazda operacja dostaje termin deadline, przekazywany do
+wszystkich lockow, ktore bierze. NULL oznacza czekanie bez limitu, a NO_WAIT -
+brak czekania. Jesli ktoregos locka nie uda sie wziac, oddajemy w odwrotnej
+kolejnosci te, ktore juz mamy (tak jak przy zwyklym zakonczeniu operacji),
+i zwracamy ETIMEDOUT albo EAGAIN - operacja nie zmienia wtedy drzewa.
+*/
+static const struct timespec no_wait;
+#define NO_WAIT (&no_wait)
+
+static int node_rdlock(Tree *node, const struct timespec *deadline) {
+  if (!deadline) { rwlock_rdlock(node->rwlock); return 0; }
+  if (deadline == NO_WAIT) { return rwlock_tryrdlock(node->rwlock); }
+  return rwlock_timedrdlock(node->rwlock, deadline);
+}
+
+static int node_wrlock(Tree *node, const struct timespec *deadline) {
+  if (!deadline) { rwlock_wrlock(node->rwlock); return 0; }
+  if (deadline == NO_WAIT) { return rwlock_trywrlock(node->rwlock); }
+  return rwlock_timedwrlock(node->rwlock, deadline);
+}
+
+/*
+Foldery z pasami: folder, ktory ma co najmniej STRIPE_THRESHOLD dzieci, dostaje
+indeks podzielony na pasy z osobnymi mutexami (index_make_striped). tree_create
+i tree_remove w takim folderze biora na nim lock czytelnika i mutex pasa nazwy
+zamiast locka pisarza, wiec operacje na roznych nazwach ida rownolegle. Lock
+pisarza (wylacznosc na calym folderze) biora dalej tree_move, tree_children_apply,
+transakcje, zmiany przy obserwatorach i usuwanie zajetego folderu; tree_list
+bierze wszystkie pasy naraz.
+
+Skoro dzieci moga znikac przy locku czytelnika na ojcu, kazdy, kto pod takim
+lockiem wyjmie z indeksu wskaznik na dziecko, przypina je (pins), zanim puści
+mutex pasa, i odpina dopiero, gdy samo dziecko jest zablokowane albo juz go nie
+potrzebuje. Usuwajacy pod mutexem pasa sprawdza, ze dziecko nie jest przypiete
+i ze uda sie wziac na nim lock pisarza bez czekania; inaczej przechodzi na lock
+pisarza na ojcu. Mutexy pasow sa trzymane krotko i nigdy w czasie czekania na
+rwlock, a locki oddajemy, idac po wskaznikach parent, bez szukania w indeksach,
+wiec nie ma zakleszczen.
+*/
+#define STRIPE_THRESHOLD 1024
 
-  Tree *subtree = get_subfolder(tree, path, LOCK);
-  if (!subtree) {
-    assert(get_subfolder(tree, path, UNLOCK) == subtree);
-    return NULL;
+static bool is_striped(Tree *node) {
+  return atomic_load_explicit(&node->striped, memory_order_acquire);
+}
+
+// dziecko i-tego komponentu folderu node, ktory trzymamy w trybie czytelnika;
+// w folderze z pasami przypina je (*pinned)
+static Tree *get_child_pinned(Tree *node, const ParsedPath *path, size_t i, bool *pinned) {
+  *pinned = false;
+  if (!node->children || !is_striped(node)) { return get_child_parsed(node, path, i); }
+
+  index_lock_key(node->children, path->components[i], path->hashes[i]);
+  Tree *child = get_child_parsed(node, path, i);
+  if (child) {
+    atomic_fetch_add_explicit(&child->pins, 1, memory_order_relaxed);
+    *pinned = true;
   }
+  index_unlock_key(node->children, path->components[i], path->hashes[i]);
+  return child;
+}
 
-  rwlock_rdlock(subtree->rwlock);
-  char *result = make_map_contents_string(subtree->hmap);
-  rwlock_rdunlock(subtree->rwlock);
+static void unpin(Tree *node) {
+  atomic_fetch_sub_explicit(&node->pins, 1, memory_order_release);
+}
 
-  assert(get_subfolder(tree, path, UNLOCK) == subtree);
-  return result;
+/*
+Zamrozone poddrzewa (tree_freeze): obszar zamrozony jest zamkniety w dol - dzieci
+zamrozonego folderu sa zamrozone, a nowych nie da sie w nim utworzyc ani wstawic
+przeniesieniem. Operacje, ktore by cos w nim zmienily, zwracaja EROFS, wiec nikt
+nie bierze na nim locka pisarza, zeby cos zmienic. Przejscia od pierwszego
+zamrozonego wierzcholka schodza zatem bez lockow i bez przypinania; locki
+czytelnika na przodkach obszaru bierzemy jak zwykle, wiec jego korzen moze
+przeniesc tree_move (lock pisarza na LCA lezy nad nim), choc usunac go nie mozna.
+tree_freeze ustawia flage korzenia na koncu (release), pod lockiem pisarza na nim,
+wiec kto ja zobaczy (acquire), widzi caly zamrozony i skompaktowany obszar.
+*/
+static bool is_frozen(Tree *node) {
+  return atomic_load_explicit(&node->frozen, memory_order_acquire);
 }
 
-int tree_create(Tree* tree, const char* path) {
-  if (!is_path_valid(path)) { return EINVAL; }
-  if (!strcmp(path, "/")) { return EEXIST; }
-  
-  char component[MAX_FOLDER_NAME_LENGTH + 1];
-  char *parent_path = make_path_to_parent(path, component);
-  Tree *subtree = get_subfolder(tree, parent_path, LOCK);
-  if (!subtree) { assert(!get_subfolder(tree, parent_path, UNLOCK)); free(parent_path); return ENOENT; }
+// oddaje locki wziete przez ostatnie lock_subfolder na path, od najglebszego
+static Tree *unlock_subfolder(ParsedPath *path) {
+  if (path->pinned) { unpin(path->found); }
+  Tree *node = path->last_locked;
+  for (size_t i = 0; i < path->n_locked; ++i) {
+    Tree *parent = node->parent;
+    rwlock_rdunlock(node->rwlock);
+    node = parent;
+  }
+  return path->found;
+}
 
-  Tree *new_node = tree_new();
-  rwlock_wrlock(subtree->rwlock);
-  bool insert_successful = hmap_insert(subtree->hmap, component, new_node);
-  rwlock_wrunlock(subtree->rwlock);
+// get_subfolder_parsed w trybie LOCK od korzenia do to, z terminem; ustawia *result
+// tak samo i zapisuje w path, co trzeba oddac. Jesli nie zdazymy z lockiem, zwraca
+// jego blad, nie trzymajac zadnych lockow.
+static int lock_subfolder(Tree *tree, ParsedPath *path, size_t to, const struct timespec *deadline, Tree **result) {
+  Tree *subtree = tree;
+  bool pinned = false;
+  path->n_locked = 0;
+  path->pinned = false;
+  for (size_t i = 0; i < to; ++i) {
+    if (is_frozen(subtree)) {
+      // nizej nic sie nie zmienia; ojca subtree trzymamy, wiec mozna go odpiac
+      if (pinned) { unpin(subtree); }
+      pinned = false;
+      for (; i < to && subtree; ++i) { subtree = get_child_parsed(subtree, path, i); }
+      break;
+    }
+    int err = node_rdlock(subtree, deadline);
+    if (pinned) { unpin(subtree); }
+    if (err) {
+      path->found = NULL;
+      unlock_subfolder(path);
+      return err;
+    }
+    path->last_locked = subtree;
+    path->n_locked++;
 
-  assert(get_subfolder(tree, parent_path, UNLOCK) == subtree);
-  free(parent_path);
-  
-  if (!insert_successful) {
-    tree_free(new_node);
-    return EEXIST;
+    subtree = get_child_pinned(subtree, path, i, &pinned);
+
+    if (!subtree) { break; }
   }
+
+  path->found = *result = subtree;
+  path->pinned = pinned;
   return 0;
 }
 
-int tree_remove(Tree* tree, const char* path) {
-  if (!is_path_valid(path)) { return EINVAL; }
-  if (!strcmp(path, "/")) { return EBUSY; }
+// to samo co get_subfolder, ale dla sparsowanej sciezki: schodzi od node po
+// komponentach [from, to) i nie liczy juz hashy ani nie kopiuje nazw; LOCK
+// schodzi od korzenia (from == 0), a UNLOCK oddaje to, co wzial ostatni LOCK
+static Tree *get_subfolder_parsed(Tree *node, ParsedPath *path, size_t from, size_t to, TraverseMode mode) {
+  if (mode == UNLOCK) { return unlock_subfolder(path); }
+  if (mode == LOCK) {
+    assert(from == 0);
+    Tree *result;
+    lock_subfolder(node, path, to, NULL, &result);
+    return result;
+  }
 
-  int result = 0;
+  Tree *subtree = node;
+  for (size_t i = from; i < to; ++i) {
+    subtree = get_child_parsed(subtree, path, i);
 
-  char component[MAX_FOLDER_NAME_LENGTH + 1];
-  char *parent_path = make_path_to_parent(path, component);
-  Tree *parent = get_subfolder(tree, parent_path, LOCK);
-  if (!parent) { result = ENOENT; goto exit1; }
+    if (!subtree) { return NULL; }
+  }
 
-  rwlock_wrlock(parent->rwlock);
-  // we have read-write permissions, so no operation is running in the subtree
+  return subtree;
+}
 
-  Tree *node = (Tree *)hmap_get(parent->hmap, component);
-  if (!node) { result = ENOENT; goto exit2; }
-  if (hmap_size(node->hmap)) { result = ENOTEMPTY; goto exit2; }
+/*
+Uchwyty folderow: uchwyt trzyma wskaznik na folder, jego sciezke i lancuch
+przodkow od korzenia. Operacja wzgledna bierze locki czytelnika na przodkach
+po wskaznikach z lancucha - bez parsowania, hashowania i szukania w indeksach -
+i dalej schodzi od folderu uchwytu jak zwykla operacja od korzenia. Locki na
+przodkach sa nadal potrzebne, bo lock pisarza wyzej (tree_move, transakcje,
+tree_walk) musi wykluczac wszystko ponizej.
+
+Lancuch zmienia tylko przeniesienie przodka albo usuniecie samego folderu, a oba
+robi ktos, kto ma wylacznosc na ojcu przenoszonego (usuwanego) wierzcholka. Taki
+ktos poprawia pod dirs_lock sciezki i lancuchy uchwytow i zwieksza ich generacje.
+Operacja wzgledna kopiuje lancuch spod mutexa uchwytu, blokuje go od korzenia
+i po kazdym locku sprawdza generacje: jesli sie nie zmienila, to kolejny
+wierzcholek lancucha nadal jest dzieckiem zablokowanego (przeniesc go nie mozna,
+a usunac - tylko pusty, czyli po przeniesieniu) i mozna go bezpiecznie blokowac.
+Inaczej oddajemy locki i zaczynamy od nowa. Folder usuniety przy otwartych
+uchwytach zwalnia ostatni tree_close.
+*/
+struct TreeDir {
+  Tree *tree; // korzen drzewa
+  Tree *node;
+  TreeDir *next, **prev; // lista otwartych uchwytow, pod dirs_lock
+  pthread_mutex_t lock; // chroni chain, depth i removed; zmieniajacy trzyma tez dirs_lock
+  char *path; // stala, dopoki trzymamy locki na lancuchu
+  Tree **chain; // przodkowie node, od korzenia
+  size_t depth;
+  bool removed;
+  atomic_uint_fast64_t generation;
+};
 
-  assert(hmap_remove(parent->hmap, component));
-  tree_free(node);
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+static TreeDir *open_dirs;
+static atomic_size_t n_open_dirs;
+
+// liczy lancuch przodkow od nowa; wolajacy trzyma locki, przy ktorych przodkowie sa stali
+static void dir_set_chain(TreeDir *dir) {
+  size_t depth = 0;
+  for (Tree *node = dir->node->parent; node; node = node->parent) { depth++; }
+  if (!(dir->chain = (Tree **)realloc(dir->chain, (depth ? depth : 1) * sizeof(Tree *)))) { bad_malloc(); }
+  dir->depth = depth;
+  for (Tree *node = dir->node->parent; node; node = node->parent) { dir->chain[--depth] = node; }
+}
 
-exit2:
-  rwlock_wrunlock(parent->rwlock);
-exit1:
-  assert(get_subfolder(tree, parent_path, UNLOCK) == parent);
-  free(parent_path);
+// path wzgledem uchwytu dir jako sciezka bezwzgledna (dla dir == NULL - bez zmian);
+// wynik rozny od path trzeba zwolnic
+static char *absolute_path(TreeDir *dir, const char *path) {
+  if (!dir || !strcmp(dir->path, "/")) { return (char *)path; }
+  size_t len = strlen(dir->path);
+  char *result = (char *)malloc(len + strlen(path));
+  if (!result) { bad_malloc(); }
+  memcpy(result, dir->path, len);
+  strcpy(result + len, path + 1);
   return result;
 }
 
-// returns true if str starts with prefix and is longer, false otherwise
-bool starts_with(const char *str, const char *prefix) {
-  return strlen(str) > strlen(prefix) && (strncmp(str, prefix, strlen(prefix)) == 0);
+static void free_absolute_path(const char *path, char *absolute) {
+  if (absolute != path) { free(absolute); }
 }
 
-Tree *get_lca(Tree *tree, const char* source, const char* target, TraverseMode mode) {
-  // get longest common prefix of source and target
-  const char *prefix_end1 = source, *prefix_end2 = target;
-  while (*prefix_end1 && *prefix_end2 && *prefix_end1 == *prefix_end2) { prefix_end1++; prefix_end2++; }
+// log_op dla sciezek wzglednych wobec uchwytu dir
+static void log_dir_op(Tree *tree, TreeDir *dir, TreeLogOpType type, const char *path, const char *target) {
+  if (!is_logged(tree)) { return; }
+  char *absolute = absolute_path(dir, path);
+  char *absolute_target = target ? absolute_path(dir, target) : NULL;
+  log_op(tree, type, absolute, absolute_target);
+  free_absolute_path(path, absolute);
+  if (target) { free_absolute_path(target, absolute_target); }
+}
 
-  // find path of lca
-  const char *last_slash = source;
-  for (const char *c=source; c < prefix_end1; ++c) {
-    if (*c == '/') { last_slash = c; }
+// wywolanie operacji sledzonego drzewa; trace == NULL, jesli slad nie jest zapisywany
+typedef struct TraceCall {
+  Trace *trace;
+  uint64_t start;
+  uint8_t flags;
+  uint64_t extra[3]; // timeout i argumenty, w kolejnosci z TreeTrace.h
+  size_t n_extra;
+} TraceCall;
+
+static void trace_begin(Tree *tree, TraceCall *call, const struct timespec *deadline) {
+  Trace *trace = atomic_load_explicit(&tree->trace, memory_order_acquire);
+  if (!trace || !atomic_load_explicit(&trace->active, memory_order_relaxed)) {
+    call->trace = NULL;
+    return;
   }
-  char lca_path[MAX_PATH_LENGTH + 1];
-  strncpy(lca_path, source, last_slash - source + 1);
-  lca_path[last_slash - source + 1] = '\0';
+  call->trace = trace;
+  call->start = monotonic_ns();
+  call->flags = 0;
+  call->n_extra = 0;
+  if (deadline == NO_WAIT) {
+    call->flags = TREE_TRACE_TRY;
+  } else if (deadline) {
+    uint64_t end = (uint64_t)deadline->tv_sec * 1000000000u + deadline->tv_nsec;
+    call->flags = TREE_TRACE_TIMED;
+    call->extra[call->n_extra++] = end > call->start ? end - call->start : 0;
+  }
+}
 
-  return get_subfolder(tree, lca_path, mode);
+static void trace_args(TraceCall *call, uint64_t first, uint64_t second) {
+  if (!call->trace) { return; }
+  call->flags |= TREE_TRACE_ARGS;
+  call->extra[call->n_extra++] = first;
+  call->extra[call->n_extra++] = second;
 }
 
-/*
+// sciezki wzgledne wobec uchwytu dir trafiaja do sladu jako bezwzgledne
+static void trace_end(TraceCall *call, TreeTraceOp op, TreeDir *dir, const char *path, const char *target, int result) {
+  if (!call->trace) { return; }
+  uint64_t duration = monotonic_ns() - call->start;
+  TreeTraceEntry entry = { 0 };
+  entry.duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+  entry.op = (uint8_t)op;
+  entry.flags = call->flags;
+  entry.result = (int16_t)result;
+  char *absolute = dir && path && is_path_valid(path) ? absolute_path(dir, path) : (char *)path;
+  char *absolute_target = dir && target && is_path_valid(target) ? absolute_path(dir, target) : (char *)target;
+  trace_append(call->trace, &entry, call->start, call->extra, call->n_extra, absolute, absolute_target);
+  if (absolute) { free_absolute_path(path, absolute); }
+  if (absolute_target) { free_absolute_path(target, absolute_target); }
+}
 
-Opis synchronizacji:
-Schodząc wgłąd drzewa, na każdym stopniu zbieram rwlocki w trybie czytelnika
-To zabezpiecza mnie przed przeniesieniem folderu, na którym aktualnie pracuję
-i dziwnymi przeplotami. W każdej z funkcji wyżej zbieram tylko jednego locka
-w trybie pisarza, więc tam nie ma zadnych kłopotów z zakleszczeniami - tutaj
-jest inaczej. Żeby rozwiązać ten problem, zamiast blokować osobno dwa wierzchołki
-(próby tego szybszego rozwiązania są poniżej), od razu blokuję w trybie pisarza
-LCA ojców szukanych wierzchołków. Dzięki temu blokujemy tylko jeden wierzchołek,
-co zabezpiecza nas przed deadlockami. Ponadto dzięki trybowi pisarza, możemy
-dowoli czytać i pisać w całym poddrzewie, zatem pozostałe operacje wykonuejmy
-w trybie WEAK, tj. bez zbierania żadnych locków. Locki oddajemy w kolejności
-odwrotnej niż je zbieraliśmy, co robimy za pomocą post-order rekurencji w funkcji
-path_rdunlock
-*/
-int tree_move(Tree *tree, const char *source, const char *target) {
-  if (!source || !is_path_valid(source)) { return EINVAL; }
-  if (!target || !is_path_valid(target)) { return EINVAL; }
-  if (!strcmp(source, "/")) { return EBUSY; }
-  if (!strcmp(target, "/")) { return EEXIST; }
+// przeniesiono source na target (sciezki bezwzgledne) z wylacznoscia na LCA ojcow:
+// poprawia uchwyty w przeniesionym poddrzewie
+static void dirs_moved(Tree *tree, const char *source, const char *target) {
+  if (!atomic_load_explicit(&n_open_dirs, memory_order_relaxed)) { return; }
+  size_t source_len = strlen(source), target_len = strlen(target);
+  pthread_mutex_lock(&dirs_lock);
+  for (TreeDir *dir = open_dirs; dir; dir = dir->next) {
+    if (dir->tree != tree || dir->removed || strncmp(dir->path, source, source_len)) { continue; }
+    char *path = (char *)malloc(target_len + strlen(dir->path) - source_len + 1);
+    if (!path) { bad_malloc(); }
+    memcpy(path, target, target_len);
+    strcpy(path + target_len, dir->path + source_len);
+    pthread_mutex_lock(&dir->lock);
+    free(dir->path);
+    dir->path = path;
+    dir_set_chain(dir);
+    atomic_fetch_add_explicit(&dir->generation, 1, memory_order_release);
+    pthread_mutex_unlock(&dir->lock);
+  }
+  pthread_mutex_unlock(&dirs_lock);
+}
 
-  char source_component[MAX_FOLDER_NAME_LENGTH + 1];
-  char *source_parent_path = make_path_to_parent(source, source_component);
+// node wyjeto z drzewa z wylacznoscia na jego ojcu: zwalnia go, chyba ze sa na
+// niego otwarte uchwyty - wtedy oznacza je jako usuniete, a zwolni go ostatni tree_close
+static void free_removed(Tree *node) {
+  // nowy uchwyt wymaga locka na ojcu, wiec licznik moze juz tylko malec
+  if (atomic_load_explicit(&node->handles, memory_order_relaxed)) {
+    pthread_mutex_lock(&dirs_lock);
+    bool open = atomic_load_explicit(&node->handles, memory_order_relaxed);
+    for (TreeDir *dir = open_dirs; open && dir; dir = dir->next) {
+      if (dir->node != node) { continue; }
+      pthread_mutex_lock(&dir->lock);
+      dir->removed = true;
+      atomic_fetch_add_explicit(&dir->generation, 1, memory_order_release);
+      pthread_mutex_unlock(&dir->lock);
+    }
+    pthread_mutex_unlock(&dirs_lock);
+    if (open) { return; }
+  }
+  tree_free(node);
+}
 
-  char target_component[MAX_FOLDER_NAME_LENGTH + 1];
-  char *target_parent_path = make_path_to_parent(target, target_component);
+char* tree_list(Tree* tree, const char *path) {
+  return tree_list_prefix(tree, path, "");
+}
 
-  int result = 0;
-  if (starts_with(target, source)) { result = EINVMV; goto exit0; }
-  if (starts_with(source, target)) {
-    Tree *node = get_subfolder(tree, source, LOCK);
-    assert(get_subfolder(tree, source, UNLOCK) == node);
-    result = node ? EEXIST : ENOENT;
-    goto exit0;
+static int list_prefix_until(Tree *tree, const char *path, const char *prefix, const struct timespec *deadline, char **result) {
+  *result = NULL;
+  if (!is_path_valid(path) || !prefix) { return EINVAL; }
+
+  int err = 0;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *subtree;
+  if ((err = lock_subfolder(tree, &parsed, parsed.n, deadline, &subtree))) { return err; }
+  if (!subtree) { err = ENOENT; goto exit; }
+  if (!subtree->children) { err = ENOTDIR; goto exit; }
+  if (is_frozen(subtree)) {
+    *result = index_contents_string(subtree->children, prefix);
+    goto exit;
+  }
+
+  if ((err = node_rdlock(subtree, deadline))) { goto exit; }
+  index_lock_all(subtree->children);
+  *result = index_contents_string(subtree->children, prefix);
+  index_unlock_all(subtree->children);
+  rwlock_rdunlock(subtree->rwlock);
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == subtree);
+  return err;
+}
+
+// tree to korzen drzewa, a sciezki sa wzgledne wobec uchwytu dir (jesli nie NULL)
+static int list_traced(Tree *tree, TreeDir *dir, const char *path, const char *prefix, const struct timespec *deadline,
+                       char **result) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  int err = list_prefix_until(dir ? dir->node : tree, path, prefix, deadline, result);
+  trace_end(&call, TREE_TRACE_LIST, dir, path, prefix && *prefix ? prefix : NULL, err);
+  return err;
+}
+
+char* tree_list_prefix(Tree* tree, const char *path, const char *prefix) {
+  char *result;
+  list_traced(tree, NULL, path, prefix, NULL, &result);
+  return result;
+}
+
+int tree_list_timed(Tree *tree, const char *path, const struct timespec *deadline, char **result) {
+  return list_traced(tree, NULL, path, "", deadline, result);
+}
+
+int tree_list_try(Tree *tree, const char *path, char **result) {
+  return list_traced(tree, NULL, path, "", NO_WAIT, result);
+}
+
+/*
+tree_list_many: sciezki przegladamy w porzadku leksykograficznym, wiec te ze
+wspolnym prefiksem sa obok siebie. Trzymamy locki czytelnika na lancuchu od
+korzenia do ostatnio wymienionego folderu (tak jak przy zwyklym przejsciu)
+i przed kolejna sciezka oddajemy tylko te, ktore leza ponizej wspolnego
+prefiksu, a reszte bierzemy, schodzac dalej.
+*/
+typedef struct ListManyItem {
+  const char *path;
+  size_t index;
+} ListManyItem;
+
+static int list_many_cmp(const void *a, const void *b) {
+  return strcmp(((const ListManyItem *)a)->path, ((const ListManyItem *)b)->path);
+}
+
+// liczba pelnych komponentow wspolnych dla sciezek a i b
+static size_t common_components(const char *a, const char *b) {
+  size_t n = 0;
+  for (size_t i = 1; a[i] && a[i] == b[i]; ++i) {
+    if (a[i] == '/') { n++; }
+  }
+  return n;
+}
+
+// oddaje locki wziete na glebokosciach od keep w dol
+static void list_many_unlock(Tree **locked, const bool *took, size_t *n_locked, size_t keep) {
+  while (*n_locked > keep) {
+    --*n_locked;
+    if (took[*n_locked]) { rwlock_rdunlock(locked[*n_locked]->rwlock); }
+  }
+}
+
+void tree_list_many(Tree *tree, const char *const *paths, size_t n, char **out) {
+  ListManyItem *items = (ListManyItem *)malloc((n ? n : 1) * sizeof(ListManyItem));
+  if (!items) { bad_malloc(); }
+  size_t n_items = 0;
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = NULL;
+    if (paths[i] && is_path_valid(paths[i])) { items[n_items++] = (ListManyItem){ paths[i], i }; }
+  }
+  qsort(items, n_items, sizeof(ListManyItem), list_many_cmp);
+
+  // locked[d] to wierzcholek na glebokosci d; took[d] mowi, czy wzielismy na nim
+  // lock (zamrozonych nie blokujemy, ale zamrozenie moze wejsc, gdy czekamy na lock)
+  Tree *locked[MAX_PATH_LENGTH / 2 + 1];
+  bool took[MAX_PATH_LENGTH / 2 + 1];
+  size_t n_locked = 0;
+  ParsedPath parsed;
+  const char *previous = "/";
+  for (size_t k = 0; k < n_items; ++k) {
+    const char *path = items[k].path;
+    size_t keep = common_components(previous, path) + 1;
+    list_many_unlock(locked, took, &n_locked, keep);
+    previous = path;
+
+    parse_path(tree, path, &parsed);
+    if (!n_locked) {
+      took[n_locked] = !is_frozen(tree);
+      if (took[n_locked]) { rwlock_rdlock(tree->rwlock); }
+      locked[n_locked++] = tree;
+    }
+    while (n_locked <= parsed.n) {
+      Tree *parent = locked[n_locked - 1];
+      if (is_frozen(parent)) {
+        // zamrozonych nie blokujemy (dziecko zamrozonego tez jest zamrozone)
+        Tree *child = get_child_parsed(parent, &parsed, n_locked - 1);
+        if (!child) { break; }
+        took[n_locked] = false;
+        locked[n_locked++] = child;
+        continue;
+      }
+      bool pinned;
+      Tree *child = get_child_pinned(parent, &parsed, n_locked - 1, &pinned);
+      if (!child) { break; }
+      took[n_locked] = !is_frozen(child);
+      if (took[n_locked]) { rwlock_rdlock(child->rwlock); }
+      if (pinned) { unpin(child); }
+      locked[n_locked++] = child;
+    }
+    if (n_locked <= parsed.n) { continue; }
+
+    Tree *node = locked[parsed.n];
+    if (!node->children) { continue; }
+    index_lock_all(node->children);
+    out[items[k].index] = index_contents_string(node->children, "");
+    index_unlock_all(node->children);
+  }
+  list_many_unlock(locked, took, &n_locked, 0);
+  free(items);
+}
+
+TreeWatch *tree_watch(Tree *tree, const char *path, bool recursive) {
+  if (!is_path_valid(path)) { return NULL; }
+
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *node = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  TreeWatch *watch = NULL;
+  if (node && node->children) {
+    watch = (TreeWatch *)malloc(sizeof(TreeWatch));
+    if (!watch) { bad_malloc(); }
+    watch->tree = tree;
+    watch->recursive = recursive;
+    atomic_init(&watch->active, true);
+    atomic_init(&watch->overflowed, false);
+    atomic_init(&watch->refcount, 2);
+    if (!(watch->events = ring_new(TREE_WATCH_CAPACITY, sizeof(TreeEvent)))) { bad_malloc(); }
+
+    rwlock_wrlock(node->rwlock);
+    watch->next = node->watches;
+    node->watches = watch;
+    atomic_fetch_add_explicit(&tree->n_watches, 1, memory_order_relaxed);
+    rwlock_wrunlock(node->rwlock);
   }
+
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == node);
+  return watch;
+}
+
+// path jest wzgledna wobec uchwytu dir (dla dir == NULL - wobec korzenia), a wolajacy
+// trzyma locki na przodkach folderu uchwytu (dir_lock)
+static int create_until(Tree *tree, TreeDir *dir, const char *path, const struct timespec *deadline) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  if (!strcmp(path, "/")) { return EEXIST; }
   
-  Tree *lca = get_lca(tree, source_parent_path, target_parent_path, LOCK);
+  int result = 0;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  size_t depth = parsed.n - 1;
+  const char *component = parsed.components[depth];
+  Tree *subtree;
+  if ((result = lock_subfolder(dir ? dir->node : tree, &parsed, depth, deadline, &subtree))) { return result; }
+  if (!subtree) { result = ENOENT; goto exit; }
+  if (!subtree->children) { result = ENOTDIR; goto exit; }
+  if (is_frozen(subtree)) { result = EROFS; goto exit; }
+
+  Tree *new_node = child_dir_new(subtree);
+  bool insert_successful;
+  if (is_striped(subtree) && !is_watched(tree)) {
+    if ((result = node_rdlock(subtree, deadline))) { tree_free(new_node); goto exit; }
+    // ktos mogl zamrozic subtree, zanim wzielismy lock
+    if (is_frozen(subtree)) {
+      rwlock_rdunlock(subtree->rwlock);
+      tree_free(new_node);
+      result = EROFS;
+      goto exit;
+    }
+    index_lock_key(subtree->children, component, parsed.hashes[depth]);
+    insert_successful = index_insert(subtree->children, component, new_node);
+    // pod mutexem pasa, zeby nikt nie usunal nowego folderu przed attach_node
+    if (insert_successful) {
+      attach_node(subtree, new_node);
+      log_dir_op(tree, dir, TREE_LOG_CREATE, path, NULL);
+    }
+    index_unlock_key(subtree->children, component, parsed.hashes[depth]);
+    rwlock_rdunlock(subtree->rwlock);
+  } else {
+    if ((result = node_wrlock(subtree, deadline))) { tree_free(new_node); goto exit; }
+    if (is_frozen(subtree)) {
+      rwlock_wrunlock(subtree->rwlock);
+      tree_free(new_node);
+      result = EROFS;
+      goto exit;
+    }
+    insert_successful = index_insert(subtree->children, component, new_node);
+    if (insert_successful) {
+      attach_node(subtree, new_node);
+      if (is_watched(tree)) {
+        char *absolute = absolute_path(dir, path);
+        notify(tree, subtree, TREE_EVENT_CREATED, absolute, 0);
+        free_absolute_path(path, absolute);
+      }
+      log_dir_op(tree, dir, TREE_LOG_CREATE, path, NULL);
+      if (!is_striped(subtree) && index_size(subtree->children) >= STRIPE_THRESHOLD) {
+        index_make_striped(subtree->children);
+        atomic_store_explicit(&subtree->striped, true, memory_order_release);
+      }
+    }
+    rwlock_wrunlock(subtree->rwlock);
+  }
+
+  if (!insert_successful) {
+    tree_free(new_node);
+    result = EEXIST;
+  }
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, depth, UNLOCK) == subtree);
+  return result;
+}
+
+static int create_traced(Tree *tree, TreeDir *dir, const char *path, const struct timespec *deadline) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  int result = create_until(tree, dir, path, deadline);
+  trace_end(&call, TREE_TRACE_CREATE, dir, path, NULL, result);
+  return result;
+}
+
+int tree_create(Tree* tree, const char* path) {
+  return create_traced(tree, NULL, path, NULL);
+}
+
+int tree_create_timed(Tree *tree, const char *path, const struct timespec *deadline) {
+  return create_traced(tree, NULL, path, deadline);
+}
+
+int tree_create_try(Tree *tree, const char *path) {
+  return create_traced(tree, NULL, path, NO_WAIT);
+}
+
+// tree_remove w folderze z pasami, przy locku czytelnika na ojcu. Zwraca false
+// i wynik w *result, albo true, jesli folder jest zajety (ktos w nim pracuje,
+// do niego schodzi albo ma na niego uchwyt) i trzeba go usunac zwyczajnie,
+// z lockiem pisarza na ojcu.
+static bool remove_striped(Tree *tree, TreeDir *dir, const char *path, Tree *parent, ParsedPath *parsed, int *result,
+                           const struct timespec *deadline) {
+  size_t depth = parsed->n - 1;
+  const char *component = parsed->components[depth];
+  if ((*result = node_rdlock(parent, deadline))) { return false; }
+  // ktos mogl zamrozic parent, zanim wzielismy lock
+  if (is_frozen(parent)) {
+    *result = get_child_parsed(parent, parsed, depth) ? EROFS : ENOENT;
+    rwlock_rdunlock(parent->rwlock);
+    return false;
+  }
+
+  bool busy = false;
+  Tree *node = NULL;
+  index_lock_key(parent->children, component, parsed->hashes[depth]);
+  Tree *child = get_child_parsed(parent, parsed, depth);
+  if (!child) {
+    *result = ENOENT;
+  } else if (is_frozen(child)) {
+    *result = EROFS;
+  } else if (atomic_load_explicit(&child->pins, memory_order_acquire) ||
+             atomic_load_explicit(&child->handles, memory_order_relaxed) || rwlock_trywrlock(child->rwlock)) {
+    busy = true;
+  } else if (child->children && index_size(child->children)) {
+    rwlock_wrunlock(child->rwlock);
+    *result = ENOTEMPTY;
+  } else {
+    ensure(index_remove(parent->children, component));
+    log_dir_op(tree, dir, TREE_LOG_REMOVE, path, NULL);
+    node = child;
+  }
+  index_unlock_key(parent->children, component, parsed->hashes[depth]);
+
+  if (node) {
+    // node nie jest juz osiagalny, a lock pisarza na nim mamy od chwili, gdy byl
+    detach_node(parent, node);
+    rwlock_wrunlock(node->rwlock);
+    free_removed(node);
+    *result = 0;
+  }
+  rwlock_rdunlock(parent->rwlock);
+  return busy;
+}
+
+static int remove_until(Tree *tree, TreeDir *dir, const char *path, const struct timespec *deadline) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  if (!strcmp(path, "/")) { return EBUSY; }
+
+  int result = 0;
+
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  size_t depth = parsed.n - 1;
+  const char *component = parsed.components[depth];
+  Tree *parent;
+  if ((result = lock_subfolder(dir ? dir->node : tree, &parsed, depth, deadline, &parent))) { return result; }
+  if (!parent) { result = ENOENT; goto exit1; }
+  if (is_frozen(parent)) { result = get_child_parsed(parent, &parsed, depth) ? EROFS : ENOENT; goto exit1; }
+  if (is_striped(parent) && !is_watched(tree) && !remove_striped(tree, dir, path, parent, &parsed, &result, deadline)) { goto exit1; }
+
+  if ((result = node_wrlock(parent, deadline))) { goto exit1; }
+  // we have read-write permissions, so no operation is running in the subtree
+
+  Tree *node = get_child_parsed(parent, &parsed, depth);
+  // ktos mogl zamrozic parent, zanim wzielismy lock
+  if (is_frozen(parent)) { result = node ? EROFS : ENOENT; goto exit2; }
+  if (!node) { result = ENOENT; goto exit2; }
+  if (is_frozen(node)) { result = EROFS; goto exit2; }
+  if (node->children && index_size(node->children)) { result = ENOTEMPTY; goto exit2; }
+
+  ensure(index_remove(parent->children, component));
+  detach_node(parent, node);
+  if (is_watched(tree)) {
+    char *absolute = absolute_path(dir, path);
+    notify(tree, parent, TREE_EVENT_REMOVED, absolute, 0);
+    detach_watches(node, absolute);
+    free_absolute_path(path, absolute);
+  }
+  log_dir_op(tree, dir, TREE_LOG_REMOVE, path, NULL);
+  free_removed(node);
+
+exit2:
+  rwlock_wrunlock(parent->rwlock);
+exit1:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, depth, UNLOCK) == parent);
+  return result;
+}
+
+static int remove_traced(Tree *tree, TreeDir *dir, const char *path, const struct timespec *deadline) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  int result = remove_until(tree, dir, path, deadline);
+  trace_end(&call, TREE_TRACE_REMOVE, dir, path, NULL, result);
+  return result;
+}
+
+int tree_remove(Tree* tree, const char* path) {
+  return remove_traced(tree, NULL, path, NULL);
+}
+
+int tree_remove_timed(Tree *tree, const char *path, const struct timespec *deadline) {
+  return remove_traced(tree, NULL, path, deadline);
+}
+
+int tree_remove_try(Tree *tree, const char *path) {
+  return remove_traced(tree, NULL, path, NO_WAIT);
+}
+
+// returns true if str starts with prefix and is longer, false otherwise
+bool starts_with(const char *str, const char *prefix) {
+  return strlen(str) > strlen(prefix) && (strncmp(str, prefix, strlen(prefix)) == 0);
+}
+
+Tree *get_lca(Tree *tree, const char* source, const char* target, TraverseMode mode) {
+  // get longest common prefix of source and target
+  const char *prefix_end1 = source, *prefix_end2 = target;
+  while (*prefix_end1 && *prefix_end2 && *prefix_end1 == *prefix_end2) { prefix_end1++; prefix_end2++; }
+
+  // find path of lca
+  const char *last_slash = source;
+  for (const char *c=source; c < prefix_end1; ++c) {
+    if (*c == '/') { last_slash = c; }
+  }
+  char lca_path[MAX_PATH_LENGTH + 1];
+  strncpy(lca_path, source, last_slash - source + 1);
+  lca_path[last_slash - source + 1] = '\0';
+
+  return get_subfolder(tree, lca_path, mode);
+}
+
+/*
+
+Opis synchronizacji:
+Schodząc wgłąd drzewa, na każdym stopniu zbieram rwlocki w trybie czytelnika
+To zabezpiecza mnie przed przeniesieniem folderu, na którym aktualnie pracuję
+i dziwnymi przeplotami. W każdej z funkcji wyżej zbieram tylko jednego locka
+w trybie pisarza, więc tam nie ma zadnych kłopotów z zakleszczeniami - tutaj
+jest inaczej. Żeby rozwiązać ten problem, zamiast blokować osobno dwa wierzchołki
+(próby tego szybszego rozwiązania są poniżej), od razu blokuję w trybie pisarza
+LCA ojców szukanych wierzchołków. Dzięki temu blokujemy tylko jeden wierzchołek,
+co zabezpiecza nas przed deadlockami. Ponadto dzięki trybowi pisarza, możemy
+dowoli czytać i pisać w całym poddrzewie, zatem pozostałe operacje wykonuejmy
+w trybie WEAK, tj. bez zbierania żadnych locków. Locki oddajemy w kolejności
+odwrotnej niż je zbieraliśmy, co robimy za pomocą post-order rekurencji w funkcji
+path_rdunlock
+*/
+static int move_until(Tree *tree, TreeDir *dir, const char *source, const char *target, const struct timespec *deadline) {
+  if (!source || !is_path_valid(source)) { return EINVAL; }
+  if (!target || !is_path_valid(target)) { return EINVAL; }
+  if (!strcmp(source, "/")) { return EBUSY; }
+  if (!strcmp(target, "/")) { return EEXIST; }
+
+  ParsedPath source_path, target_path;
+  parse_path(tree, source, &source_path);
+  parse_path(tree, target, &target_path);
+  size_t source_depth = source_path.n - 1;
+  size_t target_depth = target_path.n - 1;
+  const char *source_component = source_path.components[source_depth];
+  const char *target_component = target_path.components[target_depth];
+
+  int result = 0;
+  Tree *start = dir ? dir->node : tree;
+  if (starts_with(target, source)) { return EINVMV; }
+  if (starts_with(source, target)) {
+    Tree *node;
+    if ((result = lock_subfolder(start, &source_path, source_path.n, deadline, &node))) { return result; }
+    ensure(get_subfolder_parsed(tree, &source_path, 0, source_path.n, UNLOCK) == node);
+    return node ? EEXIST : ENOENT;
+  }
+
+  // LCA ojcow lezy na koncu najdluzszego wspolnego prefiksu ich sciezek
+  size_t lca_depth = 0;
+  while (lca_depth < source_depth && lca_depth < target_depth &&
+         !strcmp(source_path.components[lca_depth], target_path.components[lca_depth])) {
+    lca_depth++;
+  }
+  Tree *lca;
+  if ((result = lock_subfolder(start, &source_path, lca_depth, deadline, &lca))) { return result; }
   if (!lca) { result = ENOENT; goto exit1; }
 
-  rwlock_wrlock(lca->rwlock);
+  if ((result = node_wrlock(lca, deadline))) { goto exit1; }
   
-  Tree *source_parent = get_subfolder(tree, source_parent_path, WEAK);
+  Tree *source_parent = get_subfolder_parsed(lca, &source_path, lca_depth, source_depth, WEAK);
   if (!source_parent) { result = ENOENT; goto exit2; }
   
-  Tree *target_parent = get_subfolder(tree, target_parent_path, WEAK);
+  Tree *target_parent = get_subfolder_parsed(lca, &target_path, lca_depth, target_depth, WEAK);
   if (!target_parent) { result = ENOENT; goto exit2; }
   
-  Tree *source_node = hmap_get(source_parent->hmap, source_component);
+  Tree *source_node = get_child_parsed(source_parent, &source_path, source_depth);
   if (!source_node) { result = ENOENT; goto exit2; }
+  if (!target_parent->children) { result = ENOTDIR; goto exit2; }
+  // korzen zamrozonego obszaru mozna przeniesc, ale nic w nim ani do niego
+  if (is_frozen(source_parent) || is_frozen(target_parent)) { result = EROFS; goto exit2; }
   
-  assert(hmap_remove(source_parent->hmap, source_component));
-  bool success = hmap_insert(target_parent->hmap, target_component, source_node);
+  ensure(index_remove(source_parent->children, source_component));
+  bool success = index_insert(target_parent->children, target_component, source_node);
   if (!success) {
-    assert(hmap_insert(source_parent->hmap, source_component, source_node));
+    ensure(index_insert(source_parent->children, source_component, source_node));
     result = EEXIST;
+  } else {
+    // liczby potomkow LCA i wyzej sie nie zmieniaja
+    long moved = atomic_load_explicit(&source_node->descendants, memory_order_relaxed) + 1;
+    source_node->parent = target_parent;
+    add_descendants(source_parent, lca, -moved);
+    add_descendants(target_parent, lca, moved);
+    lower_height(source_parent);
+    raise_height(target_parent, get_height(source_node));
+    if (is_watched(tree) || atomic_load_explicit(&n_open_dirs, memory_order_relaxed)) {
+      char *absolute_source = absolute_path(dir, source), *absolute_target = absolute_path(dir, target);
+      if (is_watched(tree)) {
+        uint64_t cookie = atomic_fetch_add_explicit(&next_cookie, 1, memory_order_relaxed) + 1;
+        notify(tree, source_parent, TREE_EVENT_MOVED_FROM, absolute_source, cookie);
+        notify(tree, target_parent, TREE_EVENT_MOVED_TO, absolute_target, cookie);
+      }
+      dirs_moved(tree, absolute_source, absolute_target);
+      free_absolute_path(source, absolute_source);
+      free_absolute_path(target, absolute_target);
+    }
+    log_dir_op(tree, dir, TREE_LOG_MOVE, source, target);
   }
 
 exit2:
   rwlock_wrunlock(lca->rwlock);
 exit1:
-  assert(get_lca(tree, source_parent_path, target_parent_path, UNLOCK) == lca);
-exit0:
-  free(source_parent_path); 
-  free(target_parent_path);
+  ensure(get_subfolder_parsed(tree, &source_path, 0, lca_depth, UNLOCK) == lca);
+  return result;
+}
+
+static int move_traced(Tree *tree, TreeDir *dir, const char *source, const char *target,
+                       const struct timespec *deadline) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  int result = move_until(tree, dir, source, target, deadline);
+  trace_end(&call, TREE_TRACE_MOVE, dir, source, target, result);
+  return result;
+}
+
+int tree_move(Tree *tree, const char *source, const char *target) {
+  return move_traced(tree, NULL, source, target, NULL);
+}
+
+int tree_move_timed(Tree *tree, const char *source, const char *target, const struct timespec *deadline) {
+  return move_traced(tree, NULL, source, target, deadline);
+}
+
+int tree_move_try(Tree *tree, const char *source, const char *target) {
+  return move_traced(tree, NULL, source, target, NO_WAIT);
+}
+
+
+// sciezka dziecka powstaje przez dopisanie nazwy i '/' do sciezki ojca;
+// bufor musi miec miejsce na path_len + MAX_FOLDER_NAME_LENGTH + 2 znakow
+static size_t make_child_path(char *child_path, size_t path_len, const char *name) {
+  size_t name_len = strlen(name);
+  memcpy(child_path + path_len, name, name_len);
+  child_path[path_len + name_len] = '/';
+  child_path[path_len + name_len + 1] = '\0';
+  return path_len + name_len + 1;
+}
+
+// Wiele operacji na dzieciach jednego folderu: jedno zejscie po sciezce
+// i jeden lock pisarza na ojcu zamiast osobnych dla kazdej operacji.
+// Wyniki sa takie, jak przy wykonaniu operacji po kolei.
+static void children_apply(Tree *tree, const char *parent_path, const TreeChildOp *ops, int *results, size_t n) {
+  if (!is_path_valid(parent_path)) {
+    for (size_t i = 0; i < n; ++i) { results[i] = EINVAL; }
+    return;
+  }
+
+  ParsedPath parsed;
+  parse_path(tree, parent_path, &parsed);
+  Tree *parent = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  if (!parent || !parent->children) {
+    for (size_t i = 0; i < n; ++i) { results[i] = parent && !ops[i].remove ? ENOTDIR : ENOENT; }
+    goto exit;
+  }
+  if (is_frozen(parent)) {
+    for (size_t i = 0; i < n; ++i) { results[i] = EROFS; }
+    goto exit;
+  }
+
+  // sciezke dziecka skladamy tylko dla zdarzen i strumieni zmian
+  char child_path[MAX_PATH_LENGTH + MAX_FOLDER_NAME_LENGTH + 2];
+  size_t parent_len = strlen(parent_path);
+  memcpy(child_path, parent_path, parent_len);
+
+  rwlock_wrlock(parent->rwlock);
+  // ktos mogl zamrozic parent, zanim wzielismy lock
+  if (is_frozen(parent)) {
+    for (size_t i = 0; i < n; ++i) { results[i] = EROFS; }
+    rwlock_wrunlock(parent->rwlock);
+    goto exit;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    const char *name = ops[i].name;
+    if (!is_folder_name_valid(name)) { results[i] = EINVAL; continue; }
+    Tree *node = get_child(parent, name);
+    if (ops[i].remove) {
+      if (!node) { results[i] = ENOENT; continue; }
+      if (is_frozen(node)) { results[i] = EROFS; continue; }
+      if (node->children && index_size(node->children)) { results[i] = ENOTEMPTY; continue; }
+      ensure(index_remove(parent->children, name));
+      detach_node(parent, node);
+      if (is_watched(tree) || is_logged(tree)) {
+        make_child_path(child_path, parent_len, name);
+        notify(tree, parent, TREE_EVENT_REMOVED, child_path, 0);
+        detach_watches(node, child_path);
+        log_op(tree, TREE_LOG_REMOVE, child_path, NULL);
+      }
+      free_removed(node);
+      results[i] = 0;
+    } else {
+      if (node) { results[i] = EEXIST; continue; }
+      Tree *new_node = child_dir_new(parent);
+      ensure(index_insert(parent->children, name, new_node));
+      attach_node(parent, new_node);
+      if (is_watched(tree) || is_logged(tree)) {
+        make_child_path(child_path, parent_len, name);
+        notify(tree, parent, TREE_EVENT_CREATED, child_path, 0);
+        log_op(tree, TREE_LOG_CREATE, child_path, NULL);
+      }
+      results[i] = 0;
+    }
+  }
+  rwlock_wrunlock(parent->rwlock);
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == parent);
+}
+
+void tree_children_apply(Tree *tree, const char *parent_path, const TreeChildOp *ops, int *results, size_t n) {
+  TraceCall call;
+  trace_begin(tree, &call, NULL);
+  children_apply(tree, parent_path, ops, results, n);
+  // wpis na kazda operacje, z liczba dalszych operacji wywolania
+  for (size_t i = 0; i < n && call.trace; ++i) {
+    TraceCall op_call = call;
+    trace_args(&op_call, ops[i].remove, n - 1 - i);
+    trace_end(&op_call, TREE_TRACE_CHILDREN, NULL, parent_path, ops[i].name, results[i]);
+  }
+}
+
+// Zapis do pliku: tak jak w tree_create zbieramy read-locki na sciezce do ojca,
+// a ojca blokujemy w trybie czytelnika (w trybie pisarza tylko na chwile, jesli
+// plik trzeba utworzyc). Sam plik blokujemy w trybie pisarza na czas kopiowania.
+static int write_until(Tree *tree, const char *path, size_t offset, const char *buf, size_t len,
+                       const struct timespec *deadline) {
+  if (!is_path_valid(path)) { return EINVAL; }
+  if (!strcmp(path, "/")) { return EISDIR; }
+
+  int result = 0;
+
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  size_t depth = parsed.n - 1;
+  const char *component = parsed.components[depth];
+  Tree *parent;
+  if ((result = lock_subfolder(tree, &parsed, depth, deadline, &parent))) { return result; }
+  if (!parent) { result = ENOENT; goto exit1; }
+  if (!parent->children) { result = ENOTDIR; goto exit1; }
+  if (is_frozen(parent)) { result = EROFS; goto exit1; }
+
+  if ((result = node_rdlock(parent, deadline))) { goto exit1; }
+  // ktos mogl zamrozic parent, zanim wzielismy lock
+  if (is_frozen(parent)) { rwlock_rdunlock(parent->rwlock); result = EROFS; goto exit1; }
+  bool pinned;
+  Tree *node = get_child_pinned(parent, &parsed, depth, &pinned);
+  while (!node) {
+    rwlock_rdunlock(parent->rwlock);
+    if ((result = node_wrlock(parent, deadline))) { goto exit1; }
+    // ktos mogl zamrozic parent, zanim wzielismy lock
+    if (is_frozen(parent)) { rwlock_wrunlock(parent->rwlock); result = EROFS; goto exit1; }
+    if (!get_child(parent, component)) {
+      Tree *new_node = file_node_new();
+      if (!index_insert(parent->children, component, new_node)) { fatal("Unable to insert file"); }
+      attach_node(parent, new_node);
+      notify(tree, parent, TREE_EVENT_CREATED, path, 0);
+      log_write(tree, path, 0, NULL, 0);
+      // nowy plik zapisujemy od razu, pod tym samym lockiem (nikt inny go jeszcze
+      // nie widzi): kolejny lock moglby sie nie udac, a plik juz by powstal
+      file_write(new_node->file, offset, buf, len);
+      log_write(tree, path, offset, buf, len);
+      rwlock_wrunlock(parent->rwlock);
+      goto exit1;
+    }
+    rwlock_wrunlock(parent->rwlock);
+    // w miedzyczasie ktos mogl usunac plik, wiec sprawdzamy jeszcze raz
+    if ((result = node_rdlock(parent, deadline))) { goto exit1; }
+    if (is_frozen(parent)) { rwlock_rdunlock(parent->rwlock); result = EROFS; goto exit1; }
+    node = get_child_pinned(parent, &parsed, depth, &pinned);
+  }
+  if (!node->file) { result = EISDIR; goto exit2; }
+  if (is_frozen(node)) { result = EROFS; goto exit2; }
+
+  if ((result = node_wrlock(node, deadline))) { goto exit2; }
+  // sam plik mogl zostac zamrozony, zanim wzielismy lock
+  if (is_frozen(node)) {
+    result = EROFS;
+  } else {
+    file_write(node->file, offset, buf, len);
+    log_write(tree, path, offset, buf, len);
+  }
+  rwlock_wrunlock(node->rwlock);
+
+exit2:
+  if (pinned) { unpin(node); }
+  rwlock_rdunlock(parent->rwlock);
+exit1:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, depth, UNLOCK) == parent);
+  return result;
+}
+
+static int write_traced(Tree *tree, const char *path, size_t offset, const char *buf, size_t len,
+                        const struct timespec *deadline) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  trace_args(&call, offset, len);
+  int result = write_until(tree, path, offset, buf, len, deadline);
+  trace_end(&call, TREE_TRACE_WRITE, NULL, path, NULL, result);
+  return result;
+}
+
+int tree_write(Tree *tree, const char *path, size_t offset, const char *buf, size_t len) {
+  return write_traced(tree, path, offset, buf, len, NULL);
+}
+
+int tree_write_timed(Tree *tree, const char *path, size_t offset, const char *buf, size_t len,
+                     const struct timespec *deadline) {
+  return write_traced(tree, path, offset, buf, len, deadline);
+}
 
+int tree_write_try(Tree *tree, const char *path, size_t offset, const char *buf, size_t len) {
+  return write_traced(tree, path, offset, buf, len, NO_WAIT);
+}
+
+// Odczyt nie kopiuje danych - zwraca referencje do niezmiennych kawalkow pliku,
+// wiec wszystkie locki oddajemy zanim wywolujacy zacznie czytac dane.
+static int read_until(Tree *tree, const char *path, size_t offset, size_t len, TreeReadResult *result,
+                      const struct timespec *deadline) {
+  if (!result) { return EINVAL; }
+  result->refs = NULL;
+  result->n_refs = 0;
+  result->len = 0;
+  if (!is_path_valid(path)) { return EINVAL; }
+
+  int err = 0;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *node;
+  if ((err = lock_subfolder(tree, &parsed, parsed.n, deadline, &node))) { return err; }
+  if (!node) { err = ENOENT; goto exit; }
+  if (!node->file) { err = EISDIR; goto exit; }
+
+  bool frozen = is_frozen(node);
+  if (!frozen && (err = node_rdlock(node, deadline))) { goto exit; }
+  size_t size = file_size(node->file);
+  if (offset < size) {
+    if (len > size - offset) { len = size - offset; }
+    result->refs = (ChunkRef *)malloc(file_read_max_refs(len) * sizeof(ChunkRef));
+    if (!result->refs) { bad_malloc(); }
+    result->n_refs = file_read(node->file, offset, len, result->refs, &result->len);
+  }
+  if (!frozen) { rwlock_rdunlock(node->rwlock); }
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == node);
+  return err;
+}
+
+static int read_traced(Tree *tree, const char *path, size_t offset, size_t len, TreeReadResult *result,
+                       const struct timespec *deadline) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  trace_args(&call, offset, len);
+  int err = read_until(tree, path, offset, len, result, deadline);
+  trace_end(&call, TREE_TRACE_READ, NULL, path, NULL, err);
+  return err;
+}
+
+int tree_read(Tree *tree, const char *path, size_t offset, size_t len, TreeReadResult *result) {
+  return read_traced(tree, path, offset, len, result, NULL);
+}
+
+int tree_read_timed(Tree *tree, const char *path, size_t offset, size_t len, TreeReadResult *result,
+                    const struct timespec *deadline) {
+  return read_traced(tree, path, offset, len, result, deadline);
+}
+
+int tree_read_try(Tree *tree, const char *path, size_t offset, size_t len, TreeReadResult *result) {
+  return read_traced(tree, path, offset, len, result, NO_WAIT);
+}
+
+void tree_read_release(TreeReadResult *result) {
+  for (size_t i = 0; i < result->n_refs; ++i) {
+    chunk_release(result->refs[i].chunk);
+  }
+  free(result->refs);
+  result->refs = NULL;
+  result->n_refs = 0;
+  result->len = 0;
+}
+
+static int stat_until(Tree *tree, const char *path, TreeStat *stat, const struct timespec *deadline) {
+  if (!is_path_valid(path) || !stat) { return EINVAL; }
+
+  int err;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *node;
+  if ((err = lock_subfolder(tree, &parsed, parsed.n, deadline, &node))) { return err; }
+  if (node) {
+    stat->descendants = atomic_load_explicit(&node->descendants, memory_order_relaxed);
+    stat->height = get_height(node);
+    stat->children = node->children ? index_size(node->children) : 0;
+    stat->is_file = node->file != NULL;
+  }
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == node);
+  return node ? 0 : ENOENT;
+}
+
+static int stat_traced(Tree *tree, const char *path, TreeStat *stat, const struct timespec *deadline) {
+  TraceCall call;
+  trace_begin(tree, &call, deadline);
+  int result = stat_until(tree, path, stat, deadline);
+  trace_end(&call, TREE_TRACE_STAT, NULL, path, NULL, result);
   return result;
 }
 
+int tree_stat(Tree *tree, const char *path, TreeStat *stat) {
+  return stat_traced(tree, path, stat, NULL);
+}
+
+int tree_stat_timed(Tree *tree, const char *path, TreeStat *stat, const struct timespec *deadline) {
+  return stat_traced(tree, path, stat, deadline);
+}
+
+int tree_stat_try(Tree *tree, const char *path, TreeStat *stat) {
+  return stat_traced(tree, path, stat, NO_WAIT);
+}
+
+bool tree_exists(Tree *tree, const char *path) {
+  TreeStat stat;
+  return !stat_traced(tree, path, &stat, NULL);
+}
+
+TreeDir *tree_open(Tree *tree, const char *path) {
+  if (!is_path_valid(path)) { return NULL; }
+
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *node = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  TreeDir *dir = NULL;
+  if (node && node->children) {
+    dir = (TreeDir *)malloc(sizeof(TreeDir));
+    if (!dir) { bad_malloc(); }
+    dir->tree = tree;
+    dir->node = node;
+    if (!(dir->path = strdup(path))) { bad_malloc(); }
+    dir->chain = NULL;
+    dir->removed = false;
+    atomic_init(&dir->generation, 0);
+    if (pthread_mutex_init(&dir->lock, NULL)) { syserr("Unable to create mutex"); }
+    // przodkowie node sa zablokowani, wiec lancuch jest staly
+    dir_set_chain(dir);
+
+    pthread_mutex_lock(&dirs_lock);
+    dir->prev = &open_dirs;
+    dir->next = open_dirs;
+    if (open_dirs) { open_dirs->prev = &dir->next; }
+    open_dirs = dir;
+    atomic_fetch_add_explicit(&node->handles, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&n_open_dirs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&dirs_lock);
+  }
+
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == node);
+  return dir;
+}
+
+void tree_close(TreeDir *dir) {
+  pthread_mutex_lock(&dirs_lock);
+  *dir->prev = dir->next;
+  if (dir->next) { dir->next->prev = dir->prev; }
+  atomic_fetch_sub_explicit(&n_open_dirs, 1, memory_order_relaxed);
+  bool last = atomic_fetch_sub_explicit(&dir->node->handles, 1, memory_order_relaxed) == 1;
+  bool removed = dir->removed;
+  pthread_mutex_unlock(&dirs_lock);
+
+  if (last && removed) { tree_free(dir->node); }
+  ensure(!pthread_mutex_destroy(&dir->lock));
+  free(dir->path);
+  free(dir->chain);
+  free(dir);
+}
+
+// lancuchy do tej glebokosci kopiujemy na stos
+#define DIR_CHAIN_STACK 64
+
+// locki wziete przez dir_lock
+typedef struct DirLocks {
+  Tree *stack[DIR_CHAIN_STACK];
+  Tree **chain;
+  size_t n;
+} DirLocks;
+
+static void dir_unlock(DirLocks *locks) {
+  for (size_t i = locks->n; i-- > 0;) { rwlock_rdunlock(locks->chain[i]->rwlock); }
+  if (locks->chain != locks->stack) { free(locks->chain); }
+}
+
+// blokuje w trybie czytelnika przodkow folderu uchwytu, od korzenia (patrz opis
+// uchwytow). Zwraca ENOENT, jesli folder usunieto.
+static int dir_lock(TreeDir *dir, DirLocks *locks) {
+  for (;;) {
+    pthread_mutex_lock(&dir->lock);
+    if (dir->removed) {
+      pthread_mutex_unlock(&dir->lock);
+      return ENOENT;
+    }
+    uint_fast64_t generation = atomic_load_explicit(&dir->generation, memory_order_relaxed);
+    size_t depth = dir->depth;
+    locks->chain = depth <= DIR_CHAIN_STACK ? locks->stack : (Tree **)malloc(depth * sizeof(Tree *));
+    if (!locks->chain) { bad_malloc(); }
+    memcpy(locks->chain, dir->chain, depth * sizeof(Tree *));
+    pthread_mutex_unlock(&dir->lock);
+
+    bool valid = true;
+    for (locks->n = 0; valid && locks->n < depth; locks->n++) {
+      rwlock_rdlock(locks->chain[locks->n]->rwlock);
+      valid = atomic_load_explicit(&dir->generation, memory_order_acquire) == generation;
+    }
+    if (valid) { return 0; }
+    dir_unlock(locks);
+  }
+}
+
+char *tree_dir_list(TreeDir *dir, const char *path) {
+  DirLocks locks;
+  char *result = NULL;
+  if (dir_lock(dir, &locks)) { return NULL; }
+  list_traced(dir->tree, dir, path, "", NULL, &result);
+  dir_unlock(&locks);
+  return result;
+}
+
+int tree_dir_create(TreeDir *dir, const char *path) {
+  DirLocks locks;
+  int result = dir_lock(dir, &locks);
+  if (result) { return result; }
+  result = create_traced(dir->tree, dir, path, NULL);
+  dir_unlock(&locks);
+  return result;
+}
+
+int tree_dir_remove(TreeDir *dir, const char *path) {
+  DirLocks locks;
+  int result = dir_lock(dir, &locks);
+  if (result) { return result; }
+  result = remove_traced(dir->tree, dir, path, NULL);
+  dir_unlock(&locks);
+  return result;
+}
+
+int tree_dir_move(TreeDir *dir, const char *source, const char *target) {
+  DirLocks locks;
+  int result = dir_lock(dir, &locks);
+  if (result) { return result; }
+  result = move_traced(dir->tree, dir, source, target, NULL);
+  dir_unlock(&locks);
+  return result;
+}
+
+/*
+Transakcje: tak jak tree_move, commit blokuje w trybie pisarza jeden wierzcholek -
+LCA wszystkich folderow, w ktorych transakcja cos zmienia (ojcow sciezek) - a jego
+przodkow w trybie czytelnika. To jest kanoniczna kolejnosc, w ktorej nie ma
+zakleszczen, a transakcje w rozlacznych poddrzewach ida rownolegle. Pod LCA
+operacje wykonujemy po kolei w trybie WEAK, zapamietujac, co zrobily; jesli
+ktoras sie nie uda, wycofujemy poprzednie w odwrotnej kolejnosci. Nikt nie widzi
+stanu posredniego, bo LCA jest zablokowane do konca. Zdarzenia dla obserwatorow
+wysylamy i usuniete foldery zwalniamy dopiero, gdy wszystkie operacje sie udaly.
+*/
+typedef struct TxnOp {
+  TreeTxnOpType type;
+  char *path;
+  char *target; // tylko dla TREE_TXN_MOVE
+  char *parent_path, *target_parent_path;
+  char name[MAX_FOLDER_NAME_LENGTH + 1], target_name[MAX_FOLDER_NAME_LENGTH + 1];
+  int error; // wynik znany bez patrzenia na drzewo (np. dla "/"), albo 0
+  // wypelniane przy wykonaniu, do wycofania i wyslania zdarzen
+  Tree *parent, *target_parent, *node;
+} TxnOp;
+
+struct TreeTxn {
+  Tree *tree;
+  TxnOp *ops;
+  size_t n;
+  size_t capacity;
+};
+
+TreeTxn *tree_txn_begin(Tree *tree) {
+  TreeTxn *txn = (TreeTxn *)malloc(sizeof(TreeTxn));
+  if (!txn) { bad_malloc(); }
+  txn->tree = tree;
+  txn->ops = NULL;
+  txn->n = txn->capacity = 0;
+  return txn;
+}
+
+static char *txn_strdup(const char *str) {
+  char *result = strdup(str);
+  if (!result) { bad_malloc(); }
+  return result;
+}
+
+int tree_txn_add(TreeTxn *txn, TreeTxnOpType type, const char *path, const char *target) {
+  if (type != TREE_TXN_CREATE && type != TREE_TXN_REMOVE && type != TREE_TXN_MOVE) { return EINVAL; }
+  if (!path || !is_path_valid(path)) { return EINVAL; }
+  if (type == TREE_TXN_MOVE && (!target || !is_path_valid(target))) { return EINVAL; }
+
+  if (txn->n == txn->capacity) {
+    txn->capacity = txn->capacity ? 2 * txn->capacity : 4;
+    if (!(txn->ops = (TxnOp *)realloc(txn->ops, txn->capacity * sizeof(TxnOp)))) { bad_malloc(); }
+  }
+  TxnOp *op = &txn->ops[txn->n++];
+  memset(op, 0, sizeof(TxnOp));
+  op->type = type;
+  op->path = txn_strdup(path);
+  if (type == TREE_TXN_MOVE) { op->target = txn_strdup(target); }
+
+  // te same bledy co w tree_create, tree_remove i tree_move
+  if (!strcmp(path, "/")) {
+    op->error = type == TREE_TXN_CREATE ? EEXIST : EBUSY;
+  } else if (type == TREE_TXN_MOVE && !strcmp(target, "/")) {
+    op->error = EEXIST;
+  } else if (type == TREE_TXN_MOVE && starts_with(target, path)) {
+    op->error = EINVMV;
+  } else {
+    op->parent_path = make_path_to_parent(path, op->name);
+    if (type == TREE_TXN_MOVE) { op->target_parent_path = make_path_to_parent(target, op->target_name); }
+  }
+  return 0;
+}
+
+void tree_txn_abort(TreeTxn *txn) {
+  for (size_t i = 0; i < txn->n; ++i) {
+    free(txn->ops[i].path);
+    free(txn->ops[i].target);
+    free(txn->ops[i].parent_path);
+    free(txn->ops[i].target_parent_path);
+  }
+  free(txn->ops);
+  free(txn);
+}
+
+// zmniejsza prefiks lca (dlugosci *lca_len, konczacy sie '/') do wspolnego prefiksu z path
+static void shrink_lca(const char *lca, size_t *lca_len, const char *path) {
+  size_t len = 0;
+  for (size_t i = 0; i < *lca_len && lca[i] == path[i]; ++i) {
+    if (lca[i] == '/') { len = i + 1; }
+  }
+  *lca_len = len;
+}
+
+// attach_node i detach_node dla transakcji: liczniki potomkow poprawiamy tylko do
+// LCA (bez niego), a zmiane powyzej zbieramy w *delta i nanosimy raz, po sukcesie,
+// zeby tree_stat na LCA i wyzej nie widzial stanu posredniego
+static void txn_attach(Tree *lca, long *delta, Tree *parent, Tree *node) {
+  long moved = atomic_load_explicit(&node->descendants, memory_order_relaxed) + 1;
+  node->parent = parent;
+  add_descendants(parent, lca, moved);
+  *delta += moved;
+  raise_height(parent, get_height(node));
+}
+
+static void txn_detach(Tree *lca, long *delta, Tree *parent, Tree *node) {
+  long moved = atomic_load_explicit(&node->descendants, memory_order_relaxed) + 1;
+  add_descendants(parent, lca, -moved);
+  *delta -= moved;
+  lower_height(parent);
+}
+
+static Tree *txn_folder(Tree *tree, Tree *lca, size_t lca_depth, const char *path, ParsedPath *parsed) {
+  parse_path(tree, path, parsed);
+  return get_subfolder_parsed(lca, parsed, lca_depth, parsed->n, WEAK);
+}
+
+static int txn_apply(Tree *tree, Tree *lca, size_t lca_depth, long *delta, TxnOp *op, ParsedPath *parsed) {
+  if (op->error) { return op->error; }
+  Tree *parent = txn_folder(tree, lca, lca_depth, op->parent_path, parsed);
+  if (!parent) { return ENOENT; }
+  Tree *node = get_child(parent, op->name);
+
+  switch (op->type) {
+  case TREE_TXN_CREATE:
+    if (!parent->children) { return ENOTDIR; }
+    if (node) { return EEXIST; }
+    if (is_frozen(parent)) { return EROFS; }
+    node = child_dir_new(parent);
+    ensure(index_insert(parent->children, op->name, node));
+    txn_attach(lca, delta, parent, node);
+    break;
+  case TREE_TXN_REMOVE:
+    if (!node) { return ENOENT; }
+    if (is_frozen(node)) { return EROFS; }
+    if (node->children && index_size(node->children)) { return ENOTEMPTY; }
+    ensure(index_remove(parent->children, op->name));
+    txn_detach(lca, delta, parent, node);
+    break;
+  case TREE_TXN_MOVE:
+    if (starts_with(op->path, op->target)) { return node ? EEXIST : ENOENT; }
+    Tree *target_parent = txn_folder(tree, lca, lca_depth, op->target_parent_path, parsed);
+    if (!target_parent || !node) { return ENOENT; }
+    if (!target_parent->children) { return ENOTDIR; }
+    if (is_frozen(parent) || is_frozen(target_parent)) { return EROFS; }
+    ensure(index_remove(parent->children, op->name));
+    if (!index_insert(target_parent->children, op->target_name, node)) {
+      ensure(index_insert(parent->children, op->name, node));
+      return EEXIST;
+    }
+    txn_detach(lca, delta, parent, node);
+    txn_attach(lca, delta, target_parent, node);
+    op->target_parent = target_parent;
+    break;
+  }
+  op->parent = parent;
+  op->node = node;
+  return 0;
+}
+
+static void txn_undo(Tree *lca, long *delta, TxnOp *op) {
+  switch (op->type) {
+  case TREE_TXN_CREATE:
+    ensure(index_remove(op->parent->children, op->name));
+    txn_detach(lca, delta, op->parent, op->node);
+    tree_free(op->node);
+    break;
+  case TREE_TXN_REMOVE:
+    ensure(index_insert(op->parent->children, op->name, op->node));
+    txn_attach(lca, delta, op->parent, op->node);
+    break;
+  case TREE_TXN_MOVE:
+    ensure(index_remove(op->target_parent->children, op->target_name));
+    ensure(index_insert(op->parent->children, op->name, op->node));
+    txn_detach(lca, delta, op->target_parent, op->node);
+    txn_attach(lca, delta, op->parent, op->node);
+    break;
+  }
+}
+
+static void txn_notify(Tree *tree, TxnOp *op) {
+  switch (op->type) {
+  case TREE_TXN_CREATE:
+    notify(tree, op->parent, TREE_EVENT_CREATED, op->path, 0);
+    break;
+  case TREE_TXN_REMOVE:
+    notify(tree, op->parent, TREE_EVENT_REMOVED, op->path, 0);
+    detach_watches(op->node, op->path);
+    break;
+  case TREE_TXN_MOVE:
+    if (is_watched(tree)) {
+      uint64_t cookie = atomic_fetch_add_explicit(&next_cookie, 1, memory_order_relaxed) + 1;
+      notify(tree, op->parent, TREE_EVENT_MOVED_FROM, op->path, cookie);
+      notify(tree, op->target_parent, TREE_EVENT_MOVED_TO, op->target, cookie);
+    }
+    break;
+  }
+}
+
+// rekordy operacji udanej transakcji; ida do strumieni razem
+static void txn_log(Tree *tree, TreeTxn *txn) {
+  TreeLog *log = active_log(tree);
+  if (!log) { return; }
+  LogEntry **entries = (LogEntry **)malloc(txn->n * sizeof(LogEntry *));
+  if (!entries) { bad_malloc(); }
+  for (size_t i = 0; i < txn->n; ++i) {
+    TxnOp *op = &txn->ops[i];
+    TreeLogRecord change = { 0 };
+    change.type = op->type == TREE_TXN_CREATE ? TREE_LOG_CREATE : op->type == TREE_TXN_REMOVE ? TREE_LOG_REMOVE : TREE_LOG_MOVE;
+    change.txn_left = txn->n - 1 - i;
+    change.path = op->path;
+    change.target = op->target;
+    entries[i] = log_entry_new(&change);
+  }
+  log_append(log, entries, txn->n);
+  free(entries);
+}
+
+int tree_txn_commit(TreeTxn *txn, size_t *failed) {
+  Tree *tree = txn->tree;
+  TraceCall call;
+  trace_begin(tree, &call, NULL);
+  int result = 0;
+  size_t i = 0;
+  if (!txn->n) { goto exit; }
+
+  const char *lca_path = NULL;
+  size_t lca_len = 0;
+  for (size_t j = 0; j < txn->n; ++j) {
+    TxnOp *op = &txn->ops[j];
+    if (op->error) { continue; }
+    if (!lca_path) {
+      lca_path = op->parent_path;
+      lca_len = strlen(lca_path);
+    }
+    shrink_lca(lca_path, &lca_len, op->parent_path);
+    if (op->target_parent_path) { shrink_lca(lca_path, &lca_len, op->target_parent_path); }
+  }
+  char lca_buffer[MAX_PATH_LENGTH + 1] = "/";
+  if (lca_path) {
+    memcpy(lca_buffer, lca_path, lca_len);
+    lca_buffer[lca_len] = '\0';
+  }
+
+  ParsedPath lca_parsed, parsed;
+  parse_path(tree, lca_buffer, &lca_parsed);
+  Tree *lca = get_subfolder_parsed(tree, &lca_parsed, 0, lca_parsed.n, LOCK);
+  // LCA jest przodkiem ojca pierwszej operacji, wiec ta na pewno sie nie uda
+  if (!lca) { result = txn->ops[0].error ? txn->ops[0].error : ENOENT; goto exit1; }
+
+  rwlock_wrlock(lca->rwlock);
+  long delta = 0;
+  for (; i < txn->n; ++i) {
+    if ((result = txn_apply(tree, lca, lca_parsed.n, &delta, &txn->ops[i], &parsed))) { break; }
+  }
+  if (result) {
+    for (size_t j = i; j-- > 0;) { txn_undo(lca, &delta, &txn->ops[j]); }
+  } else {
+    add_descendants(lca, NULL, delta);
+    for (size_t j = 0; j < txn->n; ++j) { txn_notify(tree, &txn->ops[j]); }
+    txn_log(tree, txn);
+    for (size_t j = 0; j < txn->n; ++j) {
+      TxnOp *op = &txn->ops[j];
+      if (op->type == TREE_TXN_MOVE) { dirs_moved(tree, op->path, op->target); }
+      if (op->type == TREE_TXN_REMOVE) { free_removed(op->node); }
+    }
+  }
+  rwlock_wrunlock(lca->rwlock);
+
+exit1:
+  ensure(get_subfolder_parsed(tree, &lca_parsed, 0, lca_parsed.n, UNLOCK) == lca);
+exit:
+  if (result && failed) { *failed = i; }
+  // wpis na kazda operacje, z wynikiem calej transakcji
+  for (size_t j = 0; j < txn->n && call.trace; ++j) {
+    TraceCall op_call = call;
+    trace_args(&op_call, txn->ops[j].type, txn->n - 1 - j);
+    trace_end(&op_call, TREE_TRACE_TXN, NULL, txn->ops[j].path, txn->ops[j].target, result);
+  }
+  tree_txn_abort(txn);
+  return result;
+}
+
+/*
+Rownolegle przechodzenie poddrzewa: tak jak w tree_move blokujemy korzen
+poddrzewa w trybie pisarza (a przodkow w trybie czytelnika), wiec nikt inny
+nie pracuje w tym poddrzewie i dalej chodzimy w trybie WEAK, bez lockow.
+Foldery do odwiedzenia trafiaja do kolejek work-stealing, po jednej na watek;
+watek bez pracy podbiera ja innym. pending liczy foldery wrzucone do kolejek
+i jeszcze nieprzetworzone - gdy spadnie do zera, praca jest skonczona.
+Z tego mechanizmu korzystaja tree_walk i tree_find, rozniac sie tylko funkcja
+przetwarzajaca folder (process) i danymi doczepionymi do folderu (data).
+Lock czytelnika na korzeniu by nie wystarczyl: robotnicy iteruja po indeksach
+bez lockow, wiec w poddrzewie nie moze sie zmienic nic - poza przeniesieniami
+i usunieciami takze create, tree_children_apply i zapis tworzacy plik. Licznik
+przejsc na korzeniu musialaby wtedy sprawdzac kazda zmiana na wszystkich swoich
+przodkach, a zmiany w poddrzewie i tak czekalyby do konca przejscia. Lock
+pisarza daje to samo wykluczenie bez kosztu dla innych operacji; odczyty
+w poddrzewie tez czekaja, ale zamrozone poddrzewo przechodzimy bez locka.
+*/
+
+#define WALK_DEQUE_CAPACITY (1 << 16)
+
+typedef struct WalkWorker WalkWorker;
+
+typedef void (*walk_process_t)(WalkWorker *worker, Tree *dir, int depth, const char *path, size_t path_len, void *data);
+
+typedef struct WalkItem {
+  Tree *node;
+  int depth;
+  void *data;
+  size_t path_len;
+  char path[];
+} WalkItem;
+
+typedef struct WalkContext {
+  walk_process_t process;
+  void *arg;
+  int nthreads;
+  Deque **deques;
+  atomic_long pending;
+} WalkContext;
+
+struct WalkWorker {
+  WalkContext *ctx;
+  int id;
+  unsigned int seed;
+};
+
+static WalkItem *walk_item_new(Tree *node, int depth, const char *path, size_t path_len, void *data) {
+  WalkItem *item = (WalkItem *)malloc(sizeof(WalkItem) + path_len + 1);
+  if (!item) { bad_malloc(); }
+  item->node = node;
+  item->depth = depth;
+  item->data = data;
+  item->path_len = path_len;
+  memcpy(item->path, path, path_len);
+  item->path[path_len] = '\0';
+  return item;
+}
+
+// zleca przetworzenie folderu; jesli kolejka jest pelna, przetwarzamy go od razu
+static void walk_spawn(WalkWorker *worker, Tree *dir, int depth, const char *path, size_t path_len, void *data) {
+  WalkContext *ctx = worker->ctx;
+  WalkItem *item = walk_item_new(dir, depth, path, path_len, data);
+  atomic_fetch_add(&ctx->pending, 1);
+  if (!deque_push(ctx->deques[worker->id], item)) {
+    atomic_fetch_sub(&ctx->pending, 1);
+    free(item);
+    ctx->process(worker, dir, depth, path, path_len, data);
+  }
+}
+
+static WalkItem *walk_steal(WalkWorker *worker) {
+  WalkContext *ctx = worker->ctx;
+  int start = rand_r(&worker->seed) % ctx->nthreads;
+  for (int i = 0; i < ctx->nthreads; ++i) {
+    int victim = (start + i) % ctx->nthreads;
+    if (victim == worker->id) { continue; }
+    WalkItem *item = (WalkItem *)deque_steal(ctx->deques[victim]);
+    if (item) { return item; }
+  }
+  return NULL;
+}
+
+static void *walk_worker(void *data) {
+  WalkWorker *worker = (WalkWorker *)data;
+  WalkContext *ctx = worker->ctx;
+  for (;;) {
+    WalkItem *item = (WalkItem *)deque_pop(ctx->deques[worker->id]);
+    if (!item) { item = walk_steal(worker); }
+    if (!item) {
+      if (!atomic_load(&ctx->pending)) { break; }
+      sched_yield();
+      continue;
+    }
+    ctx->process(worker, item->node, item->depth, item->path, item->path_len, item->data);
+    free(item);
+    atomic_fetch_sub(&ctx->pending, 1);
+  }
+  return NULL;
+}
+
+// przetwarza rownolegle poddrzewo o korzeniu root; wywolujacy musi je zablokowac
+static void walk_run(Tree *root, const char *path, walk_process_t process, void *arg, void *root_data, int nthreads) {
+  if (nthreads < 1) { nthreads = 1; }
+
+  WalkContext ctx;
+  ctx.process = process;
+  ctx.arg = arg;
+  ctx.nthreads = nthreads;
+  ctx.deques = (Deque **)malloc(nthreads * sizeof(Deque *));
+  WalkWorker *workers = (WalkWorker *)malloc(nthreads * sizeof(WalkWorker));
+  pthread_t *threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  if (!ctx.deques || !workers || !threads) { bad_malloc(); }
+  for (int i = 0; i < nthreads; ++i) {
+    ctx.deques[i] = deque_new(WALK_DEQUE_CAPACITY);
+    workers[i] = (WalkWorker){ &ctx, i, (unsigned int)i * 2654435761u + 1 };
+  }
+  atomic_init(&ctx.pending, 0);
+  walk_spawn(&workers[0], root, 0, path, strlen(path), root_data);
+
+  // watek wywolujacy jest robotnikiem numer 0
+  for (int i = 1; i < nthreads; ++i) {
+    if (pthread_create(&threads[i], NULL, walk_worker, &workers[i])) { syserr("Unable to create thread"); }
+  }
+  walk_worker(&workers[0]);
+  for (int i = 1; i < nthreads; ++i) {
+    if (pthread_join(threads[i], NULL)) { syserr("Unable to join thread"); }
+  }
+
+  for (int i = 0; i < nthreads; ++i) { deque_free(ctx.deques[i]); }
+  free(ctx.deques);
+  free(workers);
+  free(threads);
+}
+
+typedef struct WalkArgs {
+  tree_visitor_t visitor;
+  void *arg;
+} WalkArgs;
+
+static void walk_dir(WalkWorker *worker, Tree *dir, int depth, const char *path, size_t path_len, void *data) {
+  (void)data;
+  WalkArgs *args = (WalkArgs *)worker->ctx->arg;
+  char *child_path = (char *)malloc(path_len + MAX_FOLDER_NAME_LENGTH + 2);
+  if (!child_path) { bad_malloc(); }
+  memcpy(child_path, path, path_len);
+
+  const char *key;
+  void *value;
+  NameIndexIterator it = index_iterator(dir->children);
+  while (index_next(&it, &key, &value)) {
+    Tree *child = (Tree *)value;
+    size_t child_path_len = make_child_path(child_path, path_len, key);
+    args->visitor(child_path, key, depth + 1, args->arg);
+    if (child->children && index_size(child->children)) {
+      walk_spawn(worker, child, depth + 1, child_path, child_path_len, NULL);
+    }
+  }
+  free(child_path);
+}
+
+int tree_walk(Tree *tree, const char *path, tree_visitor_t visitor, void *arg, int nthreads) {
+  if (!is_path_valid(path) || !visitor) { return EINVAL; }
+
+  int result = 0;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *root = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  if (!root) { result = ENOENT; goto exit; }
+  if (!root->children) { result = ENOTDIR; goto exit; }
+
+  // zamrozonego poddrzewa nikt nie zmienia, wiec moze je przechodzic wielu naraz
+  bool frozen = is_frozen(root);
+  if (!frozen) { rwlock_wrlock(root->rwlock); }
+  WalkArgs args = { visitor, arg };
+  walk_run(root, path, walk_dir, &args, NULL, nthreads);
+  if (!frozen) { rwlock_wrunlock(root->rwlock); }
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == root);
+  return result;
+}
+
+/*
+Kopiowanie poddrzewa: zrodlo blokujemy tak jak w tree_walk (lock pisarza na
+korzeniu, czytelnika na przodkach), wiec jego struktura i pliki sa stale,
+i rownolegle budujemy kopie odlaczona od drzewa - nikt jej nie widzi, wiec
+robotnicy wypelniaja swoje foldery bez zadnych lockow. Liczby potomkow
+i wysokosci kopiujemy ze zrodla zamiast liczyc je przy kazdym wstawieniu,
+a pliki dziela kawalki ze zrodlem (copy-on-write). Na koniec, juz bez locka
+na zrodle, wstawiamy korzen kopii do folderu docelowego jednym index_insert
+pod lockiem pisarza - kopia pojawia sie w drzewie od razu cala.
+*/
+
+// mniej wiecej tyle wierzcholkow na watek; male poddrzewa kopiujemy w jednym watku
+#define COPY_NODES_PER_THREAD 4096
+
+// kopia wierzcholka bez dzieci, z agregatami zrodla
+static Tree *copy_node_new(Tree *source, Tree *parent) {
+  Tree *copy = source->children ? child_dir_new(parent) : node_new(NULL, file_clone(source->file));
+  atomic_init(&copy->descendants, atomic_load_explicit(&source->descendants, memory_order_relaxed));
+  atomic_init(&copy->height, get_height(source));
+  return copy;
+}
+
+static void copy_dir(WalkWorker *worker, Tree *dir, int depth, const char *path, size_t path_len, void *data) {
+  Tree *copy = (Tree *)data;
+  const char *key;
+  void *value;
+  NameIndexIterator it = index_iterator(dir->children);
+  while (index_next(&it, &key, &value)) {
+    Tree *child = (Tree *)value;
+    Tree *child_copy = copy_node_new(child, copy);
+    child_copy->parent = copy;
+    ensure(index_insert(copy->children, key, child_copy));
+    // sciezki nie sa potrzebne, wiec zostawiamy sciezke korzenia
+    if (child->children && index_size(child->children)) {
+      walk_spawn(worker, child, depth + 1, path, path_len, child_copy);
+    }
+  }
+  if (index_size(copy->children) >= STRIPE_THRESHOLD) {
+    index_make_striped(copy->children);
+    atomic_init(&copy->striped, true);
+  }
+}
+
+// kopia wierzcholka node o sciezce path, ktory jest zablokowany w trybie pisarza albo zamrozony
+static Tree *copy_locked(Tree *tree, Tree *node, const char *path) {
+  Tree *copy = copy_node_new(node, tree);
+  if (node->children && index_size(node->children)) {
+    long nodes = atomic_load_explicit(&node->descendants, memory_order_relaxed);
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > nodes / COPY_NODES_PER_THREAD + 1) { nthreads = nodes / COPY_NODES_PER_THREAD + 1; }
+    walk_run(node, path, copy_dir, NULL, copy, (int)nthreads);
+  }
+  return copy;
+}
+
+// buduje odlaczona kopie wierzcholka source; jej korzen nie ma jeszcze ojca
+static int copy_subtree(Tree *tree, const char *source, Tree **result) {
+  int ret = 0;
+  ParsedPath parsed;
+  parse_path(tree, source, &parsed);
+  Tree *node = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  if (!node) { ret = ENOENT; goto exit; }
+
+  bool frozen = is_frozen(node);
+  if (!frozen) { rwlock_wrlock(node->rwlock); }
+  *result = copy_locked(tree, node, source);
+  if (!frozen) { rwlock_wrunlock(node->rwlock); }
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == node);
+  return ret;
+}
+
+// Kopia trafia do strumieni zmian jako utworzenie kolejnych folderow i plikow
+// (z zawartoscia, po kawalku na rekord), w porzadku pre-order. Zrodlo mozna
+// zmienic miedzy zrobieniem kopii a wstawieniem jej do drzewa, wiec rekord
+// "skopiuj source" powtorzony w chwili wstawienia moglby dac co innego.
+static void log_copy(Tree *tree, Tree *node, char *path, size_t path_len) {
+  if (node->file) {
+    size_t size = file_size(node->file);
+    if (!size) {
+      log_write(tree, path, 0, NULL, 0);
+      return;
+    }
+    ChunkRef *refs = (ChunkRef *)malloc(file_read_max_refs(size) * sizeof(ChunkRef));
+    if (!refs) { bad_malloc(); }
+    size_t len, offset = 0;
+    size_t n_refs = file_read(node->file, 0, size, refs, &len);
+    for (size_t i = 0; i < n_refs; ++i) {
+      log_write(tree, path, offset, refs[i].data, refs[i].len);
+      offset += refs[i].len;
+      chunk_release(refs[i].chunk);
+    }
+    free(refs);
+    return;
+  }
+  log_op(tree, TREE_LOG_CREATE, path, NULL);
+  const char *key;
+  void *value;
+  NameIndexIterator it = index_iterator(node->children);
+  while (index_next(&it, &key, &value)) {
+    log_copy(tree, (Tree *)value, path, make_child_path(path, path_len, key));
+  }
+}
+
+static int copy_path(Tree *tree, const char *source, const char *target) {
+  if (!source || !is_path_valid(source)) { return EINVAL; }
+  if (!target || !is_path_valid(target)) { return EINVAL; }
+  if (!strcmp(target, "/")) { return EEXIST; }
+
+  int result = 0;
+  ParsedPath parsed;
+  parse_path(tree, target, &parsed);
+  size_t depth = parsed.n - 1;
+  // tanie sprawdzenie celu, zanim zbudujemy cala kopie; rozstrzyga sprawdzenie
+  // ponizej, pod lockiem pisarza na ojcu
+  Tree *parent = get_subfolder_parsed(tree, &parsed, 0, depth, LOCK);
+  if (!parent) {
+    result = ENOENT;
+  } else if (!parent->children) {
+    result = ENOTDIR;
+  } else if (is_frozen(parent)) {
+    result = EROFS;
+  } else {
+    rwlock_rdlock(parent->rwlock);
+    if (get_child_parsed(parent, &parsed, depth)) { result = EEXIST; }
+    rwlock_rdunlock(parent->rwlock);
+  }
+  ensure(get_subfolder_parsed(tree, &parsed, 0, depth, UNLOCK) == parent);
+  if (result) { return result; }
+
+  Tree *copy = NULL;
+  if ((result = copy_subtree(tree, source, &copy))) { return result; }
+
+  parent = get_subfolder_parsed(tree, &parsed, 0, depth, LOCK);
+  if (!parent) { result = ENOENT; goto exit; }
+  if (!parent->children) { result = ENOTDIR; goto exit; }
+  if (is_frozen(parent)) { result = EROFS; goto exit; }
+
+  rwlock_wrlock(parent->rwlock);
+  // ktos mogl zamrozic parent, zanim wzielismy lock
+  if (is_frozen(parent)) {
+    result = EROFS;
+  } else if (index_insert(parent->children, parsed.components[depth], copy)) {
+    attach_node(parent, copy);
+    notify(tree, parent, TREE_EVENT_CREATED, target, 0);
+    if (is_logged(tree)) {
+      size_t target_len = strlen(target);
+      char *path = (char *)malloc(target_len + get_height(copy) * (MAX_FOLDER_NAME_LENGTH + 1) + 1);
+      if (!path) { bad_malloc(); }
+      memcpy(path, target, target_len + 1);
+      log_copy(tree, copy, path, target_len);
+      free(path);
+    }
+    if (!is_striped(parent) && index_size(parent->children) >= STRIPE_THRESHOLD) {
+      index_make_striped(parent->children);
+      atomic_store_explicit(&parent->striped, true, memory_order_release);
+    }
+    copy = NULL;
+  } else {
+    result = EEXIST;
+  }
+  rwlock_wrunlock(parent->rwlock);
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, depth, UNLOCK) == parent);
+  if (copy) { tree_free(copy); }
+  return result;
+}
+
+int tree_copy(Tree *tree, const char *source, const char *target) {
+  TraceCall call;
+  trace_begin(tree, &call, NULL);
+  int result = copy_path(tree, source, target);
+  trace_end(&call, TREE_TRACE_COPY, NULL, source, target, result);
+  return result;
+}
+
+// oznacza potomkow node jako zamrozonych i opcjonalnie kompaktuje indeksy;
+// wolajacy ma wylacznosc na node
+static void freeze_subtree(Tree *node, bool compact) {
+  if (!node->children) { return; }
+  const char *key;
+  void *value;
+  NameIndexIterator it = index_iterator(node->children);
+  while (index_next(&it, &key, &value)) {
+    Tree *child = (Tree *)value;
+    // zamrozone poddrzewo moga juz czytac inni bez lockow
+    if (is_frozen(child)) { continue; }
+    freeze_subtree(child, compact);
+    atomic_store_explicit(&child->frozen, true, memory_order_relaxed);
+  }
+  if (compact) { index_freeze(node->children); }
+}
+
+static int freeze_path(Tree *tree, const char *path, bool compact) {
+  if (!is_path_valid(path)) { return EINVAL; }
+
+  int result = 0;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *node = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  if (!node) { result = ENOENT; goto exit; }
+  if (is_frozen(node)) { goto exit; }
+
+  rwlock_wrlock(node->rwlock);
+  // ktos mogl zamrozic node, zanim wzielismy lock
+  if (!is_frozen(node)) {
+    freeze_subtree(node, compact);
+    atomic_store_explicit(&node->frozen, true, memory_order_release);
+    TreeLogRecord change = { 0 };
+    change.type = TREE_LOG_FREEZE;
+    change.compact = compact;
+    change.path = path;
+    log_change(tree, &change);
+  }
+  rwlock_wrunlock(node->rwlock);
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == node);
+  return result;
+}
+
+int tree_freeze(Tree *tree, const char *path, bool compact) {
+  TraceCall call;
+  trace_begin(tree, &call, NULL);
+  trace_args(&call, compact, 0);
+  int result = freeze_path(tree, path, compact);
+  trace_end(&call, TREE_TRACE_FREEZE, NULL, path, NULL, result);
+  return result;
+}
+
+/*
+Ladowanie posortowanej listy sciezek. W liscie posortowanej strcmp sciezki
+spod jednego folderu leza obok siebie ('/' jest mniejsze od liter), wiec
+lista dzieli sie na rozlaczne grupy wg komponentu najwyzszego poziomu.
+Planujemy jednostki pracy: ciagi sasiednich grup pod jednym folderem, po okolo
+unit_size sciezek; w grupe wieksza niz unit_size schodzimy poziom nizej, a jej
+folder ("kregoslup") tworzy watek planujacy. Watki buduja poddrzewa jednostek
+bez lockow - sa odlaczone od drzewa i kazde nalezy do jednego watku - idac po
+sciezkach ze stosem otwartych folderow. Dzieci folderu zbieramy az do jego
+zamkniecia (w posortowanej liscie juz do niego nie wrocimy), wiec znamy ich
+liczbe przed wstawieniem: indeks jest rezerwowany raz i nie rosnie, a duze
+foldery od razu dostaja pasy. Na koniec watek wywolujacy podpina wyniki
+jednostek do kregoslupa, a grupy najwyzszego poziomu - pod lockiem pisarza
+na korzeniu - do drzewa. Zamrozony korzen i zajete nazwy najwyzszego poziomu
+sprawdzamy tez na poczatku, pod lockiem czytelnika, zeby nie budowac na darmo.
+*/
+
+// tyle jednostek na watek, zeby wyrownac rozne rozmiary poddrzew
+#define BULK_UNITS_PER_THREAD 8
+// mniejszych grup nie dzielimy na jednostki
+#define BULK_MIN_UNIT 1024
+// tyle sciezek watek sprawdza naraz
+#define BULK_CHECK_CHUNK 4096
+
+typedef struct BulkChild {
+  const char *name; // wskazuje do sciezki z listy, bez '\0'
+  size_t len;
+  Tree *node;
+} BulkChild;
+
+typedef struct BulkChildren {
+  BulkChild *items;
+  size_t n;
+  size_t capacity;
+} BulkChildren;
+
+// folder utworzony przez planujacego; spine[0] to korzen drzewa
+typedef struct BulkSpine {
+  Tree *node;
+  const char *name;
+  size_t len;
+  size_t parent; // indeks ojca w spine
+  BulkChildren children;
+} BulkSpine;
+
+// sciezki [lo, hi), wszystkie pod folderem spine o sciezce dlugosci prefix_len
+typedef struct BulkUnit {
+  size_t spine;
+  size_t lo, hi;
+  size_t prefix_len;
+  BulkChildren children; // zbudowane dzieci folderu spine
+} BulkUnit;
+
+// otwarty folder na stosie watku budujacego
+typedef struct BulkLevel {
+  Tree *node;
+  const char *name;
+  size_t len;
+  BulkChildren children;
+} BulkLevel;
+
+typedef struct BulkLoad {
+  Tree *tree;
+  const char *const *paths;
+  size_t n;
+  int nthreads;
+  size_t unit_size;
+  BulkSpine *spine;
+  size_t n_spine, spine_capacity;
+  BulkUnit *units;
+  size_t n_units, units_capacity;
+  atomic_size_t next; // nastepna porcja albo jednostka do wziecia
+  atomic_bool invalid;
+} BulkLoad;
+
+static void bulk_push(BulkChildren *children, const char *name, size_t len, Tree *node) {
+  if (children->n == children->capacity) {
+    children->capacity = children->capacity ? 2 * children->capacity : 16;
+    children->items = (BulkChild *)realloc(children->items, children->capacity * sizeof(BulkChild));
+    if (!children->items) { bad_malloc(); }
+  }
+  children->items[children->n++] = (BulkChild){ name, len, node };
+}
+
+// wstawia zebrane dzieci do pustego jeszcze, odlaczonego folderu node i liczy jego agregaty
+static void bulk_fill(Tree *node, BulkChildren *children) {
+  if (children->n >= STRIPE_THRESHOLD) {
+    index_make_striped(node->children);
+    atomic_init(&node->striped, true);
+  }
+  index_reserve(node->children, children->n);
+  char name[MAX_FOLDER_NAME_LENGTH + 1];
+  size_t descendants = 0, height = 0;
+  for (size_t i = 0; i < children->n; ++i) {
+    BulkChild *child = &children->items[i];
+    memcpy(name, child->name, child->len);
+    name[child->len] = '\0';
+    ensure(index_insert(node->children, name, child->node));
+    child->node->parent = node;
+    descendants += atomic_load_explicit(&child->node->descendants, memory_order_relaxed) + 1;
+    if (get_height(child->node) + 1 > height) { height = get_height(child->node) + 1; }
+  }
+  atomic_store_explicit(&node->descendants, descendants, memory_order_relaxed);
+  atomic_store_explicit(&node->height, height, memory_order_relaxed);
+  children->n = 0;
+}
+
+// watek wywolujacy jest robotnikiem numer 0
+static void bulk_run(BulkLoad *load, void *(*worker)(void *)) {
+  atomic_store(&load->next, 0);
+  pthread_t *threads = (pthread_t *)malloc(load->nthreads * sizeof(pthread_t));
+  if (!threads) { bad_malloc(); }
+  for (int i = 1; i < load->nthreads; ++i) {
+    if (pthread_create(&threads[i], NULL, worker, load)) { syserr("Unable to create thread"); }
+  }
+  worker(load);
+  for (int i = 1; i < load->nthreads; ++i) {
+    if (pthread_join(threads[i], NULL)) { syserr("Unable to join thread"); }
+  }
+  free(threads);
+}
+
+// kazda sciezka poprawna i nie mniejsza od poprzedniej
+static void *bulk_check(void *data) {
+  BulkLoad *load = (BulkLoad *)data;
+  size_t lo;
+  while ((lo = atomic_fetch_add(&load->next, BULK_CHECK_CHUNK)) < load->n) {
+    if (atomic_load_explicit(&load->invalid, memory_order_relaxed)) { break; }
+    size_t hi = lo + BULK_CHECK_CHUNK < load->n ? lo + BULK_CHECK_CHUNK : load->n;
+    for (size_t i = lo; i < hi; ++i) {
+      const char *path = load->paths[i];
+      if (!path || !is_path_valid(path) || (i && (!load->paths[i - 1] || strcmp(load->paths[i - 1], path) > 0))) {
+        atomic_store_explicit(&load->invalid, true, memory_order_relaxed);
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+static size_t bulk_add_spine(BulkLoad *load, size_t parent, const char *name, size_t len) {
+  if (load->n_spine == load->spine_capacity) {
+    load->spine_capacity = load->spine_capacity ? 2 * load->spine_capacity : 16;
+    load->spine = (BulkSpine *)realloc(load->spine, load->spine_capacity * sizeof(BulkSpine));
+    if (!load->spine) { bad_malloc(); }
+  }
+  Tree *node = parent == (size_t)-1 ? load->tree : child_dir_new(load->tree);
+  load->spine[load->n_spine] = (BulkSpine){ node, name, len, parent, { NULL, 0, 0 } };
+  return load->n_spine++;
+}
+
+static void bulk_add_unit(BulkLoad *load, size_t spine, size_t lo, size_t hi, size_t prefix_len) {
+  if (load->n_units == load->units_capacity) {
+    load->units_capacity = load->units_capacity ? 2 * load->units_capacity : 16;
+    load->units = (BulkUnit *)realloc(load->units, load->units_capacity * sizeof(BulkUnit));
+    if (!load->units) { bad_malloc(); }
+  }
+  load->units[load->n_units++] = (BulkUnit){ spine, lo, hi, prefix_len, { NULL, 0, 0 } };
+}
+
+// koniec grupy zaczynajacej sie w lo: pierwsza sciezka >= key (prefiks grupy z '0'
+// zamiast koncowego '/'); wyszukiwanie wykladnicze, bo grupy bywaja male
+static size_t bulk_group_end(const char *const *paths, size_t lo, size_t hi, const char *key) {
+  size_t step = 1;
+  while (lo + step < hi && strcmp(paths[lo + step], key) < 0) {
+    lo += step;
+    step *= 2;
+  }
+  size_t end = lo + step < hi ? lo + step : hi;
+  while (lo + 1 < end) {
+    size_t middle = lo + (end - lo) / 2;
+    if (strcmp(paths[middle], key) < 0) {
+      lo = middle;
+    } else {
+      end = middle;
+    }
+  }
+  return end;
+}
+
+// dzieli sciezki [lo, hi) spod folderu spine (sciezka dlugosci prefix_len) na jednostki
+static void bulk_plan(BulkLoad *load, size_t spine, size_t lo, size_t hi, size_t prefix_len) {
+  // sam folder (byc moze powtorzony) jest na poczatku
+  while (lo < hi && !load->paths[lo][prefix_len]) { lo++; }
+  char key[MAX_PATH_LENGTH + 1];
+  size_t unit_lo = lo;
+  while (lo < hi) {
+    const char *name = load->paths[lo] + prefix_len;
+    size_t len = strchr(name, '/') - name;
+    size_t child_len = prefix_len + len + 1;
+    memcpy(key, load->paths[lo], child_len - 1);
+    key[child_len - 1] = '0';
+    key[child_len] = '\0';
+    size_t end = bulk_group_end(load->paths, lo, hi, key);
+    if (end - lo > load->unit_size) {
+      if (unit_lo < lo) { bulk_add_unit(load, spine, unit_lo, lo, prefix_len); }
+      bulk_plan(load, bulk_add_spine(load, spine, name, len), lo, end, child_len);
+      unit_lo = end;
+    } else if (end - unit_lo >= load->unit_size) {
+      bulk_add_unit(load, spine, unit_lo, end, prefix_len);
+      unit_lo = end;
+    }
+    lo = end;
+  }
+  if (unit_lo < hi) { bulk_add_unit(load, spine, unit_lo, hi, prefix_len); }
+}
+
+// zamyka folder ze szczytu stosu i dodaje go do dzieci folderu pod nim
+static void bulk_close(BulkLevel *levels, size_t top) {
+  bulk_fill(levels[top].node, &levels[top].children);
+  bulk_push(&levels[top - 1].children, levels[top].name, levels[top].len, levels[top].node);
+}
+
+// buduje poddrzewa jednostki; levels[0] zbiera dzieci jej folderu
+static void bulk_build(BulkLoad *load, BulkUnit *unit, BulkLevel *levels) {
+  size_t top = 0;
+  for (size_t i = unit->lo; i < unit->hi; ++i) {
+    const char *name = load->paths[i] + unit->prefix_len;
+    // foldery wspolne z poprzednia sciezka sa juz na stosie
+    size_t level = 1;
+    while (*name && level <= top) {
+      size_t len = strchr(name, '/') - name;
+      if (len != levels[level].len || memcmp(name, levels[level].name, len)) { break; }
+      name += len + 1;
+      level++;
+    }
+    while (top >= level) { bulk_close(levels, top--); }
+    while (*name) {
+      top++;
+      levels[top].node = child_dir_new(load->tree);
+      levels[top].name = name;
+      levels[top].len = strchr(name, '/') - name;
+      name += levels[top].len + 1;
+    }
+  }
+  while (top > 0) { bulk_close(levels, top--); }
+  unit->children = levels[0].children;
+  levels[0].children = (BulkChildren){ NULL, 0, 0 };
+}
+
+static void *bulk_build_worker(void *data) {
+  BulkLoad *load = (BulkLoad *)data;
+  BulkLevel *levels = (BulkLevel *)calloc(MAX_PATH_LENGTH / 2 + 1, sizeof(BulkLevel));
+  if (!levels) { bad_malloc(); }
+  size_t i;
+  while ((i = atomic_fetch_add(&load->next, 1)) < load->n_units) {
+    bulk_build(load, &load->units[i], levels);
+  }
+  for (size_t level = 0; level <= MAX_PATH_LENGTH / 2; ++level) { free(levels[level].children.items); }
+  free(levels);
+  return NULL;
+}
+
+// bledy EROFS i EEXIST wykrywane pod lockiem czytelnika na korzeniu, zanim cokolwiek
+// zbudujemy; rozstrzyga sprawdzenie pod lockiem pisarza przy podpinaniu
+static int bulk_precheck(Tree *tree, const char *const *paths, size_t n) {
+  int result = 0;
+  char key[MAX_PATH_LENGTH + 1];
+  char name[MAX_FOLDER_NAME_LENGTH + 1];
+  rwlock_rdlock(tree->rwlock);
+  if (is_frozen(tree)) { result = EROFS; }
+  // jedna nazwa najwyzszego poziomu na grupe
+  for (size_t lo = 0; lo < n && !result;) {
+    const char *first = paths[lo] + 1;
+    if (!*first) {
+      lo++;
+      continue;
+    }
+    size_t len = strchr(first, '/') - first;
+    memcpy(name, first, len);
+    name[len] = '\0';
+    if (index_get(tree->children, name)) { result = EEXIST; }
+    memcpy(key, paths[lo], len + 1);
+    key[len + 1] = '0';
+    key[len + 2] = '\0';
+    lo = bulk_group_end(paths, lo, n, key);
+  }
+  rwlock_rdunlock(tree->rwlock);
+  return result;
+}
+
+int tree_bulk_load(Tree *tree, const char *const *paths, size_t n, int nthreads) {
+  if (!paths && n) { return EINVAL; }
+  BulkLoad load;
+  load.tree = tree;
+  load.paths = paths;
+  load.n = n;
+  load.nthreads = nthreads < 1 ? 1 : nthreads;
+  load.unit_size = n / ((size_t)load.nthreads * BULK_UNITS_PER_THREAD);
+  if (load.unit_size < BULK_MIN_UNIT) { load.unit_size = BULK_MIN_UNIT; }
+  load.spine = NULL;
+  load.n_spine = load.spine_capacity = 0;
+  load.units = NULL;
+  load.n_units = load.units_capacity = 0;
+  atomic_init(&load.next, 0);
+  atomic_init(&load.invalid, false);
+
+  bulk_run(&load, bulk_check);
+  if (atomic_load(&load.invalid)) { return EINVAL; }
+  int result = bulk_precheck(tree, paths, n);
+  if (result) { return result; }
+
+  bulk_add_spine(&load, (size_t)-1, NULL, 0);
+  bulk_plan(&load, 0, 0, n, 1);
+  bulk_run(&load, bulk_build_worker);
+
+  for (size_t i = 0; i < load.n_units; ++i) {
+    BulkUnit *unit = &load.units[i];
+    for (size_t j = 0; j < unit->children.n; ++j) {
+      BulkChild *child = &unit->children.items[j];
+      bulk_push(&load.spine[unit->spine].children, child->name, child->len, child->node);
+    }
+    free(unit->children.items);
+  }
+  // kregoslup od lisci w gore: dzieci sa w spine za ojcami
+  for (size_t i = load.n_spine; i-- > 1;) {
+    BulkSpine *spine = &load.spine[i];
+    bulk_fill(spine->node, &spine->children);
+    free(spine->children.items);
+    bulk_push(&load.spine[spine->parent].children, spine->name, spine->len, spine->node);
+  }
+
+  BulkChildren *top = &load.spine[0].children;
+  char name[MAX_FOLDER_NAME_LENGTH + 1];
+  char path[MAX_PATH_LENGTH + 1] = "/";
+  rwlock_wrlock(tree->rwlock);
+  if (is_frozen(tree)) { result = EROFS; }
+  for (size_t i = 0; i < top->n && !result; ++i) {
+    memcpy(name, top->items[i].name, top->items[i].len);
+    name[top->items[i].len] = '\0';
+    if (index_get(tree->children, name)) { result = EEXIST; }
+  }
+  if (!result) {
+    index_reserve(tree->children, index_size(tree->children) + top->n);
+    for (size_t i = 0; i < top->n; ++i) {
+      Tree *node = top->items[i].node;
+      memcpy(name, top->items[i].name, top->items[i].len);
+      name[top->items[i].len] = '\0';
+      ensure(index_insert(tree->children, name, node));
+      attach_node(tree, node);
+      size_t path_len = make_child_path(path, 1, name);
+      notify(tree, tree, TREE_EVENT_CREATED, path, 0);
+      if (is_logged(tree)) { log_copy(tree, node, path, path_len); }
+    }
+    if (!is_striped(tree) && index_size(tree->children) >= STRIPE_THRESHOLD) {
+      index_make_striped(tree->children);
+      atomic_store_explicit(&tree->striped, true, memory_order_release);
+    }
+  }
+  rwlock_wrunlock(tree->rwlock);
+
+  if (result) {
+    for (size_t i = 0; i < top->n; ++i) { tree_free(top->items[i].node); }
+  }
+  free(top->items);
+  free(load.spine);
+  free(load.units);
+  return result;
+}
+
+TreeLogStream *tree_log_open(Tree *tree, Tree **snapshot, uint64_t *seq) {
+  TreeLogStream *stream = (TreeLogStream *)malloc(sizeof(TreeLogStream));
+  if (!stream) { bad_malloc(); }
+  pthread_condattr_t attr;
+  ensure(!pthread_condattr_init(&attr));
+  ensure(!pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+  if (pthread_cond_init(&stream->ready, &attr)) { syserr("Unable to create condition variable"); }
+  ensure(!pthread_condattr_destroy(&attr));
+  stream->entries = NULL;
+  stream->start = stream->end = stream->capacity = 0;
+
+  // kazda mutacja trzyma lock na korzeniu, wiec zadna nie jest w polowie
+  rwlock_wrlock(tree->rwlock);
+  TreeLog *log = atomic_load_explicit(&tree->log, memory_order_relaxed);
+  if (!log) {
+    if (!(log = (TreeLog *)malloc(sizeof(TreeLog)))) { bad_malloc(); }
+    if (pthread_mutex_init(&log->lock, NULL)) { syserr("Unable to create mutex"); }
+    atomic_init(&log->seq, 0);
+    atomic_init(&log->n_streams, 0);
+    log->streams = NULL;
+    atomic_store_explicit(&tree->log, log, memory_order_release);
+  }
+  stream->log = log;
+  if (snapshot) { *snapshot = copy_locked(tree, tree, "/"); }
+  if (seq) { *seq = atomic_load_explicit(&log->seq, memory_order_relaxed); }
+  pthread_mutex_lock(&log->lock);
+  stream->next = log->streams;
+  log->streams = stream;
+  atomic_fetch_add_explicit(&log->n_streams, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&log->lock);
+  rwlock_wrunlock(tree->rwlock);
+  return stream;
+}
+
+// wpisy poczatkowe sladu dla poddrzewa node o sciezce path: foldery w porzadku
+// pre-order, pliki (zapis calej dlugosci) i zamrozenia
+static void trace_snapshot(Trace *trace, Tree *node, char *path, size_t path_len) {
+  TreeTraceEntry entry = { 0 };
+  entry.flags = TREE_TRACE_SETUP;
+  if (node->file) {
+    uint64_t args[2] = { 0, file_size(node->file) };
+    entry.op = TREE_TRACE_WRITE;
+    entry.flags |= TREE_TRACE_ARGS;
+    trace_append(trace, &entry, 0, args, 2, path, NULL);
+    return;
+  }
+  if (node->parent) {
+    entry.op = TREE_TRACE_CREATE;
+    trace_append(trace, &entry, 0, NULL, 0, path, NULL);
+  }
+  const char *key;
+  void *value;
+  NameIndexIterator it = index_iterator(node->children);
+  while (index_next(&it, &key, &value)) {
+    trace_snapshot(trace, (Tree *)value, path, make_child_path(path, path_len, key));
+  }
+  path[path_len] = '\0';
+  if (is_frozen(node) && (!node->parent || !is_frozen(node->parent))) {
+    uint64_t args[2] = { index_frozen(node->children), 0 };
+    entry.op = TREE_TRACE_FREEZE;
+    entry.flags |= TREE_TRACE_ARGS;
+    trace_append(trace, &entry, 0, args, 2, path, NULL);
+  }
+}
+
+int tree_trace_start(Tree *tree, const char *file) {
+  // kazda mutacja trzyma lock na korzeniu, wiec stan poczatkowy jest spojny
+  int result = 0;
+  rwlock_wrlock(tree->rwlock);
+  Trace *trace = atomic_load_explicit(&tree->trace, memory_order_relaxed);
+  if (!trace) {
+    if (!(trace = (Trace *)aligned_alloc(_Alignof(Trace), sizeof(Trace)))) { bad_malloc(); }
+    atomic_init(&trace->active, false);
+    trace->fd = -1;
+    if (pthread_mutex_init(&trace->file_lock, NULL)) { syserr("Unable to create mutex"); }
+    for (int i = 0; i < TRACE_STRIPES; ++i) {
+      if (pthread_mutex_init(&trace->stripes[i].lock, NULL)) { syserr("Unable to create mutex"); }
+      if (!(trace->stripes[i].data = (char *)malloc(TRACE_BUFFER_SIZE))) { bad_malloc(); }
+      trace->stripes[i].len = 0;
+    }
+    atomic_store_explicit(&tree->trace, trace, memory_order_release);
+  }
+  if (atomic_load_explicit(&trace->active, memory_order_relaxed)) {
+    result = EBUSY;
+    goto exit;
+  }
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    result = errno;
+    goto exit;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  TreeTraceHeader header = { TREE_TRACE_MAGIC, (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec };
+  if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+    result = errno ? errno : EIO;
+    close(fd);
+    goto exit;
+  }
+  for (int i = 0; i < TRACE_STRIPES; ++i) { pthread_mutex_lock(&trace->stripes[i].lock); }
+  trace->fd = fd;
+  trace->error = 0;
+  trace->start = monotonic_ns();
+  for (int i = TRACE_STRIPES; i-- > 0;) { pthread_mutex_unlock(&trace->stripes[i].lock); }
+  char path[MAX_PATH_LENGTH + 1] = "/";
+  trace_snapshot(trace, tree, path, 1);
+  atomic_store_explicit(&trace->active, true, memory_order_relaxed);
+
+exit:
+  rwlock_wrunlock(tree->rwlock);
+  return result;
+}
+
+int tree_trace_stop(Tree *tree) {
+  Trace *trace = atomic_load_explicit(&tree->trace, memory_order_acquire);
+  if (!trace) { return 0; }
+  rwlock_wrlock(tree->rwlock);
+  int result = trace_close(trace);
+  rwlock_wrunlock(tree->rwlock);
+  return result;
+}
+
+/*
+Wyszukiwanie wzorca: wzorzec to ciag komponentow, z ktorych kazdy jest albo
+wzorcem nazwy (z '*' i '?'), albo "**", pasujacym do dowolnej liczby folderow.
+Dopasowanie to automat niedeterministyczny - stanem jest zbior pozycji we
+wzorcu (posortowana tablica, states[0] to jej dlugosc). Do folderu schodzimy
+tylko, jesli po jego nazwie zbior nie jest pusty, wiec poddrzewa, ktore nie
+moga pasowac, sa odcinane. Gdy w zbiorze sa tylko komponenty bez wzorcow,
+zamiast przegladac wszystkie dzieci szukamy ich nazw wprost w indeksie.
+W przeciwnym razie przegladamy tylko dzieci o wspolnym prefiksie wszystkich
+aktywnych komponentow (w trie to jedno poddrzewo).
+*/
+
+typedef struct FindArgs {
+  int n_components;
+  char (*components)[MAX_FOLDER_NAME_LENGTH + 1];
+  bool *is_literal;
+  bool *is_any_depth; // komponent "**"
+  size_t *prefix_len; // dlugosc prefiksu komponentu bez wildcardow
+  const char **interned; // internowane nazwy komponentow bez wildcardow (albo NULL)
+  uint64_t *hashes;
+  tree_find_callback_t callback;
+  void *arg;
+} FindArgs;
+
+// dodaje pozycje do zbioru stanow wraz z pozycjami osiagalnymi przez "**"
+static void find_add_state(const FindArgs *args, int *states, int position) {
+  for (;;) {
+    int i = 1;
+    while (i <= states[0] && states[i] < position) { ++i; }
+    if (i <= states[0] && states[i] == position) { return; }
+    memmove(states + i + 1, states + i, (states[0] - i + 1) * sizeof(int));
+    states[i] = position;
+    states[0]++;
+    if (position == args->n_components || !args->is_any_depth[position]) { return; }
+    position++;
+  }
+}
+
+static int *find_states_new(const FindArgs *args) {
+  int *states = (int *)malloc((args->n_components + 2) * sizeof(int));
+  if (!states) { bad_malloc(); }
+  states[0] = 0;
+  return states;
+}
+
+// stany po przejsciu do dziecka o nazwie name
+static void find_step(const FindArgs *args, const int *states, const char *name, int *next) {
+  next[0] = 0;
+  for (int i = 1; i <= states[0]; ++i) {
+    int position = states[i];
+    if (position == args->n_components) { continue; }
+    if (args->is_any_depth[position]) {
+      find_add_state(args, next, position);
+    } else if (glob_match(args->components[position], name)) {
+      find_add_state(args, next, position + 1);
+    }
+  }
+}
+
+static bool find_accepts(const FindArgs *args, const int *states) {
+  return states[0] && states[states[0]] == args->n_components;
+}
+
+static bool find_can_descend(const FindArgs *args, const int *states) {
+  return states[0] && states[1] < args->n_components;
+}
+
+static void find_visit_child(WalkWorker *worker, const FindArgs *args, const int *states,
+                             Tree *child, const char *name, int depth, char *child_path, size_t path_len) {
+  int *next = find_states_new(args);
+  find_step(args, states, name, next);
+  size_t child_path_len = make_child_path(child_path, path_len, name);
+  if (find_accepts(args, next)) { args->callback(child_path, args->arg); }
+  if (find_can_descend(args, next) && child->children && index_size(child->children)) {
+    walk_spawn(worker, child, depth + 1, child_path, child_path_len, next);
+  } else {
+    free(next);
+  }
+}
+
+static void find_dir(WalkWorker *worker, Tree *dir, int depth, const char *path, size_t path_len, void *data) {
+  FindArgs *args = (FindArgs *)worker->ctx->arg;
+  int *states = (int *)data;
+  char *child_path = (char *)malloc(path_len + MAX_FOLDER_NAME_LENGTH + 2);
+  if (!child_path) { bad_malloc(); }
+  memcpy(child_path, path, path_len);
+
+  bool only_literals = true;
+  for (int i = 1; i <= states[0]; ++i) {
+    int position = states[i];
+    if (position < args->n_components && !args->is_literal[position]) { only_literals = false; }
+  }
+
+  if (only_literals) {
+    for (int i = 1; i <= states[0]; ++i) {
+      int position = states[i];
+      if (position == args->n_components) { continue; }
+      const char *name = args->components[position];
+      // ta sama nazwa moze wystapic na kilku pozycjach - odwiedzamy ja raz
+      bool seen = false;
+      for (int j = 1; j < i; ++j) {
+        if (states[j] < args->n_components && !strcmp(args->components[states[j]], name)) { seen = true; }
+      }
+      Tree *child = (Tree *)index_get_interned(dir->children, name, args->interned[position], args->hashes[position]);
+      if (child && !seen) { find_visit_child(worker, args, states, child, name, depth, child_path, path_len); }
+    }
+  } else {
+    // najdluzszy prefiks, od ktorego musi sie zaczynac nazwa pasujaca do ktoregos stanu
+    char prefix[MAX_FOLDER_NAME_LENGTH + 1];
+    size_t prefix_len = SIZE_MAX;
+    for (int i = 1; i <= states[0]; ++i) {
+      int position = states[i];
+      if (position == args->n_components) { continue; }
+      const char *component = args->components[position];
+      size_t len = args->is_any_depth[position] ? 0 : args->prefix_len[position];
+      if (prefix_len == SIZE_MAX) {
+        memcpy(prefix, component, len);
+        prefix_len = len;
+      }
+      size_t common = 0;
+      while (common < prefix_len && common < len && prefix[common] == component[common]) { ++common; }
+      prefix_len = common;
+    }
+    if (prefix_len == SIZE_MAX) { prefix_len = 0; }
+    prefix[prefix_len] = '\0';
+
+    const char *key;
+    void *value;
+    NameIndexIterator it = index_prefix_iterator(dir->children, prefix);
+    while (index_next(&it, &key, &value)) {
+      find_visit_child(worker, args, states, (Tree *)value, key, depth, child_path, path_len);
+    }
+  }
+
+  free(child_path);
+  free(states);
+}
+
+int tree_find(Tree *tree, const char *path, const char *pattern, tree_find_callback_t callback, void *arg, int nthreads) {
+  if (!is_path_valid(path) || !is_pattern_valid(pattern) || !callback) { return EINVAL; }
+
+  FindArgs args;
+  args.n_components = 0;
+  for (const char *c = pattern + 1; *c; ++c) {
+    if (*c == '/') { args.n_components++; }
+  }
+  args.components = malloc((args.n_components + 1) * sizeof(*args.components));
+  args.is_literal = (bool *)malloc((args.n_components + 1) * sizeof(bool));
+  args.is_any_depth = (bool *)malloc((args.n_components + 1) * sizeof(bool));
+  args.prefix_len = (size_t *)malloc((args.n_components + 1) * sizeof(size_t));
+  args.interned = (const char **)malloc((args.n_components + 1) * sizeof(char *));
+  args.hashes = (uint64_t *)malloc((args.n_components + 1) * sizeof(uint64_t));
+  if (!args.components || !args.is_literal || !args.is_any_depth || !args.prefix_len || !args.interned || !args.hashes) {
+    bad_malloc();
+  }
+  // nazwy bez wildcardow szukamy wprost: hash liczymy raz, a w drzewie z
+  // internowanymi nazwami porownujemy wskazniki (nazwa, ktorej nikt nie
+  // trzyma, nie wystepuje w zadnym folderze)
+  NameIndexKind kind = index_kind(tree->children);
+  uint64_t seed = index_seed(tree->children);
+  const char *subpattern = pattern;
+  for (int i = 0; (subpattern = split_path(subpattern, args.components[i])); ++i) {
+    args.is_any_depth[i] = !strcmp(args.components[i], "**");
+    args.is_literal[i] = !strpbrk(args.components[i], "*?");
+    args.prefix_len[i] = strcspn(args.components[i], "*?");
+    args.hashes[i] = hmap_hash(seed, args.components[i], strlen(args.components[i]));
+    args.interned[i] = kind == NAME_INDEX_INTERNED && args.is_literal[i] ? intern_find(args.components[i]) : NULL;
+  }
+  args.callback = callback;
+  args.arg = arg;
+
+  int result = 0;
+  ParsedPath parsed;
+  parse_path(tree, path, &parsed);
+  Tree *root = get_subfolder_parsed(tree, &parsed, 0, parsed.n, LOCK);
+  if (!root) { result = ENOENT; goto exit; }
+  if (!root->children) { result = ENOTDIR; goto exit; }
+
+  bool frozen = is_frozen(root);
+  if (!frozen) { rwlock_wrlock(root->rwlock); }
+  int *states = find_states_new(&args);
+  find_add_state(&args, states, 0);
+  if (find_accepts(&args, states)) { callback(path, arg); }
+  if (find_can_descend(&args, states)) {
+    walk_run(root, path, find_dir, &args, states, nthreads);
+  } else {
+    free(states);
+  }
+  if (!frozen) { rwlock_wrunlock(root->rwlock); }
+
+exit:
+  ensure(get_subfolder_parsed(tree, &parsed, 0, parsed.n, UNLOCK) == root);
+  free(args.components);
+  free(args.is_literal);
+  free(args.is_any_depth);
+  free(args.prefix_len);
+  for (int i = 0; i < args.n_components; ++i) {
+    if (args.interned[i]) { intern_release(args.interned[i]); }
+  }
+  free(args.interned);
+  free(args.hashes);
+  return result;
+}
 
 
 // tutaj ponizej jest tylko do wgladu owoc mojej dluugiej pracy, niestety
@@ -275,7 +3364,7 @@ int tree_moveSEMI(Tree *tree, const char *source, const char *target) {
   if (starts_with(target, source)) { result = EINVMV; goto exit0; }
   if (starts_with(source, target)) {
     Tree *node = get_subfolder(tree, source, LOCK);
-    assert(get_subfolder(tree, source, UNLOCK) == node);
+    ensure(get_subfolder(tree, source, UNLOCK) == node);
     result = node ? EEXIST : ENOENT;
     goto exit0;
   }
@@ -342,13 +3431,13 @@ int tree_moveSEMI(Tree *tree, const char *source, const char *target) {
     if (!target_parent) { result = ENOENT; goto exit3; }
   }
   
-  Tree *source_node = hmap_get(source_parent->hmap, source_component);
+  Tree *source_node = index_get(source_parent->children, source_component);
   if (!source_node) { result = ENOENT; goto exit4; }
   
-  assert(hmap_remove(source_parent->hmap, source_component));
-  bool success = hmap_insert(target_parent->hmap, target_component, source_node);
+  ensure(index_remove(source_parent->children, source_component));
+  bool success = index_insert(target_parent->children, target_component, source_node);
   if (!success) {
-    assert(hmap_insert(source_parent->hmap, source_component, source_node));
+    ensure(index_insert(source_parent->children, source_component, source_node));
     result = EEXIST;
   }
 
@@ -375,18 +3464,18 @@ exit3:
   if (mode == LOCK) {
     assert (cmp == 1 || cmp == -1);
     if (cmp == -1) {
-      assert(get_subfolder(tree, target_parent_path, UNLOCK) == target_parent);
+      ensure(get_subfolder(tree, target_parent_path, UNLOCK) == target_parent);
     } else if (cmp == 1) {
-      assert(get_subfolder(tree, source_parent_path, UNLOCK) == source_parent);
+      ensure(get_subfolder(tree, source_parent_path, UNLOCK) == source_parent);
     }
   }
 exit2:
   if (mode == LOCK) {
     assert (cmp == 1 || cmp == -1);
     if (cmp == -1) {
-      assert(get_subfolder(tree, source_parent_path, UNLOCK) == source_parent);
+      ensure(get_subfolder(tree, source_parent_path, UNLOCK) == source_parent);
     } else if (cmp == 1) {
-      assert(get_subfolder(tree, target_parent_path, UNLOCK) == target_parent);
+      ensure(get_subfolder(tree, target_parent_path, UNLOCK) == target_parent);
     }
   } else {
     rwlock_wrunlock(lca->rwlock);
@@ -397,7 +3486,7 @@ exit2:
   // }
 
 exit1:
-  assert(get_lca(tree, source_parent_path, target_parent_path, UNLOCK) == lca);
+  ensure(get_lca(tree, source_parent_path, target_parent_path, UNLOCK) == lca);
 exit0:
   free(source_parent_path); 
   free(target_parent_path);
@@ -510,8 +3599,8 @@ void get_two_subfolders(
       }
     }
 
-    if (subpathA && subtreeA) { subtreeA = (Tree *)hmap_get(subtreeA->hmap, componentA); }
-    if (subpathB && subtreeB) { subtreeB = (Tree *)hmap_get(subtreeB->hmap, componentB); }
+    if (subpathA && subtreeA) { subtreeA = (Tree *)index_get(subtreeA->children, componentA); }
+    if (subpathB && subtreeB) { subtreeB = (Tree *)index_get(subtreeB->children, componentB); }
     if (!subpathA && !subpathB) { break; }
   }
 
@@ -524,8 +3613,8 @@ void breathe(Tree* tree) {
   return;
   const char *key;
   void *value;
-  HashMapIterator it = hmap_iterator(tree->hmap);
-  while (hmap_next(tree->hmap, &it, &key, &value)) {
+  NameIndexIterator it = index_iterator(tree->children);
+  while (index_next(&it, &key, &value)) {
     Tree *child = (Tree *)value;
     breathe(child);
   }
@@ -560,7 +3649,7 @@ int tree_moveFAST(Tree* tree, const char* source, const char* target) {
   if (starts_with(target, source)) { result = EINVMV; goto exit0; }
   if (starts_with(source, target)) {
     Tree *node = get_subfolder(tree, source, LOCK);
-    assert(get_subfolder(tree, source, UNLOCK) == node);
+    ensure(get_subfolder(tree, source, UNLOCK) == node);
     result = node ? EEXIST : ENOENT;
     goto exit0;
   }
@@ -602,13 +3691,13 @@ int tree_moveFAST(Tree* tree, const char* source, const char* target) {
   );
   if (!source_parent || !target_parent) { result = ENOENT; goto exit2; }
   
-  Tree *source_node = hmap_get(source_parent->hmap, source_component);
+  Tree *source_node = index_get(source_parent->children, source_component);
   if (!source_node) { result = ENOENT; goto exit2; }
   
-  assert(hmap_remove(source_parent->hmap, source_component));
-  bool success = hmap_insert(target_parent->hmap, target_component, source_node);
+  ensure(index_remove(source_parent->children, source_component));
+  bool success = index_insert(target_parent->children, target_component, source_node);
   if (!success) {
-    assert(hmap_insert(source_parent->hmap, source_component, source_node));
+    ensure(index_insert(source_parent->children, source_component, source_node));
     result = EEXIST;
   }
 
@@ -621,7 +3710,7 @@ exit2:
 
 exit1:
   if (release_lca) {
-    assert(get_lca(tree, source_parent_path, target_parent_path, UNLOCK) == lca);
+    ensure(get_lca(tree, source_parent_path, target_parent_path, UNLOCK) == lca);
   }
 exit0:
   free(source_parent_path); 
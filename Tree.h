@@ -1,5 +1,13 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "File.h"
+#include "NameIndex.h"
+
 // Kod błędu zwracany przy próbie przeniesienia folderu do swojego podfolderu
 #define EINVMV (-20)
 
@@ -9,12 +17,26 @@ typedef struct Tree Tree;
 // Tworzy nowe drzewo folderów z jednym, pustym folderem "/".
 Tree* tree_new();
 
+// Jak tree_new, ale dzieci każdego folderu drzewa są trzymane w indeksie danego rodzaju.
+// NAME_INDEX_TRIE daje posortowane tree_list bez sortowania, tanie wyliczanie nazw
+// o danym prefiksie (tree_list_prefix, tree_find) i mniej pamięci przy wspólnych prefiksach.
+Tree* tree_new_with_index(NameIndexKind kind);
+
 // Zwalnia całą pamięć związaną z podanym drzewem.
 void tree_free(Tree*);
 
 // Wymienia zawartość danego folderu, zwracając nowy napis postaci "foo,bar,baz"
 char* tree_list(Tree* tree, const char* path);
 
+// Jak tree_list, ale wymienia tylko dzieci, których nazwy zaczynają się od prefix
+// (np. do stronicowania dużych folderów).
+char* tree_list_prefix(Tree* tree, const char* path, const char* prefix);
+
+// Wymienia zawartość n folderów naraz: out[i] to wynik tree_list(tree, paths[i]) (NULL, jeśli
+// paths[i] nie jest folderem). Wspólne prefiksy ścieżek są przechodzone i blokowane raz.
+// Każdy folder jest wymieniony atomowo, ale nie wszystkie naraz.
+void tree_list_many(Tree* tree, const char* const* paths, size_t n, char** out);
+
 // Tworzy nowy podfolder (np. dla path="/foo/bar/baz/", tworzy pusty podfolder baz w folderze "/foo/bar/").
 int tree_create(Tree* tree, const char* path);
 
@@ -23,3 +45,257 @@ int tree_remove(Tree* tree, const char* path);
 
 // Przenosi folder source wraz z zawartością na miejsce target (przenoszone jest całe poddrzewo), o ile to możliwe 
 int tree_move(Tree* tree, const char* source, const char* target);
+
+// Operacja na dziecku folderu dla tree_children_apply: tree_create albo (remove) tree_remove.
+typedef struct TreeChildOp {
+  const char* name;
+  bool remove;
+} TreeChildOp;
+
+// Wykonuje po kolei n operacji na dzieciach folderu parent_path, zakładając lock na folderze tylko raz.
+// results[i] to wynik i-tej operacji, taki jak zwróciłyby tree_create/tree_remove.
+void tree_children_apply(Tree* tree, const char* parent_path, const TreeChildOp* ops, int* results, size_t n);
+
+// Agregaty poddrzewa zwracane przez tree_stat.
+typedef struct TreeStat {
+  size_t descendants; // liczba wszystkich potomków (folderów i plików)
+  size_t height;      // wysokość poddrzewa (0 dla pustego folderu i pliku)
+  size_t children;    // liczba dzieci (0 dla pliku)
+  bool is_file;
+} TreeStat;
+
+// Zwraca agregaty poddrzewa path w czasie proporcjonalnym do głębokości path, a nie do rozmiaru poddrzewa,
+// albo ENOENT, jeśli path nie istnieje. Nie alokuje pamięci i nie blokuje samego path.
+int tree_stat(Tree* tree, const char* path, TreeStat* stat);
+
+// Sprawdza, czy path istnieje (folder lub plik), bez alokowania pamięci.
+bool tree_exists(Tree* tree, const char* path);
+
+// Wynik tree_read: ciąg referencji do niezmiennych kawałków pliku, łącznie len bajtów.
+// Dane pozostają ważne do wywołania tree_read_release, niezależnie od dalszych operacji na drzewie.
+typedef struct TreeReadResult {
+  ChunkRef *refs;
+  size_t n_refs;
+  size_t len;
+} TreeReadResult;
+
+// Zapisuje len bajtów z buf do pliku path od pozycji offset, tworząc plik, jeśli nie istnieje.
+int tree_write(Tree* tree, const char* path, size_t offset, const char* buf, size_t len);
+
+// Czyta co najwyżej len bajtów pliku path od pozycji offset, bez kopiowania danych.
+int tree_read(Tree* tree, const char* path, size_t offset, size_t len, TreeReadResult* result);
+
+// Zwalnia referencje zwrócone przez tree_read.
+void tree_read_release(TreeReadResult* result);
+
+// Wersje operacji z ograniczonym czasem czekania na locki. Wersje _timed czekają
+// najwyżej do deadline (czas bezwzględny na zegarze CLOCK_MONOTONIC) i zwracają wtedy
+// ETIMEDOUT, a wersje _try nie czekają wcale i zwracają EAGAIN. W obu przypadkach
+// operacja nie zmienia drzewa, a locki wzięte po drodze są już oddane. Poza tym
+// wyniki są takie jak dla zwykłych wersji; tree_list_timed/_try zwraca listę
+// w *result, a jeśli path nie jest folderem - ENOENT albo ENOTDIR.
+int tree_list_timed(Tree* tree, const char* path, const struct timespec* deadline, char** result);
+int tree_list_try(Tree* tree, const char* path, char** result);
+int tree_create_timed(Tree* tree, const char* path, const struct timespec* deadline);
+int tree_create_try(Tree* tree, const char* path);
+int tree_remove_timed(Tree* tree, const char* path, const struct timespec* deadline);
+int tree_remove_try(Tree* tree, const char* path);
+int tree_move_timed(Tree* tree, const char* source, const char* target, const struct timespec* deadline);
+int tree_move_try(Tree* tree, const char* source, const char* target);
+int tree_stat_timed(Tree* tree, const char* path, TreeStat* stat, const struct timespec* deadline);
+int tree_stat_try(Tree* tree, const char* path, TreeStat* stat);
+int tree_write_timed(Tree* tree, const char* path, size_t offset, const char* buf, size_t len,
+                     const struct timespec* deadline);
+int tree_write_try(Tree* tree, const char* path, size_t offset, const char* buf, size_t len);
+int tree_read_timed(Tree* tree, const char* path, size_t offset, size_t len, TreeReadResult* result,
+                    const struct timespec* deadline);
+int tree_read_try(Tree* tree, const char* path, size_t offset, size_t len, TreeReadResult* result);
+
+// Uchwyt folderu (jak deskryptor katalogu dla openat): operacje względne zaczynają
+// przejście od folderu uchwytu, bez parsowania i wyszukiwania jego ścieżki od korzenia.
+// Uchwyt pozostaje ważny po przeniesieniu folderu lub jego przodków; po usunięciu
+// folderu operacje na uchwycie zwracają ENOENT (tree_dir_list - NULL).
+typedef struct TreeDir TreeDir;
+
+// Otwiera uchwyt folderu path. Zwraca NULL, jeśli path nie jest istniejącym folderem.
+TreeDir* tree_open(Tree* tree, const char* path);
+
+// Zamyka uchwyt. Wszystkie uchwyty drzewa trzeba zamknąć przed tree_free.
+void tree_close(TreeDir* dir);
+
+// Odpowiedniki tree_list, tree_create, tree_remove i tree_move dla ścieżek względnych,
+// zapisywanych tak jak bezwzględne ("/" to sam folder uchwytu, "/a/b/" - jego wnuk b).
+char* tree_dir_list(TreeDir* dir, const char* path);
+int tree_dir_create(TreeDir* dir, const char* path);
+int tree_dir_remove(TreeDir* dir, const char* path);
+int tree_dir_move(TreeDir* dir, const char* source, const char* target);
+
+// Transakcja: ciąg operacji create/remove/move wykonywanych atomowo - wszystkie albo żadna.
+typedef struct TreeTxn TreeTxn;
+
+typedef enum TreeTxnOpType {
+  TREE_TXN_CREATE, // tree_create(path)
+  TREE_TXN_REMOVE, // tree_remove(path)
+  TREE_TXN_MOVE,   // tree_move(path, target)
+} TreeTxnOpType;
+
+// Zaczyna nową, pustą transakcję na drzewie tree.
+TreeTxn* tree_txn_begin(Tree* tree);
+
+// Dopisuje operację na koniec transakcji (target tylko dla TREE_TXN_MOVE, inaczej ignorowany).
+// Zwraca EINVAL dla złej ścieżki albo rodzaju operacji, inaczej 0.
+int tree_txn_add(TreeTxn* txn, TreeTxnOpType type, const char* path, const char* target);
+
+// Wykonuje operacje po kolei (każda widzi skutki poprzednich) i zwalnia transakcję.
+// Jeśli wszystkie się udają, zwraca 0; inaczej wycofuje wykonane, zwraca wynik pierwszej
+// nieudanej (taki jak zwróciłaby odpowiednia funkcja) i, jeśli failed != NULL, jej indeks.
+// Inne operacje widzą albo stan sprzed transakcji, albo stan po wszystkich jej operacjach.
+// Blokuje tylko najniższego wspólnego przodka zmienianych folderów, więc transakcje
+// w rozłącznych poddrzewach wykonują się równolegle.
+int tree_txn_commit(TreeTxn* txn, size_t* failed);
+
+// Porzuca transakcję bez wykonywania jej operacji.
+void tree_txn_abort(TreeTxn* txn);
+
+// Funkcja wywoływana przez tree_walk dla każdego potomka: pełna ścieżka, nazwa i głębokość
+// względem korzenia przejścia (dzieci korzenia mają głębokość 1). Może być wołana współbieżnie z wielu wątków.
+typedef void (*tree_visitor_t)(const char* path, const char* name, int depth, void* arg);
+
+// Odwiedza równolegle (nthreads wątków) wszystkich potomków folderu path. Na czas przejścia
+// poddrzewo jest zablokowane w trybie pisarza (czekają też odczyty w nim), więc visitor nie może
+// wołać operacji na tym poddrzewie. Zamrożonego poddrzewa tree_walk nie blokuje.
+int tree_walk(Tree* tree, const char* path, tree_visitor_t visitor, void* arg, int nthreads);
+
+// Kopiuje folder lub plik source wraz z całą zawartością na miejsce target. Kopia jest budowana
+// równolegle poza drzewem, przy zablokowanym w trybie pisarza source, i wstawiana jednym ruchem,
+// więc inne operacje widzą albo brak target, albo całą kopię. Pliki dzielą dane ze źródłem aż do zapisu.
+// Błędy target są wykrywane przed budową kopii (i jeszcze raz przy wstawianiu).
+// Zwraca 0, EINVAL, ENOENT (brak source albo ojca target), ENOTDIR, EEXIST albo EROFS.
+int tree_copy(Tree* tree, const char* source, const char* target);
+
+// Zamraża folder lub plik path z całą zawartością: od tej chwili create, remove, move, write,
+// tree_children_apply, transakcje i tree_copy, które by coś w nim zmieniły, zwracają EROFS.
+// Sam korzeń można przenieść (z całym poddrzewem), ale nie usunąć. Odczyty schodzą przez
+// zamrożone foldery bez locków, a tree_walk, tree_find i tree_copy nie blokują zamrożonego
+// korzenia. Jeśli compact, indeksy dzieci zamieniane są na posortowane tablice (index_freeze).
+// Zamrożenie jest na zawsze; dla już zamrożonego path nic nie robi. Zwraca 0, EINVAL albo ENOENT.
+int tree_freeze(Tree* tree, const char* path, bool compact);
+
+// Ładuje do drzewa foldery z listy paths (n ścieżek posortowanych strcmp; powtórzenia i "/"
+// są pomijane, brakujący przodkowie tworzeni). Lista dzielona jest wg komponentu najwyższego
+// poziomu (duże grupy - głębiej), rozłączne poddrzewa budowane równolegle (nthreads wątków)
+// bez locków, z indeksami dzieci od razu na znaną liczbę dzieci, i podpinane pod korzeń na
+// końcu, pod lockiem pisarza - inne operacje widzą albo nic z listy, albo całość. Foldery
+// najwyższego poziomu z listy nie mogą już istnieć. Zwraca 0, EINVAL (niepoprawna albo
+// nieposortowana ścieżka), EEXIST albo EROFS (zamrożony korzeń); po błędzie drzewo się nie zmienia.
+int tree_bulk_load(Tree* tree, const char* const* paths, size_t n, int nthreads);
+
+// Funkcja wywoływana przez tree_find dla każdego folderu lub pliku pasującego do wzorca (pełna ścieżka).
+typedef void (*tree_find_callback_t)(const char* path, void* arg);
+
+// Wywołuje callback dla każdego węzła w poddrzewie path, którego ścieżka względem path pasuje
+// do wzorca pattern (np. "/projects/*/build/cache*/"; '*', '?' w nazwach, "**" to dowolnie wiele folderów).
+// Przeszukiwanie odcina poddrzewa, które nie mogą pasować; dla nthreads > 1 działa równolegle,
+// na tych samych zasadach co tree_walk.
+int tree_find(Tree* tree, const char* path, const char* pattern, tree_find_callback_t callback, void* arg, int nthreads);
+
+// Rodzaje zdarzeń zgłaszanych obserwatorom przez tree_watch.
+typedef enum TreeEventType {
+  TREE_EVENT_CREATED,    // utworzono folder lub plik path
+  TREE_EVENT_REMOVED,    // usunięto path (także sam obserwowany folder - to ostatnie zdarzenie)
+  TREE_EVENT_MOVED_FROM, // przeniesiono path gdzie indziej; para dla MOVED_TO ma to samo cookie
+  TREE_EVENT_MOVED_TO,   // przeniesiono coś na path
+  TREE_EVENT_OVERFLOW,   // kolejka była pełna i część zdarzeń przepadła (path == NULL)
+} TreeEventType;
+
+typedef struct TreeEvent {
+  TreeEventType type;
+  char* path;      // pełna ścieżka; zwalnia wywołujący tree_watch_next
+  uint64_t cookie; // niezerowe tylko dla przeniesień
+} TreeEvent;
+
+// Pojemność kolejki zdarzeń jednego obserwatora.
+#define TREE_WATCH_CAPACITY 1024
+
+typedef struct TreeWatch TreeWatch;
+
+// Zaczyna obserwować zmiany dzieci folderu path (dla recursive - wszystkich potomków).
+// Zdarzenia trafiają do ograniczonej kolejki bez locków, po wykonaniu zmiany.
+// Zwraca NULL, jeśli path nie jest istniejącym folderem.
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive);
+
+// Pobiera najstarsze zdarzenie (bez czekania). Zwraca false, jeśli kolejka jest pusta.
+// Może być wołane przez jeden wątek naraz, współbieżnie z operacjami na drzewie.
+bool tree_watch_next(TreeWatch* watch, TreeEvent* event);
+
+// Kończy obserwację i zwalnia obserwatora (także po tree_free drzewa).
+void tree_unwatch(TreeWatch* watch);
+
+// Rodzaje zmian w strumieniu zmian drzewa (tree_log_open).
+typedef enum TreeLogOpType {
+  TREE_LOG_CREATE, // tree_create(path)
+  TREE_LOG_REMOVE, // tree_remove(path)
+  TREE_LOG_MOVE,   // tree_move(path, target)
+  TREE_LOG_WRITE,  // tree_write(path, offset, data, len); len == 0 tylko tworzy plik
+  TREE_LOG_FREEZE, // tree_freeze(path, compact)
+} TreeLogOpType;
+
+// Wykonana zmiana drzewa. Powtórzenie rekordów w kolejności seq na kopii drzewa
+// z chwili otwarcia strumienia daje na niej te same zmiany. Inne mutacje (dzieci
+// folderu, transakcje, tree_copy, operacje na uchwytach) trafiają do strumienia
+// jako ciągi takich rekordów, ze ścieżkami bezwzględnymi.
+typedef struct TreeLogRecord {
+  uint64_t seq;         // kolejne numery od 1, wspólne dla wszystkich strumieni drzewa
+  struct timespec time; // chwila wykonania zmiany, na zegarze CLOCK_MONOTONIC
+  TreeLogOpType type;
+  // ile następnych rekordów należy do tej samej transakcji; rekordy transakcji
+  // (tylko TREE_LOG_CREATE, TREE_LOG_REMOVE i TREE_LOG_MOVE) idą w strumieniu po kolei
+  uint32_t txn_left;
+  bool compact;         // TREE_LOG_FREEZE
+  const char* path;
+  const char* target;   // TREE_LOG_MOVE
+  const char* data;     // TREE_LOG_WRITE
+  size_t offset;
+  size_t len;
+} TreeLogRecord;
+
+typedef struct TreeLogStream TreeLogStream;
+
+// Otwiera strumień zmian drzewa wykonanych od tej chwili. Jeśli snapshot != NULL,
+// zapisuje tam nowe drzewo - kopię tree z tej samej chwili (z tym samym rodzajem
+// indeksu), a jeśli seq != NULL - numer ostatniego rekordu sprzed otwarcia. Na czas
+// otwarcia korzeń jest zablokowany w trybie pisarza. Dopóki jakiś strumień jest otwarty,
+// każda mutacja przed oddaniem locków dopisuje rekord do kolejek wszystkich strumieni
+// pod wspólnym mutexem. Kolejki nie mają limitu, więc mutacje nigdy nie czekają na
+// odbiorców. Strumienie trzeba zamknąć przed tree_free.
+TreeLogStream* tree_log_open(Tree* tree, Tree** snapshot, uint64_t* seq);
+
+// Pobiera do max najstarszych rekordów do records i zwraca ich liczbę. Czeka na co
+// najmniej jeden najdłużej do deadline (jak w wersjach _timed; NULL - bez limitu).
+// Rekordy trzeba oddać przez tree_log_release. Może być wołane przez jeden wątek naraz.
+size_t tree_log_read(TreeLogStream* stream, const TreeLogRecord** records, size_t max,
+                     const struct timespec* deadline);
+
+// Zwalnia rekordy pobrane przez tree_log_read.
+void tree_log_release(const TreeLogRecord** records, size_t n);
+
+// Zamyka strumień; niepobrane rekordy przepadają.
+void tree_log_close(TreeLogStream* stream);
+
+// Numer ostatniego rekordu w strumieniach drzewa (0, jeśli żadnego nie było). Po powrocie
+// z mutacji jest co najmniej taki, jak numer jej rekordu.
+uint64_t tree_log_seq(Tree* tree);
+
+// Zaczyna zapisywać do pliku file ślad wywołań drzewa (format w TreeTrace.h): operację,
+// ścieżki, wątek, czas wywołania i powrotu oraz wynik każdego tree_list(_prefix), tree_create,
+// tree_remove, tree_move (także wersji _timed, _try i na uchwytach), tree_stat, tree_exists,
+// tree_read, tree_write (bez danych), tree_copy i tree_freeze. Ślad zaczyna się od stanu drzewa
+// w chwili startu, więc da się go powtórzyć na pustym drzewie (replay.c). tree_children_apply
+// i tree_txn_commit dają wpis na każdą swoją operację; tree_list_many, tree_walk, tree_find
+// i tree_bulk_load nie trafiają do śladu. Wątki dopisują wpisy do buforów w pamięci, bez
+// wspólnego locka; bez śladu wywołanie sprawdza tylko jeden wskaźnik. Zwraca 0, EBUSY
+// (ślad już trwa) albo błąd otwarcia lub zapisu pliku.
+int tree_trace_start(Tree* tree, const char* file);
+
+// Kończy ślad i dopisuje bufory do pliku (robi to też tree_free). Zwraca 0 albo pierwszy błąd zapisu.
+int tree_trace_stop(Tree* tree);
@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "TreeClient.h"
+#include "TreeProto.h"
+#include "err.h"
+#include "path_utils.h"
+
+#define READ_CHUNK 65536
+
+struct TreeClient {
+  int fd;
+  int error; // pierwszy blad polaczenia
+  // biezaca wiadomosc: miejsce na naglowek i wpisy
+  char *out;
+  size_t out_len;
+  size_t out_capacity;
+  uint32_t out_count;
+  // odebrane, a jeszcze nie rozlozone bajty
+  char *in;
+  size_t in_start;
+  size_t in_len;
+  size_t in_capacity;
+  uint32_t entries_left; // wpisy pozostale w biezacej wiadomosci odpowiedzi
+  size_t in_flight;      // wyslane operacje bez odebranych wynikow
+};
+
+TreeClient *tree_client_connect(const char *socket_path) {
+  struct sockaddr_un addr = { 0 };
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) { return NULL; }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+
+  TreeClient *client = (TreeClient *)calloc(1, sizeof(TreeClient));
+  if (!client) { bad_malloc(); }
+  client->fd = fd;
+  client->out_len = sizeof(TreeMsgHeader);
+  return client;
+}
+
+void tree_client_close(TreeClient *client) {
+  close(client->fd);
+  free(client->out);
+  free(client->in);
+  free(client);
+}
+
+static void reserve(char **data, size_t *capacity, size_t size) {
+  if (size <= *capacity) { return; }
+  size_t new_capacity = *capacity ? *capacity : 4096;
+  while (new_capacity < size) { new_capacity *= 2; }
+  if (!(*data = (char *)realloc(*data, new_capacity))) { bad_malloc(); }
+  *capacity = new_capacity;
+}
+
+static void fail(TreeClient *client) {
+  if (!client->error) { client->error = errno == EPIPE || !errno ? ECONNRESET : errno; }
+  client->in_flight = 0;
+}
+
+// dopisuje do bufora wejsciowego to, co jest w gniezdzie; zwraca false po bledzie
+static bool receive(TreeClient *client) {
+  if (client->in_start == client->in_len) {
+    client->in_start = client->in_len = 0;
+  } else if (client->in_start > client->in_capacity / 2) {
+    memmove(client->in, client->in + client->in_start, client->in_len - client->in_start);
+    client->in_len -= client->in_start;
+    client->in_start = 0;
+  }
+  reserve(&client->in, &client->in_capacity, client->in_len + READ_CHUNK);
+  ssize_t n = recv(client->fd, client->in + client->in_len, client->in_capacity - client->in_len, 0);
+  if (n < 0 && errno == EINTR) { return true; }
+  if (n <= 0) {
+    if (n == 0) { errno = ECONNRESET; }
+    fail(client);
+    return false;
+  }
+  client->in_len += n;
+  return true;
+}
+
+int tree_client_flush(TreeClient *client) {
+  if (client->error) { return client->error; }
+  if (!client->out_count) { return 0; }
+  TreeMsgHeader header = { client->out_len - sizeof(header), client->out_count };
+  memcpy(client->out, &header, sizeof(header));
+
+  // czytamy odpowiedzi, gdy nie da sie pisac, bo serwer przestaje czytac zadania
+  // od klienta, ktory nie odbiera wynikow
+  size_t sent = 0;
+  while (sent < client->out_len) {
+    struct pollfd fds = { client->fd, POLLIN | POLLOUT, 0 };
+    if (poll(&fds, 1, -1) < 0) {
+      if (errno == EINTR) { continue; }
+      fail(client);
+      return client->error;
+    }
+    if (fds.revents & POLLIN && !receive(client)) { return client->error; }
+    if (fds.revents & (POLLOUT | POLLERR | POLLHUP)) {
+      ssize_t n = send(client->fd, client->out + sent, client->out_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n >= 0) {
+        sent += n;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fail(client);
+        return client->error;
+      }
+    }
+  }
+  client->in_flight += client->out_count;
+  client->out_len = sizeof(TreeMsgHeader);
+  client->out_count = 0;
+  return 0;
+}
+
+int tree_client_submit(TreeClient *client, const TreeOp *op) {
+  if (client->error) { return client->error; }
+  size_t path_len = op->path ? strlen(op->path) : 0;
+  size_t target_len = op->type == TREE_OP_MOVE && op->target ? strlen(op->target) : 0;
+  // za dluga sciezka i tak jest niepoprawna; pusta serwer odrzuci z EINVAL
+  if (path_len > MAX_PATH_LENGTH) { path_len = 0; }
+  if (target_len > MAX_PATH_LENGTH) { target_len = 0; }
+  size_t size = sizeof(TreeReqEntry) + path_len + target_len;
+  if (client->out_len - sizeof(TreeMsgHeader) + size > TREE_PROTO_MAX_MESSAGE) {
+    int err = tree_client_flush(client);
+    if (err) { return err; }
+  }
+
+  TreeReqEntry entry = { (uint64_t)(uintptr_t)op->user_data, (uint8_t)op->type, 0,
+                         (uint16_t)path_len, (uint16_t)target_len, 0 };
+  reserve(&client->out, &client->out_capacity, client->out_len + size);
+  char *end = client->out + client->out_len;
+  memcpy(end, &entry, sizeof(entry));
+  if (path_len) { memcpy(end + sizeof(entry), op->path, path_len); }
+  if (target_len) { memcpy(end + sizeof(entry) + path_len, op->target, target_len); }
+  client->out_len += size;
+  client->out_count++;
+  return 0;
+}
+
+size_t tree_client_reap(TreeClient *client, TreeCompletion *out, size_t max, bool wait) {
+  size_t n = 0;
+  while (n < max) {
+    size_t available = client->in_len - client->in_start;
+    const char *data = client->in + client->in_start;
+    if (!client->entries_left && available >= sizeof(TreeMsgHeader)) {
+      TreeMsgHeader header;
+      memcpy(&header, data, sizeof(header));
+      client->entries_left = header.count;
+      client->in_start += sizeof(header);
+      continue;
+    }
+    TreeReplyEntry entry;
+    if (client->entries_left && available >= sizeof(entry)) {
+      memcpy(&entry, data, sizeof(entry));
+      size_t list_len = entry.list_len == TREE_PROTO_NO_LIST ? 0 : entry.list_len;
+      if (available >= sizeof(entry) + list_len) {
+        char *list = NULL;
+        if (entry.list_len != TREE_PROTO_NO_LIST) {
+          if (!(list = (char *)malloc(list_len + 1))) { bad_malloc(); }
+          memcpy(list, data + sizeof(entry), list_len);
+          list[list_len] = '\0';
+        }
+        out[n++] = (TreeCompletion){ (void *)(uintptr_t)entry.tag, entry.result, list };
+        client->in_start += sizeof(entry) + list_len;
+        client->entries_left--;
+        client->in_flight--;
+        continue;
+      }
+    }
+    // w buforze nie ma calego wpisu
+    if (n || !wait || !client->in_flight || !receive(client)) { break; }
+  }
+  return n;
+}
+
+// wysyla jedna operacje i czeka na jej wynik
+static int call(TreeClient *client, TreeOpType type, const char *path, const char *target, char **list) {
+  TreeOp op = { type, path, target, NULL };
+  TreeCompletion completion;
+  if (tree_client_submit(client, &op) || tree_client_flush(client) ||
+      !tree_client_reap(client, &completion, 1, true)) {
+    return ECONNRESET;
+  }
+  if (list) {
+    *list = completion.list;
+  } else {
+    free(completion.list);
+  }
+  return completion.result;
+}
+
+char *tree_client_list(TreeClient *client, const char *path) {
+  char *list = NULL;
+  call(client, TREE_OP_LIST, path, NULL, &list);
+  return list;
+}
+
+int tree_client_create(TreeClient *client, const char *path) {
+  return call(client, TREE_OP_CREATE, path, NULL, NULL);
+}
+
+int tree_client_remove(TreeClient *client, const char *path) {
+  return call(client, TREE_OP_REMOVE, path, NULL, NULL);
+}
+
+int tree_client_move(TreeClient *client, const char *source, const char *target) {
+  return call(client, TREE_OP_MOVE, source, target, NULL);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "TreeQueue.h" // TreeOp, TreeCompletion
+
+// Klient serwera drzewa (server.c) na gnieździe uniksowym. Interfejs asynchroniczny
+// jest jak w TreeQueue: zgłoszenia trafiają do bieżącej wiadomości, tree_client_flush
+// wysyła ją jako jedną paczkę, a wyniki odbiera się tree_client_reap w kolejności
+// ich zakończenia na serwerze. Można mieć w toku wiele wiadomości naraz.
+// Klient nie jest bezpieczny dla wątków - każdy wątek powinien mieć własny.
+typedef struct TreeClient TreeClient;
+
+// Łączy się z serwerem na gnieździe socket_path. Zwraca NULL (z errno), jeśli się nie uda.
+TreeClient* tree_client_connect(const char* socket_path);
+
+// Zamyka połączenie; wyniki operacji w toku przepadają.
+void tree_client_close(TreeClient* client);
+
+// Dopisuje operację do bieżącej wiadomości; napisy są kopiowane. Pełną wiadomość
+// wysyła od razu. Zwraca 0 albo kod błędu połączenia.
+int tree_client_submit(TreeClient* client, const TreeOp* op);
+
+// Wysyła bieżącą wiadomość. Zwraca 0 albo kod błędu połączenia.
+int tree_client_flush(TreeClient* client);
+
+// Odbiera do max wyników do out i zwraca ich liczbę; list zwalnia odbiorca. Jeśli wait,
+// czeka na co najmniej jeden, o ile jakakolwiek wysłana operacja jest w toku. Po zerwaniu
+// połączenia wyniki operacji w toku przepadają, a tree_client_submit i flush zwracają błąd.
+size_t tree_client_reap(TreeClient* client, TreeCompletion* out, size_t max, bool wait);
+
+// Operacje synchroniczne, jak w Tree.h, w jednym obiegu do serwera. Przy błędzie
+// połączenia zwracają ECONNRESET (lista - NULL). Wymagają, by nic nie było w toku.
+char* tree_client_list(TreeClient* client, const char* path);
+int tree_client_create(TreeClient* client, const char* path);
+int tree_client_remove(TreeClient* client, const char* path);
+int tree_client_move(TreeClient* client, const char* source, const char* target);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binarny protokół serwera drzewa (server.c) na gniazdach uniksowych. Obie strony są
+// na tej samej maszynie, więc liczby idą w porządku bajtów hosta.
+//
+// Strumień w każdą stronę to ciąg wiadomości: nagłówek TreeMsgHeader, a za nim
+// size bajtów z count wpisami. Wpis żądania to TreeReqEntry i bajty ścieżek
+// (path_len bajtów path, potem target_len bajtów target, bez '\0'), wpis odpowiedzi -
+// TreeReplyEntry i ewentualnie list_len bajtów wyniku tree_list.
+//
+// Klient może wysyłać kolejne wiadomości, nie czekając na odpowiedzi. Serwer wykonuje
+// operacje współbieżnie i odsyła wyniki w kolejności ich zakończenia, po kilka w jednej
+// wiadomości; wynik rozpoznaje się po tagu nadanym przez klienta. Operacje w toku nie są
+// uporządkowane względem siebie, także te z jednej wiadomości.
+
+// Największy dopuszczalny rozmiar treści wiadomości; większa zamyka połączenie.
+#define TREE_PROTO_MAX_MESSAGE (1u << 20)
+
+typedef struct TreeMsgHeader {
+  uint32_t size;
+  uint32_t count;
+} TreeMsgHeader;
+
+// type to TreeOpType z TreeQueue.h
+typedef struct TreeReqEntry {
+  uint64_t tag;
+  uint8_t type;
+  uint8_t unused;
+  uint16_t path_len;
+  uint16_t target_len;
+  uint16_t unused2;
+} TreeReqEntry;
+
+// Wartość list_len odpowiedzi bez listy (inna operacja albo lista się nie udała).
+#define TREE_PROTO_NO_LIST UINT32_MAX
+
+// result jak w Tree.h; jeśli list_len to nie TREE_PROTO_NO_LIST, za wpisem jest napis listy
+typedef struct TreeReplyEntry {
+  uint64_t tag;
+  int32_t result;
+  uint32_t list_len;
+} TreeReplyEntry;
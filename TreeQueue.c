@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TreeQueue.h"
+#include "Ring.h"
+#include "err.h"
+#include "path_utils.h"
+
+// ile zgloszen robotnik zdejmuje naraz; w obrebie takiej paczki operacje
+// create/remove na dzieciach tego samego folderu sa sklejane w jedno
+// tree_children_apply, czyli jedno zejscie po sciezce i jeden lock pisarza
+#define QUEUE_BATCH 64
+
+struct TreeQueue {
+  Tree *tree;
+  size_t capacity;
+  Ring *submissions;
+  Ring *completions;
+  atomic_size_t in_flight; // zgloszone, a jeszcze nieodebrane
+  // semafory podnosimy tylko, gdy ktos na nich spi, zeby ich licznik
+  // nie rosl bez konca przy stalym obciazeniu
+  sem_t submitted;
+  sem_t completed;
+  atomic_int sleeping_workers;
+  atomic_int waiting_reapers;
+  atomic_bool stop;
+  int nworkers;
+  pthread_t *workers;
+};
+
+static void complete(TreeQueue *queue, void *user_data, int result, char *list) {
+  TreeCompletion completion = { user_data, result, list };
+  // in_flight <= capacity, wiec w kolejce zakonczen zawsze jest miejsce
+  if (!ring_push(queue->completions, &completion)) { fatal("Completion queue overflow"); }
+  // para z bariera w tree_queue_reap (opis w worker)
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&queue->waiting_reapers) && sem_post(&queue->completed)) { syserr("sem_post"); }
+}
+
+static void execute(TreeQueue *queue, const TreeOp *op) {
+  switch (op->type) {
+  case TREE_OP_LIST: {
+    char *list = tree_list(queue->tree, op->path);
+    complete(queue, op->user_data, list ? 0 : (is_path_valid(op->path) ? ENOENT : EINVAL), list);
+    break;
+  }
+  case TREE_OP_CREATE:
+    complete(queue, op->user_data, tree_create(queue->tree, op->path), NULL);
+    break;
+  case TREE_OP_REMOVE:
+    complete(queue, op->user_data, tree_remove(queue->tree, op->path), NULL);
+    break;
+  case TREE_OP_MOVE:
+    complete(queue, op->user_data, tree_move(queue->tree, op->path, op->target), NULL);
+    break;
+  default:
+    complete(queue, op->user_data, EINVAL, NULL);
+  }
+}
+
+// wykonuje paczke: najpierw grupy create/remove o wspolnym ojcu, potem reszte
+static void execute_batch(TreeQueue *queue, TreeOp *ops, size_t n) {
+  char *parents[QUEUE_BATCH];
+  char names[QUEUE_BATCH][MAX_FOLDER_NAME_LENGTH + 1];
+  bool done[QUEUE_BATCH];
+  for (size_t i = 0; i < n; ++i) {
+    parents[i] = NULL;
+    done[i] = false;
+    bool child_op = ops[i].type == TREE_OP_CREATE || ops[i].type == TREE_OP_REMOVE;
+    if (child_op && is_path_valid(ops[i].path) && strcmp(ops[i].path, "/")) {
+      parents[i] = make_path_to_parent(ops[i].path, names[i]);
+    }
+  }
+
+  TreeChildOp group[QUEUE_BATCH];
+  int results[QUEUE_BATCH];
+  size_t members[QUEUE_BATCH];
+  for (size_t i = 0; i < n; ++i) {
+    if (!parents[i] || done[i]) { continue; }
+    size_t size = 0;
+    for (size_t j = i; j < n; ++j) {
+      if (parents[j] && !done[j] && !strcmp(parents[i], parents[j])) {
+        group[size] = (TreeChildOp){ names[j], ops[j].type == TREE_OP_REMOVE };
+        members[size++] = j;
+        done[j] = true;
+      }
+    }
+    tree_children_apply(queue->tree, parents[i], group, results, size);
+    for (size_t k = 0; k < size; ++k) {
+      complete(queue, ops[members[k]].user_data, results[k], NULL);
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (!done[i]) { execute(queue, &ops[i]); }
+    free(parents[i]);
+  }
+}
+
+static void *worker(void *data) {
+  TreeQueue *queue = (TreeQueue *)data;
+  TreeOp ops[QUEUE_BATCH];
+  for (;;) {
+    size_t n = 0;
+    while (n < QUEUE_BATCH && ring_pop(queue->submissions, &ops[n])) { n++; }
+    if (n) {
+      execute_batch(queue, ops, n);
+      continue;
+    }
+    if (atomic_load(&queue->stop)) { break; }
+
+    // najpierw oglaszamy, ze idziemy spac, a dopiero potem sprawdzamy kolejke
+    // jeszcze raz - zglaszajacy wrzuca zgloszenie, zanim sprawdzi spiacych,
+    // wiec ktores z nas zauwazy drugie; nadmiarowe jednostki semafora
+    // najwyzej obroca petle na pustej kolejce. Zapis w ring i odczyt licznika
+    // (i odwrotnie) to zapis, a potem odczyt innej zmiennej: bez barier seq_cst
+    // po obu stronach oba odczyty moglyby zobaczyc stare wartosci
+    atomic_fetch_add(&queue->sleeping_workers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring_pop(queue->submissions, &ops[0])) {
+      atomic_fetch_sub(&queue->sleeping_workers, 1);
+      execute_batch(queue, ops, 1);
+      continue;
+    }
+    if (!atomic_load(&queue->stop)) {
+      while (sem_wait(&queue->submitted)) {
+        if (errno != EINTR) { syserr("sem_wait"); }
+      }
+    }
+    atomic_fetch_sub(&queue->sleeping_workers, 1);
+  }
+  return NULL;
+}
+
+TreeQueue *tree_queue_new(Tree *tree, size_t capacity, int nworkers) {
+  if (!tree || !capacity || nworkers < 1) { return NULL; }
+  TreeQueue *queue = (TreeQueue *)malloc(sizeof(TreeQueue));
+  if (!queue) { bad_malloc(); }
+  queue->tree = tree;
+  queue->capacity = capacity;
+  queue->submissions = ring_new(capacity, sizeof(TreeOp));
+  queue->completions = ring_new(capacity, sizeof(TreeCompletion));
+  atomic_init(&queue->in_flight, 0);
+  atomic_init(&queue->stop, false);
+  atomic_init(&queue->sleeping_workers, 0);
+  atomic_init(&queue->waiting_reapers, 0);
+  if (sem_init(&queue->submitted, 0, 0) || sem_init(&queue->completed, 0, 0)) { syserr("sem_init"); }
+  queue->nworkers = nworkers;
+  queue->workers = (pthread_t *)malloc(nworkers * sizeof(pthread_t));
+  if (!queue->workers) { bad_malloc(); }
+  for (int i = 0; i < nworkers; ++i) {
+    if (pthread_create(&queue->workers[i], NULL, worker, queue)) { syserr("Unable to create thread"); }
+  }
+  return queue;
+}
+
+void tree_queue_free(TreeQueue *queue) {
+  atomic_store(&queue->stop, true);
+  for (int i = 0; i < queue->nworkers; ++i) {
+    if (sem_post(&queue->submitted)) { syserr("sem_post"); }
+  }
+  for (int i = 0; i < queue->nworkers; ++i) {
+    if (pthread_join(queue->workers[i], NULL)) { syserr("Unable to join thread"); }
+  }
+
+  TreeCompletion completion;
+  while (ring_pop(queue->completions, &completion)) { free(completion.list); }
+
+  sem_destroy(&queue->submitted);
+  sem_destroy(&queue->completed);
+  ring_free(queue->submissions);
+  ring_free(queue->completions);
+  free(queue->workers);
+  free(queue);
+}
+
+bool tree_queue_submit(TreeQueue *queue, const TreeOp *op) {
+  size_t in_flight = atomic_load_explicit(&queue->in_flight, memory_order_relaxed);
+  do {
+    if (in_flight >= queue->capacity) { return false; }
+  } while (!atomic_compare_exchange_weak_explicit(&queue->in_flight, &in_flight, in_flight + 1,
+                                                  memory_order_relaxed, memory_order_relaxed));
+  // miejsce zarezerwowane przez in_flight, wiec kolejka zgloszen nie jest pelna
+  if (!ring_push(queue->submissions, op)) { fatal("Submission queue overflow"); }
+  // para z bariera w worker
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&queue->sleeping_workers) && sem_post(&queue->submitted)) { syserr("sem_post"); }
+  return true;
+}
+
+// odejmuje n odebranych wynikow od in_flight. Gdy nic juz nie jest w toku, budzi
+// wszystkich czekajacych odbiorcow: na wyniki, ktore zabral inny odbiorca, czekaliby
+// bez konca, a tak zobacza in_flight == 0 i wroca bez wynikow. Para z bariera
+// w tree_queue_reap, jak w complete.
+static void reaped(TreeQueue *queue, size_t n) {
+  if (atomic_fetch_sub(&queue->in_flight, n) != n) { return; }
+  atomic_thread_fence(memory_order_seq_cst);
+  for (int i = atomic_load(&queue->waiting_reapers); i > 0; --i) {
+    if (sem_post(&queue->completed)) { syserr("sem_post"); }
+  }
+}
+
+size_t tree_queue_reap(TreeQueue *queue, TreeCompletion *out, size_t max, bool wait) {
+  size_t n = 0;
+  for (;;) {
+    size_t popped = 0;
+    while (n + popped < max && ring_pop(queue->completions, &out[n + popped])) { popped++; }
+    if (popped) { reaped(queue, popped); }
+    n += popped;
+    if (n || !wait || !max || !atomic_load(&queue->in_flight)) { break; }
+
+    atomic_fetch_add(&queue->waiting_reapers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    bool got = ring_pop(queue->completions, &out[n]);
+    if (!got && atomic_load(&queue->in_flight)) {
+      while (sem_wait(&queue->completed)) {
+        if (errno != EINTR) { syserr("sem_wait"); }
+      }
+    }
+    atomic_fetch_sub(&queue->waiting_reapers, 1);
+    if (got) { reaped(queue, 1); n++; }
+  }
+  return n;
+}
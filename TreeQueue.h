@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Tree.h"
+
+// Asynchroniczny interfejs do drzewa w stylu io_uring: operacje trafiają do
+// kolejki zgłoszeń, wykonuje je pula wątków, a wyniki odbiera się z kolejki
+// zakończeń. Obie kolejki są lock-free. Operacje będące w toku nie są
+// uporządkowane względem siebie - jeśli kolejność ma znaczenie, trzeba
+// odebrać wynik jednej przed zgłoszeniem drugiej.
+typedef struct TreeQueue TreeQueue;
+
+typedef enum TreeOpType {
+  TREE_OP_LIST,
+  TREE_OP_CREATE,
+  TREE_OP_REMOVE,
+  TREE_OP_MOVE
+} TreeOpType;
+
+// Zgłoszenie operacji. Napisy path i target muszą pozostać ważne do odebrania wyniku.
+typedef struct TreeOp {
+  TreeOpType type;
+  const char *path;
+  const char *target; // tylko dla TREE_OP_MOVE
+  void *user_data;
+} TreeOp;
+
+// Wynik operacji: result jak w tree_create/tree_remove/tree_move, a dla
+// TREE_OP_LIST list to wynik tree_list (do zwolnienia przez odbiorcę).
+typedef struct TreeCompletion {
+  void *user_data;
+  int result;
+  char *list;
+} TreeCompletion;
+
+// Tworzy kolejki na co najwyżej capacity operacji w toku i nworkers wątków wykonujących.
+TreeQueue* tree_queue_new(Tree* tree, size_t capacity, int nworkers);
+
+// Czeka na wykonanie zgłoszonych operacji i zwalnia kolejki; nieodebrane wyniki przepadają.
+void tree_queue_free(TreeQueue* queue);
+
+// Zgłasza operację. Zwraca false, jeśli w toku jest już capacity operacji
+// (licząc te z nieodebranymi wynikami) - trzeba wtedy odebrać wyniki.
+bool tree_queue_submit(TreeQueue* queue, const TreeOp* op);
+
+// Odbiera do max wyników do out i zwraca ich liczbę. Jeśli wait, czeka na co najmniej jeden,
+// o ile jakakolwiek operacja jest w toku. Odbierać może naraz wiele wątków; czekający wraca
+// z 0, gdy wszystkie wyniki odebrali inni.
+size_t tree_queue_reap(TreeQueue* queue, TreeCompletion* out, size_t max, bool wait);
@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "TreeReplica.h"
+#include "err.h"
+
+// ile rekordow watek repliki pobiera i stosuje naraz
+#define REPLICA_BATCH 256
+// co tyle watek repliki czekajacy na rekordy sprawdza, czy ma sie zakonczyc
+#define REPLICA_POLL_NS 20000000
+
+struct TreeReplica {
+  Tree *primary;
+  Tree *tree;
+  TreeLogStream *stream;
+  pthread_t thread;
+  atomic_bool stop;
+  atomic_uint_fast64_t seq;
+  // do czekania na seq i statystyk
+  pthread_mutex_t lock;
+  pthread_cond_t applied;
+  uint64_t batches;
+  uint64_t errors;
+  double lag;
+  double total_lag;
+  double max_lag;
+};
+
+static double seconds_between(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static int apply(Tree *tree, const TreeLogRecord *record) {
+  switch (record->type) {
+  case TREE_LOG_CREATE:
+    return tree_create(tree, record->path);
+  case TREE_LOG_REMOVE:
+    return tree_remove(tree, record->path);
+  case TREE_LOG_MOVE:
+    return tree_move(tree, record->path, record->target);
+  case TREE_LOG_WRITE:
+    return tree_write(tree, record->path, record->offset, record->data, record->len);
+  case TREE_LOG_FREEZE:
+    return tree_freeze(tree, record->path, record->compact);
+  }
+  return EINVAL;
+}
+
+static TreeTxnOpType txn_op_type(TreeLogOpType type) {
+  return type == TREE_LOG_CREATE ? TREE_TXN_CREATE : type == TREE_LOG_REMOVE ? TREE_TXN_REMOVE : TREE_TXN_MOVE;
+}
+
+static void *applier(void *data) {
+  TreeReplica *replica = (TreeReplica *)data;
+  const TreeLogRecord *records[REPLICA_BATCH];
+  // transakcja moze sie zaczac w jednej paczce, a skonczyc w nastepnej
+  TreeTxn *txn = NULL;
+  while (!atomic_load(&replica->stop)) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += REPLICA_POLL_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    size_t n = tree_log_read(replica->stream, records, REPLICA_BATCH, &deadline);
+    if (!n) { continue; }
+
+    struct timespec oldest = records[0]->time;
+    uint64_t seq = 0;
+    uint64_t errors = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const TreeLogRecord *record = records[i];
+      if (record->txn_left || txn) {
+        if (!txn) { txn = tree_txn_begin(replica->tree); }
+        tree_txn_add(txn, txn_op_type(record->type), record->path, record->target);
+        if (record->txn_left) { continue; }
+        if (tree_txn_commit(txn, NULL)) { errors++; }
+        txn = NULL;
+      } else if (apply(replica->tree, record)) {
+        errors++;
+      }
+      seq = record->seq;
+    }
+    tree_log_release(records, n);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double lag = seconds_between(&oldest, &now);
+    pthread_mutex_lock(&replica->lock);
+    if (seq) { atomic_store(&replica->seq, seq); }
+    replica->batches++;
+    replica->errors += errors;
+    replica->lag = lag;
+    replica->total_lag += lag;
+    if (lag > replica->max_lag) { replica->max_lag = lag; }
+    pthread_cond_broadcast(&replica->applied);
+    pthread_mutex_unlock(&replica->lock);
+  }
+  if (txn) { tree_txn_abort(txn); }
+  return NULL;
+}
+
+TreeReplica *tree_replica_new(Tree *primary) {
+  TreeReplica *replica = (TreeReplica *)calloc(1, sizeof(TreeReplica));
+  if (!replica) { bad_malloc(); }
+  replica->primary = primary;
+  uint64_t seq;
+  replica->stream = tree_log_open(primary, &replica->tree, &seq);
+  atomic_init(&replica->stop, false);
+  atomic_init(&replica->seq, seq);
+  if (pthread_mutex_init(&replica->lock, NULL)) { syserr("Unable to create mutex"); }
+  pthread_condattr_t attr;
+  ensure(!pthread_condattr_init(&attr));
+  ensure(!pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+  if (pthread_cond_init(&replica->applied, &attr)) { syserr("Unable to create condition variable"); }
+  ensure(!pthread_condattr_destroy(&attr));
+  if (pthread_create(&replica->thread, NULL, applier, replica)) { syserr("Unable to create thread"); }
+  return replica;
+}
+
+void tree_replica_free(TreeReplica *replica) {
+  atomic_store(&replica->stop, true);
+  if (pthread_join(replica->thread, NULL)) { syserr("Unable to join thread"); }
+  tree_log_close(replica->stream);
+  tree_free(replica->tree);
+  ensure(!pthread_cond_destroy(&replica->applied));
+  ensure(!pthread_mutex_destroy(&replica->lock));
+  free(replica);
+}
+
+Tree *tree_replica_tree(TreeReplica *replica) {
+  return replica->tree;
+}
+
+uint64_t tree_replica_seq(TreeReplica *replica) {
+  return atomic_load(&replica->seq);
+}
+
+int tree_replica_wait(TreeReplica *replica, uint64_t seq, const struct timespec *deadline) {
+  if (atomic_load(&replica->seq) >= seq) { return 0; }
+  int err = 0;
+  pthread_mutex_lock(&replica->lock);
+  while (atomic_load(&replica->seq) < seq && err != ETIMEDOUT) {
+    err = deadline ? pthread_cond_timedwait(&replica->applied, &replica->lock, deadline)
+                   : pthread_cond_wait(&replica->applied, &replica->lock);
+  }
+  // rekord mogl zostac zastosowany tuz przed uplywem terminu
+  err = atomic_load(&replica->seq) >= seq ? 0 : ETIMEDOUT;
+  pthread_mutex_unlock(&replica->lock);
+  return err;
+}
+
+void tree_replica_stats(TreeReplica *replica, TreeReplicaStats *stats) {
+  pthread_mutex_lock(&replica->lock);
+  stats->seq = atomic_load(&replica->seq);
+  uint64_t last = tree_log_seq(replica->primary);
+  stats->behind = last > stats->seq ? last - stats->seq : 0;
+  stats->batches = replica->batches;
+  stats->errors = replica->errors;
+  stats->lag = replica->lag;
+  stats->mean_lag = replica->batches ? replica->total_lag / replica->batches : 0;
+  stats->max_lag = replica->max_lag;
+  pthread_mutex_unlock(&replica->lock);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "Tree.h"
+
+// Replika drzewa do odczytów: osobne drzewo, zaczynające jako kopia głównego, na którym
+// wątek repliki powtarza w paczkach rekordy ze strumienia zmian głównego drzewa
+// (tree_log_open). Odczyty z repliki nie dotykają locków głównego drzewa. Replika widzi
+// zmiany głównego drzewa w tej samej kolejności, a transakcje - w całości.
+typedef struct TreeReplica TreeReplica;
+
+typedef struct TreeReplicaStats {
+  uint64_t seq;     // numer ostatniego zastosowanego rekordu
+  uint64_t behind;  // ile rekordów głównego drzewa replika jeszcze nie zastosowała
+  uint64_t batches; // liczba zastosowanych paczek
+  uint64_t errors;  // rekordy, których nie udało się powtórzyć (ktoś zmieniał replikę)
+  // opóźnienie paczki: od wykonania jej najstarszej zmiany na głównym drzewie
+  // do zastosowania całej paczki na replice, w sekundach
+  double lag;       // ostatniej paczki
+  double mean_lag;
+  double max_lag;
+} TreeReplicaStats;
+
+// Tworzy replikę drzewa primary i uruchamia jej wątek. Replikę trzeba zwolnić przed
+// tree_free(primary).
+TreeReplica* tree_replica_new(Tree* primary);
+
+// Zatrzymuje wątek repliki i zwalnia ją razem z jej drzewem.
+void tree_replica_free(TreeReplica* replica);
+
+// Drzewo repliki, do odczytów. Zmieniać je może tylko wątek repliki.
+Tree* tree_replica_tree(TreeReplica* replica);
+
+// Numer ostatniego rekordu zastosowanego na replice.
+uint64_t tree_replica_seq(TreeReplica* replica);
+
+// Czeka, aż replika zastosuje rekord seq, najdłużej do deadline (jak w wersjach _timed;
+// NULL - bez limitu). Zwraca 0 albo ETIMEDOUT. Żeby odczytać z repliki własne zmiany,
+// wystarczy po nich poczekać na seq = tree_log_seq(primary).
+int tree_replica_wait(TreeReplica* replica, uint64_t seq, const struct timespec* deadline);
+
+void tree_replica_stats(TreeReplica* replica, TreeReplicaStats* stats);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Format pliku śladu wywołań drzewa (tree_trace_start w Tree.h), czytanego przez
+// replay.c. Ślad czyta się na tej samej maszynie, więc liczby idą w porządku bajtów hosta.
+//
+// Plik to nagłówek TreeTraceHeader, a za nim ciąg wpisów: TreeTraceEntry, opcjonalne
+// pola uint64_t (timeout, jeśli TREE_TRACE_TIMED; dwa argumenty, jeśli TREE_TRACE_ARGS),
+// potem path_len bajtów path i target_len bajtów target, bez '\0'. Najpierw idą wpisy
+// TREE_TRACE_SETUP, które odtwarzają stan drzewa z chwili rozpoczęcia śladu, potem
+// wywołania. Wpisy różnych wątków są przeplecione kawałkami, a wpisy jednego wątku
+// leżą w kolejności wywołań.
+
+#define TREE_TRACE_MAGIC 0x3145434152544552ull // "RETRACE1"
+
+typedef struct TreeTraceHeader {
+  uint64_t magic;
+  uint64_t start; // początek śladu, ns od epoki (CLOCK_REALTIME)
+} TreeTraceHeader;
+
+typedef enum TreeTraceOp {
+  TREE_TRACE_LIST,   // tree_list, tree_list_prefix (target to prefiks) i tree_dir_list
+  TREE_TRACE_CREATE,
+  TREE_TRACE_REMOVE,
+  TREE_TRACE_MOVE,   // path na target
+  TREE_TRACE_STAT,   // tree_stat i tree_exists
+  TREE_TRACE_READ,   // argumenty: offset, len
+  TREE_TRACE_WRITE,  // argumenty: offset, len; dane nie są zapisywane
+  TREE_TRACE_COPY,   // path na target
+  TREE_TRACE_FREEZE, // argument: compact
+  // tree_children_apply: wpis na operację, path to rodzic, target to nazwa; argumenty:
+  // remove i liczba dalszych operacji wywołania
+  TREE_TRACE_CHILDREN,
+  // tree_txn_commit: wpis na operację, wynik całej transakcji; argumenty: TreeTxnOpType
+  // i liczba dalszych operacji transakcji
+  TREE_TRACE_TXN,
+} TreeTraceOp;
+
+// flagi wpisu
+#define TREE_TRACE_SETUP 1 // stan początkowy drzewa, nie wywołanie (time == 0)
+#define TREE_TRACE_TIMED 2 // wersja _timed; za wpisem timeout w ns od wywołania do deadline
+#define TREE_TRACE_TRY 4   // wersja _try
+#define TREE_TRACE_ARGS 8  // za wpisem (i timeoutem) dwa argumenty operacji
+
+typedef struct TreeTraceEntry {
+  uint64_t time;     // ns od początku śladu do wywołania
+  uint32_t duration; // ns od wywołania do powrotu, najwyżej UINT32_MAX
+  uint32_t thread;   // numer wątku wywołującego, nadawany w procesie kolejno od 1
+  uint8_t op;        // TreeTraceOp
+  uint8_t flags;
+  int16_t result;    // wynik jak w Tree.h
+  uint16_t path_len;
+  uint16_t target_len;
+} TreeTraceEntry;
@@ -0,0 +1,310 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Trie.h"
+#include "err.h"
+
+typedef struct TrieNode TrieNode;
+
+struct TrieNode {
+    void* value; // NULL if no key ends at this node.
+    TrieNode** children; // Sorted by the first letter of their labels.
+    uint32_t bitmap; // Bit c is set iff there is a child whose label starts with 'a' + c.
+    uint8_t label_len;
+    char label[]; // Letters on the edge from the parent (not null-terminated).
+};
+
+struct Trie {
+    TrieNode* root; // Has an empty label and never holds a value.
+    size_t size;
+};
+
+static int letter(char c)
+{
+    return c >= 'a' && c <= 'z' ? c - 'a' : -1;
+}
+
+static int n_children(const TrieNode* node)
+{
+    return __builtin_popcount(node->bitmap);
+}
+
+// Position in `children` of the child starting with letter `c`.
+static int child_slot(const TrieNode* node, int c)
+{
+    return __builtin_popcount(node->bitmap & ((1u << c) - 1));
+}
+
+static TrieNode* get_child(const TrieNode* node, int c)
+{
+    if (!(node->bitmap & (1u << c)))
+        return NULL;
+    return node->children[child_slot(node, c)];
+}
+
+static TrieNode* node_new(const char* label, size_t label_len)
+{
+    TrieNode* node = malloc(offsetof(TrieNode, label) + label_len);
+    if (!node) { bad_malloc(); }
+    memset(node, 0, offsetof(TrieNode, label));
+    node->label_len = label_len;
+    memcpy(node->label, label, label_len);
+    return node;
+}
+
+static void add_child(TrieNode* node, TrieNode* child)
+{
+    int c = letter(child->label[0]);
+    int n = n_children(node);
+    int slot = child_slot(node, c);
+    TrieNode** children = realloc(node->children, (n + 1) * sizeof(TrieNode*));
+    if (!children) { bad_malloc(); }
+    memmove(children + slot + 1, children + slot, (n - slot) * sizeof(TrieNode*));
+    children[slot] = child;
+    node->children = children;
+    node->bitmap |= 1u << c;
+}
+
+static void remove_child(TrieNode* node, int c)
+{
+    int n = n_children(node);
+    int slot = child_slot(node, c);
+    memmove(node->children + slot, node->children + slot + 1, (n - slot - 1) * sizeof(TrieNode*));
+    node->bitmap &= ~(1u << c);
+    if (n == 1) {
+        free(node->children);
+        node->children = NULL;
+    }
+}
+
+Trie* trie_new()
+{
+    // The root is allocated together with the trie - most directories are empty.
+    Trie* trie = malloc(sizeof(Trie) + sizeof(TrieNode));
+    if (!trie) { bad_malloc(); }
+    trie->root = (TrieNode*)(trie + 1);
+    memset(trie->root, 0, sizeof(TrieNode));
+    trie->size = 0;
+    return trie;
+}
+
+static void free_children(TrieNode* node)
+{
+    for (int i = 0; i < n_children(node); ++i) {
+        free_children(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+}
+
+void trie_free(Trie* trie)
+{
+    free_children(trie->root);
+    free(trie);
+}
+
+size_t trie_size(Trie* trie)
+{
+    return trie->size;
+}
+
+// Find the node at which the descent along `key` ends: either `key` ends
+// exactly at a node boundary (`*matched` is then 0), or it ends inside the
+// label of a node (`*matched` is the number of label letters matched).
+// Returns NULL if the key diverges from the trie.
+static TrieNode* descend(TrieNode* node, const char* key, size_t* matched)
+{
+    *matched = 0;
+    while (*key) {
+        int c = letter(*key);
+        TrieNode* child = c < 0 ? NULL : get_child(node, c);
+        if (!child)
+            return NULL;
+        size_t i = 1;
+        while (i < child->label_len && key[i] == child->label[i])
+            ++i;
+        if (i < child->label_len) {
+            if (key[i])
+                return NULL;
+            *matched = i;
+            return child;
+        }
+        node = child;
+        key += i;
+    }
+    return node;
+}
+
+void* trie_get(Trie* trie, const char* key)
+{
+    size_t matched;
+    TrieNode* node = descend(trie->root, key, &matched);
+    return node && !matched ? node->value : NULL;
+}
+
+bool trie_insert(Trie* trie, const char* key, void* value)
+{
+    size_t len = strlen(key);
+    if (len == 0 || len > TRIE_MAX_KEY_LENGTH)
+        return false;
+    TrieNode* node = trie->root;
+    while (*key) {
+        int c = letter(*key);
+        if (c < 0)
+            return false;
+        TrieNode* child = get_child(node, c);
+        if (!child) {
+            size_t rest = strlen(key);
+            for (size_t i = 1; i < rest; ++i) {
+                if (letter(key[i]) < 0)
+                    return false;
+            }
+            child = node_new(key, rest);
+            add_child(node, child);
+            node = child;
+            break;
+        }
+        size_t i = 1;
+        while (i < child->label_len && key[i] == child->label[i])
+            ++i;
+        if (i < child->label_len) {
+            // Split the edge: `middle` takes the common part of the label.
+            TrieNode* middle = node_new(child->label, i);
+            node->children[child_slot(node, c)] = middle;
+            child->label_len -= i;
+            memmove(child->label, child->label + i, child->label_len);
+            add_child(middle, child);
+            child = middle;
+        }
+        node = child;
+        key += i;
+    }
+    if (node->value)
+        return false;
+    node->value = value;
+    trie->size++;
+    return true;
+}
+
+// Replace the child of `parent` starting with letter `c`, which holds no value
+// and has a single child, with that grandchild extended by the child's label,
+// so that every inner node branches.
+static void merge_with_child(TrieNode* parent, int c)
+{
+    TrieNode** slot = &parent->children[child_slot(parent, c)];
+    TrieNode* node = *slot;
+    TrieNode* child = node->children[0];
+    char label[TRIE_MAX_KEY_LENGTH];
+    memcpy(label, node->label, node->label_len);
+    memcpy(label + node->label_len, child->label, child->label_len);
+    TrieNode* merged = node_new(label, node->label_len + child->label_len);
+    merged->value = child->value;
+    merged->children = child->children;
+    merged->bitmap = child->bitmap;
+    *slot = merged;
+    free(child);
+    free(node->children);
+    free(node);
+}
+
+bool trie_remove(Trie* trie, const char* key)
+{
+    // Descend remembering the last two edges, which are the only ones
+    // that may need restructuring.
+    TrieNode* grandparent = NULL;
+    TrieNode* parent = NULL;
+    TrieNode* node = trie->root;
+    while (*key) {
+        int c = letter(*key);
+        TrieNode* child = c < 0 ? NULL : get_child(node, c);
+        if (!child || strncmp(key, child->label, child->label_len))
+            return false;
+        grandparent = parent;
+        parent = node;
+        node = child;
+        key += child->label_len;
+    }
+    if (!node->value)
+        return false;
+    node->value = NULL;
+    trie->size--;
+
+    if (!parent)
+        return true;
+    if (n_children(node) == 0) {
+        remove_child(parent, letter(node->label[0]));
+        free(node);
+        if (grandparent && !parent->value && n_children(parent) == 1)
+            merge_with_child(grandparent, letter(parent->label[0]));
+    } else if (n_children(node) == 1) {
+        merge_with_child(parent, letter(node->label[0]));
+    }
+    return true;
+}
+
+TrieIterator trie_iterator(Trie* trie)
+{
+    return trie_prefix_iterator(trie, "");
+}
+
+TrieIterator trie_prefix_iterator(Trie* trie, const char* prefix)
+{
+    TrieIterator it;
+    it.depth = 0;
+    it.started = false;
+    size_t matched;
+    TrieNode* root = descend(trie->root, prefix, &matched);
+    if (!root)
+        return it;
+    // The key leading to `root`, excluding its own label, is a prefix of `prefix`.
+    it.key_len = strlen(prefix) - (matched ? matched : root->label_len);
+    memcpy(it.key, prefix, it.key_len);
+    it.stack[it.depth++] = root;
+    return it;
+}
+
+// Advance to the next node of the subtree in pre-order, keeping the path
+// to it on the stack. Returns false at the end.
+static bool next_node(TrieIterator* it)
+{
+    TrieNode* node = it->stack[it->depth - 1];
+    if (!it->started) {
+        it->started = true;
+    } else if (node->bitmap) {
+        node = node->children[0];
+        it->stack[it->depth++] = node;
+    } else {
+        for (;;) {
+            TrieNode* done = it->stack[--it->depth];
+            it->key_len -= done->label_len;
+            if (!it->depth)
+                return false;
+            TrieNode* parent = it->stack[it->depth - 1];
+            uint32_t later = parent->bitmap & ~((2u << letter(done->label[0])) - 1);
+            if (later) {
+                node = parent->children[child_slot(parent, __builtin_ctz(later))];
+                it->stack[it->depth++] = node;
+                break;
+            }
+        }
+    }
+    memcpy(it->key + it->key_len, node->label, node->label_len);
+    it->key_len += node->label_len;
+    return true;
+}
+
+bool trie_next(TrieIterator* it, const char** key, void** value)
+{
+    while (it->depth && next_node(it)) {
+        TrieNode* node = it->stack[it->depth - 1];
+        if (node->value) {
+            it->key[it->key_len] = '\0';
+            *key = it->key;
+            *value = node->value;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// A compressed radix tree mapping keys to values.
+// Keys are non-empty C-strings over the alphabet 'a'-'z', of length at most
+// TRIE_MAX_KEY_LENGTH, so every node has at most 26 children. Children are
+// kept in a sparse array indexed by a 26-bit bitmap, which keeps them sorted:
+// iteration yields keys in lexicographic order, and all keys with a given
+// prefix form one subtree. Shared prefixes are stored once.
+// Values are non-null pointers.
+typedef struct Trie Trie;
+
+#define TRIE_MAX_KEY_LENGTH 255
+
+// Create a new, empty trie.
+Trie* trie_new();
+
+// Free the trie and its nodes, but not the values.
+void trie_free(Trie* trie);
+
+// Get the value stored under `key`, or NULL if not present.
+void* trie_get(Trie* trie, const char* key);
+
+// Insert a `value` under `key` and return true, or do nothing and return
+// false if `key` already exists or is not a valid key. `value` must not be NULL.
+bool trie_insert(Trie* trie, const char* key, void* value);
+
+// Remove the value under `key` and return true (the value is not free'd),
+// or do nothing and return false if `key` was not present.
+bool trie_remove(Trie* trie, const char* key);
+
+// Return the number of keys in the trie.
+size_t trie_size(Trie* trie);
+
+typedef struct TrieIterator TrieIterator;
+
+// Return an iterator over all elements, in lexicographic order of keys.
+TrieIterator trie_iterator(Trie* trie);
+
+// Return an iterator over the elements whose keys start with `prefix`,
+// in lexicographic order. Only the matching subtree is visited.
+TrieIterator trie_prefix_iterator(Trie* trie, const char* prefix);
+
+// Set `*key` and `*value` to the current element and advance the iterator.
+// If there are no more elements, leaves `*key` and `*value` unchanged and
+// returns false.
+// `*key` points into the iterator and is valid until the next call.
+// The trie cannot be modified while it is being iterated.
+bool trie_next(TrieIterator* it, const char** key, void** value);
+
+struct TrieIterator {
+    void* stack[TRIE_MAX_KEY_LENGTH + 1]; // Path from the subtree root to the current node.
+    int depth; // 0 when finished.
+    bool started;
+    size_t key_len;
+    char key[TRIE_MAX_KEY_LENGTH + 1];
+};
@@ -0,0 +1,2646 @@
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "HashMap.h"
+#include "Intern.h"
+#include "Namespace.h"
+#include "ShmTree.h"
+#include "Tree.h"
+#include "TreeClient.h"
+#include "TreeProto.h"
+#include "TreeQueue.h"
+#include "TreeReplica.h"
+#include "TreeTrace.h"
+#include "err.h"
+#include "path_utils.h"
+
+// Mixed workload on a small, hot tree: every thread performs random
+// list/create/remove/move operations on paths of depth 1-4 over a 4-letter
+// alphabet, so that threads constantly contend on the same directories.
+// Usage: bench [threads] [operations per thread]
+//
+// Child index comparison: fills one directory with names sharing long
+// prefixes and measures create, lookup, list, prefix list and find for the
+// hash and trie indexes, along with the memory they use.
+// Usage: bench index [names]
+//
+// Name interning: builds a tree of project-like directories, where a few
+// dozen names (src, build, cache, ...) make up most of the nodes, with and
+// without interned names, and measures memory, lookups and find.
+// Usage: bench names [nodes]
+//
+// Hot directory: every thread creates its own jobs in one shared directory,
+// which quickly grows large enough to get a striped index, then removes them;
+// one more thread keeps listing it. Measures creates, removes and list latency.
+// Usage: bench hot [threads] [jobs per thread]
+//
+// Subtree copy: builds a project-like template directory and copies it once
+// with tree_copy and once with a tree_create per node, as a client would.
+// Usage: bench copy [nodes]
+//
+// Deep project root: creates and removes directories right below a folder at
+// the given depth, once with absolute paths and once through a handle from
+// tree_open with relative paths.
+// Usage: bench deep [depth] [operations]
+//
+// Frozen release: builds a deep release directory with many entries, then
+// looks entries up and lists the release before and after tree_freeze with
+// compaction, which lets the reads skip all locks inside the release.
+// Usage: bench frozen [depth] [operations]
+//
+// Read replica: runs the mixed workload once on a plain tree and once on a
+// tree with a replica attached, while one more thread creates a directory on
+// the primary, waits until the replica has applied it and checks it there
+// (read-your-writes). Reports the throughput cost, the replica lag and the
+// wait, then checks that the replica ended up equal to the primary.
+// Usage: bench replica [threads] [operations per thread]
+//
+// Bulk load: sorts the paths of a project-like tree and loads them into an
+// empty tree once with a tree_create per path and once with tree_bulk_load,
+// on one thread and on the given number of threads.
+// Usage: bench bulk [threads] [nodes]
+//
+// Checks: short runs of the documented behavior of each feature, including
+// its error paths, that stop with an error at the first violation. ctest runs
+// each of them as a separate test.
+// Usage: bench check [name]
+
+#define MAX_DEPTH 4
+#define ALPHABET 4
+
+typedef struct Worker {
+    Tree* tree;
+    long n_ops;
+    unsigned int seed;
+    long n_succeeded;
+} Worker;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void random_path(unsigned int* seed, char* path, int max_depth)
+{
+    int depth = 1 + rand_r(seed) % max_depth;
+    char* p = path;
+    *p++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *p++ = 'a' + rand_r(seed) % ALPHABET;
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+static void* run_worker(void* data)
+{
+    Worker* worker = data;
+    char source[2 * MAX_DEPTH + 2];
+    char target[2 * MAX_DEPTH + 2];
+    for (long i = 0; i < worker->n_ops; ++i) {
+        random_path(&worker->seed, source, MAX_DEPTH);
+        int op = rand_r(&worker->seed) % 10;
+        int result;
+        if (op < 4) {
+            char* list = tree_list(worker->tree, source);
+            result = list ? 0 : ENOENT;
+            free(list);
+        } else if (op < 7) {
+            result = tree_create(worker->tree, source);
+        } else if (op < 9) {
+            result = tree_remove(worker->tree, source);
+        } else {
+            // Never move deeper than the source, so the tree stays shallow.
+            random_path(&worker->seed, target, (strlen(source) - 1) / 2);
+            result = tree_move(worker->tree, source, target);
+        }
+        if (!result)
+            worker->n_succeeded++;
+    }
+    return NULL;
+}
+
+// Name number i: one of a few common prefixes followed by a fixed-width
+// base-26 counter, like numbered photos or log files.
+static void index_name(long i, char* name)
+{
+    static const char* prefixes[] = { "report", "reportdraft", "photo", "photoholiday" };
+    char* p = name + sprintf(name, "/%s", prefixes[i % 4]);
+    long x = i / 4;
+    for (int digit = 4; digit >= 0; --digit) {
+        p[digit] = 'a' + x % 26;
+        x /= 26;
+    }
+    strcpy(p + 5, "/");
+}
+
+static void count_found(const char* path, void* arg)
+{
+    (void)path;
+    ++*(long*)arg;
+}
+
+static void bench_index(NameIndexKind kind, const char* label, long n_names)
+{
+    char path[64];
+    struct mallinfo2 before = mallinfo2();
+    Tree* tree = tree_new_with_index(kind);
+
+    double start = now();
+    for (long i = 0; i < n_names; ++i) {
+        index_name(i, path);
+        if (tree_create(tree, path))
+            fatal("Unable to create %s", path);
+    }
+    double create = now() - start;
+    size_t memory = mallinfo2().uordblks - before.uordblks;
+
+    start = now();
+    for (long i = 0; i < n_names; ++i) {
+        index_name(i, path);
+        TreeStat stat;
+        if (tree_stat(tree, path, &stat))
+            fatal("Unable to find %s", path);
+    }
+    double lookup = now() - start;
+
+    start = now();
+    free(tree_list(tree, "/"));
+    double list = now() - start;
+
+    start = now();
+    free(tree_list_prefix(tree, "/", "photoholiday"));
+    double list_prefix = now() - start;
+
+    long found = 0;
+    start = now();
+    tree_find(tree, "/", "/reportdraft*/", count_found, &found, 1);
+    double find = now() - start;
+
+    printf("%-5s names=%ld memory=%zuB (%.0fB/name) create=%.0f/s lookup=%.0f/s"
+           " list=%.3fms list_prefix=%.3fms find=%.3fms (%ld found)\n",
+        label, n_names, memory, (double)memory / n_names, n_names / create, n_names / lookup,
+        list * 1e3, list_prefix * 1e3, find * 1e3, found);
+    tree_free(tree);
+}
+
+// Common directory names, most frequent first.
+static const char* common_names[] = {
+    "src", "build", "tmp", "cache", "lib", "include", "test", "docs", "bin", "obj",
+    "out", "vendor", "config", "scripts", "assets", "data", "logs", "dist", "public", "static",
+    "utils", "core", "common", "internal", "api", "models", "views", "main", "release", "debug",
+    "node", "modules", "packages", "examples", "tools", "res", "images", "fonts", "styles", "old",
+};
+#define N_COMMON_NAMES (sizeof(common_names) / sizeof(common_names[0]))
+
+// Generate paths of `n_nodes` distinct directories, parents before children:
+// a thousand top-level projects with unique names, below them mostly common
+// names (skewed towards the first ones) and one in eight unique names.
+static char** names_tree_paths(long n_nodes)
+{
+    char** paths = calloc(n_nodes, sizeof(char*));
+    if (!paths)
+        bad_malloc();
+    Tree* tree = tree_new();
+    unsigned int seed = 1;
+    long n_paths = 0;
+    char path[256];
+    for (long parent = -1; n_paths < n_nodes; ++parent) {
+        const char* parent_path = parent < 0 ? "/" : paths[parent];
+        size_t parent_len = strlen(parent_path);
+        if (parent_len > 128)
+            continue;
+        int n_children = parent < 0 ? 1000 : rand_r(&seed) % 7;
+        for (int i = 0; i < n_children && n_paths < n_nodes; ++i) {
+            char name[16];
+            if (parent < 0 || rand_r(&seed) % 8 == 0) {
+                for (int j = 0; j < 8; ++j)
+                    name[j] = 'a' + rand_r(&seed) % 26;
+                name[8] = '\0';
+            } else {
+                double u = rand_r(&seed) / (RAND_MAX + 1.0);
+                strcpy(name, common_names[(size_t)(u * u * N_COMMON_NAMES)]);
+            }
+            sprintf(path, "%s%s/", parent_path, name);
+            if (tree_create(tree, path))
+                continue;
+            if (!(paths[n_paths++] = strdup(path)))
+                bad_malloc();
+        }
+    }
+    tree_free(tree);
+    return paths;
+}
+
+static void bench_names(NameIndexKind kind, const char* label, char** paths, long n_nodes)
+{
+    struct mallinfo2 before = mallinfo2();
+    Tree* tree = tree_new_with_index(kind);
+    for (long i = 0; i < n_nodes; ++i) {
+        if (tree_create(tree, paths[i]))
+            fatal("Unable to create %s", paths[i]);
+    }
+    size_t memory = mallinfo2().uordblks - before.uordblks;
+    InternStats stats;
+    intern_stats(&stats);
+
+    long n_lookups = 4 * n_nodes;
+    unsigned int seed = 2;
+    double start = now();
+    for (long i = 0; i < n_lookups; ++i) {
+        TreeStat stat;
+        if (tree_stat(tree, paths[rand_r(&seed) % n_nodes], &stat))
+            fatal("Lookup failed");
+    }
+    double lookup = now() - start;
+
+    long found = 0;
+    start = now();
+    for (int i = 0; i < 10; ++i)
+        tree_find(tree, "/", "/*/src/include/", count_found, &found, 1);
+    double find = (now() - start) / 10;
+
+    printf("%-8s nodes=%ld memory=%zuB (%.1fB/node) interned=%zu names/%zu refs saved=%zuB"
+           " lookup=%.0f/s find=%.3fms (%ld found)\n",
+        label, n_nodes, memory, (double)memory / n_nodes, stats.names, stats.references,
+        stats.bytes_saved, n_lookups / lookup, find * 1e3, found / 10);
+    tree_free(tree);
+}
+
+typedef struct HotWorker {
+    Tree* tree;
+    int id;
+    long n_jobs;
+    double create_time, remove_time;
+} HotWorker;
+
+typedef struct HotLister {
+    Tree* tree;
+    long n_lists;
+} HotLister;
+
+static volatile int hot_done;
+
+// Job number i of thread id: base-26 digits, so all names are distinct.
+static void job_path(int id, long i, char* path)
+{
+    char* p = path + sprintf(path, "/jobs/");
+    for (long x = (long)id << 24 | i, digit = 0; digit < 8; ++digit, x /= 26)
+        *p++ = 'a' + x % 26;
+    strcpy(p, "/");
+}
+
+static void* run_hot_worker(void* data)
+{
+    HotWorker* worker = data;
+    char path[32];
+    double start = now();
+    for (long i = 0; i < worker->n_jobs; ++i) {
+        job_path(worker->id, i, path);
+        if (tree_create(worker->tree, path))
+            fatal("Unable to create %s", path);
+    }
+    worker->create_time = now() - start;
+    start = now();
+    for (long i = 0; i < worker->n_jobs; ++i) {
+        job_path(worker->id, i, path);
+        if (tree_remove(worker->tree, path))
+            fatal("Unable to remove %s", path);
+    }
+    worker->remove_time = now() - start;
+    return NULL;
+}
+
+static void* run_hot_lister(void* data)
+{
+    HotLister* lister = data;
+    while (!hot_done) {
+        free(tree_list(lister->tree, "/jobs/"));
+        lister->n_lists++;
+    }
+    return NULL;
+}
+
+static void bench_hot(int n_threads, long n_jobs)
+{
+    Tree* tree = tree_new();
+    tree_create(tree, "/jobs/");
+    HotWorker* workers = calloc(n_threads, sizeof(HotWorker));
+    pthread_t* threads = calloc(n_threads + 1, sizeof(pthread_t));
+    if (!workers || !threads)
+        bad_malloc();
+
+    HotLister lister = { tree, 0 };
+    hot_done = 0;
+    double start = now();
+    if (pthread_create(&threads[n_threads], NULL, run_hot_lister, &lister))
+        syserr("Unable to create thread");
+    for (int i = 0; i < n_threads; ++i) {
+        workers[i] = (HotWorker) { tree, i, n_jobs, 0, 0 };
+        if (pthread_create(&threads[i], NULL, run_hot_worker, &workers[i]))
+            syserr("Unable to create thread");
+    }
+    double create_time = 0, remove_time = 0;
+    for (int i = 0; i < n_threads; ++i) {
+        if (pthread_join(threads[i], NULL))
+            syserr("Unable to join thread");
+        create_time += workers[i].create_time;
+        remove_time += workers[i].remove_time;
+    }
+    double elapsed = now() - start;
+    hot_done = 1;
+    if (pthread_join(threads[n_threads], NULL))
+        syserr("Unable to join thread");
+
+    printf("threads=%d jobs=%ld time=%.3fs creates=%.0f/s removes=%.0f/s (per thread)"
+           " lists=%ld (%.3fms each)\n",
+        n_threads, n_threads * n_jobs, elapsed, n_jobs * n_threads / create_time,
+        n_jobs * n_threads / remove_time, lister.n_lists, lister.n_lists ? elapsed / lister.n_lists * 1e3 : 0.0);
+    free(workers);
+    free(threads);
+    tree_free(tree);
+}
+
+static void create_prefixed(Tree* tree, const char* prefix, const char* path)
+{
+    char prefixed[512];
+    sprintf(prefixed, "%s%s", prefix, path + 1);
+    if (tree_create(tree, prefixed))
+        fatal("Unable to create %s", prefixed);
+}
+
+static void bench_copy(long n_nodes)
+{
+    char** paths = names_tree_paths(n_nodes);
+    Tree* tree = tree_new();
+    tree_create(tree, "/template/");
+    for (long i = 0; i < n_nodes; ++i)
+        create_prefixed(tree, "/template/", paths[i]);
+
+    double start = now();
+    if (tree_copy(tree, "/template/", "/copy/"))
+        fatal("Unable to copy");
+    double copy = now() - start;
+
+    start = now();
+    tree_create(tree, "/loop/");
+    for (long i = 0; i < n_nodes; ++i)
+        create_prefixed(tree, "/loop/", paths[i]);
+    double loop = now() - start;
+
+    printf("nodes=%ld tree_copy=%.3fs (%.0f nodes/s) create loop=%.3fs (%.0f nodes/s) speedup=%.1fx\n",
+        n_nodes, copy, n_nodes / copy, loop, n_nodes / loop, loop / copy);
+    for (long i = 0; i < n_nodes; ++i)
+        free(paths[i]);
+    free(paths);
+    tree_free(tree);
+}
+
+static void bench_deep(int depth, long n_ops)
+{
+    Tree* tree = tree_new();
+    char root[512] = "/";
+    for (int i = 0; i < depth; ++i) {
+        sprintf(root + strlen(root), "project%c/", 'a' + i % 26);
+        tree_create(tree, root);
+    }
+    size_t root_len = strlen(root);
+    char path[600];
+
+    double start = now();
+    for (long i = 0; i < n_ops; ++i) {
+        sprintf(path, "%sjob%c/", root, 'a' + (int)(i % 26));
+        if (tree_create(tree, path) || tree_remove(tree, path))
+            fatal("Unable to create or remove %s", path);
+    }
+    double absolute = now() - start;
+
+    TreeDir* dir = tree_open(tree, root);
+    start = now();
+    for (long i = 0; i < n_ops; ++i) {
+        sprintf(path, "/job%c/", 'a' + (int)(i % 26));
+        if (tree_dir_create(dir, path) || tree_dir_remove(dir, path))
+            fatal("Unable to create or remove %s", path);
+    }
+    double relative = now() - start;
+    tree_close(dir);
+
+    printf("depth=%d path=%zuB absolute=%.0f ops/s relative=%.0f ops/s speedup=%.2fx\n",
+        depth, root_len, 2 * n_ops / absolute, 2 * n_ops / relative, absolute / relative);
+    tree_free(tree);
+}
+
+static double frozen_reads(Tree* tree, const char* release, long n_ops)
+{
+    char path[600];
+    double start = now();
+    for (long i = 0; i < n_ops; ++i) {
+        sprintf(path, "%sentry%c%c/", release, 'a' + (int)(i % 26), 'a' + (int)(i / 26 % 26));
+        if (!tree_exists(tree, path))
+            fatal("Missing %s", path);
+        if (i % 16 == 0) {
+            char* list = tree_list(tree, release);
+            if (!list)
+                fatal("Unable to list %s", release);
+            free(list);
+        }
+    }
+    return now() - start;
+}
+
+static void bench_frozen(int depth, long n_ops)
+{
+    Tree* tree = tree_new();
+    char release[512] = "/";
+    for (int i = 0; i < depth; ++i) {
+        sprintf(release + strlen(release), "release%c/", 'a' + i % 26);
+        tree_create(tree, release);
+    }
+    char path[600];
+    for (int i = 0; i < 26 * 26; ++i) {
+        sprintf(path, "%sentry%c%c/", release, 'a' + i % 26, 'a' + i / 26);
+        tree_create(tree, path);
+    }
+
+    double locked = frozen_reads(tree, release, n_ops);
+    // Freeze from the top, so the whole path below the root is lock-free.
+    if (tree_freeze(tree, "/releasea/", true))
+        fatal("Unable to freeze");
+    double frozen = frozen_reads(tree, release, n_ops);
+
+    printf("depth=%d entries=%d locked=%.0f ops/s frozen=%.0f ops/s speedup=%.2fx\n",
+        depth, 26 * 26, n_ops / locked, n_ops / frozen, locked / frozen);
+    tree_free(tree);
+}
+
+static double run_workers(Tree* tree, int n_threads, long n_ops)
+{
+    Worker* workers = calloc(n_threads, sizeof(Worker));
+    pthread_t* threads = calloc(n_threads, sizeof(pthread_t));
+    if (!workers || !threads)
+        bad_malloc();
+    double start = now();
+    for (int i = 0; i < n_threads; ++i) {
+        workers[i] = (Worker) { tree, n_ops, i + 1, 0 };
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]))
+            syserr("Unable to create thread");
+    }
+    for (int i = 0; i < n_threads; ++i) {
+        if (pthread_join(threads[i], NULL))
+            syserr("Unable to join thread");
+    }
+    double elapsed = now() - start;
+    free(workers);
+    free(threads);
+    return elapsed;
+}
+
+#define MAX_WAITS 100000
+
+typedef struct ReadYourWrites {
+    Tree* primary;
+    TreeReplica* replica;
+    volatile int done;
+    long n_waits;
+    double waits[MAX_WAITS];
+} ReadYourWrites;
+
+static void* run_read_your_writes(void* data)
+{
+    ReadYourWrites* ryw = data;
+    char path[16];
+    // The workload only uses the letters a-d, so these names never collide with it.
+    for (long i = 0; !ryw->done && ryw->n_waits < MAX_WAITS; ++i) {
+        sprintf(path, "/ryw%c%c%c/", 'e' + (int)(i % 22), 'e' + (int)(i / 22 % 22), 'e' + (int)(i / 484 % 22));
+        if (tree_create(ryw->primary, path))
+            fatal("Unable to create %s", path);
+        double start = now();
+        tree_replica_wait(ryw->replica, tree_log_seq(ryw->primary), NULL);
+        ryw->waits[ryw->n_waits++] = now() - start;
+        if (!tree_exists(tree_replica_tree(ryw->replica), path))
+            fatal("Replica is missing %s", path);
+        tree_remove(ryw->primary, path);
+    }
+    return NULL;
+}
+
+// Compares listings of every path the workload may create.
+static bool same_lists(Tree* a, Tree* b, char* path, int depth)
+{
+    char* list_a = tree_list(a, path);
+    char* list_b = tree_list(b, path);
+    bool same = (!list_a && !list_b) || (list_a && list_b && !strcmp(list_a, list_b));
+    free(list_a);
+    free(list_b);
+    size_t len = strlen(path);
+    for (int i = 0; same && depth < MAX_DEPTH && i < ALPHABET; ++i) {
+        sprintf(path + len, "%c/", 'a' + i);
+        same = same_lists(a, b, path, depth + 1);
+    }
+    path[len] = '\0';
+    return same;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_replica(int n_threads, long n_ops)
+{
+    Tree* tree = tree_new();
+    double plain = run_workers(tree, n_threads, n_ops);
+    tree_free(tree);
+
+    tree = tree_new();
+    ReadYourWrites* ryw = calloc(1, sizeof(ReadYourWrites));
+    if (!ryw)
+        bad_malloc();
+    ryw->primary = tree;
+    ryw->replica = tree_replica_new(tree);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_read_your_writes, ryw))
+        syserr("Unable to create thread");
+    double replicated = run_workers(tree, n_threads, n_ops);
+    ryw->done = 1;
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+
+    tree_replica_wait(ryw->replica, tree_log_seq(tree), NULL);
+    TreeReplicaStats stats;
+    tree_replica_stats(ryw->replica, &stats);
+    char path[2 * MAX_DEPTH + 2] = "/";
+    bool same = same_lists(tree, tree_replica_tree(ryw->replica), path, 0);
+    qsort(ryw->waits, ryw->n_waits, sizeof(double), compare_doubles);
+
+    long total = n_ops * n_threads;
+    printf("threads=%d plain=%.0f ops/s replicated=%.0f ops/s records=%llu batches=%llu errors=%llu\n",
+        n_threads, total / plain, total / replicated, (unsigned long long)stats.seq,
+        (unsigned long long)stats.batches, (unsigned long long)stats.errors);
+    printf("lag mean=%.1fus max=%.1fus read-your-writes waits=%ld p50=%.1fus p99=%.1fus consistent=%s\n",
+        stats.mean_lag * 1e6, stats.max_lag * 1e6, ryw->n_waits,
+        ryw->n_waits ? ryw->waits[ryw->n_waits / 2] * 1e6 : 0,
+        ryw->n_waits ? ryw->waits[ryw->n_waits * 99 / 100] * 1e6 : 0, same ? "yes" : "no");
+
+    tree_replica_free(ryw->replica);
+    free(ryw);
+    tree_free(tree);
+}
+
+static int compare_strings(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static double bulk_load(char** paths, long n_nodes, int n_threads)
+{
+    Tree* tree = tree_new();
+    double start = now();
+    if (tree_bulk_load(tree, (const char* const*)paths, n_nodes, n_threads))
+        fatal("Unable to bulk load");
+    double time = now() - start;
+    TreeStat stat;
+    if (tree_stat(tree, "/", &stat) || stat.descendants != (size_t)n_nodes)
+        fatal("Bulk load created %zu nodes instead of %ld", stat.descendants, n_nodes);
+    tree_free(tree);
+    return time;
+}
+
+static void bench_bulk(int n_threads, long n_nodes)
+{
+    char** paths = names_tree_paths(n_nodes);
+    qsort(paths, n_nodes, sizeof(char*), compare_strings);
+
+    Tree* tree = tree_new();
+    double start = now();
+    for (long i = 0; i < n_nodes; ++i) {
+        if (tree_create(tree, paths[i]))
+            fatal("Unable to create %s", paths[i]);
+    }
+    double loop = now() - start;
+    tree_free(tree);
+
+    double single = bulk_load(paths, n_nodes, 1);
+    double parallel = bulk_load(paths, n_nodes, n_threads);
+    printf("nodes=%ld create loop=%.3fs (%.0f nodes/s)\n", n_nodes, loop, n_nodes / loop);
+    printf("tree_bulk_load threads=1: %.3fs (%.0f nodes/s, %.1fx)\n", single, n_nodes / single, loop / single);
+    printf("tree_bulk_load threads=%d: %.3fs (%.0f nodes/s, %.1fx)\n",
+        n_threads, parallel, n_nodes / parallel, loop / parallel);
+    for (long i = 0; i < n_nodes; ++i)
+        free(paths[i]);
+    free(paths);
+}
+
+// tree_list with the names sorted, so that it doesn't depend on the index
+static char* sorted_list(Tree* tree, const char* path)
+{
+    char* list = tree_list(tree, path);
+    if (!list || !*list)
+        return list;
+    size_t n = 1;
+    for (char* p = list; *p; ++p)
+        n += *p == ',';
+    char** names = malloc(n * sizeof(char*));
+    if (!names)
+        bad_malloc();
+    n = 0;
+    for (char* name = strtok(list, ","); name; name = strtok(NULL, ","))
+        names[n++] = name;
+    qsort(names, n, sizeof(char*), compare_strings);
+    char* result = malloc(strlen(path) + 1 + n * (MAX_FOLDER_NAME_LENGTH + 1));
+    if (!result)
+        bad_malloc();
+    char* p = result;
+    for (size_t i = 0; i < n; ++i)
+        p += sprintf(p, i ? ",%s" : "%s", names[i]);
+    free(names);
+    free(list);
+    return result;
+}
+
+static bool lists(Tree* tree, const char* path, const char* expected)
+{
+    char* list = sorted_list(tree, path);
+    bool same = list ? expected && !strcmp(list, expected) : !expected;
+    free(list);
+    return same;
+}
+
+// Reads up to len bytes of the file into buf and returns how many were read.
+static size_t read_into(Tree* tree, const char* path, size_t offset, size_t len, char* buf)
+{
+    TreeReadResult read;
+    ensure(!tree_read(tree, path, offset, len, &read));
+    size_t n = 0;
+    for (size_t i = 0; i < read.n_refs; ++i) {
+        memcpy(buf + n, read.refs[i].data, read.refs[i].len);
+        n += read.refs[i].len;
+    }
+    ensure(n == read.len);
+    tree_read_release(&read);
+    return n;
+}
+
+static void check_files(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/"));
+    ensure(!tree_write(tree, "/a/f/", 0, "hello", 5));
+    ensure(!tree_write(tree, "/a/f/", 3, "p!", 2));
+    char buf[16];
+    ensure(read_into(tree, "/a/f/", 0, 100, buf) == 5 && !memcmp(buf, "help!", 5));
+    ensure(read_into(tree, "/a/f/", 1, 2, buf) == 2 && !memcmp(buf, "el", 2));
+    ensure(read_into(tree, "/a/f/", 10, 2, buf) == 0);
+    ensure(lists(tree, "/a/", "f"));
+
+    // A gap reads as zeros, and a read spanning chunks comes in several pieces.
+    ensure(!tree_write(tree, "/a/f/", 2 * CHUNK_SIZE, "x", 1));
+    TreeReadResult read;
+    ensure(!tree_read(tree, "/a/f/", 0, 3 * CHUNK_SIZE, &read));
+    ensure(read.len == 2 * CHUNK_SIZE + 1 && read.n_refs >= 3);
+    ensure(read_into(tree, "/a/f/", CHUNK_SIZE - 1, 2, buf) == 2 && !buf[0] && !buf[1]);
+
+    // Data of a read stays valid after the file is overwritten and removed.
+    ensure(!tree_write(tree, "/a/f/", 0, "HELP!", 5));
+    ensure(!tree_remove(tree, "/a/f/"));
+    ensure(!memcmp(read.refs[0].data, "help!", 5));
+    tree_read_release(&read);
+
+    ensure(tree_write(tree, "/a/", 0, "x", 1) == EISDIR);
+    ensure(tree_write(tree, "/", 0, "x", 1) == EISDIR);
+    ensure(tree_write(tree, "/b/f/", 0, "x", 1) == ENOENT);
+    ensure(!tree_write(tree, "/g/", 0, "x", 1));
+    ensure(tree_write(tree, "/g/h/", 0, "x", 1) == ENOTDIR);
+    ensure(tree_create(tree, "/g/h/") == ENOTDIR);
+    ensure(tree_read(tree, "/a/", 0, 1, &read) == EISDIR);
+    ensure(tree_read(tree, "/a/f/", 0, 1, &read) == ENOENT);
+    ensure(tree_list(tree, "/g/") == NULL);
+    ensure(!tree_move(tree, "/g/", "/a/g/") && read_into(tree, "/a/g/", 0, 1, buf) == 1 && buf[0] == 'x');
+    tree_free(tree);
+}
+
+typedef struct Visits {
+    pthread_mutex_t lock;
+    const char* root;
+    long n;
+    long depths;
+    bool bad;
+} Visits;
+
+static void visit(const char* path, const char* name, int depth, void* arg)
+{
+    Visits* visits = arg;
+    size_t root_len = strlen(visits->root), path_len = strlen(path), name_len = strlen(name);
+    int components = 0;
+    for (const char* p = path + root_len; *p; ++p)
+        components += *p == '/';
+    bool bad = strncmp(path, visits->root, root_len) || path_len < name_len + 2
+        || strncmp(path + path_len - name_len - 1, name, name_len) || components != depth;
+    pthread_mutex_lock(&visits->lock);
+    visits->n++;
+    visits->depths += depth;
+    visits->bad |= bad;
+    pthread_mutex_unlock(&visits->lock);
+}
+
+static void check_walk(void)
+{
+    // 10 folders, each with 10 folders, each with 10 folders and a file
+    Tree* tree = tree_new();
+    char path[32];
+    for (int i = 0; i < 1000; ++i) {
+        sprintf(path, "/%c/", 'a' + i / 100);
+        tree_create(tree, path);
+        sprintf(path, "/%c/%c/", 'a' + i / 100, 'a' + i / 10 % 10);
+        tree_create(tree, path);
+        sprintf(path, "/%c/%c/%c/", 'a' + i / 100, 'a' + i / 10 % 10, 'a' + i % 10);
+        ensure(!tree_create(tree, path));
+    }
+    ensure(!tree_write(tree, "/a/a/a/f/", 0, "x", 1));
+
+    for (int n_threads = 1; n_threads <= 4; n_threads *= 2) {
+        Visits visits = { PTHREAD_MUTEX_INITIALIZER, "/", 0, 0, false };
+        ensure(!tree_walk(tree, "/", visit, &visits, n_threads));
+        ensure(!visits.bad && visits.n == 1111 && visits.depths == 10 + 200 + 3000 + 4);
+        visits = (Visits) { PTHREAD_MUTEX_INITIALIZER, "/b/", 0, 0, false };
+        ensure(!tree_walk(tree, "/b/", visit, &visits, n_threads));
+        ensure(!visits.bad && visits.n == 110 && visits.depths == 10 + 200);
+        visits = (Visits) { PTHREAD_MUTEX_INITIALIZER, "/c/c/c/", 0, 0, false };
+        ensure(!tree_walk(tree, "/c/c/c/", visit, &visits, n_threads));
+        ensure(visits.n == 0);
+    }
+
+    Visits visits = { PTHREAD_MUTEX_INITIALIZER, "/", 0, 0, false };
+    ensure(tree_walk(tree, "/z/", visit, &visits, 2) == ENOENT);
+    ensure(tree_walk(tree, "/a/a/a/f/", visit, &visits, 2) == ENOTDIR);
+    ensure(tree_walk(tree, "a", visit, &visits, 2) == EINVAL);
+    ensure(tree_walk(tree, "/", NULL, &visits, 2) == EINVAL);
+    ensure(visits.n == 0);
+    tree_free(tree);
+}
+
+typedef struct Found {
+    pthread_mutex_t lock;
+    char* paths[16];
+    int n;
+} Found;
+
+static void collect_found(const char* path, void* arg)
+{
+    Found* found = arg;
+    pthread_mutex_lock(&found->lock);
+    ensure(found->n < 16);
+    if (!(found->paths[found->n++] = strdup(path)))
+        bad_malloc();
+    pthread_mutex_unlock(&found->lock);
+}
+
+// Paths matching the pattern, sorted and separated by spaces.
+static bool finds(Tree* tree, const char* path, const char* pattern, int n_threads, const char* expected)
+{
+    Found found = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+    ensure(!tree_find(tree, path, pattern, collect_found, &found, n_threads));
+    qsort(found.paths, found.n, sizeof(char*), compare_strings);
+    char result[1024] = "";
+    for (int i = 0; i < found.n; ++i) {
+        if (i)
+            strcat(result, " ");
+        strcat(result, found.paths[i]);
+        free(found.paths[i]);
+    }
+    return !strcmp(result, expected);
+}
+
+static void check_find(void)
+{
+    static const char* paths[] = { "/projects/", "/projects/alpha/", "/projects/alpha/build/",
+        "/projects/alpha/build/cache/", "/projects/alpha/build/cachex/", "/projects/alpha/build/out/",
+        "/projects/alpha/src/", "/projects/alpha/src/build/", "/projects/alpha/src/build/cache/",
+        "/projects/beta/", "/projects/beta/build/", "/projects/beta/build/cache/" };
+    NameIndexKind kinds[] = { NAME_INDEX_HASH, NAME_INDEX_TRIE, NAME_INDEX_INTERNED };
+    for (int k = 0; k < 3; ++k) {
+        Tree* tree = tree_new_with_index(kinds[k]);
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+            ensure(!tree_create(tree, paths[i]));
+        for (int n_threads = 1; n_threads <= 3; n_threads += 2) {
+            ensure(finds(tree, "/", "/projects/*/build/cache*/", n_threads,
+                "/projects/alpha/build/cache/ /projects/alpha/build/cachex/ /projects/beta/build/cache/"));
+            ensure(finds(tree, "/", "/**/cache/", n_threads,
+                "/projects/alpha/build/cache/ /projects/alpha/src/build/cache/ /projects/beta/build/cache/"));
+            ensure(finds(tree, "/projects/", "/?eta/", n_threads, "/projects/beta/"));
+            ensure(finds(tree, "/projects/alpha/", "/**/build/", n_threads,
+                "/projects/alpha/build/ /projects/alpha/src/build/"));
+            ensure(finds(tree, "/", "/projects/gamma/", n_threads, ""));
+        }
+        Found found = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+        ensure(tree_find(tree, "/nope/", "/*/", collect_found, &found, 1) == ENOENT);
+        ensure(tree_find(tree, "/", "*/", collect_found, &found, 1) == EINVAL);
+        ensure(tree_find(tree, "/", "/Caps/", collect_found, &found, 1) == EINVAL);
+        ensure(tree_find(tree, "/", "/*/", NULL, &found, 1) == EINVAL);
+        ensure(found.n == 0);
+        tree_free(tree);
+    }
+}
+
+static bool stats(Tree* tree, const char* path, size_t descendants, size_t height, size_t children)
+{
+    TreeStat stat;
+    return !tree_stat(tree, path, &stat) && stat.descendants == descendants && stat.height == height
+        && stat.children == children;
+}
+
+typedef struct Shape {
+    pthread_mutex_t lock;
+    long n;
+    int height;
+} Shape;
+
+static void measure(const char* path, const char* name, int depth, void* arg)
+{
+    (void)path;
+    (void)name;
+    Shape* shape = arg;
+    pthread_mutex_lock(&shape->lock);
+    shape->n++;
+    if (depth > shape->height)
+        shape->height = depth;
+    pthread_mutex_unlock(&shape->lock);
+}
+
+// Aggregates of path agree with a walk of its subtree.
+static bool consistent(Tree* tree, const char* path)
+{
+    Shape shape = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+    TreeStat stat;
+    ensure(!tree_walk(tree, path, measure, &shape, 1));
+    return !tree_stat(tree, path, &stat) && stat.descendants == (size_t)shape.n && stat.height == (size_t)shape.height;
+}
+
+// Folder names a..z, ba..bz, ... for a number.
+static char* number_name(long i, char* p)
+{
+    do {
+        *p++ = 'a' + i % 26;
+        i /= 26;
+    } while (i);
+    *p = '\0';
+    return p;
+}
+
+typedef struct Racer {
+    Tree* tree;
+    int id;
+    unsigned int seed;
+} Racer;
+
+// Creates and removes chains of up to three folders in /hot/, which is
+// striped, so that heights go up and down under the read lock of /hot/.
+static void* run_racer(void* data)
+{
+    Racer* racer = data;
+    char path[64];
+    for (long i = 0; i < 20000; ++i) {
+        char* p = path + sprintf(path, "/hot/");
+        *p++ = 'a' + racer->id;
+        p = number_name(rand_r(&racer->seed) % 8, p);
+        int depth = 1 + rand_r(&racer->seed) % 3;
+        size_t len[3];
+        for (int d = 0; d < depth; ++d) {
+            strcpy(p, "/");
+            len[d] = strlen(path);
+            tree_create(racer->tree, path);
+            p = path + len[d];
+            *p++ = 'x';
+        }
+        // Leave some chains behind, in part or in full.
+        for (int d = depth - 1; d >= 0 && rand_r(&racer->seed) % 4; --d) {
+            path[len[d]] = '\0';
+            tree_remove(racer->tree, path);
+        }
+    }
+    return NULL;
+}
+
+static void check_aggregates(void)
+{
+    Tree* tree = tree_new();
+    ensure(stats(tree, "/", 0, 0, 0));
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/a/b/") && !tree_create(tree, "/a/b/c/"));
+    ensure(!tree_write(tree, "/a/f/", 0, "x", 1));
+    ensure(stats(tree, "/", 4, 3, 1) && stats(tree, "/a/", 3, 2, 2) && stats(tree, "/a/b/c/", 0, 0, 0));
+    TreeStat stat;
+    ensure(!tree_stat(tree, "/a/f/", &stat) && stat.is_file && stat.children == 0 && stat.height == 0);
+    ensure(!tree_stat(tree, "/a/", &stat) && !stat.is_file);
+    ensure(!tree_move(tree, "/a/b/", "/d/"));
+    ensure(stats(tree, "/", 4, 2, 2) && stats(tree, "/a/", 1, 1, 1) && stats(tree, "/d/", 1, 1, 1));
+    ensure(!tree_remove(tree, "/d/c/"));
+    ensure(stats(tree, "/", 3, 2, 2) && stats(tree, "/d/", 0, 0, 0));
+    ensure(tree_exists(tree, "/a/f/") && tree_exists(tree, "/") && !tree_exists(tree, "/d/c/"));
+    ensure(tree_stat(tree, "/d/c/", &stat) == ENOENT && tree_stat(tree, "d", &stat) == EINVAL);
+
+    // Heights of a striped folder stay exact while its children change concurrently.
+    char path[64];
+    ensure(!tree_create(tree, "/hot/"));
+    for (long i = 0; i < 2000; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/hot/z")), "/");
+        ensure(!tree_create(tree, path));
+    }
+    Racer racers[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i) {
+        racers[i] = (Racer) { tree, i, i + 1 };
+        if (pthread_create(&threads[i], NULL, run_racer, &racers[i]))
+            syserr("Unable to create thread");
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (pthread_join(threads[i], NULL))
+            syserr("Unable to join thread");
+    }
+    ensure(consistent(tree, "/") && consistent(tree, "/hot/"));
+    for (int i = 0; i < 4; ++i) {
+        for (long j = 0; j < 8; ++j) {
+            char* p = path + sprintf(path, "/hot/%c", 'a' + i);
+            strcpy(number_name(j, p), "/");
+            ensure(!tree_exists(tree, path) || consistent(tree, path));
+        }
+    }
+    tree_free(tree);
+}
+
+typedef struct Reaper {
+    TreeQueue* queue;
+    atomic_int reaped;
+} Reaper;
+
+// Reaps one result at a time until nothing is in flight.
+static void* run_reaper(void* data)
+{
+    Reaper* reaper = data;
+    TreeCompletion completion;
+    while (tree_queue_reap(reaper->queue, &completion, 1, true)) {
+        free(completion.list);
+        atomic_fetch_add(&reaper->reaped, 1);
+    }
+    return NULL;
+}
+
+static void check_queue(void)
+{
+    Tree* tree = tree_new();
+    int results[6];
+    TreeChildOp ops[] = { { "a", false }, { "a", false }, { "a", true }, { "a", true }, { "A", false }, { "b", false } };
+    tree_children_apply(tree, "/", ops, results, 6);
+    ensure(!results[0] && results[1] == EEXIST && !results[2] && results[3] == ENOENT && results[4] == EINVAL);
+    ensure(!results[5] && lists(tree, "/", "b"));
+    tree_children_apply(tree, "/c/", ops, results, 2);
+    ensure(results[0] == ENOENT && results[1] == ENOENT);
+    ensure(!tree_write(tree, "/f/", 0, "x", 1));
+    tree_children_apply(tree, "/f/", ops, results, 1);
+    ensure(results[0] == ENOTDIR);
+
+    TreeQueue* queue = tree_queue_new(tree, 64, 2);
+    TreeCompletion completions[64];
+    ensure(tree_queue_reap(queue, completions, 64, true) == 0);
+    char paths[64][16];
+    for (long i = 0; i < 64; ++i) {
+        strcpy(number_name(i, paths[i] + sprintf(paths[i], "/b/")), "/");
+        TreeOp op = { TREE_OP_CREATE, paths[i], NULL, paths[i] };
+        ensure(tree_queue_submit(queue, &op));
+    }
+    TreeOp list = { TREE_OP_LIST, "/b/", NULL, NULL };
+    ensure(!tree_queue_submit(queue, &list));
+    size_t n = 0;
+    while (n < 64)
+        n += tree_queue_reap(queue, completions + n, 64 - n, true);
+    for (long i = 0; i < 64; ++i)
+        ensure(!completions[i].result && !completions[i].list && tree_exists(tree, completions[i].user_data));
+
+    TreeOp batch[] = { { TREE_OP_LIST, "/b/", NULL, "list" }, { TREE_OP_LIST, "/nope/", NULL, "missing" },
+        { TREE_OP_REMOVE, "/b/a/", NULL, "remove" }, { TREE_OP_MOVE, "/b/b/", "/moved/", "move" },
+        { TREE_OP_CREATE, "bad", NULL, "bad" } };
+    for (int i = 0; i < 5; ++i)
+        ensure(tree_queue_submit(queue, &batch[i]));
+    for (n = 0; n < 5;)
+        n += tree_queue_reap(queue, completions + n, 5 - n, true);
+    for (int i = 0; i < 5; ++i) {
+        const char* tag = completions[i].user_data;
+        int result = completions[i].result;
+        if (!strcmp(tag, "list"))
+            ensure(!result && completions[i].list && strstr(completions[i].list, "c"));
+        else
+            ensure(!completions[i].list);
+        ensure(strcmp(tag, "missing") || result == ENOENT);
+        ensure(strcmp(tag, "remove") || !result);
+        ensure(strcmp(tag, "move") || !result);
+        ensure(strcmp(tag, "bad") || result == EINVAL);
+        free(completions[i].list);
+    }
+    ensure(tree_exists(tree, "/moved/") && !tree_exists(tree, "/b/a/"));
+
+    // One operation at a time, so that workers and the reaper keep going
+    // to sleep and being woken up.
+    for (long i = 0; i < 100000; ++i) {
+        TreeOp op = { i % 2 ? TREE_OP_REMOVE : TREE_OP_CREATE, "/x/", NULL, NULL };
+        ensure(tree_queue_submit(queue, &op));
+        ensure(tree_queue_reap(queue, completions, 1, true) == 1 && !completions[0].result);
+    }
+
+    // Several reapers share the results; each must return once nothing is
+    // left in flight, even if others took the results it was waiting for.
+    for (int round = 0; round < 200; ++round) {
+        Reaper reapers = { queue, 0 };
+        for (int i = 0; i < 8; ++i) {
+            TreeOp op = { TREE_OP_LIST, "/", NULL, NULL };
+            ensure(tree_queue_submit(queue, &op));
+        }
+        pthread_t threads[4];
+        for (int i = 0; i < 4; ++i) {
+            if (pthread_create(&threads[i], NULL, run_reaper, &reapers))
+                syserr("Unable to create thread");
+        }
+        for (int i = 0; i < 4; ++i) {
+            if (pthread_join(threads[i], NULL))
+                syserr("Unable to join thread");
+        }
+        ensure(reapers.reaped == 8);
+    }
+    tree_queue_free(queue);
+    tree_free(tree);
+}
+
+// The Release build (-O3 -DNDEBUG) must behave exactly like the Debug one.
+static void check_release(void)
+{
+    int calls = 0;
+    ensure(++calls == 1);
+    ensure(calls == 1);
+
+    // a fixed single-threaded run of the mixed workload, with results
+    // recorded from the Debug build
+    Tree* tree = tree_new();
+    Worker worker = { tree, 200000, 1, 0 };
+    run_worker(&worker);
+    TreeStat stat;
+    ensure(!tree_stat(tree, "/", &stat));
+    ensure(worker.n_succeeded == 84910 && stat.descendants == 245 && stat.height == 4);
+    tree_free(tree);
+}
+
+static void check_hashing(void)
+{
+    const char* key = "abcdefghijklmnopqrstuvwxyz";
+    uint64_t hash = hmap_hash(1, key, 26);
+    ensure(hash == hmap_hash(1, key, 26));
+    ensure(hash != hmap_hash(2, key, 26));
+    ensure(hash != hmap_hash(1, key, 25) && hmap_hash(1, key, 0) != hmap_hash(2, key, 0));
+    // every byte of the key matters
+    char changed[27];
+    for (int i = 0; i < 26; ++i) {
+        strcpy(changed, key);
+        changed[i] = 'a' + (changed[i] - 'a' + 1) % 26;
+        ensure(hmap_hash(1, changed, 26) != hash);
+    }
+
+    // Seeded maps work like the unseeded one.
+    HashMap* maps[] = { hmap_new(), hmap_new_seeded(12345) };
+    char name[16];
+    for (int m = 0; m < 2; ++m) {
+        HashMap* map = maps[m];
+        ensure(hmap_seed(map) == (m ? 12345 : 0));
+        for (long i = 0; i < 100000; ++i) {
+            number_name(i, name);
+            ensure(hmap_insert(map, name, (void*)(i + 1)));
+        }
+        ensure(!hmap_insert(map, "a", (void*)1) && hmap_size(map) == 100000);
+        for (long i = 0; i < 100000; ++i) {
+            number_name(i, name);
+            uint64_t h = hmap_hash(hmap_seed(map), name, strlen(name));
+            ensure(hmap_get(map, name) == (void*)(i + 1) && hmap_get_hashed(map, name, h) == (void*)(i + 1));
+        }
+        const char* key;
+        void* value;
+        long n = 0;
+        HashMapIterator it = hmap_iterator(map);
+        while (hmap_next(map, &it, &key, &value))
+            n += hmap_get(map, key) == value;
+        ensure(n == 100000);
+        for (long i = 0; i < 100000; i += 2) {
+            number_name(i, name);
+            ensure(hmap_remove(map, name));
+        }
+        ensure(!hmap_remove(map, "a") && hmap_size(map) == 50000 && hmap_get(map, "b") == (void*)2);
+        hmap_free(map);
+    }
+}
+
+static void check_trie(void)
+{
+    Trie* trie = trie_new();
+    static const char* keys[] = { "photo", "photos", "pho", "report", "reportdraft", "a", "zz" };
+    for (long i = 0; i < 7; ++i)
+        ensure(trie_insert(trie, keys[i], (void*)(i + 1)));
+    ensure(!trie_insert(trie, "photo", (void*)1) && !trie_insert(trie, "", (void*)1));
+    ensure(!trie_insert(trie, "Photo", (void*)1) && !trie_insert(trie, "ph0", (void*)1));
+    char long_key[TRIE_MAX_KEY_LENGTH + 2];
+    memset(long_key, 'q', TRIE_MAX_KEY_LENGTH + 1);
+    long_key[TRIE_MAX_KEY_LENGTH + 1] = '\0';
+    ensure(!trie_insert(trie, long_key, (void*)1));
+    long_key[TRIE_MAX_KEY_LENGTH] = '\0';
+    ensure(trie_insert(trie, long_key, (void*)8) && trie_get(trie, long_key) == (void*)8);
+    ensure(trie_size(trie) == 8 && trie_get(trie, "photo") == (void*)1 && !trie_get(trie, "phot"));
+
+    // iteration in order, and over a prefix only
+    const char* key;
+    void* value;
+    char keys_seen[1024] = "";
+    TrieIterator it = trie_iterator(trie);
+    while (trie_next(&it, &key, &value)) {
+        if (strlen(key) < 20)
+            strcat(strcat(keys_seen, key), " ");
+    }
+    ensure(!strcmp(keys_seen, "a pho photo photos report reportdraft zz "));
+    keys_seen[0] = '\0';
+    it = trie_prefix_iterator(trie, "phot");
+    while (trie_next(&it, &key, &value))
+        strcat(strcat(keys_seen, key), " ");
+    ensure(!strcmp(keys_seen, "photo photos "));
+    it = trie_prefix_iterator(trie, "x");
+    ensure(!trie_next(&it, &key, &value));
+
+    ensure(trie_remove(trie, "photo") && !trie_remove(trie, "photo") && !trie_remove(trie, "phot"));
+    ensure(trie_get(trie, "photos") == (void*)2 && trie_get(trie, "pho") == (void*)3 && trie_size(trie) == 7);
+    trie_free(trie);
+
+    // Tree lists come out sorted with the trie index.
+    Tree* tree = tree_new_with_index(NAME_INDEX_TRIE);
+    for (int i = 6; i >= 0; --i) {
+        char path[32];
+        sprintf(path, "/%s/", keys[i]);
+        ensure(!tree_create(tree, path));
+    }
+    char* list = tree_list(tree, "/");
+    ensure(list && !strcmp(list, "a,pho,photo,photos,report,reportdraft,zz"));
+    free(list);
+    list = tree_list_prefix(tree, "/", "report");
+    ensure(list && !strcmp(list, "report,reportdraft"));
+    free(list);
+    list = tree_list_prefix(tree, "/", "q");
+    ensure(list && !*list);
+    free(list);
+    ensure(!tree_list_prefix(tree, "/nope/", "a"));
+    tree_free(tree);
+}
+
+static void* run_interner(void* data)
+{
+    const char** result = data;
+    for (int i = 0; i < 100000; ++i) {
+        const char* name = intern_acquire("shared");
+        const char* found = intern_find("shared");
+        ensure(found == name);
+        intern_release(found);
+        intern_release(name);
+    }
+    *result = intern_acquire("shared");
+    return NULL;
+}
+
+static void check_intern(void)
+{
+    InternStats before, stats;
+    intern_stats(&before);
+    ensure(!intern_find("neverinterned"));
+    const char* a = intern_acquire("src");
+    const char* b = intern_acquire("src");
+    ensure(a == b && !strcmp(a, "src") && intern_find("src") == a);
+    intern_ref(a);
+    intern_stats(&stats);
+    ensure(stats.names == before.names + 1 && stats.references == before.references + 4);
+    for (int i = 0; i < 4; ++i)
+        intern_release(a);
+    ensure(!intern_find("src"));
+
+    // Threads interning and releasing the same name agree on its pointer while
+    // they hold it.
+    const char* names[4] = { NULL };
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i) {
+        if (pthread_create(&threads[i], NULL, run_interner, &names[i]))
+            syserr("Unable to create thread");
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (pthread_join(threads[i], NULL))
+            syserr("Unable to join thread");
+    }
+    ensure(names[0] == names[1] && names[1] == names[2] && names[2] == names[3]);
+    for (int i = 0; i < 4; ++i)
+        intern_release(names[i]);
+
+    // An interned tree stores each name once and releases it when freed.
+    Tree* tree = tree_new_with_index(NAME_INDEX_INTERNED);
+    char path[32];
+    for (int i = 0; i < 100; ++i) {
+        sprintf(path, "/%c%c/", 'a' + i / 10, 'a' + i % 10);
+        ensure(!tree_create(tree, path));
+        strcat(path, "src/");
+        ensure(!tree_create(tree, path));
+    }
+    intern_stats(&stats);
+    ensure(stats.names == before.names + 101 && stats.references >= before.references + 200);
+    ensure(!tree_move(tree, "/aa/src/", "/ab/src/lib/") && !tree_remove(tree, "/ac/src/"));
+    ensure(lists(tree, "/ab/src/", "lib") && lists(tree, "/ac/", ""));
+    tree_free(tree);
+    intern_stats(&stats);
+    ensure(stats.names == before.names && stats.references == before.references);
+}
+
+// The next event of the watch has the given type and path.
+static bool next_event(TreeWatch* watch, TreeEventType type, const char* path, uint64_t* cookie)
+{
+    TreeEvent event;
+    if (!tree_watch_next(watch, &event))
+        return false;
+    bool same = event.type == type && (path ? event.path && !strcmp(event.path, path) : !event.path);
+    if (cookie)
+        *cookie = event.cookie;
+    free(event.path);
+    return same;
+}
+
+static void check_watch(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/"));
+    ensure(!tree_watch(tree, "/nope/", false));
+    TreeWatch* watch = tree_watch(tree, "/a/", false);
+    TreeWatch* recursive = tree_watch(tree, "/", true);
+    ensure(watch && recursive);
+    TreeEvent event;
+    ensure(!tree_watch_next(watch, &event));
+
+    ensure(!tree_create(tree, "/a/b/") && !tree_create(tree, "/a/b/c/") && !tree_write(tree, "/a/f/", 0, "x", 1));
+    ensure(next_event(watch, TREE_EVENT_CREATED, "/a/b/", NULL));
+    ensure(next_event(watch, TREE_EVENT_CREATED, "/a/f/", NULL));
+    ensure(!tree_watch_next(watch, &event));
+    ensure(next_event(recursive, TREE_EVENT_CREATED, "/a/b/", NULL));
+    ensure(next_event(recursive, TREE_EVENT_CREATED, "/a/b/c/", NULL));
+    ensure(next_event(recursive, TREE_EVENT_CREATED, "/a/f/", NULL));
+
+    // A move out of the watched folder pairs both events with one cookie.
+    uint64_t from, to;
+    ensure(!tree_move(tree, "/a/b/", "/d/"));
+    ensure(next_event(watch, TREE_EVENT_MOVED_FROM, "/a/b/", &from) && from);
+    ensure(!tree_watch_next(watch, &event));
+    ensure(next_event(recursive, TREE_EVENT_MOVED_FROM, "/a/b/", &from));
+    ensure(next_event(recursive, TREE_EVENT_MOVED_TO, "/d/", &to) && from == to);
+    ensure(!tree_remove(tree, "/d/c/"));
+    ensure(next_event(recursive, TREE_EVENT_REMOVED, "/d/c/", NULL) && !tree_watch_next(watch, &event));
+
+    // Failed operations produce no events, and a full queue reports an overflow.
+    ensure(tree_create(tree, "/a/f/") == EEXIST && !tree_watch_next(recursive, &event));
+    char path[32];
+    for (long i = 0; i < TREE_WATCH_CAPACITY + 10; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/a/x")), "/");
+        ensure(!tree_create(tree, path));
+    }
+    long n = 0;
+    bool overflow = false;
+    while (tree_watch_next(watch, &event)) {
+        overflow |= event.type == TREE_EVENT_OVERFLOW;
+        n += event.type == TREE_EVENT_CREATED;
+        free(event.path);
+    }
+    ensure(overflow && n < TREE_WATCH_CAPACITY + 10);
+
+    // Removing the watched folder is its last event.
+    TreeWatch* leaf = tree_watch(tree, "/d/", false);
+    ensure(leaf && !tree_remove(tree, "/d/"));
+    ensure(next_event(leaf, TREE_EVENT_REMOVED, "/d/", NULL) && !tree_watch_next(leaf, &event));
+    ensure(!tree_create(tree, "/d/") && !tree_watch_next(leaf, &event));
+    tree_unwatch(leaf);
+    tree_unwatch(watch);
+    tree_free(tree);
+    tree_unwatch(recursive);
+}
+
+static void check_mounts(void)
+{
+    Tree* root = tree_new();
+    Tree* data = tree_new();
+    Tree* cache = tree_new();
+    Namespace* ns = ns_new(root);
+    ensure(!ns_create(ns, "/mnt/") && !ns_create(ns, "/mnt/data/") && !tree_create(data, "/x/"));
+    ensure(ns_mount(ns, "/", data) == EINVAL && ns_mount(ns, "/nope/", data) == ENOENT);
+    ensure(!ns_mount(ns, "/mnt/data/", data) && ns_mount(ns, "/mnt/data/", cache) == EBUSY);
+
+    // Paths below the mount point go to the mounted tree.
+    char* list = ns_list(ns, "/mnt/data/");
+    ensure(list && !strcmp(list, "x"));
+    free(list);
+    ensure(!ns_create(ns, "/mnt/data/y/") && tree_exists(data, "/y/") && !tree_exists(root, "/mnt/data/y/"));
+    ensure(!ns_create(ns, "/mnt/data/c/") && !ns_mount(ns, "/mnt/data/c/", cache));
+    ensure(!ns_write(ns, "/mnt/data/c/f/", 0, "abc", 3) && tree_exists(cache, "/f/"));
+    TreeReadResult read;
+    ensure(!ns_read(ns, "/mnt/data/c/f/", 1, 5, &read) && read.len == 2);
+    tree_read_release(&read);
+    TreeStat stat;
+    ensure(!ns_stat(ns, "/mnt/data/", &stat) && stat.children == 3);
+
+    // Mount points stay in place, and moves don't cross trees.
+    ensure(ns_remove(ns, "/mnt/data/") == EBUSY && ns_move(ns, "/mnt/data/", "/other/") == EBUSY);
+    ensure(ns_move(ns, "/mnt/", "/other/") == EBUSY);
+    ensure(ns_move(ns, "/mnt/data/x/", "/x/") == EXDEV);
+    ensure(!ns_move(ns, "/mnt/data/x/", "/mnt/data/y/x/") && tree_exists(data, "/y/x/"));
+
+    ensure(ns_umount(ns, "/mnt/data/") == EBUSY && ns_umount(ns, "/mnt/") == EINVAL);
+    ensure(!ns_umount(ns, "/mnt/data/c/") && !ns_umount(ns, "/mnt/data/"));
+    ensure(!ns_create(ns, "/mnt/data/z/") && tree_exists(root, "/mnt/data/z/") && !tree_exists(data, "/z/"));
+    ns_free(ns);
+    tree_free(root);
+    tree_free(data);
+    tree_free(cache);
+}
+
+// Holds the write lock of a folder from another thread: tree_walk locks it
+// and the visitor waits until it's released.
+typedef struct Holder {
+    Tree* tree;
+    const char* path;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool held;
+    bool released;
+} Holder;
+
+static void hold_visit(const char* path, const char* name, int depth, void* arg)
+{
+    (void)path;
+    (void)name;
+    (void)depth;
+    Holder* holder = arg;
+    pthread_mutex_lock(&holder->lock);
+    holder->held = true;
+    pthread_cond_broadcast(&holder->cond);
+    while (!holder->released)
+        pthread_cond_wait(&holder->cond, &holder->lock);
+    pthread_mutex_unlock(&holder->lock);
+}
+
+static void* run_holder(void* data)
+{
+    Holder* holder = data;
+    ensure(!tree_walk(holder->tree, holder->path, hold_visit, holder, 1));
+    return NULL;
+}
+
+// The folder must have exactly one descendant.
+static void hold(Holder* holder, Tree* tree, const char* path)
+{
+    *holder = (Holder) { tree, path, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, false };
+    if (pthread_create(&holder->thread, NULL, run_holder, holder))
+        syserr("Unable to create thread");
+    pthread_mutex_lock(&holder->lock);
+    while (!holder->held)
+        pthread_cond_wait(&holder->cond, &holder->lock);
+    pthread_mutex_unlock(&holder->lock);
+}
+
+static void release(Holder* holder)
+{
+    pthread_mutex_lock(&holder->lock);
+    holder->released = true;
+    pthread_cond_broadcast(&holder->cond);
+    pthread_mutex_unlock(&holder->lock);
+    if (pthread_join(holder->thread, NULL))
+        syserr("Unable to join thread");
+}
+
+static struct timespec in_ms(long ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += ms * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    return ts;
+}
+
+typedef struct Locker {
+    Tree* tree;
+    atomic_bool done;
+} Locker;
+
+// Keeps taking and dropping the write lock of /w/.
+static void* run_locker(void* data)
+{
+    Locker* locker = data;
+    while (!locker->done) {
+        tree_create(locker->tree, "/w/q/");
+        tree_remove(locker->tree, "/w/q/");
+    }
+    return NULL;
+}
+
+static void check_deadlines(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/") && !tree_write(tree, "/a/f/", 0, "abc", 3) && !tree_create(tree, "/b/"));
+    Holder holder;
+    hold(&holder, tree, "/a/");
+
+    // Everything that needs /a/ fails without waiting or changing the tree.
+    char* list = NULL;
+    TreeStat stat;
+    TreeReadResult read;
+    ensure(tree_list_try(tree, "/a/", &list) == EAGAIN && !list);
+    ensure(tree_create_try(tree, "/a/x/") == EAGAIN);
+    ensure(tree_remove_try(tree, "/a/f/") == EAGAIN);
+    ensure(tree_move_try(tree, "/a/f/", "/b/f/") == EAGAIN);
+    ensure(tree_stat_try(tree, "/a/f/", &stat) == EAGAIN);
+    ensure(tree_read_try(tree, "/a/f/", 0, 3, &read) == EAGAIN);
+    ensure(tree_write_try(tree, "/a/f/", 0, "x", 1) == EAGAIN);
+    ensure(tree_write_try(tree, "/a/g/", 0, "x", 1) == EAGAIN);
+
+    struct timespec deadline = in_ms(20);
+    ensure(tree_list_timed(tree, "/a/", &deadline, &list) == ETIMEDOUT && !list);
+    ensure(tree_create_timed(tree, "/a/x/", &deadline) == ETIMEDOUT);
+    ensure(tree_remove_timed(tree, "/a/f/", &deadline) == ETIMEDOUT);
+    ensure(tree_move_timed(tree, "/b/", "/a/b/", &deadline) == ETIMEDOUT);
+    ensure(tree_stat_timed(tree, "/a/f/", &stat, &deadline) == ETIMEDOUT);
+    ensure(tree_read_timed(tree, "/a/f/", 0, 3, &read, &deadline) == ETIMEDOUT);
+    ensure(tree_write_timed(tree, "/a/g/", 0, "x", 1, &deadline) == ETIMEDOUT);
+    ensure(now() >= deadline.tv_sec + deadline.tv_nsec * 1e-9);
+
+    // Other folders are not affected.
+    deadline = in_ms(1000);
+    ensure(!tree_create_try(tree, "/b/x/") && !tree_list_timed(tree, "/b/", &deadline, &list));
+    ensure(!strcmp(list, "x"));
+    free(list);
+    ensure(!tree_write_try(tree, "/b/g/", 0, "x", 1) && !tree_stat_try(tree, "/b/g/", &stat) && stat.is_file);
+    release(&holder);
+    ensure(lists(tree, "/a/", "f") && lists(tree, "/", "a,b") && !tree_exists(tree, "/a/g/"));
+    ensure(!tree_read_try(tree, "/a/f/", 0, 3, &read) && read.len == 3);
+    tree_read_release(&read);
+
+    // With the locks free the variants work like the plain operations.
+    deadline = in_ms(1000);
+    ensure(!tree_move_timed(tree, "/b/", "/a/b/", &deadline) && tree_move_try(tree, "/a/", "/a/b/c/") == EINVMV);
+    ensure(tree_create_try(tree, "/a/b/") == EEXIST && tree_remove_timed(tree, "/a/", &deadline) == ENOTEMPTY);
+    ensure(tree_create_try(tree, "bad") == EINVAL && tree_remove_try(tree, "/") == EBUSY);
+
+    // A write that creates a file and then fails to lock must not leave the
+    // file behind, even when another thread keeps taking the parent lock.
+    ensure(!tree_create(tree, "/w/"));
+    Locker locker = { tree, false };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_locker, &locker))
+        syserr("Unable to create thread");
+    char path[32];
+    for (long i = 0; i < 20000; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/w/f")), "/");
+        int result = tree_write_try(tree, path, 0, "x", 1);
+        ensure(!result || result == EAGAIN);
+        ensure(tree_exists(tree, path) == !result);
+    }
+    locker.done = true;
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    tree_free(tree);
+}
+
+// Creates and removes /p/ and /q/ together in transactions.
+static void* run_pair_txns(void* data)
+{
+    Locker* locker = data;
+    for (int i = 0; i < 20000; ++i) {
+        TreeTxn* txn = tree_txn_begin(locker->tree);
+        TreeTxnOpType type = i % 2 ? TREE_TXN_REMOVE : TREE_TXN_CREATE;
+        ensure(!tree_txn_add(txn, type, "/p/", NULL) && !tree_txn_add(txn, type, "/q/", NULL));
+        ensure(!tree_txn_commit(txn, NULL));
+    }
+    locker->done = true;
+    return NULL;
+}
+
+static void check_txns(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/a/x/"));
+    TreeTxn* txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/b/", NULL));
+    ensure(!tree_txn_add(txn, TREE_TXN_MOVE, "/a/x/", "/b/x/"));
+    ensure(!tree_txn_add(txn, TREE_TXN_REMOVE, "/a/", NULL));
+    ensure(tree_txn_add(txn, TREE_TXN_CREATE, "bad", NULL) == EINVAL);
+    ensure(tree_txn_add(txn, (TreeTxnOpType)7, "/c/", NULL) == EINVAL);
+    size_t failed = 99;
+    ensure(!tree_txn_commit(txn, &failed) && failed == 99);
+    ensure(lists(tree, "/", "b") && lists(tree, "/b/", "x"));
+
+    // A failing operation undoes the ones before it.
+    txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/c/", NULL));
+    ensure(!tree_txn_add(txn, TREE_TXN_MOVE, "/b/x/", "/c/x/"));
+    ensure(!tree_txn_add(txn, TREE_TXN_REMOVE, "/b/", NULL));
+    ensure(!tree_txn_add(txn, TREE_TXN_REMOVE, "/nope/", NULL));
+    ensure(tree_txn_commit(txn, &failed) == ENOENT && failed == 3);
+    ensure(lists(tree, "/", "b") && lists(tree, "/b/", "x"));
+    txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/c/", NULL) && !tree_txn_add(txn, TREE_TXN_CREATE, "/c/", NULL));
+    ensure(tree_txn_commit(txn, &failed) == EEXIST && failed == 1 && !tree_exists(tree, "/c/"));
+    txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_MOVE, "/b/", "/b/x/y/"));
+    ensure(tree_txn_commit(txn, &failed) == EINVMV && failed == 0);
+    ensure(!tree_txn_commit(tree_txn_begin(tree), NULL));
+    txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/c/", NULL));
+    tree_txn_abort(txn);
+    ensure(!tree_exists(tree, "/c/"));
+
+    // Others see both folders of a transaction or neither.
+    Locker locker = { tree, false };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_pair_txns, &locker))
+        syserr("Unable to create thread");
+    while (!locker.done) {
+        char* list = sorted_list(tree, "/");
+        ensure(!strcmp(list, "b") || !strcmp(list, "b,p,q"));
+        free(list);
+    }
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    ensure(lists(tree, "/", "b"));
+    tree_free(tree);
+}
+
+typedef struct Striper {
+    Tree* tree;
+    bool remove;
+    long n_succeeded;
+} Striper;
+
+// Creates (or removes) the same 5000 folders in /hot/ as the other threads.
+static void* run_striper(void* data)
+{
+    Striper* striper = data;
+    char path[32];
+    for (long i = 0; i < 5000; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/hot/")), "/");
+        int result = striper->remove ? tree_remove(striper->tree, path) : tree_create(striper->tree, path);
+        ensure(!result || result == (striper->remove ? ENOENT : EEXIST));
+        striper->n_succeeded += !result;
+    }
+    return NULL;
+}
+
+static long count_names(const char* list)
+{
+    long n = *list != '\0';
+    for (; *list; ++list)
+        n += *list == ',';
+    return n;
+}
+
+static void check_striping(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/hot/"));
+    for (int remove = 0; remove < 2; ++remove) {
+        Striper stripers[4];
+        pthread_t threads[4];
+        for (int i = 0; i < 4; ++i) {
+            stripers[i] = (Striper) { tree, remove, 0 };
+            if (pthread_create(&threads[i], NULL, run_striper, &stripers[i]))
+                syserr("Unable to create thread");
+        }
+        // Lists taken meanwhile are whole lists of distinct names.
+        for (int i = 0; i < 50; ++i) {
+            char* list = sorted_list(tree, "/hot/");
+            const char* previous = "";
+            for (char* name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+                ensure(strcmp(previous, name) < 0);
+                previous = name;
+            }
+            free(list);
+        }
+        long n_succeeded = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (pthread_join(threads[i], NULL))
+                syserr("Unable to join thread");
+            n_succeeded += stripers[i].n_succeeded;
+        }
+        // Each name was created (removed) exactly once.
+        ensure(n_succeeded == 5000);
+        char* list = tree_list(tree, "/hot/");
+        ensure(count_names(list) == (remove ? 0 : 5000));
+        free(list);
+        ensure(remove ? stats(tree, "/", 1, 1, 1) : stats(tree, "/", 5001, 2, 1));
+    }
+
+    // Busy or non-empty children of a striped folder are still handled.
+    char path[32];
+    for (long i = 0; i < 2000; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/hot/")), "/");
+        ensure(!tree_create(tree, path));
+    }
+    ensure(!tree_create(tree, "/hot/a/b/") && tree_remove(tree, "/hot/a/") == ENOTEMPTY);
+    TreeDir* dir = tree_open(tree, "/hot/c/");
+    ensure(dir && !tree_remove(tree, "/hot/c/") && tree_dir_create(dir, "/x/") == ENOENT);
+    tree_close(dir);
+    Holder holder;
+    hold(&holder, tree, "/hot/a/");
+    ensure(tree_remove_try(tree, "/hot/a/b/") == EAGAIN && !tree_remove(tree, "/hot/d/"));
+    release(&holder);
+    ensure(!tree_remove(tree, "/hot/a/b/") && !tree_remove(tree, "/hot/a/") && !tree_exists(tree, "/hot/a/"));
+    ensure(stats(tree, "/hot/", 1997, 1, 1997));
+    tree_free(tree);
+}
+
+typedef struct Paths {
+    pthread_mutex_t lock;
+    size_t root_len;
+    char** paths;
+    size_t n;
+    size_t capacity;
+} Paths;
+
+static void collect_path(const char* path, const char* name, int depth, void* arg)
+{
+    (void)name;
+    (void)depth;
+    Paths* paths = arg;
+    pthread_mutex_lock(&paths->lock);
+    if (paths->n == paths->capacity) {
+        paths->capacity = paths->capacity ? 2 * paths->capacity : 64;
+        if (!(paths->paths = realloc(paths->paths, paths->capacity * sizeof(char*))))
+            bad_malloc();
+    }
+    if (!(paths->paths[paths->n++] = strdup(path + paths->root_len)))
+        bad_malloc();
+    pthread_mutex_unlock(&paths->lock);
+}
+
+// The subtrees have the same folders and files, by relative path.
+static bool same_subtrees(Tree* a, const char* a_path, Tree* b, const char* b_path)
+{
+    Paths paths[2] = { { PTHREAD_MUTEX_INITIALIZER, strlen(a_path) - 1, NULL, 0, 0 },
+        { PTHREAD_MUTEX_INITIALIZER, strlen(b_path) - 1, NULL, 0, 0 } };
+    ensure(!tree_walk(a, a_path, collect_path, &paths[0], 2) && !tree_walk(b, b_path, collect_path, &paths[1], 2));
+    bool same = paths[0].n == paths[1].n;
+    for (int i = 0; i < 2; ++i)
+        qsort(paths[i].paths, paths[i].n, sizeof(char*), compare_strings);
+    for (size_t i = 0; same && i < paths[0].n; ++i)
+        same = !strcmp(paths[0].paths[i], paths[1].paths[i]);
+    for (int i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < paths[i].n; ++j)
+            free(paths[i].paths[j]);
+        free(paths[i].paths);
+    }
+    return same;
+}
+
+static void check_copy(void)
+{
+    Tree* tree = tree_new();
+    char path[64];
+    ensure(!tree_create(tree, "/src/"));
+    for (int i = 0; i < 3000; ++i) {
+        sprintf(path, "/src/%c/", 'a' + i / 300);
+        tree_create(tree, path);
+        sprintf(path, "/src/%c/%c/", 'a' + i / 300, 'a' + i / 30 % 10);
+        tree_create(tree, path);
+        sprintf(path, "/src/%c/%c/%c/", 'a' + i / 300, 'a' + i / 30 % 10, 'a' + i % 30 % 26);
+        tree_create(tree, path);
+    }
+    ensure(!tree_write(tree, "/src/a/a/file/", 0, "source", 6));
+    TreeStat source, copy;
+    ensure(!tree_stat(tree, "/src/", &source));
+
+    ensure(!tree_copy(tree, "/src/", "/dst/"));
+    ensure(same_subtrees(tree, "/src/", tree, "/dst/"));
+    ensure(!tree_stat(tree, "/dst/", &copy) && copy.descendants == source.descendants && copy.height == source.height);
+    ensure(consistent(tree, "/") && consistent(tree, "/dst/"));
+
+    // Files share data until one side is written.
+    char buf[16];
+    ensure(read_into(tree, "/dst/a/a/file/", 0, 16, buf) == 6 && !memcmp(buf, "source", 6));
+    ensure(!tree_write(tree, "/dst/a/a/file/", 0, "copy", 4));
+    ensure(read_into(tree, "/src/a/a/file/", 0, 16, buf) == 6 && !memcmp(buf, "source", 6));
+    ensure(read_into(tree, "/dst/a/a/file/", 0, 16, buf) == 6 && !memcmp(buf, "copyce", 6));
+    ensure(!tree_copy(tree, "/src/a/a/file/", "/f/") && read_into(tree, "/f/", 0, 16, buf) == 6);
+    ensure(!tree_create(tree, "/dst/a/a/new/") && !tree_exists(tree, "/src/a/a/new/"));
+
+    // Errors of the target come before the copy is built, so a source held
+    // by another thread doesn't delay them.
+    Holder holder;
+    hold(&holder, tree, "/src/");
+    ensure(tree_copy(tree, "/src/", "/dst/") == EEXIST && tree_copy(tree, "/src/", "/nope/x/") == ENOENT);
+    ensure(tree_copy(tree, "/src/", "/f/x/") == ENOTDIR);
+    release(&holder);
+    ensure(tree_copy(tree, "/nope/", "/x/") == ENOENT);
+    ensure(tree_copy(tree, "src", "/x/") == EINVAL && tree_copy(tree, "/src/", "/") != 0);
+    ensure(!tree_exists(tree, "/x/") && stats(tree, "/", 2 * source.descendants + 4, source.height + 1, 3));
+    tree_free(tree);
+}
+
+// Moves /a/ to /m/ and back.
+static void* run_mover(void* data)
+{
+    Locker* locker = data;
+    for (int i = 0; i < 20000; ++i)
+        ensure(!tree_move(locker->tree, i % 2 ? "/m/" : "/a/", i % 2 ? "/a/" : "/m/"));
+    locker->done = true;
+    return NULL;
+}
+
+static void check_handles(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/a/b/") && !tree_write(tree, "/f/", 0, "x", 1));
+    ensure(!tree_open(tree, "/nope/") && !tree_open(tree, "/f/") && !tree_open(tree, "bad"));
+    TreeDir* dir = tree_open(tree, "/a/b/");
+    TreeDir* root = tree_open(tree, "/");
+    ensure(dir && root);
+    ensure(!tree_dir_create(dir, "/c/") && !tree_dir_create(dir, "/c/d/") && tree_exists(tree, "/a/b/c/d/"));
+    ensure(tree_dir_create(dir, "/c/") == EEXIST && tree_dir_create(dir, "/x/y/") == ENOENT);
+    ensure(tree_dir_create(dir, "c") == EINVAL);
+    char* list = tree_dir_list(dir, "/");
+    ensure(list && !strcmp(list, "c"));
+    free(list);
+    ensure(!tree_dir_move(dir, "/c/d/", "/e/") && lists(tree, "/a/b/", "c,e"));
+    ensure(tree_dir_move(dir, "/c/", "/c/x/") == EINVMV && tree_dir_remove(dir, "/") == EBUSY);
+    ensure(tree_dir_remove(dir, "/nope/") == ENOENT && !tree_dir_remove(dir, "/e/"));
+
+    // The handle follows its folder, and moves of its ancestors.
+    ensure(!tree_move(tree, "/a/b/", "/b/") && !tree_dir_create(dir, "/g/") && tree_exists(tree, "/b/g/"));
+    ensure(!tree_create(tree, "/z/") && !tree_move(tree, "/b/", "/z/b/"));
+    ensure(!tree_dir_create(dir, "/h/") && lists(tree, "/z/b/", "c,g,h"));
+    ensure(!tree_dir_create(root, "/i/") && lists(tree, "/", "a,f,i,z"));
+
+    // Operations on a handle of a removed folder fail.
+    TreeDir* leaf = tree_open(tree, "/z/b/h/");
+    ensure(leaf && !tree_remove(tree, "/z/b/h/"));
+    ensure(!tree_dir_list(leaf, "/") && tree_dir_create(leaf, "/x/") == ENOENT);
+    ensure(!tree_create(tree, "/z/b/h/") && tree_dir_create(leaf, "/x/") == ENOENT);
+    tree_close(leaf);
+
+    // Creates and removes through a handle while its ancestor keeps moving.
+    ensure(!tree_create(tree, "/a/w/"));
+    TreeDir* moving = tree_open(tree, "/a/w/");
+    Locker locker = { tree, false };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_mover, &locker))
+        syserr("Unable to create thread");
+    while (!locker.done) {
+        ensure(!tree_dir_create(moving, "/x/"));
+        ensure(!tree_dir_remove(moving, "/x/"));
+    }
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    ensure(!tree_dir_create(moving, "/y/") && tree_exists(tree, "/a/w/y/"));
+    tree_close(moving);
+    tree_close(dir);
+    tree_close(root);
+    tree_free(tree);
+}
+
+typedef struct Freezer {
+    Tree* tree;
+    const char* const* paths;
+    int n;
+    atomic_bool done;
+} Freezer;
+
+// Freezes the folders one by one.
+static void* run_freezer(void* data)
+{
+    Freezer* freezer = data;
+    for (int i = 0; i < freezer->n; ++i) {
+        ensure(!tree_freeze(freezer->tree, freezer->paths[i], i % 2));
+        sched_yield();
+    }
+    atomic_store(&freezer->done, true);
+    return NULL;
+}
+
+static void check_queries(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/a/b/") && !tree_create(tree, "/a/b/c/"));
+    ensure(!tree_create(tree, "/a/d/") && !tree_write(tree, "/a/f/", 0, "x", 1));
+
+    // tree_stat and tree_exists don't allocate.
+    TreeStat stat;
+    ensure(!tree_stat(tree, "/a/b/", &stat) && tree_exists(tree, "/a/f/"));
+    size_t before = mallinfo2().uordblks;
+    for (int i = 0; i < 1000; ++i) {
+        ensure(!tree_stat(tree, "/a/b/", &stat) && stat.descendants == 1);
+        ensure(tree_exists(tree, "/a/b/c/") && tree_exists(tree, "/a/f/") && !tree_exists(tree, "/a/x/"));
+        ensure(tree_stat(tree, "/a/x/", &stat) == ENOENT && !tree_exists(tree, "bad"));
+    }
+    ensure(mallinfo2().uordblks == before);
+
+    // Each result of tree_list_many is what tree_list would return.
+    const char* paths[] = { "/a/b/", "/", "/a/", "/a/f/", "/nope/", "/a/b/c/", "bad", "/a/" };
+    char* out[8];
+    tree_list_many(tree, paths, 8, out);
+    ensure(!out[3] && !out[4] && !out[6] && out[5]);
+    for (int i = 0; i < 8; ++i) {
+        char* list = tree_list(tree, paths[i]);
+        ensure(list ? out[i] && !strcmp(list, out[i]) : !out[i]);
+        free(list);
+        free(out[i]);
+    }
+    tree_list_many(tree, paths, 0, out);
+
+    // Listing while the listed folders get frozen one by one.
+    static char names[64][16];
+    const char* many[64];
+    char path[32];
+    ensure(!tree_create(tree, "/m/"));
+    for (int i = 0; i < 64; ++i) {
+        sprintf(names[i], "/m/%c%c/", 'a' + i / 26, 'a' + i % 26);
+        many[i] = names[i];
+        strcpy(path, names[i]);
+        strcat(path, "x/");
+        ensure(!tree_create(tree, names[i]) && !tree_create(tree, path));
+    }
+    Freezer freezer = { tree, many, 64, false };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_freezer, &freezer))
+        syserr("Unable to create thread");
+    char* lists_out[64];
+    while (!atomic_load(&freezer.done)) {
+        tree_list_many(tree, many, 64, lists_out);
+        for (int i = 0; i < 64; ++i) {
+            ensure(lists_out[i] && !strcmp(lists_out[i], "x"));
+            free(lists_out[i]);
+        }
+    }
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    ensure(!tree_move(tree, "/m/", "/n/") && lists(tree, "/n/aa/", "x"));
+    tree_free(tree);
+}
+
+// Creates /p<letter>/<name>/ for 500 names in the shared tree.
+static void fill_shared(ShmTree* tree, char letter)
+{
+    char path[32];
+    sprintf(path, "/p%c/", letter);
+    ensure(!shm_tree_create(tree, path));
+    for (long i = 0; i < 500; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/p%c/", letter)), "/");
+        ensure(!shm_tree_create(tree, path));
+    }
+}
+
+static void check_shared(void)
+{
+    char name[32];
+    sprintf(name, "/bench-check-%d", (int)getpid());
+    shm_tree_unlink(name);
+    ShmTree* tree = shm_tree_open(name, 16 << 20);
+    if (!tree)
+        syserr("Unable to open %s", name);
+    ensure(!shm_tree_create(tree, "/a/") && shm_tree_create(tree, "/a/") == EEXIST);
+
+    // Two processes change the tree at once, each through its own mapping.
+    pid_t pid = fork();
+    if (pid < 0)
+        syserr("fork");
+    if (!pid) {
+        ShmTree* child = shm_tree_open(name, 16 << 20);
+        if (!child)
+            _exit(2);
+        fill_shared(child, 'c');
+        ensure(!shm_tree_move(child, "/a/", "/pc/moved/"));
+        shm_tree_close(child);
+        _exit(0);
+    }
+    fill_shared(tree, 'p');
+    int status;
+    if (waitpid(pid, &status, 0) != pid)
+        syserr("waitpid");
+    ensure(WIFEXITED(status) && !WEXITSTATUS(status));
+    char* list = shm_tree_list(tree, "/");
+    ensure(list && (!strcmp(list, "pc,pp") || !strcmp(list, "pp,pc")));
+    free(list);
+    list = shm_tree_list(tree, "/pc/");
+    ensure(list && count_names(list) == 501);
+    free(list);
+    ensure(shm_tree_remove(tree, "/pc/") == ENOTEMPTY && !shm_tree_remove(tree, "/pc/moved/"));
+    ensure(shm_tree_move(tree, "/pc/", "/pc/x/") == EINVMV && shm_tree_list(tree, "/nope/") == NULL);
+
+    // A reopened segment keeps the tree, and a full one reports ENOSPC.
+    shm_tree_close(tree);
+    tree = shm_tree_open(name, 0);
+    ensure(tree && shm_tree_create(tree, "/pp/a/") == EEXIST);
+    shm_tree_close(tree);
+    ensure(!shm_tree_unlink(name));
+    tree = shm_tree_open(name, 64 << 10);
+    ensure(tree);
+    int result = 0;
+    char path[32];
+    for (long i = 0; !result; ++i) {
+        strcpy(number_name(i, path + sprintf(path, "/")), "/");
+        result = shm_tree_create(tree, path);
+    }
+    ensure(result == ENOSPC && shm_tree_free_space(tree) < 1024);
+    shm_tree_close(tree);
+    ensure(!shm_tree_unlink(name));
+}
+
+static const char* program; // argv[0], to find the other executables
+
+// Waits up to `seconds` for the child to exit and returns its wait status,
+// or kills it and returns -1.
+static int wait_exit(pid_t pid, double seconds)
+{
+    double deadline = now() + seconds;
+    int status;
+    while (waitpid(pid, &status, WNOHANG) != pid) {
+        if (now() > deadline) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return -1;
+        }
+        struct timespec ts = { 0, 10000000 };
+        nanosleep(&ts, NULL);
+    }
+    return status;
+}
+
+static void check_server(void)
+{
+    char server_path[1024], socket_path[64];
+    const char* slash = strrchr(program, '/');
+    snprintf(server_path, sizeof(server_path), "%.*sserver", slash ? (int)(slash - program + 1) : 0, program);
+    sprintf(socket_path, "/tmp/bench-check-%d.sock", (int)getpid());
+    pid_t pid = fork();
+    if (pid < 0)
+        syserr("fork");
+    if (!pid) {
+        execl(server_path, server_path, socket_path, "2", (char*)NULL);
+        _exit(127);
+    }
+    TreeClient* client = NULL;
+    for (double deadline = now() + 5; !client && now() < deadline;) {
+        if (!(client = tree_client_connect(socket_path))) {
+            struct timespec ts = { 0, 10000000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    ensure(client);
+
+    ensure(!tree_client_create(client, "/a/") && tree_client_create(client, "/a/") == EEXIST);
+    ensure(tree_client_create(client, "bad") == EINVAL && !tree_client_move(client, "/a/", "/b/"));
+    char* list = tree_client_list(client, "/");
+    ensure(list && !strcmp(list, "b"));
+    free(list);
+    ensure(!tree_client_list(client, "/a/"));
+
+    // pipelined messages, with results matched by tag
+    char paths[200][16];
+    for (long i = 0; i < 200; ++i) {
+        strcpy(number_name(i, paths[i] + sprintf(paths[i], "/b/")), "/");
+        TreeOp op = { TREE_OP_CREATE, paths[i], NULL, paths[i] };
+        ensure(!tree_client_submit(client, &op));
+        if (i % 50 == 49)
+            ensure(!tree_client_flush(client));
+    }
+    TreeCompletion completions[200];
+    for (size_t n = 0; n < 200;)
+        n += tree_client_reap(client, completions + n, 200 - n, true);
+    for (int i = 0; i < 200; ++i)
+        ensure(!completions[i].result && completions[i].user_data >= (void*)paths[0]);
+    list = tree_client_list(client, "/b/");
+    ensure(list && count_names(list) == 200);
+    free(list);
+
+    // A message whose ops run out before its count closes the connection
+    // after the first op is submitted; the server must keep serving others
+    // and still shut down.
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    ensure(fd >= 0 && !connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+    char message[64];
+    TreeReqEntry entry = { 1, TREE_OP_CREATE, 0, 4, 0, 0 };
+    TreeMsgHeader header = { sizeof(entry) + 4, 3 };
+    memcpy(message, &header, sizeof(header));
+    memcpy(message + sizeof(header), &entry, sizeof(entry));
+    memcpy(message + sizeof(header) + sizeof(entry), "/bc/", 4);
+    ensure(write(fd, message, sizeof(header) + header.size) == (ssize_t)(sizeof(header) + header.size));
+    while (read(fd, message, sizeof(message)) > 0) { }
+    close(fd);
+    ensure(tree_client_remove(client, "/b/a/") == 0);
+    list = tree_client_list(client, "/");
+    ensure(list && (!strcmp(list, "b,bc") || !strcmp(list, "bc,b")));
+    free(list);
+    tree_client_close(client);
+
+    ensure(!kill(pid, SIGINT));
+    int status = wait_exit(pid, 10);
+    ensure(status != -1 && WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+#define FREEZING_OPS 4000
+
+typedef struct Freezing {
+    Tree* tree;
+    atomic_long done;
+    int results[FREEZING_OPS];
+} Freezing;
+
+// Path of the i-th change of run_freezing: a folder, a file, a folder
+// created by tree_children_apply, or one of the folders /r/ started with.
+static char* freezing_path(long i, char* path)
+{
+    static const char kinds[] = "cfkd";
+    strcpy(number_name(i / 4, path + sprintf(path, "/r/%c", kinds[i % 4])), "/");
+    return path;
+}
+
+// Changes /r/ in every way while it gets frozen, striped paths included.
+static void* run_freezing(void* data)
+{
+    Freezing* freezing = data;
+    char path[32];
+    for (long i = 0; i < FREEZING_OPS; ++i) {
+        freezing_path(i, path);
+        int* result = &freezing->results[i];
+        if (i % 4 == 0) {
+            *result = tree_create(freezing->tree, path);
+        } else if (i % 4 == 1) {
+            *result = tree_write(freezing->tree, path, 0, "x", 1);
+        } else if (i % 4 == 2) {
+            TreeChildOp op = { path + 3, false };
+            path[strlen(path) - 1] = '\0';
+            tree_children_apply(freezing->tree, "/r/", &op, result, 1);
+        } else {
+            *result = tree_remove(freezing->tree, path);
+        }
+        atomic_store(&freezing->done, i + 1);
+        sched_yield();
+    }
+    return NULL;
+}
+
+static void check_frozen(void)
+{
+    Tree* tree = tree_new();
+    const char* names[] = { "d", "b", "e", "a", "c" };
+    char path[64];
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/y/"));
+    for (int i = 0; i < 5; ++i) {
+        sprintf(path, "/a/%s/", names[i]);
+        ensure(!tree_create(tree, path));
+        sprintf(path, "/a/%s/%s/", names[i], names[i]);
+        ensure(!tree_create(tree, path));
+    }
+    ensure(!tree_write(tree, "/a/f/", 0, "frozen", 6));
+    ensure(tree_freeze(tree, "bad", true) == EINVAL && tree_freeze(tree, "/nope/", true) == ENOENT);
+    ensure(!tree_freeze(tree, "/a/", true) && !tree_freeze(tree, "/a/", false) && !tree_freeze(tree, "/a/b/", false));
+
+    // Nothing inside changes, by any kind of operation.
+    ensure(tree_create(tree, "/a/x/") == EROFS && tree_create(tree, "/a/b/x/") == EROFS);
+    ensure(tree_remove(tree, "/a/b/b/") == EROFS && tree_remove(tree, "/a/") == EROFS);
+    ensure(tree_move(tree, "/a/b/", "/x/") == EROFS && tree_move(tree, "/y/", "/a/y/") == EROFS);
+    ensure(tree_move(tree, "/a/b/", "/a/c/x/") == EROFS && tree_write(tree, "/a/f/", 0, "x", 1) == EROFS);
+    ensure(tree_write(tree, "/a/g/", 0, "x", 1) == EROFS && tree_copy(tree, "/y/", "/a/y/") == EROFS);
+    TreeChildOp ops[] = { { "x", false }, { "b", true } };
+    int results[2];
+    tree_children_apply(tree, "/a/", ops, results, 2);
+    ensure(results[0] == EROFS && results[1] == EROFS);
+    TreeTxn* txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/z/", NULL) && !tree_txn_add(txn, TREE_TXN_REMOVE, "/a/c/c/", NULL));
+    size_t failed;
+    ensure(tree_txn_commit(txn, &failed) == EROFS && failed == 1 && !tree_exists(tree, "/z/"));
+
+    // Reads see the same tree, with sorted lists of compact folders.
+    char buf[16];
+    ensure(lists(tree, "/a/e/", "e") && !tree_list(tree, "/a/x/"));
+    char* list = tree_list(tree, "/a/");
+    ensure(list && !strcmp(list, "a,b,c,d,e,f"));
+    free(list);
+    list = tree_list_prefix(tree, "/a/", "d");
+    ensure(list && !strcmp(list, "d"));
+    free(list);
+    ensure(read_into(tree, "/a/f/", 0, 16, buf) == 6 && !memcmp(buf, "frozen", 6));
+    ensure(stats(tree, "/a/", 11, 2, 6) && consistent(tree, "/"));
+    ensure(finds(tree, "/", "/a/*/c/", 2, "/a/c/c/"));
+    ensure(!tree_copy(tree, "/a/", "/copy/") && same_subtrees(tree, "/a/", tree, "/copy/"));
+    ensure(!tree_create(tree, "/copy/x/") && !tree_exists(tree, "/a/x/"));
+
+    // The frozen root moves as a whole, and stays frozen.
+    ensure(!tree_move(tree, "/a/", "/y/a/") && !tree_move(tree, "/y/a/", "/a/"));
+    ensure(tree_create(tree, "/a/x/") == EROFS && lists(tree, "/a/", "a,b,c,d,e,f"));
+
+    // Lock-free reads of a frozen folder whose root keeps moving.
+    Locker locker = { tree, false };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_mover, &locker))
+        syserr("Unable to create thread");
+    while (!locker.done) {
+        TreeStat stat;
+        for (int i = 0; i < 2; ++i) {
+            if ((list = tree_list(tree, i ? "/m/c/" : "/a/c/"))) {
+                ensure(!strcmp(list, "c"));
+                free(list);
+            }
+            if (!tree_stat(tree, i ? "/m/" : "/a/", &stat))
+                ensure(stat.descendants == 11);
+        }
+    }
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    ensure(lists(tree, "/", "a,copy,y") && consistent(tree, "/"));
+
+    // A freeze racing changes of a striped folder: each change either made
+    // it into the frozen folder or failed with EROFS, and none came after one
+    // that failed.
+    static Freezing freezing;
+    freezing.tree = tree;
+    ensure(!tree_create(tree, "/r/"));
+    for (long i = 3; i < FREEZING_OPS; i += 4)
+        ensure(!tree_create(tree, freezing_path(i, path)));
+    if (pthread_create(&thread, NULL, run_freezing, &freezing))
+        syserr("Unable to create thread");
+    while (atomic_load(&freezing.done) < FREEZING_OPS / 4)
+        sched_yield();
+    ensure(!tree_freeze(tree, "/r/", true));
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    bool refused = false;
+    for (long i = 0; i < FREEZING_OPS; ++i) {
+        int result = freezing.results[i];
+        ensure(!result || result == EROFS);
+        ensure(!refused || result == EROFS);
+        refused = result == EROFS;
+        ensure(tree_exists(tree, freezing_path(i, path)) == (i % 4 == 3 ? result != 0 : !result));
+    }
+    ensure(consistent(tree, "/r/"));
+    tree_free(tree);
+}
+
+static void check_replica(void)
+{
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/a/b/") && !tree_log_seq(tree));
+    Tree* snapshot;
+    uint64_t seq;
+    TreeLogStream* stream = tree_log_open(tree, &snapshot, &seq);
+    ensure(stream && !seq && lists(snapshot, "/a/", "b"));
+
+    // Each change gives one record (a write of a new file - two); failed operations give none.
+    ensure(!tree_create(tree, "/c/") && tree_create(tree, "/c/") == EEXIST && !tree_move(tree, "/c/", "/a/c/"));
+    ensure(!tree_write(tree, "/f/", 1, "xy", 2) && tree_remove(tree, "/a/") == ENOTEMPTY && !tree_remove(tree, "/a/b/"));
+    TreeChildOp ops[] = { { "d", false }, { "d", true }, { "x", true } };
+    int results[3];
+    tree_children_apply(tree, "/a/", ops, results, 3);
+    TreeTxn* txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/t/", NULL) && !tree_txn_add(txn, TREE_TXN_MOVE, "/t/", "/a/t/"));
+    ensure(!tree_txn_commit(txn, NULL) && !tree_freeze(tree, "/a/", true));
+    const struct {
+        TreeLogOpType type;
+        uint32_t txn_left;
+        const char* path;
+        const char* target;
+    } expected[] = {
+        { TREE_LOG_CREATE, 0, "/c/", NULL }, { TREE_LOG_MOVE, 0, "/c/", "/a/c/" },
+        { TREE_LOG_WRITE, 0, "/f/", NULL }, { TREE_LOG_WRITE, 0, "/f/", NULL }, { TREE_LOG_REMOVE, 0, "/a/b/", NULL },
+        { TREE_LOG_CREATE, 0, "/a/d/", NULL }, { TREE_LOG_REMOVE, 0, "/a/d/", NULL },
+        { TREE_LOG_CREATE, 1, "/t/", NULL }, { TREE_LOG_MOVE, 0, "/t/", "/a/t/" },
+        { TREE_LOG_FREEZE, 0, "/a/", NULL },
+    };
+    const TreeLogRecord* records[16];
+    struct timespec deadline = in_ms(1000);
+    size_t n = tree_log_read(stream, records, 16, &deadline);
+    ensure(n == 10 && tree_log_seq(tree) == 10);
+    for (size_t i = 0; i < n; ++i) {
+        ensure(records[i]->seq == i + 1 && records[i]->type == expected[i].type);
+        ensure(records[i]->txn_left == expected[i].txn_left && !strcmp(records[i]->path, expected[i].path));
+        ensure(!expected[i].target || !strcmp(records[i]->target, expected[i].target));
+    }
+    ensure(!records[2]->len && records[3]->offset == 1 && records[3]->len == 2 && !memcmp(records[3]->data, "xy", 2));
+    ensure(records[9]->compact);
+    tree_log_release(records, n);
+    deadline = in_ms(10);
+    ensure(!tree_log_read(stream, records, 16, &deadline));
+    tree_log_close(stream);
+    ensure(lists(snapshot, "/", "a") && lists(snapshot, "/a/", "b"));
+    tree_free(snapshot);
+
+    // A replica of a tree changed from many threads ends up with the same tree.
+    TreeReplica* replica = tree_replica_new(tree);
+    ensure(lists(tree_replica_tree(replica), "/a/", "c,t"));
+    run_workers(tree, 4, 20000);
+    seq = tree_log_seq(tree);
+    deadline = in_ms(10000);
+    ensure(seq > 10 && !tree_replica_wait(replica, seq, &deadline) && tree_replica_seq(replica) >= seq);
+    deadline = in_ms(10);
+    ensure(tree_replica_wait(replica, tree_log_seq(tree) + 1, &deadline) == ETIMEDOUT);
+    TreeReplicaStats stats;
+    tree_replica_stats(replica, &stats);
+    ensure(stats.seq == seq && !stats.behind && !stats.errors && stats.batches && stats.max_lag >= stats.lag);
+    char path[2 * MAX_DEPTH + 2] = "/";
+    ensure(same_lists(tree, tree_replica_tree(replica), path, 0));
+    ensure(!tree_create(tree, "/e/") && !tree_replica_wait(replica, tree_log_seq(tree), NULL));
+    ensure(tree_exists(tree_replica_tree(replica), "/e/"));
+    tree_replica_free(replica);
+    tree_free(tree);
+}
+
+static void check_bulk(void)
+{
+    // Paths of a four-level tree, sorted, with duplicates and missing ancestors,
+    // and one top-level folder big enough to be split between threads.
+    char** paths = malloc(6000 * sizeof(char*));
+    if (!paths)
+        bad_malloc();
+    size_t n = 0;
+    for (long i = 0; i < 2000; ++i) {
+        char path[32] = "/";
+        char* p = number_name(i % 40, path + 1);
+        *p++ = '/';
+        if (i % 3) {
+            p = number_name(i / 40, p);
+            *p++ = '/';
+        }
+        *p = '\0';
+        if (!(paths[n++] = strdup(path)))
+            bad_malloc();
+        if (i % 7 == 0) {
+            strcpy(p, "x/y/");
+            if (!(paths[n++] = strdup(path)))
+                bad_malloc();
+        }
+    }
+    for (long i = 0; i < 3000; ++i) {
+        char path[32] = "/zz/";
+        strcpy(number_name(i, path + 4), "/");
+        if (!(paths[n++] = strdup(path)))
+            bad_malloc();
+    }
+    qsort(paths, n, sizeof(char*), compare_strings);
+    if (!(paths[n] = strdup(paths[n - 1])))
+        bad_malloc();
+    n++;
+
+    for (int threads = 1; threads <= 4; threads *= 4) {
+        Tree* tree = tree_new();
+        ensure(!tree_bulk_load(tree, (const char* const*)paths, n, threads));
+        Tree* expected = tree_new();
+        for (size_t i = 0; i < n; ++i) {
+            char path[32];
+            for (char* slash = paths[i]; (slash = strchr(slash + 1, '/'));) {
+                memcpy(path, paths[i], slash - paths[i] + 1);
+                path[slash - paths[i] + 1] = '\0';
+                tree_create(expected, path);
+            }
+        }
+        ensure(same_subtrees(tree, "/", expected, "/") && consistent(tree, "/"));
+        TreeStat a, b;
+        ensure(!tree_stat(tree, "/", &a) && !tree_stat(expected, "/", &b) && a.descendants == b.descendants);
+        ensure(a.height == 4 && a.children == 41 && stats(tree, "/zz/", 3000, 1, 3000));
+        ensure(!tree_create(tree, "/ab/new/") && !tree_remove(tree, "/ab/new/") && !tree_remove(tree, "/zz/a/"));
+
+        // After an error the tree doesn't change.
+        const char* existing[] = { "/bb/", "/new/" };
+        const char* unsorted[] = { "/new/b/", "/new/a/" };
+        const char* invalid[] = { "/new/", "new" };
+        ensure(tree_bulk_load(tree, existing, 2, threads) == EEXIST && !tree_exists(tree, "/new/"));
+        ensure(tree_bulk_load(tree, unsorted, 2, threads) == EINVAL && !tree_exists(tree, "/new/"));
+        ensure(tree_bulk_load(tree, invalid, 2, threads) == EINVAL && !tree_exists(tree, "/new/"));
+        ensure(!tree_bulk_load(tree, invalid, 0, threads) && !tree_bulk_load(tree, unsorted + 1, 1, threads));
+        ensure(tree_exists(tree, "/new/a/") && !tree_freeze(tree, "/", false));
+        ensure(tree_bulk_load(tree, unsorted, 1, threads) == EROFS && !tree_exists(tree, "/new/b/"));
+        ensure(!tree_stat(tree, "/", &a) && a.descendants == b.descendants + 1);
+        tree_free(expected);
+        tree_free(tree);
+    }
+    for (size_t i = 0; i < n; ++i)
+        free(paths[i]);
+    free(paths);
+}
+
+// Creates /th/ in a thread of its own.
+static void* run_traced(void* data)
+{
+    ensure(!tree_create(data, "/th/"));
+    return NULL;
+}
+
+typedef struct Traced {
+    TreeTraceEntry entry;
+    uint64_t args[2];
+    char path[64];
+    char target[64];
+} Traced;
+
+static bool traced(const Traced* traced, int op, int flags, int result, const char* path, const char* target)
+{
+    return traced->entry.op == op && traced->entry.flags == flags && traced->entry.result == result
+        && !strcmp(traced->path, path) && !strcmp(traced->target, target);
+}
+
+static void check_trace(void)
+{
+    char trace_path[64];
+    sprintf(trace_path, "/tmp/bench-trace-%d", (int)getpid());
+    Tree* tree = tree_new();
+    ensure(!tree_create(tree, "/a/") && !tree_create(tree, "/a/b/") && !tree_write(tree, "/f/", 0, "abc", 3));
+    ensure(!tree_freeze(tree, "/a/b/", false) && !tree_create(tree, "/untraced/"));
+    ensure(tree_trace_start(tree, "/nope/trace") == ENOENT);
+    ensure(!tree_trace_start(tree, trace_path) && tree_trace_start(tree, trace_path) == EBUSY);
+
+    ensure(!tree_create(tree, "/c/") && tree_create(tree, "/c/") == EEXIST && !tree_move(tree, "/c/", "/d/"));
+    char* list = tree_list_prefix(tree, "/", "d");
+    ensure(list && !strcmp(list, "d"));
+    free(list);
+    TreeStat stat;
+    char buf[16];
+    ensure(!tree_stat(tree, "/d/", &stat) && read_into(tree, "/f/", 1, 8, buf) == 2 && !tree_write(tree, "/f/", 3, "de", 2));
+    struct timespec deadline = in_ms(1000);
+    ensure(!tree_create_try(tree, "/e/") && !tree_create_timed(tree, "/g/", &deadline));
+    TreeChildOp ops[] = { { "x", false }, { "x", true } };
+    int results[2];
+    tree_children_apply(tree, "/d/", ops, results, 2);
+    TreeTxn* txn = tree_txn_begin(tree);
+    ensure(!tree_txn_add(txn, TREE_TXN_CREATE, "/t/", NULL) && !tree_txn_add(txn, TREE_TXN_REMOVE, "/nope/", NULL));
+    ensure(tree_txn_commit(txn, NULL) == ENOENT);
+    ensure(!tree_copy(tree, "/d/", "/h/") && !tree_freeze(tree, "/h/", true) && tree_remove(tree, "/a/b/") == EROFS);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_traced, tree))
+        syserr("Unable to create thread");
+    if (pthread_join(thread, NULL))
+        syserr("Unable to join thread");
+    ensure(!tree_trace_stop(tree) && !tree_create(tree, "/after/"));
+
+    // The file holds the initial state, then the calls of each thread in order.
+    FILE* file = fopen(trace_path, "r");
+    ensure(file);
+    TreeTraceHeader header;
+    ensure(fread(&header, sizeof(header), 1, file) == 1 && header.magic == TREE_TRACE_MAGIC);
+    Traced entries[32];
+    int n = 0, n_setup = 0;
+    uint32_t other = 0;
+    while (n < 32 && fread(&entries[n].entry, sizeof(TreeTraceEntry), 1, file) == 1) {
+        Traced* e = &entries[n];
+        if (e->entry.flags & TREE_TRACE_TIMED)
+            ensure(fread(e->args, sizeof(uint64_t), 1, file) == 1 && e->args[0] <= 1000000000);
+        if (e->entry.flags & TREE_TRACE_ARGS)
+            ensure(fread(e->args, sizeof(uint64_t), 2, file) == 2);
+        ensure(e->entry.path_len < 64 && e->entry.target_len < 64);
+        ensure(fread(e->path, 1, e->entry.path_len, file) == e->entry.path_len);
+        ensure(fread(e->target, 1, e->entry.target_len, file) == e->entry.target_len);
+        e->path[e->entry.path_len] = e->target[e->entry.target_len] = '\0';
+        if (e->entry.flags & TREE_TRACE_SETUP) {
+            ensure(n == n_setup++ && !e->entry.time);
+        } else if (!strcmp(e->path, "/th/")) {
+            // another thread, so this entry may lie anywhere among the calls
+            other = e->entry.thread;
+            ensure(traced(e, TREE_TRACE_CREATE, 0, 0, "/th/", ""));
+            continue;
+        }
+        n++;
+    }
+    fclose(file);
+    ensure(other && n == n_setup + 16);
+
+    // Folders come before their children and frozen folders after their contents.
+    int order[5] = { -1, -1, -1, -1, -1 };
+    for (int i = 0; i < n_setup; ++i) {
+        const Traced* e = &entries[i];
+        if (traced(e, TREE_TRACE_CREATE, TREE_TRACE_SETUP, 0, "/a/", ""))
+            order[0] = i;
+        else if (traced(e, TREE_TRACE_CREATE, TREE_TRACE_SETUP, 0, "/a/b/", ""))
+            order[1] = i;
+        else if (traced(e, TREE_TRACE_FREEZE, TREE_TRACE_SETUP | TREE_TRACE_ARGS, 0, "/a/b/", "") && !e->args[0])
+            order[2] = i;
+        else if (traced(e, TREE_TRACE_WRITE, TREE_TRACE_SETUP | TREE_TRACE_ARGS, 0, "/f/", "") && e->args[1] == 3)
+            order[3] = i;
+        else if (traced(e, TREE_TRACE_CREATE, TREE_TRACE_SETUP, 0, "/untraced/", ""))
+            order[4] = i;
+    }
+    ensure(n_setup == 5 && order[0] >= 0 && order[0] < order[1] && order[1] < order[2] && order[3] >= 0 && order[4] >= 0);
+
+    const Traced* e = entries + n_setup;
+    ensure(traced(e++, TREE_TRACE_CREATE, 0, 0, "/c/", "") && traced(e++, TREE_TRACE_CREATE, 0, EEXIST, "/c/", ""));
+    ensure(traced(e++, TREE_TRACE_MOVE, 0, 0, "/c/", "/d/") && traced(e++, TREE_TRACE_LIST, 0, 0, "/", "d"));
+    ensure(traced(e++, TREE_TRACE_STAT, 0, 0, "/d/", ""));
+    ensure(traced(e, TREE_TRACE_READ, TREE_TRACE_ARGS, 0, "/f/", "") && e->args[0] == 1 && e->args[1] == 8);
+    ++e;
+    ensure(traced(e, TREE_TRACE_WRITE, TREE_TRACE_ARGS, 0, "/f/", "") && e->args[0] == 3 && e->args[1] == 2);
+    ++e;
+    ensure(traced(e++, TREE_TRACE_CREATE, TREE_TRACE_TRY, 0, "/e/", ""));
+    ensure(traced(e++, TREE_TRACE_CREATE, TREE_TRACE_TIMED, 0, "/g/", ""));
+    ensure(traced(e, TREE_TRACE_CHILDREN, TREE_TRACE_ARGS, 0, "/d/", "x") && !e->args[0] && e->args[1] == 1);
+    ++e;
+    ensure(traced(e, TREE_TRACE_CHILDREN, TREE_TRACE_ARGS, 0, "/d/", "x") && e->args[0] && !e->args[1]);
+    ++e;
+    ensure(traced(e, TREE_TRACE_TXN, TREE_TRACE_ARGS, ENOENT, "/t/", "") && e->args[0] == TREE_TXN_CREATE && e->args[1] == 1);
+    ++e;
+    ensure(traced(e, TREE_TRACE_TXN, TREE_TRACE_ARGS, ENOENT, "/nope/", "") && e->args[0] == TREE_TXN_REMOVE && !e->args[1]);
+    ++e;
+    ensure(traced(e++, TREE_TRACE_COPY, 0, 0, "/d/", "/h/"));
+    ensure(traced(e, TREE_TRACE_FREEZE, TREE_TRACE_ARGS, 0, "/h/", "") && e->args[0]);
+    ++e;
+    ensure(traced(e++, TREE_TRACE_REMOVE, 0, EROFS, "/a/b/", ""));
+    for (int i = n_setup; i < n; ++i)
+        ensure(entries[i].entry.thread != other && (i == n_setup || entries[i].entry.time >= entries[i - 1].entry.time));
+    tree_free(tree);
+
+    // The trace replays with the same results.
+    char command[1200];
+    const char* slash = strrchr(program, '/');
+    snprintf(command, sizeof(command), "%.*sreplay %s fast", slash ? (int)(slash - program + 1) : 0, program, trace_path);
+    FILE* replay = popen(command, "r");
+    ensure(replay);
+    char line[256];
+    bool setup = false, matched = false;
+    while (fgets(line, sizeof(line), replay)) {
+        setup |= strstr(line, "setup=5 (failed 0) calls=17 ") != NULL;
+        matched |= !strcmp(line, "mismatched results: 0 of 17\n");
+    }
+    ensure(!pclose(replay) && setup && matched);
+    unlink(trace_path);
+}
+
+typedef struct Check {
+    const char* name;
+    void (*run)(void);
+} Check;
+
+static const Check checks[] = {
+    { "files", check_files },
+    { "walk", check_walk },
+    { "find", check_find },
+    { "aggregates", check_aggregates },
+    { "queue", check_queue },
+    { "release", check_release },
+    { "hashing", check_hashing },
+    { "trie", check_trie },
+    { "intern", check_intern },
+    { "watch", check_watch },
+    { "mounts", check_mounts },
+    { "deadlines", check_deadlines },
+    { "txns", check_txns },
+    { "striping", check_striping },
+    { "copy", check_copy },
+    { "handles", check_handles },
+    { "queries", check_queries },
+    { "shared", check_shared },
+    { "server", check_server },
+    { "frozen", check_frozen },
+    { "replica", check_replica },
+    { "bulk", check_bulk },
+    { "trace", check_trace },
+};
+
+static void run_checks(const char* name)
+{
+    bool found = false;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i) {
+        if (name && strcmp(name, checks[i].name))
+            continue;
+        checks[i].run();
+        printf("check %s: ok\n", checks[i].name);
+        found = true;
+    }
+    if (!found)
+        fatal("No check named %s", name);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "check")) {
+        program = argv[0];
+        run_checks(argc > 2 ? argv[2] : NULL);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "index")) {
+        long n_names = argc > 2 ? atol(argv[2]) : 200000;
+        if (n_names < 1)
+            fatal("Usage: %s index [names]", argv[0]);
+        bench_index(NAME_INDEX_HASH, "hash", n_names);
+        bench_index(NAME_INDEX_TRIE, "trie", n_names);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "names")) {
+        long n_nodes = argc > 2 ? atol(argv[2]) : 1000000;
+        if (n_nodes < 1000)
+            fatal("Usage: %s names [nodes >= 1000]", argv[0]);
+        char** paths = names_tree_paths(n_nodes);
+        bench_names(NAME_INDEX_HASH, "hash", paths, n_nodes);
+        bench_names(NAME_INDEX_INTERNED, "interned", paths, n_nodes);
+        for (long i = 0; i < n_nodes; ++i)
+            free(paths[i]);
+        free(paths);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "hot")) {
+        int n_threads = argc > 2 ? atoi(argv[2]) : 4;
+        long n_jobs = argc > 3 ? atol(argv[3]) : 100000;
+        if (n_threads < 1 || n_jobs < 1 || n_jobs >= 1 << 24)
+            fatal("Usage: %s hot [threads] [jobs per thread < 2^24]", argv[0]);
+        bench_hot(n_threads, n_jobs);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "copy")) {
+        long n_nodes = argc > 2 ? atol(argv[2]) : 300000;
+        if (n_nodes < 1000)
+            fatal("Usage: %s copy [nodes >= 1000]", argv[0]);
+        bench_copy(n_nodes);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "deep")) {
+        int depth = argc > 2 ? atoi(argv[2]) : 20;
+        long n_ops = argc > 3 ? atol(argv[3]) : 1000000;
+        if (depth < 1 || depth > 50 || n_ops < 1)
+            fatal("Usage: %s deep [depth <= 50] [operations]", argv[0]);
+        bench_deep(depth, n_ops);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "frozen")) {
+        int depth = argc > 2 ? atoi(argv[2]) : 10;
+        long n_ops = argc > 3 ? atol(argv[3]) : 1000000;
+        if (depth < 1 || depth > 50 || n_ops < 1)
+            fatal("Usage: %s frozen [depth <= 50] [operations]", argv[0]);
+        bench_frozen(depth, n_ops);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "replica")) {
+        int n_threads = argc > 2 ? atoi(argv[2]) : 4;
+        long n_ops = argc > 3 ? atol(argv[3]) : 300000;
+        if (n_threads < 1 || n_ops < 1)
+            fatal("Usage: %s replica [threads] [operations per thread]", argv[0]);
+        bench_replica(n_threads, n_ops);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "bulk")) {
+        int n_threads = argc > 2 ? atoi(argv[2]) : 4;
+        long n_nodes = argc > 3 ? atol(argv[3]) : 2000000;
+        if (n_threads < 1 || n_nodes < 1000)
+            fatal("Usage: %s bulk [threads] [nodes >= 1000]", argv[0]);
+        bench_bulk(n_threads, n_nodes);
+        return 0;
+    }
+
+    int n_threads = argc > 1 ? atoi(argv[1]) : 4;
+    long n_ops = argc > 2 ? atol(argv[2]) : 1000000;
+    if (n_threads < 1 || n_ops < 1)
+        fatal("Usage: %s [threads] [operations per thread]", argv[0]);
+
+    Tree* tree = tree_new();
+    Worker* workers = calloc(n_threads, sizeof(Worker));
+    pthread_t* threads = calloc(n_threads, sizeof(pthread_t));
+    if (!workers || !threads)
+        bad_malloc();
+
+    double start = now();
+    for (int i = 0; i < n_threads; ++i) {
+        workers[i] = (Worker) { tree, n_ops, i + 1, 0 };
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]))
+            syserr("Unable to create thread");
+    }
+    long n_succeeded = 0;
+    for (int i = 0; i < n_threads; ++i) {
+        if (pthread_join(threads[i], NULL))
+            syserr("Unable to join thread");
+        n_succeeded += workers[i].n_succeeded;
+    }
+    double elapsed = now() - start;
+
+    long total = n_ops * n_threads;
+    printf("threads=%d ops=%ld succeeded=%ld time=%.3fs throughput=%.0f ops/s\n",
+        n_threads, total, n_succeeded, elapsed, total / elapsed);
+
+    tree_free(tree);
+    free(workers);
+    free(threads);
+    return 0;
+}
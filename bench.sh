@@ -0,0 +1,4 @@
+# porownuje przepustowosc builda Debug (domyslnego) i Release (-O3, LTO, NDEBUG)
+for type in Debug Release; do
+  cmake -S . -B build-$type -DCMAKE_BUILD_TYPE=$type > /dev/null && cmake --build build-$type --target bench > /dev/null && echo "$type:" && ./build-$type/bench "$@"
+done
@@ -8,4 +8,9 @@ extern void syserr(const char* fmt, ...);
 extern void fatal(const char* fmt, ...);
 
 /* sygnalizuje niepowodzenie alokacji pamięci i kończy działanie */
-extern void bad_malloc();
\ No newline at end of file
+extern void bad_malloc();
+
+/* jak assert, ale wyrażenie jest wyliczane zawsze, także z NDEBUG - do
+sprawdzania wyników wywołań, które mają efekty uboczne */
+#define ensure(expr) \
+    ((expr) ? (void)0 : fatal("%s:%d: %s: Check `%s' failed.", __FILE__, __LINE__, __func__, #expr))
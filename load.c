@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tree.h"
+#include "TreeClient.h"
+#include "err.h"
+
+// Load generator for the tree server. Every thread runs the mixed workload of
+// bench (random list/create/remove/move on a small, hot tree) once through
+// direct calls on an in-process tree and once over its own connection to the
+// server, keeping up to `window` operations in flight and sending them in
+// messages of `batch` operations. Reports throughput and per-operation
+// latency (from submission to reaping the result) for both.
+// Usage: load <socket path> [threads] [operations per thread] [window] [batch]
+
+#define MAX_DEPTH 4
+#define ALPHABET 4
+#define PATH_SIZE (2 * MAX_DEPTH + 2)
+
+typedef struct Worker {
+    Tree* tree;
+    const char* socket_path;
+    long n_ops;
+    int window;
+    int batch;
+    unsigned int seed;
+    long n_succeeded;
+    double* latencies;
+} Worker;
+
+// An operation in flight over the socket; its index is the tag.
+typedef struct Slot {
+    char source[PATH_SIZE];
+    char target[PATH_SIZE];
+    double start;
+} Slot;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void random_path(unsigned int* seed, char* path, int max_depth)
+{
+    int depth = 1 + rand_r(seed) % max_depth;
+    char* p = path;
+    *p++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *p++ = 'a' + rand_r(seed) % ALPHABET;
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+// Same mix as bench: 40% list, 30% create, 20% remove, 10% move.
+static TreeOpType random_op(unsigned int* seed, char* source, char* target)
+{
+    random_path(seed, source, MAX_DEPTH);
+    int op = rand_r(seed) % 10;
+    if (op < 4)
+        return TREE_OP_LIST;
+    if (op < 7)
+        return TREE_OP_CREATE;
+    if (op < 9)
+        return TREE_OP_REMOVE;
+    // Never move deeper than the source, so the tree stays shallow.
+    random_path(seed, target, (strlen(source) - 1) / 2);
+    return TREE_OP_MOVE;
+}
+
+static void* run_local(void* data)
+{
+    Worker* worker = data;
+    char source[PATH_SIZE];
+    char target[PATH_SIZE];
+    for (long i = 0; i < worker->n_ops; ++i) {
+        TreeOpType type = random_op(&worker->seed, source, target);
+        double start = now();
+        int result;
+        if (type == TREE_OP_LIST) {
+            char* list = tree_list(worker->tree, source);
+            result = list ? 0 : ENOENT;
+            free(list);
+        } else if (type == TREE_OP_CREATE) {
+            result = tree_create(worker->tree, source);
+        } else if (type == TREE_OP_REMOVE) {
+            result = tree_remove(worker->tree, source);
+        } else {
+            result = tree_move(worker->tree, source, target);
+        }
+        worker->latencies[i] = now() - start;
+        if (!result)
+            worker->n_succeeded++;
+    }
+    return NULL;
+}
+
+static void* run_remote(void* data)
+{
+    Worker* worker = data;
+    TreeClient* client = tree_client_connect(worker->socket_path);
+    if (!client)
+        syserr("Unable to connect to %s", worker->socket_path);
+    Slot* slots = malloc(worker->window * sizeof(Slot));
+    int* free_slots = malloc(worker->window * sizeof(int));
+    TreeCompletion* completions = malloc(worker->window * sizeof(TreeCompletion));
+    if (!slots || !free_slots || !completions)
+        bad_malloc();
+    int n_free = worker->window;
+    for (int i = 0; i < worker->window; ++i)
+        free_slots[i] = i;
+
+    long submitted = 0;
+    long reaped = 0;
+    while (reaped < worker->n_ops) {
+        // Fill the window, flushing a message every `batch` operations.
+        int in_message = 0;
+        while (n_free && submitted < worker->n_ops) {
+            int tag = free_slots[--n_free];
+            Slot* slot = &slots[tag];
+            TreeOp op = { random_op(&worker->seed, slot->source, slot->target),
+                slot->source, slot->target, (void*)(intptr_t)tag };
+            slot->start = now();
+            if (tree_client_submit(client, &op))
+                fatal("Connection to the server lost");
+            submitted++;
+            if (++in_message == worker->batch) {
+                if (tree_client_flush(client))
+                    fatal("Connection to the server lost");
+                in_message = 0;
+            }
+        }
+        if (tree_client_flush(client))
+            fatal("Connection to the server lost");
+
+        size_t n = tree_client_reap(client, completions, worker->window, true);
+        if (!n)
+            fatal("Connection to the server lost");
+        double end = now();
+        for (size_t i = 0; i < n; ++i) {
+            int tag = (int)(intptr_t)completions[i].user_data;
+            worker->latencies[reaped++] = end - slots[tag].start;
+            if (!completions[i].result)
+                worker->n_succeeded++;
+            free(completions[i].list);
+            free_slots[n_free++] = tag;
+        }
+    }
+
+    tree_client_close(client);
+    free(slots);
+    free(free_slots);
+    free(completions);
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char* label, void* (*function)(void*), Worker* workers, int n_threads)
+{
+    pthread_t* threads = calloc(n_threads, sizeof(pthread_t));
+    if (!threads)
+        bad_malloc();
+    double start = now();
+    for (int i = 0; i < n_threads; ++i) {
+        workers[i].seed = i + 1;
+        workers[i].n_succeeded = 0;
+        if (pthread_create(&threads[i], NULL, function, &workers[i]))
+            syserr("Unable to create thread");
+    }
+    long n_succeeded = 0;
+    for (int i = 0; i < n_threads; ++i) {
+        if (pthread_join(threads[i], NULL))
+            syserr("Unable to join thread");
+        n_succeeded += workers[i].n_succeeded;
+    }
+    double elapsed = now() - start;
+
+    long n_ops = workers[0].n_ops;
+    long total = n_ops * n_threads;
+    double* latencies = malloc(total * sizeof(double));
+    if (!latencies)
+        bad_malloc();
+    for (int i = 0; i < n_threads; ++i)
+        memcpy(latencies + i * n_ops, workers[i].latencies, n_ops * sizeof(double));
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    printf("%-10s ops=%ld succeeded=%ld time=%.3fs throughput=%.0f ops/s"
+           " latency p50=%.1fus p99=%.1fus max=%.1fus\n",
+        label, total, n_succeeded, elapsed, total / elapsed, latencies[total / 2] * 1e6,
+        latencies[total * 99 / 100] * 1e6, latencies[total - 1] * 1e6);
+    free(latencies);
+    free(threads);
+}
+
+int main(int argc, char* argv[])
+{
+    int n_threads = argc > 2 ? atoi(argv[2]) : 4;
+    long n_ops = argc > 3 ? atol(argv[3]) : 100000;
+    int window = argc > 4 ? atoi(argv[4]) : 64;
+    int batch = argc > 5 ? atoi(argv[5]) : 16;
+    if (argc < 2 || n_threads < 1 || n_ops < 1 || window < 1 || batch < 1)
+        fatal("Usage: %s <socket path> [threads] [operations per thread] [window] [batch]", argv[0]);
+
+    Tree* tree = tree_new();
+    Worker* workers = calloc(n_threads, sizeof(Worker));
+    if (!workers)
+        bad_malloc();
+    for (int i = 0; i < n_threads; ++i) {
+        workers[i] = (Worker) { tree, argv[1], n_ops, window, batch, 0, 0, malloc(n_ops * sizeof(double)) };
+        if (!workers[i].latencies)
+            bad_malloc();
+    }
+
+    printf("threads=%d window=%d batch=%d\n", n_threads, window, batch);
+    run("in-process", run_local, workers, n_threads);
+    run("socket", run_remote, workers, n_threads);
+
+    for (int i = 0; i < n_threads; ++i)
+        free(workers[i].latencies);
+    free(workers);
+    tree_free(tree);
+    return 0;
+}
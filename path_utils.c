@@ -6,7 +6,7 @@
 #include "path_utils.h"
 #include "err.h"
 
-bool is_path_valid(const char* path)
+static bool is_valid_path_or_pattern(const char* path, bool allow_wildcards)
 {
     if (!path) { return false; }
     size_t len = strlen(path);
@@ -20,13 +20,59 @@ bool is_path_valid(const char* path)
         if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
             return false;
         for (const char* p = name_start; p != name_end; ++p)
-            if (*p < 'a' || *p > 'z')
+            if ((*p < 'a' || *p > 'z') && !(allow_wildcards && (*p == '*' || *p == '?')))
                 return false;
         name_start = name_end + 1;
     }
     return true;
 }
 
+bool is_path_valid(const char* path)
+{
+    return is_valid_path_or_pattern(path, false);
+}
+
+bool is_folder_name_valid(const char* name)
+{
+    if (!name) { return false; }
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_FOLDER_NAME_LENGTH)
+        return false;
+    for (const char* p = name; *p; ++p)
+        if (*p < 'a' || *p > 'z')
+            return false;
+    return true;
+}
+
+bool is_pattern_valid(const char* pattern)
+{
+    return is_valid_path_or_pattern(pattern, true);
+}
+
+bool glob_match(const char* pattern, const char* name)
+{
+    // Greedy matching with backtracking to the most recent '*'.
+    const char* star = NULL;
+    const char* star_name = NULL;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            star_name = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return !*pattern;
+}
+
 const char* split_path(const char* path, char* component)
 {
     const char* subpath = strchr(path + 1, '/'); // Pointer to second '/' character.
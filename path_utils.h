@@ -16,6 +16,19 @@
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char* path);
 
+// Return whether `name` is a valid folder name (see `is_path_valid`).
+bool is_folder_name_valid(const char* name);
+
+// Return whether a pattern is valid.
+// Valid patterns are like valid paths, except that components may also contain
+// the wildcards '*' (any sequence of characters) and '?' (any single character).
+// A component equal to "**" matches any number (including zero) of path components.
+bool is_pattern_valid(const char* pattern);
+
+// Return whether `name` matches the single-component pattern `pattern`
+// ('*' and '?' wildcards, no '/').
+bool glob_match(const char* pattern, const char* name);
+
 // Return the subpath obtained by removing the first component.
 // Args:
 // - `path`: should be a valid path (see `is_path_valid`).
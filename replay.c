@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tree.h"
+#include "TreeTrace.h"
+#include "err.h"
+
+// Replays a trace recorded with tree_trace_start (format in TreeTrace.h) on a
+// fresh tree. The setup entries first rebuild the tree as it was when the
+// trace started. Then every recorded thread gets its own replay thread, which
+// re-issues that thread's calls in order. In "timed" mode (the default) each
+// call starts at its recorded offset from the first call. In "fast" mode calls
+// run back to back. Reports throughput and per-operation latency next to the
+// recorded latency. It also counts calls whose result differs from the
+// recorded one; that is expected only where calls of different threads raced.
+// tree_children_apply and transactions are recorded as one entry per
+// operation and replayed as a single call again.
+// Usage: replay <trace file> [timed|fast]
+
+static const char* op_names[] = { "list", "create", "remove", "move", "stat", "read", "write", "copy", "freeze",
+    "children", "txn" };
+#define N_OPS (sizeof(op_names) / sizeof(op_names[0]))
+
+typedef struct Call {
+    TreeTraceEntry entry;
+    uint64_t timeout;
+    uint64_t args[2];
+    char* path;
+    char* target; // NULL if the call had none
+    int result;
+    double latency;
+} Call;
+
+typedef struct Thread {
+    uint32_t id;
+    Tree* tree;
+    Call* calls;
+    size_t n_calls;
+    size_t capacity;
+    bool fast;
+    double start; // when the first recorded call is replayed
+    char* zeros; // data for writes
+    size_t zeros_len;
+} Thread;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleep_until(double time)
+{
+    struct timespec ts = { (time_t)time, (long)((time - (time_t)time) * 1e9) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static char* read_file(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        syserr("Unable to open %s", path);
+    size_t capacity = 1 << 20;
+    char* data = malloc(capacity);
+    if (!data)
+        bad_malloc();
+    size_t n;
+    *size = 0;
+    while ((n = fread(data + *size, 1, capacity - *size, file)) > 0) {
+        *size += n;
+        if (*size == capacity && !(data = realloc(data, capacity *= 2)))
+            bad_malloc();
+    }
+    if (ferror(file))
+        syserr("Unable to read %s", path);
+    fclose(file);
+    return data;
+}
+
+static char* copy_string(const char* data, size_t len)
+{
+    char* copy = malloc(len + 1);
+    if (!copy)
+        bad_malloc();
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Parse the entry at `data` into `call` and return its size, or 0 if the
+// trace ends in the middle of it.
+static size_t parse_call(const char* data, size_t available, Call* call)
+{
+    if (available < sizeof(TreeTraceEntry))
+        return 0;
+    memset(call, 0, sizeof(*call));
+    memcpy(&call->entry, data, sizeof(call->entry));
+    size_t n_extra = (call->entry.flags & TREE_TRACE_TIMED ? 1 : 0) + (call->entry.flags & TREE_TRACE_ARGS ? 2 : 0);
+    size_t size = sizeof(call->entry) + n_extra * sizeof(uint64_t) + call->entry.path_len + call->entry.target_len;
+    if (available < size)
+        return 0;
+    const char* p = data + sizeof(call->entry);
+    if (call->entry.flags & TREE_TRACE_TIMED) {
+        memcpy(&call->timeout, p, sizeof(uint64_t));
+        p += sizeof(uint64_t);
+    }
+    if (call->entry.flags & TREE_TRACE_ARGS) {
+        memcpy(call->args, p, 2 * sizeof(uint64_t));
+        p += 2 * sizeof(uint64_t);
+    }
+    call->path = copy_string(p, call->entry.path_len);
+    if (call->entry.target_len)
+        call->target = copy_string(p + call->entry.path_len, call->entry.target_len);
+    return size;
+}
+
+static void add_call(Thread* thread, const Call* call)
+{
+    if (thread->n_calls == thread->capacity) {
+        thread->capacity = thread->capacity ? 2 * thread->capacity : 1024;
+        if (!(thread->calls = realloc(thread->calls, thread->capacity * sizeof(Call))))
+            bad_malloc();
+    }
+    thread->calls[thread->n_calls++] = *call;
+}
+
+static Thread* find_thread(Thread** threads, size_t* n_threads, uint32_t id)
+{
+    for (size_t i = 0; i < *n_threads; ++i) {
+        if ((*threads)[i].id == id)
+            return &(*threads)[i];
+    }
+    if (!(*threads = realloc(*threads, (*n_threads + 1) * sizeof(Thread))))
+        bad_malloc();
+    Thread* thread = &(*threads)[(*n_threads)++];
+    memset(thread, 0, sizeof(*thread));
+    thread->id = id;
+    return thread;
+}
+
+// Re-issue the call the way it was made: plain, _timed (with the same time
+// left to the deadline) or _try.
+static int issue(Thread* thread, const Call* call)
+{
+    Tree* tree = thread->tree;
+    bool try = call->entry.flags & TREE_TRACE_TRY;
+    struct timespec deadline;
+    const struct timespec* until = NULL;
+    if (call->entry.flags & TREE_TRACE_TIMED) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        uint64_t nsec = deadline.tv_nsec + call->timeout;
+        deadline.tv_sec += nsec / 1000000000;
+        deadline.tv_nsec = nsec % 1000000000;
+        until = &deadline;
+    }
+
+    int result = EINVAL;
+    switch (call->entry.op) {
+    case TREE_TRACE_LIST: {
+        char* list = NULL;
+        if (call->target) {
+            // tree_list_prefix doesn't say why it failed
+            list = tree_list_prefix(tree, call->path, call->target);
+            result = list ? 0 : call->entry.result ? call->entry.result : ENOENT;
+        } else {
+            result = try ? tree_list_try(tree, call->path, &list) : tree_list_timed(tree, call->path, until, &list);
+        }
+        free(list);
+        break;
+    }
+    case TREE_TRACE_CREATE:
+        result = try ? tree_create_try(tree, call->path)
+            : until  ? tree_create_timed(tree, call->path, until)
+                     : tree_create(tree, call->path);
+        break;
+    case TREE_TRACE_REMOVE:
+        result = try ? tree_remove_try(tree, call->path)
+            : until  ? tree_remove_timed(tree, call->path, until)
+                     : tree_remove(tree, call->path);
+        break;
+    case TREE_TRACE_MOVE: {
+        const char* target = call->target ? call->target : "";
+        result = try ? tree_move_try(tree, call->path, target)
+            : until  ? tree_move_timed(tree, call->path, target, until)
+                     : tree_move(tree, call->path, target);
+        break;
+    }
+    case TREE_TRACE_STAT: {
+        TreeStat stat;
+        result = try ? tree_stat_try(tree, call->path, &stat)
+            : until  ? tree_stat_timed(tree, call->path, &stat, until)
+                     : tree_stat(tree, call->path, &stat);
+        break;
+    }
+    case TREE_TRACE_READ: {
+        TreeReadResult read;
+        result = try ? tree_read_try(tree, call->path, call->args[0], call->args[1], &read)
+            : until  ? tree_read_timed(tree, call->path, call->args[0], call->args[1], &read, until)
+                     : tree_read(tree, call->path, call->args[0], call->args[1], &read);
+        if (!result)
+            tree_read_release(&read);
+        break;
+    }
+    case TREE_TRACE_WRITE: {
+        // The data isn't recorded, so write zeros of the same length.
+        size_t len = call->args[1];
+        if (len > thread->zeros_len) {
+            free(thread->zeros);
+            if (!(thread->zeros = calloc(len, 1)))
+                bad_malloc();
+            thread->zeros_len = len;
+        }
+        result = try ? tree_write_try(tree, call->path, call->args[0], thread->zeros, len)
+            : until  ? tree_write_timed(tree, call->path, call->args[0], thread->zeros, len, until)
+                     : tree_write(tree, call->path, call->args[0], thread->zeros, len);
+        break;
+    }
+    case TREE_TRACE_COPY:
+        result = tree_copy(tree, call->path, call->target ? call->target : "");
+        break;
+    case TREE_TRACE_FREEZE:
+        result = tree_freeze(tree, call->path, call->args[0]);
+        break;
+    }
+    return result;
+}
+
+// Re-issue the n entries of one tree_children_apply or transaction as a single
+// call and store the result of each operation.
+static void issue_batch(Thread* thread, Call* calls, size_t n)
+{
+    if (calls[0].entry.op == TREE_TRACE_CHILDREN) {
+        TreeChildOp* ops = malloc(n * sizeof(TreeChildOp));
+        int* results = malloc(n * sizeof(int));
+        if (!ops || !results)
+            bad_malloc();
+        for (size_t i = 0; i < n; ++i) {
+            ops[i].name = calls[i].target ? calls[i].target : "";
+            ops[i].remove = calls[i].args[0];
+        }
+        tree_children_apply(thread->tree, calls[0].path, ops, results, n);
+        for (size_t i = 0; i < n; ++i)
+            calls[i].result = results[i];
+        free(ops);
+        free(results);
+    } else {
+        TreeTxn* txn = tree_txn_begin(thread->tree);
+        for (size_t i = 0; i < n; ++i)
+            tree_txn_add(txn, (TreeTxnOpType)calls[i].args[0], calls[i].path, calls[i].target);
+        int result = tree_txn_commit(txn, NULL);
+        for (size_t i = 0; i < n; ++i)
+            calls[i].result = result;
+    }
+}
+
+static void* run_thread(void* data)
+{
+    Thread* thread = data;
+    for (size_t i = 0; i < thread->n_calls;) {
+        Call* call = &thread->calls[i];
+        // A batch ends with the entry that has no operations left after it.
+        size_t n = 1;
+        bool batch = call->entry.op == TREE_TRACE_CHILDREN || call->entry.op == TREE_TRACE_TXN;
+        while (batch && call[n - 1].args[1] && i + n < thread->n_calls && call[n].entry.op == call->entry.op)
+            n++;
+        double time = thread->start + call->entry.time * 1e-9;
+        if (!thread->fast && now() < time)
+            sleep_until(time);
+        double start = now();
+        if (batch)
+            issue_batch(thread, call, n);
+        else
+            call->result = issue(thread, call);
+        double latency = now() - start;
+        for (size_t j = 0; j < n; ++j)
+            call[j].latency = latency;
+        i += n;
+    }
+    return NULL;
+}
+
+static void print_latencies(const char* label, double* latencies, size_t n)
+{
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    printf(" %s p50=%.1fus p99=%.1fus max=%.1fus", label, latencies[n / 2] * 1e6, latencies[n * 99 / 100] * 1e6,
+        latencies[n - 1] * 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+    bool fast = argc > 2 && !strcmp(argv[2], "fast");
+    if (argc < 2 || (argc > 2 && !fast && strcmp(argv[2], "timed")))
+        fatal("Usage: %s <trace file> [timed|fast]", argv[0]);
+
+    size_t size;
+    char* data = read_file(argv[1], &size);
+    TreeTraceHeader header = { 0 };
+    if (size >= sizeof(header))
+        memcpy(&header, data, sizeof(header));
+    if (header.magic != TREE_TRACE_MAGIC)
+        fatal("%s is not a tree trace", argv[1]);
+
+    Tree* tree = tree_new();
+    Thread setup = { 0 };
+    setup.tree = tree;
+    Thread* threads = NULL;
+    size_t n_threads = 0, n_calls = 0, n_setup = 0, n_setup_failed = 0;
+    uint64_t first = UINT64_MAX, last = 0;
+    Call call;
+    size_t call_size;
+    for (size_t offset = sizeof(header); (call_size = parse_call(data + offset, size - offset, &call)); offset += call_size) {
+        if (call.entry.flags & TREE_TRACE_SETUP) {
+            // Setup entries come first, in order; apply them right away.
+            if (issue(&setup, &call))
+                n_setup_failed++;
+            free(call.path);
+            free(call.target);
+            n_setup++;
+            continue;
+        }
+        if (call.entry.op >= N_OPS)
+            fatal("Unknown operation %d in the trace", call.entry.op);
+        add_call(find_thread(&threads, &n_threads, call.entry.thread), &call);
+        if (call.entry.time < first)
+            first = call.entry.time;
+        if (call.entry.time + call.entry.duration > last)
+            last = call.entry.time + call.entry.duration;
+        n_calls++;
+    }
+    free(data);
+    free(setup.zeros);
+    if (!n_calls)
+        fatal("No calls in the trace");
+
+    pthread_t* handles = malloc(n_threads * sizeof(pthread_t));
+    if (!handles)
+        bad_malloc();
+    // Leave the threads some time to start before the first call.
+    double start = now() + 0.01 - first * 1e-9;
+    double begin = fast ? now() : start + first * 1e-9;
+    for (size_t i = 0; i < n_threads; ++i) {
+        threads[i].tree = tree;
+        threads[i].fast = fast;
+        threads[i].start = start;
+        if (pthread_create(&handles[i], NULL, run_thread, &threads[i]))
+            syserr("Unable to create thread");
+    }
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (pthread_join(handles[i], NULL))
+            syserr("Unable to join thread");
+    }
+    double elapsed = now() - begin;
+    double recorded = (last - first) * 1e-9;
+
+    size_t n_mismatched = 0;
+    printf("mode=%s threads=%zu setup=%zu (failed %zu) calls=%zu time=%.3fs (recorded %.3fs) throughput=%.0f ops/s\n",
+        fast ? "fast" : "timed", n_threads, n_setup, n_setup_failed, n_calls, elapsed, recorded, n_calls / elapsed);
+    double* latencies = malloc(n_calls * sizeof(double));
+    double* recorded_latencies = malloc(n_calls * sizeof(double));
+    if (!latencies || !recorded_latencies)
+        bad_malloc();
+    for (size_t op = 0; op < N_OPS; ++op) {
+        size_t n = 0, mismatched = 0;
+        for (size_t i = 0; i < n_threads; ++i) {
+            for (size_t j = 0; j < threads[i].n_calls; ++j) {
+                Call* c = &threads[i].calls[j];
+                if (c->entry.op != op)
+                    continue;
+                latencies[n] = c->latency;
+                recorded_latencies[n++] = c->entry.duration * 1e-9;
+                mismatched += c->result != c->entry.result;
+            }
+        }
+        if (!n)
+            continue;
+        n_mismatched += mismatched;
+        printf("%-8s calls=%zu mismatched=%zu", op_names[op], n, mismatched);
+        print_latencies("latency", latencies, n);
+        print_latencies("recorded", recorded_latencies, n);
+        printf("\n");
+    }
+    printf("mismatched results: %zu of %zu\n", n_mismatched, n_calls);
+
+    free(latencies);
+    free(recorded_latencies);
+    for (size_t i = 0; i < n_threads; ++i) {
+        for (size_t j = 0; j < threads[i].n_calls; ++j) {
+            free(threads[i].calls[j].path);
+            free(threads[i].calls[j].target);
+        }
+        free(threads[i].calls);
+        free(threads[i].zeros);
+    }
+    free(threads);
+    free(handles);
+    tree_free(tree);
+    return 0;
+}
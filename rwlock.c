@@ -1,6 +1,8 @@
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <assert.h>
+#include <time.h>
 
 #include "rwlock.h"
 #include "err.h"
@@ -8,77 +10,163 @@
 // Rozwiazanie z labow (przyklady09, readers-writers-template.c)
 // Czyli zaadoptowanie rozwiązanie z wykładu/ćwiczeń - nie zagładzamy
 // ani czytelników ani pisarzy, poprzez sprawdzanie czy czeka jakiś pisarz
-struct rwlock_t {
-  pthread_mutex_t mutex;
-  pthread_cond_t can_read;
-  pthread_cond_t can_write;
-  int rcount, wcount, rwait, wwait;
-  int change;
-};
 
-rwlock_t *rwlock_new() {
-  rwlock_t *rwlock = (rwlock_t *)malloc(sizeof(rwlock_t));
-  if (!rwlock) { return NULL; }
-  assert(!pthread_mutex_init(&rwlock->mutex, NULL));
-  assert(!pthread_cond_init(&rwlock->can_read, NULL));
-  assert(!pthread_cond_init(&rwlock->can_write, NULL));
+void rwlock_init(rwlock_t *rwlock, bool shared) {
+  pthread_mutexattr_t mutex_attr;
+  ensure(!pthread_mutexattr_init(&mutex_attr));
+  if (shared) {
+    // proces, ktory padl w srodku krotkiej sekcji krytycznej, nie blokuje innych (patrz lock)
+    ensure(!pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED));
+    ensure(!pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST));
+  }
+  ensure(!pthread_mutex_init(&rwlock->mutex, &mutex_attr));
+  ensure(!pthread_mutexattr_destroy(&mutex_attr));
+  // terminy w wersjach _timed sa na zegarze monotonicznym
+  pthread_condattr_t attr;
+  ensure(!pthread_condattr_init(&attr));
+  ensure(!pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+  if (shared) { ensure(!pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)); }
+  ensure(!pthread_cond_init(&rwlock->can_read, &attr));
+  ensure(!pthread_cond_init(&rwlock->can_write, &attr));
+  ensure(!pthread_condattr_destroy(&attr));
   rwlock->rcount = rwlock->wcount = rwlock->rwait = rwlock->wwait = 0;
   rwlock->change = 0;
+}
 
+void rwlock_fini(rwlock_t *rwlock) {
+  ensure(!pthread_mutex_destroy(&rwlock->mutex));
+  ensure(!pthread_cond_destroy(&rwlock->can_read));
+  ensure(!pthread_cond_destroy(&rwlock->can_write));
+}
+
+rwlock_t *rwlock_new() {
+  rwlock_t *rwlock = (rwlock_t *)malloc(sizeof(rwlock_t));
+  if (!rwlock) { return NULL; }
+  rwlock_init(rwlock, false);
   return rwlock;
 }
 
 void rwlock_destroy(rwlock_t *rwlock) {
-  assert(!pthread_mutex_destroy(&rwlock->mutex));
-  assert(!pthread_cond_destroy(&rwlock->can_read));
-  assert(!pthread_cond_destroy(&rwlock->can_write));
+  rwlock_fini(rwlock);
   free(rwlock);
 }
 
-void rwlock_rdlock(rwlock_t *rwlock) {
-  assert(!pthread_mutex_lock(&rwlock->mutex));
+// EOWNERDEAD dostajemy tylko dla locka wspolnego dla procesow, ktorego poprzedni
+// wlasciciel padl w srodku sekcji krytycznej. Przywracamy mutex do uzytku; liczniki
+// moga wtedy dalej uwzgledniac martwy proces, tak jak gdyby trzymal lock.
+static void check_owner(pthread_mutex_t *mutex, int err) {
+  if (err == EOWNERDEAD) { err = pthread_mutex_consistent(mutex); }
+  ensure(!err);
+}
+
+static void lock(pthread_mutex_t *mutex) {
+  check_owner(mutex, pthread_mutex_lock(mutex));
+}
+
+// czeka na can_read albo can_write; z terminem zwraca ETIMEDOUT po jego uplywie
+static int wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline) {
+  if (!deadline) {
+    check_owner(mutex, pthread_cond_wait(cond, mutex));
+    return 0;
+  }
+  int err = pthread_cond_timedwait(cond, mutex, deadline);
+  if (err == ETIMEDOUT) { return err; }
+  check_owner(mutex, err);
+  return 0;
+}
+
+// Wspolna czesc rwlock_rdlock, rwlock_tryrdlock i rwlock_timedrdlock. Czytelnik,
+// ktoremu minal termin, sprawdza jeszcze warunek - jesli w miedzyczasie pisarz
+// przekazal czytelnikom pierwszenstwo (change), to wchodzi, zeby zmiana nie przepadla.
+static int rdlock(rwlock_t *rwlock, bool try, const struct timespec *deadline) {
+  int err = 0;
+  lock(&rwlock->mutex);
   if (rwlock->wcount + rwlock->wwait > 0 && rwlock->change == 0) {
+    if (try) { err = EAGAIN; goto exit; }
     do {
       rwlock->rwait++;
-      assert(!pthread_cond_wait(&rwlock->can_read, &rwlock->mutex));
+      err = wait(&rwlock->can_read, &rwlock->mutex, deadline);
       rwlock->rwait--;
-    } while (rwlock->wcount > 0 && rwlock->change == 0);
+    } while (rwlock->wcount > 0 && rwlock->change == 0 && !err);
+    if (err && rwlock->wcount > 0 && rwlock->change == 0) { goto exit; }
+    err = 0;
   }
   rwlock->change = 0;
   rwlock->rcount++;
 
-  assert(!pthread_mutex_unlock(&rwlock->mutex));
+exit:
+  ensure(!pthread_mutex_unlock(&rwlock->mutex));
+  return err;
+}
+
+void rwlock_rdlock(rwlock_t *rwlock) {
+  rdlock(rwlock, false, NULL);
+}
+
+int rwlock_tryrdlock(rwlock_t *rwlock) {
+  return rdlock(rwlock, true, NULL);
+}
 
+int rwlock_timedrdlock(rwlock_t *rwlock, const struct timespec *deadline) {
+  return rdlock(rwlock, false, deadline);
 }
 
 void rwlock_rdunlock(rwlock_t *rwlock) {
-  assert(!pthread_mutex_lock(&rwlock->mutex));
+  lock(&rwlock->mutex);
   rwlock->rcount--;
   if (rwlock->rcount == 0 && rwlock->wwait > 0) {
-    assert(!pthread_cond_signal(&rwlock->can_write));
+    ensure(!pthread_cond_signal(&rwlock->can_write));
   }
-  assert(!pthread_mutex_unlock(&rwlock->mutex));
+  ensure(!pthread_mutex_unlock(&rwlock->mutex));
 }
 
-void rwlock_wrlock(rwlock_t *rwlock) {
-  assert(!pthread_mutex_lock(&rwlock->mutex));
+// Wspolna czesc wersji dla pisarza. Pisarz, ktory rezygnuje, moze byc tym,
+// na ktorego czekali uspieni czytelnicy (wstrzymani przez wwait) - jesli nie
+// czeka juz zaden inny pisarz, budzimy ich tak jak rwlock_wrunlock.
+static int wrlock(rwlock_t *rwlock, bool try, const struct timespec *deadline) {
+  int err = 0;
+  lock(&rwlock->mutex);
   while (rwlock->rcount + rwlock->wcount > 0 || rwlock->change == 1) {
+    if (try) { err = EAGAIN; goto exit; }
     rwlock->wwait++;
-    assert(!pthread_cond_wait(&rwlock->can_write, &rwlock->mutex));
+    err = wait(&rwlock->can_write, &rwlock->mutex, deadline);
     rwlock->wwait--;
+    if (err && (rwlock->rcount + rwlock->wcount > 0 || rwlock->change == 1)) {
+      if (rwlock->wwait == 0 && rwlock->wcount == 0 && rwlock->rwait > 0) {
+        rwlock->change = 1;
+        ensure(!pthread_cond_broadcast(&rwlock->can_read));
+      }
+      goto exit;
+    }
+    err = 0;
   }
   rwlock->wcount++;
-  assert(!pthread_mutex_unlock(&rwlock->mutex));
+
+exit:
+  ensure(!pthread_mutex_unlock(&rwlock->mutex));
+  return err;
+}
+
+void rwlock_wrlock(rwlock_t *rwlock) {
+  wrlock(rwlock, false, NULL);
+}
+
+int rwlock_trywrlock(rwlock_t *rwlock) {
+  return wrlock(rwlock, true, NULL);
+}
+
+int rwlock_timedwrlock(rwlock_t *rwlock, const struct timespec *deadline) {
+  return wrlock(rwlock, false, deadline);
 }
 
 void rwlock_wrunlock(rwlock_t *rwlock) {
-  assert(!pthread_mutex_lock(&rwlock->mutex));
+  lock(&rwlock->mutex);
   rwlock->wcount--;
   if (rwlock->rwait > 0) {
     rwlock->change = 1;
-    assert(!pthread_cond_broadcast(&rwlock->can_read));
+    ensure(!pthread_cond_broadcast(&rwlock->can_read));
   } else if (rwlock->wwait > 0) {
-    assert(!pthread_cond_signal(&rwlock->can_write));
+    ensure(!pthread_cond_signal(&rwlock->can_write));
   }
-  assert(!pthread_mutex_unlock(&rwlock->mutex));
+  ensure(!pthread_mutex_unlock(&rwlock->mutex));
 }
@@ -1,10 +1,35 @@
 #pragma once
 
-typedef struct rwlock_t rwlock_t;
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Struktura jest jawna, żeby lock można było osadzić w innej strukturze,
+// także w pamięci współdzielonej przez procesy (rwlock_init z shared).
+typedef struct rwlock_t {
+  pthread_mutex_t mutex;
+  pthread_cond_t can_read;
+  pthread_cond_t can_write;
+  int rcount, wcount, rwait, wwait;
+  int change;
+} rwlock_t;
 
 rwlock_t *rwlock_new();
 void rwlock_destroy(rwlock_t *rwlock);
+
+// Inicjalizuje i niszczy lock w pamięci wywołującego. Lock z shared działa między procesami;
+// jeśli proces padnie, trzymając go w trybie czytelnika lub pisarza, lock zostaje wzięty.
+void rwlock_init(rwlock_t *rwlock, bool shared);
+void rwlock_fini(rwlock_t *rwlock);
 void rwlock_rdlock(rwlock_t *rwlock);
 void rwlock_rdunlock(rwlock_t *rwlock);
 void rwlock_wrlock(rwlock_t *rwlock);
 void rwlock_wrunlock(rwlock_t *rwlock);
+
+// Wersje, które nie czekają (zwracają EAGAIN, jeśli locka nie da się wziąć od razu)
+// albo czekają najwyżej do deadline na zegarze CLOCK_MONOTONIC (zwracają ETIMEDOUT).
+// Zwracają 0, jeśli lock został wzięty.
+int rwlock_tryrdlock(rwlock_t *rwlock);
+int rwlock_timedrdlock(rwlock_t *rwlock, const struct timespec *deadline);
+int rwlock_trywrlock(rwlock_t *rwlock);
+int rwlock_timedwrlock(rwlock_t *rwlock, const struct timespec *deadline);
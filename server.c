@@ -0,0 +1,452 @@
+#define _GNU_SOURCE // accept4
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Tree.h"
+#include "TreeProto.h"
+#include "TreeQueue.h"
+#include "err.h"
+
+/*
+Serwer drzewa na gniezdzie uniksowym (protokol w TreeProto.h).
+Uzycie: server <sciezka gniazda> [watki] [plik sladu]
+Z plikiem sladu serwer zapisuje do niego slad wywolan drzewa (tree_trace_start),
+do powtorzenia przez replay.
+
+Watek petli (epoll) przyjmuje polaczenia, czyta wiadomosci i zglasza ich operacje
+do TreeQueue, ktora wykonuje je pula watkow. Watek zbierajacy odbiera wyniki, dla
+kazdego polaczenia skleja te z jednej tury w jedna wiadomosc i od razu probuje ja
+wyslac; czego nie da sie wyslac, wysyla petla po EPOLLOUT. Polaczenie zwalnia
+ostatni z wlascicieli: petla albo ostatnia operacja w toku.
+Jesli kolejka nie ma miejsca na cala wiadomosc albo klient nie odbiera odpowiedzi,
+petla przestaje czytac z polaczenia, dopoki sie to nie zmieni.
+*/
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536
+// tyle operacji moze byc w toku; wiadomosc ma ich co najwyzej tyle, ile wpisow sie w niej miesci
+#define QUEUE_CAPACITY (TREE_PROTO_MAX_MESSAGE / sizeof(TreeReqEntry))
+#define REAP_BATCH 256
+// przy tylu bajtach niewyslanych odpowiedzi przestajemy czytac zadania
+#define OUT_LIMIT (4 * TREE_PROTO_MAX_MESSAGE)
+
+typedef struct Buffer {
+  char *data;
+  size_t start; // poczatek nieskonsumowanych danych
+  size_t len;   // koniec danych
+  size_t capacity;
+} Buffer;
+
+typedef struct Conn {
+  int fd;
+  atomic_int refs; // petla i kazda operacja w toku
+  Buffer in;       // tylko petla
+  pthread_mutex_t lock; // out, closed, want_write i zmiany rejestracji w epoll
+  Buffer out;
+  bool closed;
+  bool want_write;
+  bool stalled;
+  struct Conn *prev, *next; // lista wszystkich polaczen, tylko petla
+} Conn;
+
+typedef struct Request {
+  Conn *conn;
+  uint64_t tag;
+  char paths[]; // path i target, oba zakonczone '\0'
+} Request;
+
+typedef struct Server {
+  Tree *tree;
+  TreeQueue *queue;
+  int epoll_fd;
+  int listen_fd;
+  int wake_fd;
+  Conn *conns;
+  atomic_int n_stalled;
+  pthread_mutex_t lock; // submitted, reaped, stop
+  pthread_cond_t submitted_cond;
+  size_t submitted;
+  size_t reaped;
+  bool stop;
+  pthread_t reaper;
+} Server;
+
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int sig) {
+  (void)sig;
+  interrupted = 1;
+}
+
+static void buffer_reserve(Buffer *buffer, size_t size) {
+  if (buffer->len + size <= buffer->capacity) { return; }
+  if (buffer->start) {
+    memmove(buffer->data, buffer->data + buffer->start, buffer->len - buffer->start);
+    buffer->len -= buffer->start;
+    buffer->start = 0;
+  }
+  if (buffer->len + size <= buffer->capacity) { return; }
+  size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+  while (capacity < buffer->len + size) { capacity *= 2; }
+  if (!(buffer->data = (char *)realloc(buffer->data, capacity))) { bad_malloc(); }
+  buffer->capacity = capacity;
+}
+
+static void buffer_append(Buffer *buffer, const void *data, size_t size) {
+  if (!size) { return; }
+  buffer_reserve(buffer, size);
+  memcpy(buffer->data + buffer->len, data, size);
+  buffer->len += size;
+}
+
+static void buffer_consume(Buffer *buffer, size_t size) {
+  buffer->start += size;
+  if (buffer->start == buffer->len) { buffer->start = buffer->len = 0; }
+}
+
+static size_t buffer_size(const Buffer *buffer) {
+  return buffer->len - buffer->start;
+}
+
+static void conn_release(Conn *conn) {
+  if (atomic_fetch_sub(&conn->refs, 1) != 1) { return; }
+  close(conn->fd);
+  free(conn->in.data);
+  free(conn->out.data);
+  pthread_mutex_destroy(&conn->lock);
+  free(conn);
+}
+
+// wymaga conn->lock
+static void update_events(Server *server, Conn *conn) {
+  struct epoll_event event = { 0 };
+  event.events = (conn->stalled ? 0 : EPOLLIN) | (conn->want_write ? EPOLLOUT : 0);
+  event.data.ptr = conn;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event)) { syserr("epoll_ctl"); }
+}
+
+// wysyla, ile sie da, z conn->out; wymaga conn->lock
+static void flush(Server *server, Conn *conn) {
+  bool want_write = false;
+  while (!conn->closed && buffer_size(&conn->out)) {
+    ssize_t sent = send(conn->fd, conn->out.data + conn->out.start, buffer_size(&conn->out),
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent >= 0) {
+      buffer_consume(&conn->out, sent);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      want_write = true;
+      break;
+    } else if (errno != EINTR) {
+      // zerwane polaczenie zamknie petla po EPOLLERR/EPOLLHUP
+      conn->out.start = conn->out.len = 0;
+    }
+  }
+  if (want_write != conn->want_write && !conn->closed) {
+    conn->want_write = want_write;
+    update_events(server, conn);
+  }
+}
+
+static void *reap(void *data) {
+  Server *server = (Server *)data;
+  TreeCompletion completions[REAP_BATCH];
+  bool done[REAP_BATCH];
+  for (;;) {
+    ensure(!pthread_mutex_lock(&server->lock));
+    while (server->submitted == server->reaped && !server->stop) {
+      ensure(!pthread_cond_wait(&server->submitted_cond, &server->lock));
+    }
+    bool finished = server->submitted == server->reaped;
+    ensure(!pthread_mutex_unlock(&server->lock));
+    if (finished) { break; }
+
+    size_t n = tree_queue_reap(server->queue, completions, REAP_BATCH, true);
+    for (size_t i = 0; i < n; ++i) { done[i] = false; }
+    for (size_t i = 0; i < n; ++i) {
+      if (done[i]) { continue; }
+      Conn *conn = ((Request *)completions[i].user_data)->conn;
+      ensure(!pthread_mutex_lock(&conn->lock));
+      // jedna wiadomosc ze wszystkimi wynikami tego polaczenia z tej tury
+      TreeMsgHeader header = { 0, 0 };
+      if (!conn->closed) { buffer_append(&conn->out, &header, sizeof(header)); }
+      for (size_t j = i; j < n; ++j) {
+        Request *request = (Request *)completions[j].user_data;
+        if (request->conn != conn) { continue; }
+        done[j] = true;
+        if (conn->closed) { continue; }
+        const char *list = completions[j].list;
+        size_t list_len = list ? strlen(list) : 0;
+        TreeReplyEntry entry = { request->tag, completions[j].result, list ? (uint32_t)list_len : TREE_PROTO_NO_LIST };
+        buffer_append(&conn->out, &entry, sizeof(entry));
+        buffer_append(&conn->out, list, list_len);
+        header.size += sizeof(entry) + list_len;
+        header.count++;
+      }
+      if (!conn->closed) {
+        // buffer_append moglo przesunac dane, wiec naglowek szukamy od konca
+        memcpy(conn->out.data + conn->out.len - header.size - sizeof(header), &header, sizeof(header));
+        flush(server, conn);
+      }
+      ensure(!pthread_mutex_unlock(&conn->lock));
+    }
+    for (size_t i = 0; i < n; ++i) {
+      Request *request = (Request *)completions[i].user_data;
+      free(completions[i].list);
+      conn_release(request->conn);
+      free(request);
+    }
+
+    ensure(!pthread_mutex_lock(&server->lock));
+    server->reaped += n;
+    ensure(!pthread_mutex_unlock(&server->lock));
+    if (n && atomic_load(&server->n_stalled)) {
+      uint64_t one = 1;
+      if (write(server->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) { syserr("write"); }
+    }
+  }
+  return NULL;
+}
+
+static void close_conn(Server *server, Conn *conn) {
+  ensure(!pthread_mutex_lock(&conn->lock));
+  conn->closed = true;
+  conn->out.start = conn->out.len = 0;
+  ensure(!pthread_mutex_unlock(&conn->lock));
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL)) { syserr("epoll_ctl"); }
+  if (conn->stalled) { atomic_fetch_sub(&server->n_stalled, 1); }
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    server->conns = conn->next;
+  }
+  if (conn->next) { conn->next->prev = conn->prev; }
+  conn_release(conn);
+}
+
+static void set_stalled(Server *server, Conn *conn, bool stalled) {
+  if (conn->stalled == stalled) { return; }
+  atomic_fetch_add(&server->n_stalled, stalled ? 1 : -1);
+  ensure(!pthread_mutex_lock(&conn->lock));
+  conn->stalled = stalled;
+  update_events(server, conn);
+  ensure(!pthread_mutex_unlock(&conn->lock));
+}
+
+// zglasza operacje jednej wiadomosci i zwraca, ile ich zglosila; *ok = false,
+// jesli wiadomosc jest zle zbudowana (wtedy zgloszone moga byc tylko poczatkowe)
+static uint32_t submit_message(Server *server, Conn *conn, const char *body, const TreeMsgHeader *header, bool *ok) {
+  const char *end = body + header->size;
+  uint32_t i = 0;
+  *ok = false;
+  for (; i < header->count; ++i) {
+    TreeReqEntry entry;
+    if (end - body < (ptrdiff_t)sizeof(entry)) { return i; }
+    memcpy(&entry, body, sizeof(entry));
+    body += sizeof(entry);
+    if (end - body < (ptrdiff_t)entry.path_len + entry.target_len) { return i; }
+
+    Request *request = (Request *)malloc(sizeof(Request) + entry.path_len + entry.target_len + 2);
+    if (!request) { bad_malloc(); }
+    request->conn = conn;
+    request->tag = entry.tag;
+    char *path = request->paths, *target = path + entry.path_len + 1;
+    memcpy(path, body, entry.path_len);
+    path[entry.path_len] = '\0';
+    memcpy(target, body + entry.path_len, entry.target_len);
+    target[entry.target_len] = '\0';
+    body += entry.path_len + entry.target_len;
+
+    atomic_fetch_add(&conn->refs, 1);
+    TreeOp op = { (TreeOpType)entry.type, path, target, request };
+    // petla jako jedyna zglasza i sprawdzila wczesniej, ze jest miejsce
+    if (!tree_queue_submit(server->queue, &op)) { fatal("Tree queue overflow"); }
+  }
+  *ok = body == end;
+  return i;
+}
+
+// zglasza wszystkie pelne wiadomosci z conn->in, na ktore jest miejsce;
+// zwraca false, jesli polaczenie trzeba zamknac
+static bool process_input(Server *server, Conn *conn) {
+  Buffer *in = &conn->in;
+  size_t submitted = 0;
+  bool stalled = false;
+  bool ok = true;
+  while (buffer_size(in) >= sizeof(TreeMsgHeader)) {
+    TreeMsgHeader header;
+    memcpy(&header, in->data + in->start, sizeof(header));
+    if (header.size > TREE_PROTO_MAX_MESSAGE || header.count > QUEUE_CAPACITY) { ok = false; break; }
+    if (buffer_size(in) < sizeof(header) + header.size) { break; }
+
+    ensure(!pthread_mutex_lock(&server->lock));
+    size_t in_flight = server->submitted + submitted - server->reaped;
+    ensure(!pthread_mutex_unlock(&server->lock));
+    ensure(!pthread_mutex_lock(&conn->lock));
+    size_t pending_out = buffer_size(&conn->out);
+    ensure(!pthread_mutex_unlock(&conn->lock));
+    if (in_flight + header.count > QUEUE_CAPACITY || pending_out > OUT_LIMIT) {
+      stalled = true;
+      break;
+    }
+
+    submitted += submit_message(server, conn, in->data + in->start + sizeof(header), &header, &ok);
+    buffer_consume(in, sizeof(header) + header.size);
+    if (!ok) { break; }
+  }
+
+  if (submitted) {
+    ensure(!pthread_mutex_lock(&server->lock));
+    server->submitted += submitted;
+    ensure(!pthread_cond_signal(&server->submitted_cond));
+    ensure(!pthread_mutex_unlock(&server->lock));
+  }
+  if (ok) { set_stalled(server, conn, stalled); }
+  return ok;
+}
+
+static void accept_conns(Server *server) {
+  for (;;) {
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) { return; }
+      if (errno == EINTR) { continue; }
+      if (errno == EMFILE || errno == ENFILE) { return; }
+      syserr("accept4");
+    }
+    Conn *conn = (Conn *)calloc(1, sizeof(Conn));
+    if (!conn) { bad_malloc(); }
+    conn->fd = fd;
+    atomic_init(&conn->refs, 1);
+    ensure(!pthread_mutex_init(&conn->lock, NULL));
+    conn->next = server->conns;
+    if (server->conns) { server->conns->prev = conn; }
+    server->conns = conn;
+
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event)) { syserr("epoll_ctl"); }
+  }
+}
+
+// zwraca false, jesli polaczenie trzeba zamknac
+static bool read_conn(Server *server, Conn *conn) {
+  buffer_reserve(&conn->in, READ_CHUNK);
+  ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.capacity - conn->in.len, 0);
+  if (n == 0) { return false; }
+  if (n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+  conn->in.len += n;
+  return process_input(server, conn);
+}
+
+static void run(Server *server) {
+  struct epoll_event events[MAX_EVENTS];
+  while (!interrupted) {
+    int n = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      syserr("epoll_wait");
+    }
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.ptr == &server->listen_fd) {
+        accept_conns(server);
+      } else if (events[i].data.ptr == &server->wake_fd) {
+        uint64_t count;
+        if (read(server->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) { syserr("read"); }
+      } else {
+        Conn *conn = (Conn *)events[i].data.ptr;
+        bool ok = true;
+        if (events[i].events & EPOLLOUT) {
+          ensure(!pthread_mutex_lock(&conn->lock));
+          flush(server, conn);
+          ensure(!pthread_mutex_unlock(&conn->lock));
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) { ok = read_conn(server, conn); }
+        if (!ok) { close_conn(server, conn); }
+      }
+    }
+
+    // zwolnilo sie miejsce w kolejce albo odpowiedzi zostaly wyslane
+    if (atomic_load(&server->n_stalled)) {
+      for (Conn *conn = server->conns, *next; conn; conn = next) {
+        next = conn->next;
+        if (conn->stalled && !process_input(server, conn)) { close_conn(server, conn); }
+      }
+    }
+  }
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un addr = { 0 };
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) { fatal("Socket path too long: %s", path); }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) { syserr("socket"); }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) { syserr("bind %s", path); }
+  if (listen(fd, SOMAXCONN)) { syserr("listen"); }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) { fatal("Usage: %s <socket path> [threads] [trace file]", argv[0]); }
+  long nworkers = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1) { nworkers = 1; }
+
+  struct sigaction action = { 0 };
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGINT, &action, NULL) || sigaction(SIGTERM, &action, NULL)) { syserr("sigaction"); }
+
+  Server server = { 0 };
+  server.tree = tree_new();
+  if (argc > 3 && (errno = tree_trace_start(server.tree, argv[3]))) { syserr("Unable to trace to %s", argv[3]); }
+  server.queue = tree_queue_new(server.tree, QUEUE_CAPACITY, (int)nworkers);
+  atomic_init(&server.n_stalled, 0);
+  ensure(!pthread_mutex_init(&server.lock, NULL));
+  ensure(!pthread_cond_init(&server.submitted_cond, NULL));
+  if ((server.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) { syserr("epoll_create1"); }
+  if ((server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) { syserr("eventfd"); }
+  server.listen_fd = listen_on(argv[1]);
+  struct epoll_event event = { 0 };
+  event.events = EPOLLIN;
+  event.data.ptr = &server.listen_fd;
+  if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event)) { syserr("epoll_ctl"); }
+  event.data.ptr = &server.wake_fd;
+  if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wake_fd, &event)) { syserr("epoll_ctl"); }
+  if (pthread_create(&server.reaper, NULL, reap, &server)) { syserr("Unable to create thread"); }
+
+  run(&server);
+
+  // operacje w toku jeszcze sie wykonaja, ale ich wynikow nikt juz nie wysle
+  close(server.listen_fd);
+  unlink(argv[1]);
+  while (server.conns) { close_conn(&server, server.conns); }
+  ensure(!pthread_mutex_lock(&server.lock));
+  server.stop = true;
+  ensure(!pthread_cond_signal(&server.submitted_cond));
+  ensure(!pthread_mutex_unlock(&server.lock));
+  if (pthread_join(server.reaper, NULL)) { syserr("Unable to join thread"); }
+  tree_queue_free(server.queue);
+  if ((errno = tree_trace_stop(server.tree))) { syserr("Unable to write the trace"); }
+  tree_free(server.tree);
+  close(server.wake_fd);
+  close(server.epoll_fd);
+  pthread_cond_destroy(&server.submitted_cond);
+  pthread_mutex_destroy(&server.lock);
+  return 0;
+}